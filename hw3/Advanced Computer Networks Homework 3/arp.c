@@ -3,6 +3,10 @@
 #include <netinet/if_ether.h>
 #include <net/ethernet.h>
 #include <linux/if.h>
+#include <linux/filter.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,3 +48,62 @@ char* get_target_hardware_addr(struct ether_arp *packet)
 {
 	// if you use malloc, remember to free it.
 }
+
+/*
+ * Attach a classic BPF program to the recv socket, so the kernel only passes ARP
+ * packets up instead of every frame on the segment.
+ * If ip is not NULL, only ARP packets whose sender or target protocol address is ip pass.
+ * Frames which arrived before the filter are discarded.
+ * Return -1 with errno set if ip is invalid or the filter cannot be attached.
+ */
+int attach_arp_filter(int sockfd, const char *ip)
+{
+	struct in_addr addr;
+	struct sock_fprog program;
+	struct sock_filter any_arp[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),					// ethernet type
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_ARP, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0x40000),						// accept
+		BPF_STMT(BPF_RET | BPF_K, 0),							// drop
+	};
+	struct sock_filter arp_of_ip[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),					// ethernet type
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_ARP, 0, 5),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 28),					// sender protocol address
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 38),					// target protocol address
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0x40000),						// accept
+		BPF_STMT(BPF_RET | BPF_K, 0),							// drop
+	};
+
+	if(ip == NULL)
+	{
+		program.len = sizeof(any_arp) / sizeof(any_arp[0]);
+		program.filter = any_arp;
+	}
+	else
+	{
+		if(inet_pton(AF_INET, ip, &addr) != 1)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		// BPF loads words in host order from network order
+		arp_of_ip[3].k = ntohl(addr.s_addr);
+		arp_of_ip[5].k = ntohl(addr.s_addr);
+		program.len = sizeof(arp_of_ip) / sizeof(arp_of_ip[0]);
+		program.filter = arp_of_ip;
+	}
+	if(setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+	{
+		return -1;
+	}
+
+	// Frames queued before the filter was attached did not pass it, throw them away.
+	char frame[ETH_FRAME_LEN];
+	while(recv(sockfd, frame, sizeof(frame), MSG_DONTWAIT) >= 0)
+	{
+	}
+	return 0;
+}
@@ -27,4 +27,6 @@ char* get_target_protocol_addr(struct ether_arp *packet);
 char* get_sender_protocol_addr(struct ether_arp *packet); 
 char* get_sender_hardware_addr(struct ether_arp *packet); 
 char* get_target_hardware_addr(struct ether_arp *packet); 
+
+int attach_arp_filter(int sockfd, const char *ip);
 #endif
@@ -24,7 +24,7 @@
  * One for input , the other for output.
  */
 
-int main(void)
+int main(int argc, char *argv[])
 {
 	int sockfd_recv = 0, sockfd_send = 0;
 	struct sockaddr_ll sa;
@@ -38,6 +38,13 @@ int main(void)
 		exit(1);
 	}
 
+	// Only ARP packets reach the recv socket, of the IP given as the first argument if any.
+	if(attach_arp_filter(sockfd_recv, argc > 1 ? argv[1] : NULL) < 0)
+	{
+		perror("attach arp filter error");
+		exit(1);
+	}
+
 	/*
 	 * Use recvfrom function to get packet.
 	 * recvfrom( ... )
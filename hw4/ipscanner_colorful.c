@@ -2,13 +2,36 @@
 // Send an IPv4 ICMP echo request packet via raw socket at the link layer (ethernet frame),
 // and receive echo reply packet (i.e., ping). Includes some ICMP data.
 // Need to have destination MAC address. ?
+//
+// The sweep is asynchronous: probes are fired at a fixed rate without waiting for
+// replies, and a single receive loop matches each echo reply to its probe by the
+// ICMP identifier and sequence number. A dead host costs one timeout in parallel
+// with all the others, so a /24 finishes in about one timeout instead of 254.
+//
+// Targets are CIDR blocks, address ranges and files of them, by default the subnet
+// of the interface. They are kept as sorted ranges of 32-bit addresses and the state
+// of each host is one bit, so a /8 sweep fits in a few MB.
+//
+// With -m the frames go through PACKET_MMAP rings (TPACKET_V3): probes are built in
+// the TX ring and handed to the kernel with one syscall per burst, and replies are
+// read in place from the RX ring a block at a time.
+//
+// A BPF program on the receive socket lets only the echo replies to this process
+// through, the other frames on the segment never leave the kernel.
+//
+// The frame of a probe is built once as a template. Each probe copies it and patches
+// the destination address and the sequence number, and both checksums are updated
+// incrementally (RFC 1624) instead of summed again.
+
+#define _GNU_SOURCE           // ppoll()
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>           // close()
-#include <string.h>           // strcpy, memset(), and memcpy()
+#include <unistd.h>           // close(), getopt()
+#include <string.h>           // memset(), memcpy() and strerror()
+#include <poll.h>             // ppoll()
+#include <time.h>             // clock_gettime()
 
-#include <netdb.h>            // struct addrinfo
 #include <sys/types.h>        // needed for socket(), uint8_t, uint16_t, uint32_t
 #include <sys/socket.h>       // needed for socket()
 #include <netinet/in.h>       // IPPROTO_ICMP, INET_ADDRSTRLEN
@@ -16,12 +39,13 @@
 #include <netinet/ip_icmp.h>  // struct icmp, ICMP_ECHO
 #include <arpa/inet.h>        // inet_pton() and inet_ntop()
 #include <sys/ioctl.h>        // macro ioctl is defined
+#include <sys/mman.h>         // mmap() of the PACKET_MMAP rings
 #include <bits/ioctls.h>      // defines values for argument "request" of ioctl.
 #include <net/if.h>           // struct ifreq
 #include <linux/if_ether.h>   // ETH_P_IP = 0x0800, ETH_P_IPV6 = 0x86DD
 #include <linux/if_packet.h>  // struct sockaddr_ll (see man 7 packet)
+#include <linux/filter.h>     // struct sock_fprog, BPF_STMT() and BPF_JUMP()
 #include <net/ethernet.h>
-#include <sys/time.h>         // gettimeofday()
 
 #include <errno.h>            // errno, perror()
 
@@ -30,500 +54,1067 @@
 #define IP4_HDRLEN 20  // IPv4 header length
 #define ICMP_HDRLEN 8  // ICMP header length for echo request, excludes data
 
+#define PROBE_WINDOW 65536     // outstanding probes are indexed by their 16-bit ICMP sequence number
+#define DEFAULT_RATE 1000      // probes per second unless -r is given
+#define MAX_BURST 64           // the most probes sent at once to catch up after a late wakeup
+#define MAX_TARGET_LINE 256    // the longest line of a target file
+
+#define TX_FRAME_SIZE 128      // a tpacket3_hdr and a probe frame, aligned to TPACKET_ALIGNMENT
+#define TX_BLOCK_SIZE 4096     // a multiple of TX_FRAME_SIZE, so frames follow each other across blocks
+#define TX_BLOCK_NR 256        // 8192 frames
+#define RX_FRAME_SIZE 2048
+#define RX_BLOCK_SIZE (1 << 18)
+#define RX_BLOCK_NR 16
+#define RX_BLOCK_TIMEOUT 2     // milliseconds before the kernel hands over a block which is not full
+
 #define KYEL "\x1B[0;33m"    // Yellow
 #define KRED "\x1B[0;31m"    // Red > Alive
-#define KBLU "\x1B[0;34m"    // Blue > Unreachable 
-#define KGRN "\x1B[0;32m"    // Me : My IP  
+#define KBLU "\x1B[0;34m"    // Blue > Unreachable
+#define KGRN "\x1B[0;32m"    // Me : My IP
+
+#define USAGE "Usage: %s -i interface -t timeout [-r rate] [-m] [-f file] [target ...]\n" \
+              "  -i interface  the interface to send the probes through\n" \
+              "  -t timeout    milliseconds to wait for the reply of each host\n" \
+              "  -r rate       probes sent per second, defaults to 1000\n" \
+              "  -m            send and receive through PACKET_MMAP rings instead of sendto() and recvfrom()\n" \
+              "  -f file       read targets from a file, one or more on each line, # starts a comment\n" \
+              "  target        a.b.c.d/prefix, a.b.c.d-e.f.g.h, a.b.c.d-h or a.b.c.d, defaults to the\n" \
+              "                subnet of the interface; the network and broadcast addresses of a\n" \
+              "                CIDR block are skipped\n"
+
+// A block of consecutive target addresses in host byte order. offset is the number of
+// hosts in the blocks before, so it places the hosts of the block in the bitmap.
+struct target_range
+{
+  uint32_t first;
+  uint32_t last;
+  uint64_t offset;
+};
 
+// The targets of a sweep, sorted and merged so every host is probed once.
+struct target_list
+{
+  struct target_range *ranges;
+  int n_ranges;
+  int capacity;
+  uint64_t n_hosts;
+};
+
+// A PACKET_MMAP ring shared with the kernel. The frames of the TX ring are filled in
+// order, and the RX ring is handed back and forth a block at a time.
+struct packet_ring
+{
+  uint8_t *map;              // NULL if the ring is not used
+  size_t size;
+  struct tpacket_req3 req;
+  unsigned int next;         // the next frame of the TX ring, or the next block of the RX ring
+};
+
+// A probe waiting for its echo reply. Every probe waits for the same timeout, so
+// probes expire in the order they were sent and a FIFO list is their timer.
+struct probe
+{
+  struct in_addr target;
+  uint64_t sent_ns;          // when the probe was sent, CLOCK_MONOTONIC
+  int outstanding;           // 1 from the send until the reply or the timeout
+  struct probe *next;        // the expiry list, oldest first
+  struct probe *prev;
+};
+
+// The state of one sweep.
+struct sweep
+{
+  int sendsd;
+  int recvsd;
+  struct sockaddr_ll device;
+  uint8_t *src_mac;
+  uint8_t *dst_mac;
+  char *src_ip;
+  uint32_t src_addr;         // the address of the interface in host byte order, it is not probed
+  uint16_t id;               // the ICMP identifier of every probe of this process
+  uint16_t next_seq;
+  int timeout_ms;
+  uint64_t timeout_ns;
+  uint64_t interval_ns;      // the gap between two probes
+  struct probe *probes;      // PROBE_WINDOW slots, indexed by sequence number
+  struct probe expiry;       // the head of the expiry list
+  int n_outstanding;
+  int alive_cnt;
+  struct target_list targets;
+  int next_range;            // the cursor of the sender in the targets
+  uint64_t next_addr;
+  uint8_t *alive;            // one bit for each host, set once it replies
+  uint8_t *data;
+  int datalen;
+  uint8_t *probe_template;    // the frame of every probe, built once by build_probe_template()
+  int probe_len;
+  uint8_t *send_ether_frame;
+  uint8_t *recv_ether_frame;
+  struct packet_ring tx_ring;
+  struct packet_ring rx_ring;
+  int tx_pending;            // frames of the TX ring waiting for flush_tx_ring()
+  int64_t realtime_offset_ns; // CLOCK_REALTIME - CLOCK_MONOTONIC, to read the timestamps of the RX ring
+};
 
 // Function prototypes
 uint16_t checksum (uint16_t *, int);
-uint16_t icmp4_checksum (struct icmp, uint8_t *, int);
+uint16_t update_checksum (uint16_t, uint16_t, uint16_t);
 char *allocate_strmem (int);
 uint8_t *allocate_ustrmem (int);
-int *allocate_intmem (int);
+uint64_t monotonic_ns (void);
+void build_probe_template (struct sweep *);
+int build_probe_frame (struct sweep *, uint8_t *, struct in_addr, uint16_t);
+int send_probe (struct sweep *, uint32_t);
+int setup_ring (int, int, struct packet_ring *);
+void flush_tx_ring (struct sweep *);
+void receive_ring (struct sweep *);
+void handle_frame (struct sweep *, uint8_t *, int, int, uint64_t);
+int attach_reply_filter (int, uint16_t);
+void next_target (struct sweep *);
+int parse_target (struct target_list *, char *);
+int read_target_file (struct target_list *, const char *);
+void add_target_range (struct target_list *, uint32_t, uint32_t);
+void merge_targets (struct target_list *);
+int compare_ranges (const void *, const void *);
+int64_t find_target_host (const struct target_list *, uint32_t);
+void receive_replies (struct sweep *);
+void expire_probes (struct sweep *, uint64_t);
+void link_probe (struct sweep *, struct probe *);
+void unlink_probe (struct sweep *, struct probe *);
 
 int main (int argc, char **argv)
 {
-  int i, status, datalen, frame_length, sendsd, recvsd, bytes, *ip_flags, timeout, trycount, trylim, done;
-  char *interface, *target, *src_ip, *dst_ip, *rec_ip;
-  struct ip send_iphdr, *recv_iphdr;
-  struct icmp send_icmphdr, *recv_icmphdr;
-  uint8_t *data, *src_mac, *dst_mac, *send_ether_frame, *recv_ether_frame;
-  struct addrinfo hints, *res;
-  struct sockaddr_in *ipv4;
-  struct sockaddr_ll device;
+  int i, option, rate, use_ring;
+  char *interface, *target_file;
   struct ifreq ifr;
-  struct sockaddr from;
-  socklen_t fromlen;
-  struct timeval wait, t1, t2;
-  struct timezone tz;
-  double dt;
-  void *tmp;
+  struct sweep sweep;
+
+  memset (&sweep, 0, sizeof (sweep));
+  interface = NULL;
+  target_file = NULL;
+  use_ring = 0;
+  rate = DEFAULT_RATE;
+  sweep.timeout_ms = -1;
+  while ((option = getopt (argc, argv, "i:t:r:mf:")) != -1)
+  {
+    switch (option)
+    {
+      case 'i':
+        interface = optarg;
+        break;
+      case 't':
+        sweep.timeout_ms = atoi (optarg);
+        break;
+      case 'r':
+        rate = atoi (optarg);
+        break;
+      case 'f':
+        target_file = optarg;
+        break;
+      case 'm':
+        use_ring = 1;
+        break;
+      default:
+        interface = NULL;
+        break;
+    }
+  }
+  if (interface == NULL || sweep.timeout_ms <= 0 || rate <= 0) // 格式不符
+  {
+    printf (KRED"Format Error\n");
+    fprintf (stderr, USAGE, argv[0]);
+    return (EXIT_FAILURE);
+  }
+  sweep.timeout_ns = (uint64_t) sweep.timeout_ms * 1000000ULL;
+  sweep.interval_ns = 1000000000ULL / rate;
 
   // Allocate memory for various arrays.
-  src_mac = allocate_ustrmem (6);
-  dst_mac = allocate_ustrmem (6);
-  data = allocate_ustrmem (IP_MAXPACKET);
-  send_ether_frame = allocate_ustrmem (IP_MAXPACKET);
-  recv_ether_frame = allocate_ustrmem (IP_MAXPACKET);
-  interface = allocate_strmem (40);
-  target = allocate_strmem (40);
-  src_ip = allocate_strmem (INET_ADDRSTRLEN);
-  dst_ip = allocate_strmem (INET_ADDRSTRLEN);
-  rec_ip = allocate_strmem (INET_ADDRSTRLEN);
-  ip_flags = allocate_intmem (4);
-  
-  if(argc==5) // ./ipscanner -i interface -t timeout 
-  {	  
-  	// Interface to send packet through.
-  	strcpy (interface, argv[2]);
-
-	// Submit request for a socket descriptor to look up interface.
-	// We'll use it to send packets as well, so we leave it open.
-	if ((sendsd = socket (PF_PACKET, SOCK_RAW, htons (ETH_P_ALL))) < 0) 
+  sweep.src_mac = allocate_ustrmem (6);
+  sweep.dst_mac = allocate_ustrmem (6);
+  sweep.data = allocate_ustrmem (IP_MAXPACKET);
+  sweep.probe_template = allocate_ustrmem (IP_MAXPACKET);
+  sweep.send_ether_frame = allocate_ustrmem (IP_MAXPACKET);
+  sweep.recv_ether_frame = allocate_ustrmem (IP_MAXPACKET);
+  sweep.src_ip = allocate_strmem (INET_ADDRSTRLEN);
+  sweep.probes = (struct probe *) calloc (PROBE_WINDOW, sizeof (struct probe));
+  if (sweep.probes == NULL)
+  {
+    fprintf (stderr, "ERROR: Cannot allocate memory for the outstanding probes.\n");
+    exit (EXIT_FAILURE);
+  }
+  sweep.expiry.next = &sweep.expiry;
+  sweep.expiry.prev = &sweep.expiry;
+
+  // Submit request for a socket descriptor to look up interface.
+  // We'll use it to send packets as well, so we leave it open. Protocol 0 keeps it
+  // from receiving a copy of every frame.
+  if ((sweep.sendsd = socket (PF_PACKET, SOCK_RAW, 0)) < 0)
+  {
+    perror ("socket() failed to get socket descriptor for using ioctl() ");
+    exit (EXIT_FAILURE);
+  }
+
+  // Use ioctl() to look up interface name and get its MAC address.
+  memset (&ifr, 0, sizeof (ifr));
+  snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", interface);
+  if (ioctl (sweep.sendsd, SIOCGIFHWADDR, &ifr) < 0)
+  {
+    perror ("ioctl() failed to get source MAC address ");
+    return (EXIT_FAILURE);
+  }
+
+  // Copy source MAC address.
+  memcpy (sweep.src_mac, ifr.ifr_hwaddr.sa_data, 6);
+
+  // Find interface index from interface name and store index in
+  // struct sockaddr_ll device, which will be used as an argument of sendto().
+  memset (&sweep.device, 0, sizeof (sweep.device));
+  if ((sweep.device.sll_ifindex = if_nametoindex (interface)) == 0)
+  {
+    perror ("if_nametoindex() failed to obtain interface index ");
+    exit (EXIT_FAILURE);
+  }
+
+  // Fill out sockaddr_ll.
+  sweep.device.sll_family = AF_PACKET;
+  sweep.device.sll_protocol = htons (ETH_P_ALL);
+  memcpy (sweep.device.sll_addr, sweep.src_mac, 6);
+  sweep.device.sll_halen = 6;
+
+  // Set destination MAC address
+  memset (sweep.dst_mac, 0xff, 6);
+
+  // Source IPv4 address: the address of the interface
+  memset (&ifr, 0, sizeof (ifr));
+  snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", interface);
+  ifr.ifr_addr.sa_family = AF_INET;
+  if (ioctl (sweep.sendsd, SIOCGIFADDR, &ifr) < 0)
+  {
+    perror ("ioctl() failed to get source IPv4 address ");
+    return (EXIT_FAILURE);
+  }
+  sweep.src_addr = ntohl (((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr);
+  inet_ntop (AF_INET, &((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr, sweep.src_ip, INET_ADDRSTRLEN);
+
+  // Targets: the arguments and the file, or the subnet of the interface
+  for (i = optind; i < argc; i++)
+  {
+    if (parse_target (&sweep.targets, argv[i]) < 0)
     {
-	    perror ("socket() failed to get socket descriptor for using ioctl() ");
-	    exit (EXIT_FAILURE);
-	}
-
-	// Use ioctl() to look up interface name and get its MAC address.
-	memset (&ifr, 0, sizeof (ifr));
-	snprintf (ifr.ifr_name, sizeof (ifr.ifr_name), "%s", interface);
-	if (ioctl (sendsd, SIOCGIFHWADDR, &ifr) < 0) 
+      printf (KRED"Format Error\n");
+      fprintf (stderr, "Invalid target: %s\n", argv[i]);
+      return (EXIT_FAILURE);
+    }
+  }
+  if (target_file != NULL && read_target_file (&sweep.targets, target_file) < 0)
+  {
+    return (EXIT_FAILURE);
+  }
+  if (sweep.targets.n_ranges == 0)
+  {
+    if (ioctl (sweep.sendsd, SIOCGIFNETMASK, &ifr) < 0)
     {
-	    perror ("ioctl() failed to get source MAC address ");
-	    return (EXIT_FAILURE);
-	}
+      perror ("ioctl() failed to get the netmask of the interface ");
+      return (EXIT_FAILURE);
+    }
+    uint32_t netmask = ntohl (((struct sockaddr_in *) &ifr.ifr_netmask)->sin_addr.s_addr);
+    uint32_t first = sweep.src_addr & netmask;
+    uint32_t last = first | ~netmask;
+    add_target_range (&sweep.targets, netmask >= 0xfffffffe ? first : first + 1, netmask >= 0xfffffffe ? last : last - 1);
+  }
+  merge_targets (&sweep.targets);
+  sweep.alive = (uint8_t *) calloc (sweep.targets.n_hosts / 8 + 1, 1);
+  if (sweep.alive == NULL)
+  {
+    fprintf (stderr, "ERROR: Cannot allocate memory for the state of %llu hosts.\n", (unsigned long long) sweep.targets.n_hosts);
+    exit (EXIT_FAILURE);
+  }
+  sweep.next_range = 0;
+  sweep.next_addr = sweep.targets.ranges[0].first;
+
+  // Identifier (16 bits): the pid tells the replies of this scan from other pings
+  sweep.id = (uint16_t) getpid ();
+
+  // ICMP data // 學號
+  sweep.datalen = 11;
+  memcpy (sweep.data, "M083040017", 10);
+  build_probe_template (&sweep);
+
+  // Submit request for a raw socket descriptor to receive packets. It only listens on
+  // the interface of the probes and never blocks, the loop waits in ppoll(). The socket
+  // receives nothing until bind(), so the filter and the ring see every frame from the start.
+  if ((sweep.recvsd = socket (PF_PACKET, SOCK_RAW, 0)) < 0)
+  {
+    perror ("socket() failed to obtain a receive socket descriptor ");
+    exit (EXIT_FAILURE);
+  }
+  if (attach_reply_filter (sweep.recvsd, sweep.id) < 0)
+  {
+    perror ("setsockopt() failed to attach the filter of echo replies ");
+    exit (EXIT_FAILURE);
+  }
 
-	// Copy source MAC address.
-	memcpy (src_mac, ifr.ifr_hwaddr.sa_data, 6);
+  // Map the rings, a socket whose ring is not available keeps using sendto() or recvfrom().
+  if (use_ring)
+  {
+    struct timespec realtime, monotonic;
+    clock_gettime (CLOCK_REALTIME, &realtime);
+    clock_gettime (CLOCK_MONOTONIC, &monotonic);
+    sweep.realtime_offset_ns = ((int64_t) realtime.tv_sec - monotonic.tv_sec) * 1000000000LL + (realtime.tv_nsec - monotonic.tv_nsec);
 
-	// Report source MAC address to stdout.
-	/*
-	  printf ("MAC address for interface %s is ", interface);
-	  for (i=0; i<5; i++) 
+    if (setup_ring (sweep.sendsd, PACKET_TX_RING, &sweep.tx_ring) < 0)
+    {
+      perror ("PACKET_TX_RING is not available, probes are sent with sendto() ");
+    }
+    if (setup_ring (sweep.recvsd, PACKET_RX_RING, &sweep.rx_ring) < 0)
+    {
+      perror ("PACKET_RX_RING is not available, replies are read with recvfrom() ");
+    }
+    else
+    {
+      // A reply may wait in a block until the kernel hands the block over
+      sweep.timeout_ns += RX_BLOCK_TIMEOUT * 1000000ULL;
+    }
+  }
+  if (bind (sweep.recvsd, (struct sockaddr *) &sweep.device, sizeof (sweep.device)) < 0)
+  {
+    perror ("bind() failed to bind the receive socket to the interface ");
+    exit (EXIT_FAILURE);
+  }
+
+  // SWEEP
+  // run all targets except myself. The sender fires the probe of the next host
+  // whenever it is due, and the loop sleeps until the next probe is due, the
+  // oldest probe expires, or a frame arrives.
+  uint64_t next_send_ns = monotonic_ns ();
+  while (sweep.next_range < sweep.targets.n_ranges || sweep.n_outstanding > 0)
+  {
+    uint64_t now = monotonic_ns ();
+
+    // SEND
+    int burst = 0;
+    while (sweep.next_range < sweep.targets.n_ranges && next_send_ns <= now && burst < MAX_BURST)
+    {
+      if (sweep.next_addr == sweep.src_addr)
+      {
+        printf (KGRN"\nIS ME: %s\n\n", sweep.src_ip);
+        next_target (&sweep); // 下一位
+        continue;
+      }
+      if (sweep.probes[sweep.next_seq].outstanding)
       {
-	    printf ("%02x:", src_mac[i]);
-	  }
-	  printf ("%02x\n", src_mac[5]);
-	*/
-
-	 // Find interface index from interface name and store index in
-	 // struct sockaddr_ll device, which will be used as an argument of sendto().
-     
-	 memset (&device, 0, sizeof (device));
-	 if ((device.sll_ifindex = if_nametoindex (interface)) == 0)
-         {
-	   perror ("if_nametoindex() failed to obtain interface index ");
-	   exit (EXIT_FAILURE);
-	 }
-     
-	 // printf ("Index for interface %s is %i\n", interface, device.sll_ifindex);
-
-	 // Set destination MAC address
-	 dst_mac[0] = 0xff;
-	 dst_mac[1] = 0xff;
-	 dst_mac[2] = 0xff;
-	 dst_mac[3] = 0xff;
-	 dst_mac[4] = 0xff;
-	 dst_mac[5] = 0xff;
-
-	 // Source IPv4 address
-	 strcpy (src_ip, "140.117.172.88");
-
-         int alive_cnt = 0;
-	 
-
-	 // Destination "URL" or "IPv4 address"
-	 // run subnet ip range from .1~.254 except myself
-	 for(int i=1;i<=254;i++)
-	 {
-          
-	     if(i==88)
-	     {
-		     printf(KGRN"\nIS ME: 140.117.172.88\n\n");
-		     continue; // 下一位 
- 	     }	     
-         
-	     strcpy(target,"140.117.172."); // 先寫好 prefix 
-	     char tail[3];
-         sprintf(tail,"%d",i); // 尾碼 , 數字轉字串 	     
-         strcat(target,tail);  // 字串相接: prefix + 尾碼
-         //printf("target: %s\n",target); // 送到哪兒
-	     
-	     // Fill out hints for getaddrinfo().
-	     memset (&hints, 0, sizeof (struct addrinfo));
-	     hints.ai_family = AF_INET;
-	     hints.ai_socktype = SOCK_STREAM;
-	     hints.ai_flags = hints.ai_flags | AI_CANONNAME;
-
-	     // Resolve target using getaddrinfo().
-	     if ((status = getaddrinfo (target, NULL, &hints, &res)) != 0) 
-         {
-	       fprintf (stderr, "getaddrinfo() failed: %s\n", gai_strerror (status));
-	       exit (EXIT_FAILURE);
-	     }
-	     ipv4 = (struct sockaddr_in *) res->ai_addr;
-	     tmp = &(ipv4->sin_addr);
-	     if (inet_ntop (AF_INET, tmp, dst_ip, INET_ADDRSTRLEN) == NULL)
-         {
-	       status = errno;
-	       fprintf (stderr, "inet_ntop() failed.\nError message: %s", strerror (status));
-	       exit (EXIT_FAILURE);
-	     }
-	     freeaddrinfo (res);
-
-	     // Fill out sockaddr_ll.
-	     device.sll_family = AF_PACKET;
-	     memcpy (device.sll_addr, src_mac, 6);
-	     device.sll_halen = 6;
-
-	     // ICMP data // 學號 
-	     datalen = 11;
-             //data = "M083040017"; // 會有 free invalid pointer question
-	     data[0] = 'M';
-	     data[1] = '0';
-	     data[2] = '8';
-	     data[3] = '3';
-	     data[4] = '0';
-	     data[5] = '4';
-	     data[6] = '0';
-	     data[7] = '0';
-	     data[8] = '1';
-	     data[9] = '7';
-
-	     // IPv4 header //
-	     // IPv4 header length (4 bits): Number of 32-bit words in header = 5
-	     send_iphdr.ip_hl = IP4_HDRLEN / sizeof (uint32_t);
-	     // Internet Protocol version (4 bits): IPv4
-	     send_iphdr.ip_v = 4;
-
-	     // Type of service (8 bits)
-	     send_iphdr.ip_tos = 0;
-
-	     // Total length of datagram (16 bits): IP header + ICMP header + ICMP data
-	     send_iphdr.ip_len = htons (IP4_HDRLEN + ICMP_HDRLEN + datalen);
-
-	     // ID sequence number (16 bits): unused, since single datagram 
-	     send_iphdr.ip_id = htons (0);
-
-	     // Flags, and Fragmentation offset (3, 13 bits): 0 since single datagram
-
-	     // Zero (1 bit)
-	     ip_flags[0] = 0;
-
-	     // Do not fragment flag (1 bit)
-	     ip_flags[1] = 0;
-
-	     // More fragments following flag (1 bit)
-	     ip_flags[2] = 0;
-
-	     // Fragmentation offset (13 bits)
-	     ip_flags[3] = 0;
-
-	     send_iphdr.ip_off = htons ((ip_flags[0] << 15)
-	                      + (ip_flags[1] << 14)
-	                      + (ip_flags[2] << 13)
-	                      +  ip_flags[3]);
-
-	     // Time-to-Live (8 bits): default to maximum value > to be continue
-	     send_iphdr.ip_ttl = 255;
-
-	     // Transport layer protocol (8 bits): 1 for ICMP
-	     send_iphdr.ip_p = IPPROTO_ICMP;
-
-	     // Source IPv4 address (32 bits)
-	     if ((status = inet_pton (AF_INET, src_ip, &(send_iphdr.ip_src))) != 1)
-         {
-            fprintf (stderr, "inet_pton() failed.\nError message: %s", strerror (status));
-            exit (EXIT_FAILURE);
-	     }
-
-	     // Destination IPv4 address (32 bits)
-	     if ((status = inet_pton (AF_INET, dst_ip, &(send_iphdr.ip_dst))) != 1) {
-	       fprintf (stderr, "inet_pton() failed.\nError message: %s", strerror (status));
-	       exit (EXIT_FAILURE);
-	     }
-
-	     // IPv4 header checksum (16 bits): set to 0 when calculating checksum
-	     send_iphdr.ip_sum = 0;
-	     send_iphdr.ip_sum = checksum ((uint16_t *) &send_iphdr, IP4_HDRLEN);
-
-         // ICMP header //
-
-	     // Message Type (8 bits): echo request
-	     send_icmphdr.icmp_type = ICMP_ECHO;
-
-	     // Message Code (8 bits): echo request
-	     send_icmphdr.icmp_code = 0;
-
-	     // Identifier (16 bits): usually pid of sending process - pick a number
-	     send_icmphdr.icmp_id = htons (1000); // 0x2657
-
-	     // Sequence Number (16 bits): starting from 1 
-	     send_icmphdr.icmp_seq = htons (1);
-
-	     // ICMP header checksum (16 bits): set to 0 when calculating checksum
-	     send_icmphdr.icmp_cksum = icmp4_checksum (send_icmphdr, data, datalen);
-
-	     // Fill out ethernet frame header.
-
-	     // Ethernet frame length = ethernet header (MAC + MAC + ethernet type) + ethernet data (IP header + ICMP header + ICMP data)
-	     frame_length = 6 + 6 + 2 + IP4_HDRLEN + ICMP_HDRLEN + datalen;
-
-	     // Destination and Source MAC addresses
-	     memcpy (send_ether_frame, dst_mac, 6);
-	     memcpy (send_ether_frame + 6, src_mac, 6);
-
-	     // Next is ethernet type code (ETH_P_IP for IPv4).  
-	     send_ether_frame[12] = ETH_P_IP / 256;
-	     send_ether_frame[13] = ETH_P_IP % 256;
-
-	     // Next is ethernet frame data (IPv4 header + ICMP header + ICMP data).
-
-	     // IPv4 header
-	     memcpy (send_ether_frame + ETH_HDRLEN, &send_iphdr, IP4_HDRLEN);
-
-	     // ICMP header
-	     memcpy (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN, &send_icmphdr, ICMP_HDRLEN);
-
-	     // ICMP data
-	     memcpy (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN + ICMP_HDRLEN, data, datalen);
-
-	     // Submit request for a raw socket descriptor to receive packets.
-	     if ((recvsd = socket (PF_PACKET, SOCK_RAW, htons (ETH_P_ALL))) < 0)
-         {
-	       perror ("socket() failed to obtain a receive socket descriptor ");
-	       exit (EXIT_FAILURE);
-	     }
-
-	     // Set maximum number of tries to ping remote host before giving up.
-	     trylim = 4;
-	     trycount = 0;
-
-	     // Cast recv_iphdr as pointer to IPv4 header within received ethernet frame.
-	     recv_iphdr = (struct ip *) (recv_ether_frame + ETH_HDRLEN);
-
-	     // Cast recv_icmphdr as pointer to ICMP header within received ethernet frame.
-	     recv_icmphdr = (struct icmp *) (recv_ether_frame + ETH_HDRLEN + IP4_HDRLEN);
-
-	     done = 0;
-	     for (;;) 
-         {
-
-            // SEND
-
-            // Send ethernet frame to socket.
-            if ((bytes = sendto (sendsd, send_ether_frame, frame_length, 0, (struct sockaddr *) &device, sizeof (device))) <= 0) {
-              perror ("sendto() failed ");
-              exit (EXIT_FAILURE);
-            }
-
-            // Start timer.
-            (void) gettimeofday (&t1, &tz);
-
-            // Set time for the socket to timeout and give up waiting for a reply.
-            timeout = atoi(argv[4]);
-            wait.tv_sec  = timeout;  
-            wait.tv_usec = 0;
-            setsockopt (recvsd, SOL_SOCKET, SO_RCVTIMEO, (char *) &wait, sizeof (struct timeval));
-
-            // Listen for incoming ethernet frame from socket recvsd.
-            // We expect an ICMP ethernet frame of the form:
-            //     MAC (6 bytes) + MAC (6 bytes) + ethernet type (2 bytes)
-            //     + ethernet data (IPv4 header + ICMP header)
-            // Keep at it for 'timeout' seconds, or until we get an ICMP reply.
-            
-	    struct timeval start;
-	    struct timeval end;
-
-
-            // RECEIVE LOOP
-            for (;;) 
-            {
-                 gettimeofday(&start,NULL); // 開始計時
-
-                  memset (recv_ether_frame, 0, IP_MAXPACKET * sizeof (uint8_t));
-                  memset (&from, 0, sizeof (from));
-                  fromlen = sizeof (from);
-                  if ((bytes = recvfrom (recvsd, recv_ether_frame, IP_MAXPACKET, 0, (struct sockaddr *) &from, &fromlen)) < 0) 
-                  {
-                        status = errno;
-                        // Deal with error conditions first.
-                        if (status == EAGAIN) {  // EAGAIN = 11
-                          printf ("No reply within %i seconds.\n", timeout);
-                          trycount++;
-                          break;  // Break out of Receive loop.
-                        } else if (status == EINTR) {  // EINTR = 4
-                          continue;  // Something weird happened, but let's keep listening.
-                        } else {
-                          perror ("recvfrom() failed ");
-                          exit (EXIT_FAILURE);
-                        }
-                  }  // End of error handling conditionals.
-                  // printf("trycount: %d\n",trycount);
-                  // printf("check\n\n");
-                  // Check for an IP ethernet frame, carrying ICMP echo reply. If not, ignore and keep listening.
-                  
-                  if ((((recv_ether_frame[12] << 8) + recv_ether_frame[13]) == ETH_P_IP) &&
-                     (recv_iphdr->ip_p == IPPROTO_ICMP) && (recv_icmphdr->icmp_type == ICMP_ECHOREPLY) && (recv_icmphdr->icmp_code == 0)) 
-                  {
-
-                        // Stop timer and calculate how long it took to get a reply.
-                        (void) gettimeofday (&t2, &tz);
-                        dt = (double) (t2.tv_sec - t1.tv_sec) * 1000.0 + (double) (t2.tv_usec - t1.tv_usec) / 1000.0;
-
-                        // Extract source IP address from received ethernet frame.
-                        if (inet_ntop (AF_INET, &(recv_iphdr->ip_src.s_addr), rec_ip, INET_ADDRSTRLEN) == NULL) {
-                          status = errno;
-                          fprintf (stderr, "inet_ntop() failed.\nError message: %s", strerror (status));
-                          exit (EXIT_FAILURE);
-                        }
-
-                        // Report source IPv4 address and time for reply.
-                    //printf("type: %d\n",recv_icmphdr->icmp_type);
-                    //printf("code: %d\n",recv_icmphdr->icmp_code);
-                        //printf ("%s  %g ms (%i bytes received)\n", rec_ip, dt, bytes);
-                        printf(KYEL"PING %s (data size = 10, id = 0x2657 ,seq = %d ,timeout = 10000 ms)\n",target,i);
-                        printf(KRED"\tReply from : %s ,time : %g ms\n",target,dt);
-			alive_cnt++;
-                        done = 1;
-                        break;  // Break out of Receive loop.
-                  }  // End if IP ethernet frame carrying ICMP_ECHOREPLY
-		  /*
-                  // We ran out of tries, so let's give up.
-                  if (trycount == trylim) 
-                  {
-                        //printf("type: %d\n",recv_icmphdr->icmp_type);
-                        //printf("code: %d\n",recv_icmphdr->icmp_code);
-                        if(recv_icmphdr->icmp_type==3)
-                        {
-                            printf("The host Unreachable\n");
-                        }
-                        //printf ("Unreachable | Recognized no echo replies from remote host after %i tries.\n", trylim);
-                        printf(KYEL"PING %s (data size = 10, id = 0x2657 ,seq = %d,  timeout = 10000 ms)\n",target,i);
-                        printf(KBLU"\tDestination unreachable\n");
-                        done = 1;  
-                        break;
-                  }
-                  trycount = trycount + 1;
-                  //printf("test\n");
-		  */
-                  gettimeofday(&end,NULL);
-		  long int diff;
-		  diff = 1000000*(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec);
-		  //printf("diff: %ld\n",diff);
-		  if(diff>atoi(argv[4]))
-		  {
-			 // printf("timeout!\n");
-			  printf(KYEL"PING %s (data size = 10, id = 0x2657 ,seq = %d,  timeout = 10000 ms)\n",target,i);
-                          printf(KBLU"\tDestination unreachable\n");
-                          done = 1;
-			  break;
-		  }
-            }  // End of Receive loop.
-
-            // The 'done' flag was set because an echo reply was received; break out of send loop.
-            if (done == 1) 
-            {
-               break;  // Break out of Send loop.
-            }
-
-
-
-	  }  // End of Send loop.
-
-	
-	} // send to all (except src:me) end
-      printf("Number of Alive: %d\n",alive_cnt);
-      // Close socket descriptors.
-	  close (sendsd);
-	  close (recvsd);
-
-	  // Free allocated memory.
-	  
-	  free (src_mac);
-	  //printf("test1\n");
-	  free (dst_mac);
-	  // printf("test2\n");
-	  free (data);
-	  // printf("test3\n");
-	  free (send_ether_frame);
-	  // printf("test4\n");
-	  free (recv_ether_frame);
-	  // printf("test5\n");
-	  free (interface);
-	   //printf("test6\n");
-	  free (target);
-	   //printf("test7\n");
-	  free (src_ip);
-	   //printf("test8\n");
-	  free (dst_ip);
-	   //printf("test9\n");
-	  free (rec_ip);
-	   //printf("test9\n");
-	  free (ip_flags);
-	  //printf("test10\n"); 
-	  return (EXIT_SUCCESS);
-    } // end argc == 5 : end program	  
-	else // 格式不符 
+        break; // The window is full, wait for the oldest probe
+      }
+      if (send_probe (&sweep, (uint32_t) sweep.next_addr) < 0)
+      {
+        break; // The interface queue is full, retry on the next turn
+      }
+      next_target (&sweep);
+      burst++;
+      next_send_ns += sweep.interval_ns;
+    }
+    if (sweep.tx_pending > 0)
+    {
+      flush_tx_ring (&sweep);
+    }
+    if (next_send_ns + MAX_BURST * sweep.interval_ns < now)
+    {
+      next_send_ns = now; // Do not flood the segment to make up for a long stall
+    }
+
+    // TIMEOUT
+    expire_probes (&sweep, now);
+
+    // WAIT
+    uint64_t wait_ns = UINT64_MAX;
+    if (sweep.next_range < sweep.targets.n_ranges && !sweep.probes[sweep.next_seq].outstanding)
+    {
+      wait_ns = next_send_ns > now ? next_send_ns - now : 0;
+    }
+    if (sweep.n_outstanding > 0)
+    {
+      uint64_t expiry_ns = sweep.expiry.next->sent_ns + sweep.timeout_ns;
+      uint64_t expiry_wait_ns = expiry_ns > now ? expiry_ns - now : 0;
+      if (expiry_wait_ns < wait_ns)
+      {
+        wait_ns = expiry_wait_ns;
+      }
+    }
+    if (wait_ns == UINT64_MAX)
+    {
+      break;
+    }
+    struct pollfd pfd;
+    pfd.fd = sweep.recvsd;
+    pfd.events = POLLIN;
+    struct timespec wait;
+    wait.tv_sec = wait_ns / 1000000000ULL;
+    wait.tv_nsec = wait_ns % 1000000000ULL;
+    if (ppoll (&pfd, 1, &wait, NULL) < 0 && errno != EINTR)
+    {
+      perror ("ppoll() failed ");
+      exit (EXIT_FAILURE);
+    }
+
+    // RECEIVE
+    if (pfd.revents & POLLIN)
     {
-       printf(KRED"Format Error\n");
-    }        
-	  
+      if (sweep.rx_ring.map != NULL)
+      {
+        receive_ring (&sweep);
+      }
+      else
+      {
+        receive_replies (&sweep);
+      }
+    }
+  }
+
+  printf("Number of Alive: %d\n", sweep.alive_cnt);
+  // Unmap the rings and close socket descriptors.
+  if (sweep.tx_ring.map != NULL)
+  {
+    munmap (sweep.tx_ring.map, sweep.tx_ring.size);
+  }
+  if (sweep.rx_ring.map != NULL)
+  {
+    munmap (sweep.rx_ring.map, sweep.rx_ring.size);
+  }
+  close (sweep.sendsd);
+  close (sweep.recvsd);
+
+  // Free allocated memory.
+  free (sweep.src_mac);
+  free (sweep.dst_mac);
+  free (sweep.data);
+  free (sweep.probe_template);
+  free (sweep.send_ether_frame);
+  free (sweep.recv_ether_frame);
+  free (sweep.src_ip);
+  free (sweep.probes);
+  free (sweep.targets.ranges);
+  free (sweep.alive);
+  return (EXIT_SUCCESS);
 } // end main
 
-// Build IPv4 ICMP pseudo-header and call checksum function.
-uint16_t
-icmp4_checksum (struct icmp icmphdr, uint8_t *payload, int payloadlen)
+// Read the monotonic clock in nanoseconds, it does not jump with the wall clock.
+uint64_t
+monotonic_ns (void)
 {
-  char buf[IP_MAXPACKET];
-  char *ptr;
-  int chksumlen = 0;
-  int i;
-
-  ptr = &buf[0];  // ptr points to beginning of buffer buf
-
-  // Copy Message Type to buf (8 bits)
-  memcpy (ptr, &icmphdr.icmp_type, sizeof (icmphdr.icmp_type));
-  ptr += sizeof (icmphdr.icmp_type);
-  chksumlen += sizeof (icmphdr.icmp_type);
-
-  // Copy Message Code to buf (8 bits)
-  memcpy (ptr, &icmphdr.icmp_code, sizeof (icmphdr.icmp_code));
-  ptr += sizeof (icmphdr.icmp_code);
-  chksumlen += sizeof (icmphdr.icmp_code);
-
-  // Copy ICMP checksum to buf (16 bits)
-  // Zero, since we don't know it yet
-  *ptr = 0; ptr++;
-  *ptr = 0; ptr++;
-  chksumlen += 2;
-
-  // Copy Identifier to buf (16 bits)
-  memcpy (ptr, &icmphdr.icmp_id, sizeof (icmphdr.icmp_id));
-  ptr += sizeof (icmphdr.icmp_id);
-  chksumlen += sizeof (icmphdr.icmp_id);
-
-  // Copy Sequence Number to buf (16 bits)
-  memcpy (ptr, &icmphdr.icmp_seq, sizeof (icmphdr.icmp_seq));
-  ptr += sizeof (icmphdr.icmp_seq);
-  chksumlen += sizeof (icmphdr.icmp_seq);
-
-  // Copy payload to buf
-  memcpy (ptr, payload, payloadlen);
-  ptr += payloadlen;
-  chksumlen += payloadlen;
-
-  // Pad to the next 16-bit boundary
-  for (i=0; i<payloadlen%2; i++, ptr++) {
-    *ptr = 0;
-    ptr++;
-    chksumlen++;
-  }
-
-  return checksum ((uint16_t *) buf, chksumlen);
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+// Build the ethernet frame of an echo request into probe_template once, with the
+// destination address and the sequence number zero. Every probe is a copy of it.
+void
+build_probe_template (struct sweep *sweep)
+{
+  struct ip send_iphdr;
+  struct icmp send_icmphdr;
+  uint8_t *send_ether_frame = sweep->probe_template;
+
+  // IPv4 header //
+  // IPv4 header length (4 bits): Number of 32-bit words in header = 5
+  send_iphdr.ip_hl = IP4_HDRLEN / sizeof (uint32_t);
+  // Internet Protocol version (4 bits): IPv4
+  send_iphdr.ip_v = 4;
+
+  // Type of service (8 bits)
+  send_iphdr.ip_tos = 0;
+
+  // Total length of datagram (16 bits): IP header + ICMP header + ICMP data
+  send_iphdr.ip_len = htons (IP4_HDRLEN + ICMP_HDRLEN + sweep->datalen);
+
+  // ID sequence number (16 bits): unused, since single datagram
+  send_iphdr.ip_id = htons (0);
+
+  // Flags, and Fragmentation offset (3, 13 bits): 0 since single datagram
+  send_iphdr.ip_off = htons (0);
+
+  // Time-to-Live (8 bits): default to maximum value
+  send_iphdr.ip_ttl = 255;
+
+  // Transport layer protocol (8 bits): 1 for ICMP
+  send_iphdr.ip_p = IPPROTO_ICMP;
+
+  // Source IPv4 address (32 bits)
+  send_iphdr.ip_src.s_addr = htonl (sweep->src_addr);
+
+  // Destination IPv4 address (32 bits): patched for each probe
+  send_iphdr.ip_dst.s_addr = 0;
+
+  // IPv4 header checksum (16 bits): set to 0 when calculating checksum
+  send_iphdr.ip_sum = 0;
+  send_iphdr.ip_sum = checksum ((uint16_t *) &send_iphdr, IP4_HDRLEN);
+
+  // ICMP header //
+
+  // Message Type (8 bits): echo request
+  send_icmphdr.icmp_type = ICMP_ECHO;
+
+  // Message Code (8 bits): echo request
+  send_icmphdr.icmp_code = 0;
+
+  // Identifier (16 bits): the same for every probe of the sweep
+  send_icmphdr.icmp_id = htons (sweep->id);
+
+  // Sequence Number (16 bits): patched for each probe
+  send_icmphdr.icmp_seq = 0;
+
+  // ICMP header checksum (16 bits): computed over the header and the data in the frame below
+  send_icmphdr.icmp_cksum = 0;
+
+  // Fill out ethernet frame header.
+
+  // Destination and Source MAC addresses
+  memcpy (send_ether_frame, sweep->dst_mac, 6);
+  memcpy (send_ether_frame + 6, sweep->src_mac, 6);
+
+  // Next is ethernet type code (ETH_P_IP for IPv4).
+  send_ether_frame[12] = ETH_P_IP / 256;
+  send_ether_frame[13] = ETH_P_IP % 256;
+
+  // Next is ethernet frame data (IPv4 header + ICMP header + ICMP data).
+
+  // IPv4 header
+  memcpy (send_ether_frame + ETH_HDRLEN, &send_iphdr, IP4_HDRLEN);
+
+  // ICMP header
+  memcpy (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN, &send_icmphdr, ICMP_HDRLEN);
+
+  // ICMP data
+  memcpy (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN + ICMP_HDRLEN, sweep->data, sweep->datalen);
+
+  // ICMP checksum over the ICMP header and data, IPv4 has no pseudo-header for ICMP
+  struct icmp *icmphdr = (struct icmp *) (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN);
+  icmphdr->icmp_cksum = checksum ((uint16_t *) icmphdr, ICMP_HDRLEN + sweep->datalen);
+
+  // Ethernet frame length = ethernet header (MAC + MAC + ethernet type) + ethernet data (IP header + ICMP header + ICMP data)
+  sweep->probe_len = ETH_HDRLEN + IP4_HDRLEN + ICMP_HDRLEN + sweep->datalen;
+}
+
+// Build the ethernet frame of an echo request to target into send_ether_frame: copy the
+// template and patch the destination address and the sequence number, whose zeros the
+// checksums of the template cover, so both checksums are updated instead of recomputed.
+// Returns the length of the frame.
+int
+build_probe_frame (struct sweep *sweep, uint8_t *send_ether_frame, struct in_addr target, uint16_t seq)
+{
+  struct ip *send_iphdr = (struct ip *) (send_ether_frame + ETH_HDRLEN);
+  struct icmp *send_icmphdr = (struct icmp *) (send_ether_frame + ETH_HDRLEN + IP4_HDRLEN);
+  uint16_t dst[2];
+
+  memcpy (send_ether_frame, sweep->probe_template, sweep->probe_len);
+
+  memcpy (dst, &target, sizeof (dst));
+  send_iphdr->ip_dst = target;
+  send_iphdr->ip_sum = update_checksum (update_checksum (send_iphdr->ip_sum, 0, dst[0]), 0, dst[1]);
+
+  send_icmphdr->icmp_seq = htons (seq);
+  send_icmphdr->icmp_cksum = update_checksum (send_icmphdr->icmp_cksum, 0, send_icmphdr->icmp_seq);
+
+  return (sweep->probe_len);
+}
+
+// Send the probe of target, an address in host byte order, and start its timer. A probe
+// of the TX ring is built in its frame and leaves with the next flush_tx_ring().
+// Returns -1 if the interface has no room for the frame right now.
+int
+send_probe (struct sweep *sweep, uint32_t target)
+{
+  uint16_t seq = sweep->next_seq;
+  struct probe *probe = &sweep->probes[seq];
+  struct in_addr dst;
+  dst.s_addr = htonl (target);
+
+  if (sweep->tx_ring.map != NULL)
+  {
+    struct packet_ring *ring = &sweep->tx_ring;
+    struct tpacket3_hdr *slot = (struct tpacket3_hdr *) (ring->map + (size_t) ring->next * ring->req.tp_frame_size);
+    if (__atomic_load_n (&slot->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+    {
+      return (-1); // The kernel did not send the frame of a full turn ago yet
+    }
+    // The kernel reads the frame after the header minus the sockaddr_ll of the RX layout
+    uint8_t *frame = (uint8_t *) slot + TPACKET3_HDRLEN - sizeof (struct sockaddr_ll);
+    slot->tp_len = build_probe_frame (sweep, frame, dst, seq);
+    slot->tp_next_offset = 0;
+    __atomic_store_n (&slot->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    ring->next = (ring->next + 1) % ring->req.tp_frame_nr;
+    sweep->tx_pending++;
+  }
+  // Send ethernet frame to socket.
+  else if (sendto (sweep->sendsd, sweep->send_ether_frame, build_probe_frame (sweep, sweep->send_ether_frame, dst, seq), 0,
+                   (struct sockaddr *) &sweep->device, sizeof (sweep->device)) <= 0)
+  {
+    if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+    {
+      return (-1);
+    }
+    perror ("sendto() failed ");
+    exit (EXIT_FAILURE);
+  }
+
+  probe->target = dst;
+  probe->sent_ns = monotonic_ns ();
+  probe->outstanding = 1;
+  link_probe (sweep, probe);
+  sweep->next_seq++;
+  return (0);
+}
+
+// Map a PACKET_MMAP ring of TPACKET_V3 onto a packet socket.
+// Returns -1 with errno set if the kernel does not support the ring.
+int
+setup_ring (int sd, int ring_type, struct packet_ring *ring)
+{
+  int version = TPACKET_V3;
+
+  memset (ring, 0, sizeof (struct packet_ring));
+  if (ring_type == PACKET_TX_RING)
+  {
+    ring->req.tp_block_size = TX_BLOCK_SIZE;
+    ring->req.tp_block_nr = TX_BLOCK_NR;
+    ring->req.tp_frame_size = TX_FRAME_SIZE;
+  }
+  else
+  {
+    ring->req.tp_block_size = RX_BLOCK_SIZE;
+    ring->req.tp_block_nr = RX_BLOCK_NR;
+    ring->req.tp_frame_size = RX_FRAME_SIZE;
+    ring->req.tp_retire_blk_tov = RX_BLOCK_TIMEOUT;
+  }
+  ring->req.tp_frame_nr = ring->req.tp_block_size / ring->req.tp_frame_size * ring->req.tp_block_nr;
+  ring->size = (size_t) ring->req.tp_block_size * ring->req.tp_block_nr;
+
+  if (setsockopt (sd, SOL_PACKET, PACKET_VERSION, &version, sizeof (version)) < 0 ||
+      setsockopt (sd, SOL_PACKET, ring_type, &ring->req, sizeof (ring->req)) < 0)
+  {
+    return (-1);
+  }
+  ring->map = (uint8_t *) mmap (NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, sd, 0);
+  if (ring->map == MAP_FAILED)
+  {
+    ring->map = NULL;
+    return (-1);
+  }
+  return (0);
+}
+
+// Hand the frames queued in the TX ring to the kernel, which sends them all in this call.
+// If the interface queue is full, the kernel leaves the rest of the frames in the ring
+// and they stay pending, so the next turn of the loop flushes them again.
+void
+flush_tx_ring (struct sweep *sweep)
+{
+  if (sendto (sweep->sendsd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *) &sweep->device, sizeof (sweep->device)) < 0)
+  {
+    if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+    {
+      return;
+    }
+    perror ("sendto() failed to flush the TX ring ");
+    exit (EXIT_FAILURE);
+  }
+  sweep->tx_pending = 0;
+}
+
+// Take every block the kernel handed over in the RX ring and report the echo replies,
+// the frames are read in place and the block goes back to the kernel afterwards.
+void
+receive_ring (struct sweep *sweep)
+{
+  struct packet_ring *ring = &sweep->rx_ring;
+  unsigned int i;
+
+  for (;;)
+  {
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *) (ring->map + (size_t) ring->next * ring->req.tp_block_size);
+    if (!(__atomic_load_n (&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+    {
+      return; // Nothing more to read, back to the loop.
+    }
+
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *) ((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < block->hdr.bh1.num_pkts; i++)
+    {
+      struct sockaddr_ll *from = (struct sockaddr_ll *) ((uint8_t *) hdr + TPACKET_ALIGN (sizeof (struct tpacket3_hdr)));
+      uint64_t received_ns = (uint64_t) ((int64_t) hdr->tp_sec * 1000000000LL + hdr->tp_nsec - sweep->realtime_offset_ns);
+      handle_frame (sweep, (uint8_t *) hdr + hdr->tp_mac, hdr->tp_snaplen, from->sll_pkttype, received_ns);
+      hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset);
+    }
+
+    __atomic_store_n (&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring->next = (ring->next + 1) % ring->req.tp_block_nr;
+  }
+}
+
+// Take every frame the receive socket holds and report the echo replies to our probes.
+void
+receive_replies (struct sweep *sweep)
+{
+  int bytes;
+  struct sockaddr_ll from;
+  socklen_t fromlen;
+
+  for (;;)
+  {
+    fromlen = sizeof (from);
+    if ((bytes = recvfrom (sweep->recvsd, sweep->recv_ether_frame, IP_MAXPACKET, MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen)) < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return; // Nothing more to read, back to the loop.
+      }
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror ("recvfrom() failed ");
+      exit (EXIT_FAILURE);
+    }
+    handle_frame (sweep, sweep->recv_ether_frame, bytes, from.sll_pkttype, monotonic_ns ());
+  }
+}
+
+// Attach a classic BPF program to a packet socket which accepts only unfragmented ICMP
+// echo replies carrying our identifier, everything else is dropped in the kernel.
+// Returns -1 with errno set if the filter cannot be attached.
+int
+attach_reply_filter (int sd, uint16_t id)
+{
+  struct sock_filter code[] = {
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 12),                              // ethernet type
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 10),
+    BPF_STMT (BPF_LD | BPF_B | BPF_ABS, ETH_HDRLEN + 9),                  // IP protocol
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 8),
+    BPF_STMT (BPF_LD | BPF_H | BPF_ABS, ETH_HDRLEN + 6),                  // fragment offset
+    BPF_JUMP (BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 6, 0),
+    BPF_STMT (BPF_LDX | BPF_B | BPF_MSH, ETH_HDRLEN),                     // X = IP header length
+    BPF_STMT (BPF_LD | BPF_B | BPF_IND, ETH_HDRLEN),                      // ICMP type
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 3),
+    BPF_STMT (BPF_LD | BPF_H | BPF_IND, ETH_HDRLEN + 4),                  // ICMP identifier
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+    BPF_STMT (BPF_RET | BPF_K, 0x40000),                                   // accept the whole frame
+    BPF_STMT (BPF_RET | BPF_K, 0),                                         // drop
+  };
+  struct sock_fprog program;
+
+  program.len = sizeof (code) / sizeof (code[0]);
+  program.filter = code;
+  return (setsockopt (sd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof (program)));
+}
+
+// Report a received frame if it is the echo reply to one of our probes.
+// We expect an ICMP ethernet frame of the form:
+//     MAC (6 bytes) + MAC (6 bytes) + ethernet type (2 bytes)
+//     + ethernet data (IPv4 header + ICMP header)
+void
+handle_frame (struct sweep *sweep, uint8_t *recv_ether_frame, int bytes, int pkttype, uint64_t received_ns)
+{
+  char rec_ip[INET_ADDRSTRLEN];
+  struct ip *recv_iphdr = (struct ip *) (recv_ether_frame + ETH_HDRLEN);
+
+  // Check for an IP ethernet frame, carrying ICMP echo reply. If not, ignore and keep listening.
+  // Our own probes are seen as outgoing frames.
+  if (pkttype == PACKET_OUTGOING || bytes < ETH_HDRLEN + IP4_HDRLEN ||
+      ((recv_ether_frame[12] << 8) + recv_ether_frame[13]) != ETH_P_IP || recv_iphdr->ip_p != IPPROTO_ICMP)
+  {
+    return;
+  }
+  int ip_hdrlen = recv_iphdr->ip_hl * 4;
+  if (bytes < ETH_HDRLEN + ip_hdrlen + ICMP_HDRLEN)
+  {
+    return;
+  }
+  struct icmp *recv_icmphdr = (struct icmp *) (recv_ether_frame + ETH_HDRLEN + ip_hdrlen);
+  if (recv_icmphdr->icmp_type != ICMP_ECHOREPLY || recv_icmphdr->icmp_code != 0 ||
+      ntohs (recv_icmphdr->icmp_id) != sweep->id)
+  {
+    return;
+  }
+
+  // Match the reply to its probe, a late or duplicate reply finds no outstanding probe.
+  uint16_t seq = ntohs (recv_icmphdr->icmp_seq);
+  struct probe *probe = &sweep->probes[seq];
+  if (!probe->outstanding || probe->target.s_addr != recv_iphdr->ip_src.s_addr)
+  {
+    return;
+  }
+  unlink_probe (sweep, probe);
+  int64_t host = find_target_host (&sweep->targets, ntohl (probe->target.s_addr));
+  if (host < 0 || (sweep->alive[host / 8] & (1 << (host % 8))))
+  {
+    return;
+  }
+  sweep->alive[host / 8] |= 1 << (host % 8);
+
+  // Report source IPv4 address and time for reply.
+  if (received_ns < probe->sent_ns)
+  {
+    received_ns = probe->sent_ns; // The clocks of the RX ring and of the probes differ by a hair
+  }
+  double dt = (double) (received_ns - probe->sent_ns) / 1000000.0;
+  inet_ntop (AF_INET, &probe->target, rec_ip, INET_ADDRSTRLEN);
+  printf (KYEL"PING %s (data size = 10, id = 0x%04x ,seq = %d ,timeout = %d ms)\n", rec_ip, sweep->id, seq, sweep->timeout_ms);
+  printf (KRED"\tReply from : %s ,time : %g ms\n", rec_ip, dt);
+  sweep->alive_cnt++;
+}
+
+// Report the probes whose timeout passed as unreachable, oldest first.
+void
+expire_probes (struct sweep *sweep, uint64_t now)
+{
+  char dst_ip[INET_ADDRSTRLEN];
+
+  while (sweep->n_outstanding > 0 && sweep->expiry.next->sent_ns + sweep->timeout_ns <= now)
+  {
+    struct probe *probe = sweep->expiry.next;
+    unlink_probe (sweep, probe);
+    inet_ntop (AF_INET, &probe->target, dst_ip, INET_ADDRSTRLEN);
+    printf (KYEL"PING %s (data size = 10, id = 0x%04x ,seq = %d,  timeout = %d ms)\n", dst_ip, sweep->id,
+            (int) (probe - sweep->probes), sweep->timeout_ms);
+    printf (KBLU"\tDestination unreachable\n");
+  }
+}
+
+// Append a probe which was just sent to the expiry list.
+void
+link_probe (struct sweep *sweep, struct probe *probe)
+{
+  probe->next = &sweep->expiry;
+  probe->prev = sweep->expiry.prev;
+  sweep->expiry.prev->next = probe;
+  sweep->expiry.prev = probe;
+  sweep->n_outstanding++;
+}
+
+// Remove a probe from the expiry list once it is answered or expired.
+void
+unlink_probe (struct sweep *sweep, struct probe *probe)
+{
+  probe->prev->next = probe->next;
+  probe->next->prev = probe->prev;
+  probe->next = NULL;
+  probe->prev = NULL;
+  probe->outstanding = 0;
+  sweep->n_outstanding--;
+}
+
+// Move the cursor of the sender to the next target address.
+void
+next_target (struct sweep *sweep)
+{
+  if (sweep->next_addr < sweep->targets.ranges[sweep->next_range].last)
+  {
+    sweep->next_addr++;
+    return;
+  }
+  sweep->next_range++;
+  if (sweep->next_range < sweep->targets.n_ranges)
+  {
+    sweep->next_addr = sweep->targets.ranges[sweep->next_range].first;
+  }
+}
+
+// Add the addresses of a target specification:
+//     a.b.c.d/prefix      a CIDR block without its network and broadcast addresses
+//     a.b.c.d-e.f.g.h     a range of addresses
+//     a.b.c.d-h           a range in the last octet
+//     a.b.c.d             a single address
+// Returns -1 if the specification is invalid.
+int
+parse_target (struct target_list *targets, char *spec)
+{
+  char address[INET_ADDRSTRLEN];
+  char *separator, *end;
+  struct in_addr first, last;
+  size_t length;
+
+  separator = strpbrk (spec, "/-");
+  length = separator == NULL ? strlen (spec) : (size_t) (separator - spec);
+  if (length >= sizeof (address))
+  {
+    return (-1);
+  }
+  memcpy (address, spec, length);
+  address[length] = '\0';
+  if (inet_pton (AF_INET, address, &first) != 1)
+  {
+    return (-1);
+  }
+  uint32_t from = ntohl (first.s_addr);
+
+  if (separator == NULL)
+  {
+    add_target_range (targets, from, from);
+    return (0);
+  }
+  if (*separator == '/')
+  {
+    long prefix = strtol (separator + 1, &end, 10);
+    if (end == separator + 1 || *end != '\0' || prefix < 0 || prefix > 32)
+    {
+      return (-1);
+    }
+    uint32_t netmask = prefix == 0 ? 0 : 0xffffffffU << (32 - prefix);
+    uint32_t network = from & netmask;
+    uint32_t broadcast = network | ~netmask;
+    if (prefix >= 31)
+    {
+      add_target_range (targets, network, broadcast); // no network or broadcast address, RFC 3021
+    }
+    else
+    {
+      add_target_range (targets, network + 1, broadcast - 1);
+    }
+    return (0);
+  }
+  if (strchr (separator + 1, '.') != NULL)
+  {
+    if (inet_pton (AF_INET, separator + 1, &last) != 1)
+    {
+      return (-1);
+    }
+    uint32_t to = ntohl (last.s_addr);
+    if (to < from)
+    {
+      return (-1);
+    }
+    add_target_range (targets, from, to);
+    return (0);
+  }
+  long octet = strtol (separator + 1, &end, 10);
+  if (end == separator + 1 || *end != '\0' || octet < (long) (from & 0xff) || octet > 255)
+  {
+    return (-1);
+  }
+  add_target_range (targets, from, (from & 0xffffff00U) | (uint32_t) octet);
+  return (0);
+}
+
+// Add the targets of a file, blank lines and everything after # are ignored.
+// Returns -1 if the file cannot be read or holds an invalid target.
+int
+read_target_file (struct target_list *targets, const char *path)
+{
+  char line[MAX_TARGET_LINE];
+  char *spec, *save;
+  int line_number = 0;
+  FILE *file;
+
+  if ((file = fopen (path, "r")) == NULL)
+  {
+    perror ("fopen() failed to open the target file ");
+    return (-1);
+  }
+  while (fgets (line, sizeof (line), file) != NULL)
+  {
+    line_number++;
+    line[strcspn (line, "#\r\n")] = '\0';
+    for (spec = strtok_r (line, " \t,", &save); spec != NULL; spec = strtok_r (NULL, " \t,", &save))
+    {
+      if (parse_target (targets, spec) < 0)
+      {
+        fprintf (stderr, "Invalid target at line %d of %s: %s\n", line_number, path, spec);
+        fclose (file);
+        return (-1);
+      }
+    }
+  }
+  fclose (file);
+  return (0);
+}
+
+// Append a range of addresses in host byte order, merge_targets() sorts them later.
+void
+add_target_range (struct target_list *targets, uint32_t first, uint32_t last)
+{
+  if (targets->n_ranges == targets->capacity)
+  {
+    int capacity = targets->capacity == 0 ? 16 : targets->capacity * 2;
+    struct target_range *ranges = (struct target_range *) realloc (targets->ranges, capacity * sizeof (struct target_range));
+    if (ranges == NULL)
+    {
+      fprintf (stderr, "ERROR: Cannot allocate memory for %d target ranges.\n", capacity);
+      exit (EXIT_FAILURE);
+    }
+    targets->ranges = ranges;
+    targets->capacity = capacity;
+  }
+  targets->ranges[targets->n_ranges].first = first;
+  targets->ranges[targets->n_ranges].last = last;
+  targets->n_ranges++;
+}
+
+// Sort the ranges, join the ones which overlap or touch, and number the hosts.
+void
+merge_targets (struct target_list *targets)
+{
+  int i, n = 0;
+
+  qsort (targets->ranges, targets->n_ranges, sizeof (struct target_range), compare_ranges);
+  for (i = 0; i < targets->n_ranges; i++)
+  {
+    struct target_range *range = &targets->ranges[i];
+    if (n > 0 && (uint64_t) range->first <= (uint64_t) targets->ranges[n - 1].last + 1)
+    {
+      if (range->last > targets->ranges[n - 1].last)
+      {
+        targets->ranges[n - 1].last = range->last;
+      }
+      continue;
+    }
+    targets->ranges[n++] = *range;
+  }
+  targets->n_ranges = n;
+
+  targets->n_hosts = 0;
+  for (i = 0; i < n; i++)
+  {
+    targets->ranges[i].offset = targets->n_hosts;
+    targets->n_hosts += (uint64_t) targets->ranges[i].last - targets->ranges[i].first + 1;
+  }
+}
+
+// Order ranges by their first address for qsort().
+int
+compare_ranges (const void *a, const void *b)
+{
+  const struct target_range *x = (const struct target_range *) a;
+  const struct target_range *y = (const struct target_range *) b;
+
+  return (x->first < y->first ? -1 : (x->first > y->first ? 1 : 0));
+}
+
+// Find the index of a host among all targets with a binary search of the ranges.
+// Returns -1 if the address is not a target.
+int64_t
+find_target_host (const struct target_list *targets, uint32_t address)
+{
+  int low = 0, high = targets->n_ranges - 1;
+
+  while (low <= high)
+  {
+    int middle = low + (high - low) / 2;
+    const struct target_range *range = &targets->ranges[middle];
+    if (address < range->first)
+    {
+      high = middle - 1;
+    }
+    else if (address > range->last)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      return ((int64_t) (range->offset + (address - range->first)));
+    }
+  }
+  return (-1);
 }
 
 // Computing the internet checksum (RFC 1071).
@@ -559,6 +1150,19 @@ checksum (uint16_t *addr, int len)
   return (answer);
 }
 
+// Update the internet checksum of a header whose 16-bit field changed from old to new,
+// without summing the header again (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).
+// All three are in network byte order.
+uint16_t
+update_checksum (uint16_t cksum, uint16_t old, uint16_t new_value)
+{
+  uint32_t sum = (uint16_t) ~cksum + (uint16_t) ~old + new_value;
+
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return ((uint16_t) ~sum);
+}
+
 // Allocate memory for an array of chars.
 char *
 allocate_strmem (int len)
@@ -600,24 +1204,3 @@ allocate_ustrmem (int len)
     exit (EXIT_FAILURE);
   }
 }
-
-// Allocate memory for an array of ints.
-int *
-allocate_intmem (int len)
-{
-  void *tmp;
-
-  if (len <= 0) {
-    fprintf (stderr, "ERROR: Cannot allocate memory because len = %i in allocate_intmem().\n", len);
-    exit (EXIT_FAILURE);
-  }
-
-  tmp = (int *) malloc (len * sizeof (int));
-  if (tmp != NULL) {
-    memset (tmp, 0, len * sizeof (int));
-    return (tmp);
-  } else {
-    fprintf (stderr, "ERROR: Cannot allocate memory for array allocate_intmem().\n");
-    exit (EXIT_FAILURE);
-  }
-}
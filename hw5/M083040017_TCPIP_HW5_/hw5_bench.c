@@ -0,0 +1,701 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include "hw5_server.h"
+#include "hw5_stats.h"
+
+#define MODE_ECHO               0
+#define MODE_UPPERCASE          1
+#define MODE_UDP                2
+#define MODE_GET                3
+
+#define MAX_EPOLL_EVENTS        256
+#define RECEIVE_BUFFER_SIZE     65536
+#define OUTPUT_BATCH_SIZE       4096    // requests are batched up to this size, a larger request is sent alone
+
+/**
+ * The number of requests a connection keeps in flight at most. In the open loop, a request
+ * which finds the connection full is counted as unsent instead of being queued.
+ */
+#define MAX_OUTSTANDING_REQUESTS 256
+
+/**
+ * Datagrams start with their sequence number in upper case hexadecimal, which the
+ * server sends back unchanged. A datagram without a reply for a second is lost.
+ */
+#define SEQUENCE_LENGTH         16
+#define UDP_TIMEOUT             1000000000ULL
+#define UDP_SCAN_INTERVAL       100000000ULL
+
+#define USAGE                   "Usage: %s [-m Mode] [-c Connections] [-t Threads] [-d Seconds] [-r Rate] [-s Size] [-f FilePath] Host PortNumber\n" \
+                                "  -m Mode         echo, upper, udp or get, defaults to echo\n" \
+                                "  -c Connections  the number of TCP connections or UDP flows, defaults to 64\n" \
+                                "  -t Threads      the number of threads which drive the connections, defaults to 1\n" \
+                                "  -d Seconds      the duration of the test, defaults to 10\n" \
+                                "  -r Rate         the total number of requests per second in an open loop, defaults to 0:\n" \
+                                "                  a closed loop where each connection sends a request when the previous one is answered\n" \
+                                "  -s Size         the size of echo and UDP payloads, defaults to 64\n" \
+                                "  -f FilePath     the path of the file to download in get mode\n"
+
+/**
+ * The settings of a test, shared by all threads.
+ */
+typedef struct {
+    int                 mode;
+    int                 nConnections;
+    int                 nThreads;
+    int                 durationSeconds;
+    double              rate;
+    size_t              payloadSize;
+    const char*         filePath;
+    char                payload[MAX_REQUEST_PAYLOAD];
+    struct sockaddr_in  serverSocketAddress;
+} BenchOptions;
+
+/**
+ * A TCP connection or a UDP flow. Requests are queued with the time they were due, so
+ * a request which waits for the socket is charged for the wait in the open loop.
+ */
+typedef struct {
+    int             socketFileDescriptor;
+    int             isClosed;
+
+    uint64_t        startTimes[MAX_OUTSTANDING_REQUESTS];
+    int             head;
+    int             nQueued;                // the requests which wait for their responses
+    int             nSent;                  // the first nSent of them are sent
+    uint64_t        firstSequence;          // the sequence number of the request at head
+
+    unsigned char   outputBuffer[FRAME_HEADER_SIZE + MAX_REQUEST_PAYLOAD];
+    size_t          outputOffset;
+    size_t          outputLength;
+
+    unsigned char   headerBuffer[FRAME_HEADER_SIZE];
+    size_t          headerLength;
+    uint64_t        payloadRemaining;
+} BenchConnection;
+
+/**
+ * A thread which drives a share of the connections with its own event loop.
+ */
+typedef struct {
+    const BenchOptions* pOptions;
+    int                 threadId;
+    BenchConnection*    connections;
+    int                 nConnections;
+    int                 epollFileDescriptor;
+    int                 timerFileDescriptor;    // wakes the loop when the next request is due
+    unsigned char*      receiveBuffer;
+
+    uint64_t            elapsedTime;
+    uint64_t            nCompleted;
+    uint64_t            nErrors;
+    uint64_t            nLost;
+    uint64_t            nUnsent;
+    uint64_t            nUnfinished;
+    uint64_t            receivedBytes;
+    uint64_t            histogram[HISTOGRAM_BUCKETS];
+    pthread_t           thread;
+} BenchThread;
+
+static const char* modeNames[] = { "echo", "upper", "udp", "get" };
+static pthread_barrier_t startBarrier;
+
+/**
+ * Prototypes of functions.
+ */
+int openConnection(const BenchOptions* pOptions, BenchConnection* pConnection);
+void* runBenchThread(void* pArgument);
+void scheduleRequest(BenchThread* pThread, BenchConnection* pConnection, uint64_t startTime);
+int sendRequests(BenchThread* pThread, BenchConnection* pConnection);
+int receiveResponses(BenchThread* pThread, BenchConnection* pConnection);
+int receiveDatagrams(BenchThread* pThread, BenchConnection* pConnection);
+void completeRequest(BenchThread* pThread, BenchConnection* pConnection, int isLost);
+void closeBenchConnection(BenchThread* pThread, BenchConnection* pConnection);
+
+/**
+ * The entrance of the load generator, which drives the server with many connections
+ * and reports the throughput and the latency percentiles.
+ *
+ * @param  argc the number of arguments
+ * @param  argv a pointer to a char array that stores arguments
+ * @return 0 if the application exited normally
+ */
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    memset(&options, 0, sizeof(options));
+    options.mode = MODE_ECHO;
+    options.nConnections = 64;
+    options.nThreads = 1;
+    options.durationSeconds = 10;
+    options.payloadSize = 64;
+
+    int i = 0;
+    int option = 0;
+    while ( (option = getopt(argc, argv, "m:c:t:d:r:s:f:")) != -1 ) {
+        switch ( option ) {
+            case 'm':
+                options.mode = -1;
+                for ( i = MODE_ECHO; i <= MODE_GET; ++ i ) {
+                    if ( strcmp(optarg, modeNames[i]) == 0 ) {
+                        options.mode = i;
+                    }
+                }
+                break;
+            case 'c':
+                options.nConnections = atoi(optarg);
+                break;
+            case 't':
+                options.nThreads = atoi(optarg);
+                break;
+            case 'd':
+                options.durationSeconds = atoi(optarg);
+                break;
+            case 'r':
+                options.rate = atof(optarg);
+                break;
+            case 's':
+                options.payloadSize = (size_t) atol(optarg);
+                break;
+            case 'f':
+                options.filePath = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( optind != argc - 2 || options.mode < 0 || options.nConnections <= 0 || options.nThreads <= 0 ||
+         options.durationSeconds <= 0 || options.rate < 0 || options.payloadSize > MAX_REQUEST_PAYLOAD ||
+         (options.mode == MODE_UDP && (options.payloadSize < SEQUENCE_LENGTH || options.payloadSize > BUFFER_SIZE)) ||
+         (options.mode == MODE_GET && (options.filePath == NULL || strlen(options.filePath) > MAX_REQUEST_PAYLOAD)) ) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ( options.nThreads > options.nConnections ) {
+        options.nThreads = options.nConnections;
+    }
+
+    struct hostent* pHost = gethostbyname(argv[optind]);
+    int portNumber = atoi(argv[optind + 1]);
+    if ( pHost == NULL || portNumber <= 0 ) {
+        fprintf(stderr, USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+    options.serverSocketAddress.sin_family = AF_INET;
+    options.serverSocketAddress.sin_addr = *((struct in_addr *)pHost->h_addr);
+    options.serverSocketAddress.sin_port = htons(portNumber);
+
+    // Lower case text, so upper case requests convert every byte
+    for ( i = 0; i < (int) options.payloadSize; ++ i ) {
+        options.payload[i] = (char) ('a' + i % 26);
+    }
+
+    // Every connection takes a file descriptor
+    struct rlimit fileLimit;
+    if ( getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < fileLimit.rlim_max ) {
+        fileLimit.rlim_cur = fileLimit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
+    BenchThread* threads = (BenchThread*) calloc(options.nThreads, sizeof(BenchThread));
+    BenchConnection* connections = (BenchConnection*) calloc(options.nConnections, sizeof(BenchConnection));
+    if ( threads == NULL || connections == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to allocate the connections: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Spread the connections across threads, the threads start the clock together.
+     */
+    pthread_barrier_init(&startBarrier, NULL, options.nThreads);
+    int t = 0;
+    int nAssigned = 0;
+    for ( t = 0; t < options.nThreads; ++ t ) {
+        threads[t].pOptions = &options;
+        threads[t].threadId = t;
+        threads[t].connections = connections + nAssigned;
+        threads[t].nConnections = options.nConnections / options.nThreads + (t < options.nConnections % options.nThreads ? 1 : 0);
+        nAssigned += threads[t].nConnections;
+
+        int errorCode = pthread_create(&threads[t].thread, NULL, runBenchThread, &threads[t]);
+        if ( errorCode != 0 ) {
+            fprintf(stderr, "[ERROR] Failed to start thread #%d: %s\n", t, strerror(errorCode));
+            return EXIT_FAILURE;
+        }
+    }
+
+    /*
+     * Merge the results of all threads.
+     */
+    static uint64_t histogram[HISTOGRAM_BUCKETS];
+    BenchThread total;
+    memset(&total, 0, sizeof(total));
+    int maxBucket = 0;
+    for ( t = 0; t < options.nThreads; ++ t ) {
+        pthread_join(threads[t].thread, NULL);
+        if ( threads[t].elapsedTime > total.elapsedTime ) {
+            total.elapsedTime = threads[t].elapsedTime;
+        }
+        total.nCompleted += threads[t].nCompleted;
+        total.nErrors += threads[t].nErrors;
+        total.nLost += threads[t].nLost;
+        total.nUnsent += threads[t].nUnsent;
+        total.nUnfinished += threads[t].nUnfinished;
+        total.receivedBytes += threads[t].receivedBytes;
+        int j = 0;
+        for ( j = 0; j < HISTOGRAM_BUCKETS; ++ j ) {
+            histogram[j] += threads[t].histogram[j];
+            if ( histogram[j] > 0 && j > maxBucket ) {
+                maxBucket = j;
+            }
+        }
+    }
+    pthread_barrier_destroy(&startBarrier);
+
+    double elapsedSeconds = total.elapsedTime > 0 ? total.elapsedTime / 1e9 : 1;
+    if ( options.rate > 0 ) {
+        printf("mode %s, %d connection(s), %d thread(s), open loop at %.0f requests/s, %.1f s\n",
+            modeNames[options.mode], options.nConnections, options.nThreads, options.rate, elapsedSeconds);
+    } else {
+        printf("mode %s, %d connection(s), %d thread(s), closed loop, %.1f s\n",
+            modeNames[options.mode], options.nConnections, options.nThreads, elapsedSeconds);
+    }
+    printf("requests %llu (%.1f/s), errors %llu, lost %llu, unsent %llu, unfinished %llu\n",
+        (unsigned long long) total.nCompleted, total.nCompleted / elapsedSeconds, (unsigned long long) total.nErrors,
+        (unsigned long long) total.nLost, (unsigned long long) total.nUnsent, (unsigned long long) total.nUnfinished);
+    printf("received %.2f MB (%.2f MB/s)\n", total.receivedBytes / 1e6, total.receivedBytes / 1e6 / elapsedSeconds);
+    printf("latency_us p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n",
+        getPercentile(histogram, total.nCompleted, 0.5) / 1000.0, getPercentile(histogram, total.nCompleted, 0.9) / 1000.0,
+        getPercentile(histogram, total.nCompleted, 0.99) / 1000.0, getPercentile(histogram, total.nCompleted, 0.999) / 1000.0,
+        total.nCompleted == 0 ? 0 : getBucketValue(maxBucket) / 1000.0);
+
+    free(connections);
+    free(threads);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Open a non-blocking TCP connection or a connected UDP socket to the server.
+ * The TCP handshake is completed before the socket turns non-blocking.
+ * @param  pOptions    the settings of the test
+ * @param  pConnection the connection which receives the socket
+ * @return -1 if the connection failed
+ */
+int openConnection(const BenchOptions* pOptions, BenchConnection* pConnection) {
+    int socketFileDescriptor = socket(AF_INET, (pOptions->mode == MODE_UDP ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+    if ( socketFileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if ( connect(socketFileDescriptor, (const struct sockaddr *) &pOptions->serverSocketAddress, sizeof(struct sockaddr)) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to connect to server: %s\n", strerror(errno));
+        close(socketFileDescriptor);
+        return -1;
+    }
+    fcntl(socketFileDescriptor, F_SETFL, fcntl(socketFileDescriptor, F_GETFL) | O_NONBLOCK);
+
+    pConnection->socketFileDescriptor = socketFileDescriptor;
+    pConnection->firstSequence = 1;
+    return 0;
+}
+
+/**
+ * The entrance of the threads, which connect their share of the connections and drive
+ * them until the test is over.
+ * @param  pArgument the pointer to the BenchThread struct of this thread
+ * @return NULL
+ */
+void* runBenchThread(void* pArgument) {
+    BenchThread* pThread = (BenchThread*) pArgument;
+    const BenchOptions* pOptions = pThread->pOptions;
+
+    pThread->epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    pThread->timerFileDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    pThread->receiveBuffer = (unsigned char*) malloc(RECEIVE_BUFFER_SIZE);
+    if ( pThread->epollFileDescriptor != -1 && pThread->timerFileDescriptor != -1 ) {
+        // The timer is told apart from connections by the address of its file descriptor
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = &pThread->timerFileDescriptor;
+        epoll_ctl(pThread->epollFileDescriptor, EPOLL_CTL_ADD, pThread->timerFileDescriptor, &event);
+    }
+    int i = 0;
+    for ( i = 0; i < pThread->nConnections; ++ i ) {
+        BenchConnection* pConnection = &pThread->connections[i];
+        pConnection->isClosed = TRUE;
+        if ( pThread->epollFileDescriptor == -1 || pThread->timerFileDescriptor == -1 || pThread->receiveBuffer == NULL ||
+             openConnection(pOptions, pConnection) == -1 ) {
+            ++ pThread->nErrors;
+            continue;
+        }
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = pConnection;
+        epoll_ctl(pThread->epollFileDescriptor, EPOLL_CTL_ADD, pConnection->socketFileDescriptor, &event);
+        pConnection->isClosed = FALSE;
+    }
+    pthread_barrier_wait(&startBarrier);
+
+    /*
+     * The open loop spreads the requests of this thread evenly over time and over its
+     * connections, the closed loop starts with one request on every connection.
+     */
+    uint64_t startTime = getMonotonicTime();
+    uint64_t endTime = startTime + (uint64_t) pOptions->durationSeconds * 1000000000ULL;
+    uint64_t interval = 0;
+    uint64_t nextTick = startTime;
+    uint64_t nextScan = startTime + UDP_SCAN_INTERVAL;
+    int nextConnection = 0;
+    if ( pOptions->rate > 0 ) {
+        interval = (uint64_t) (pOptions->nThreads * 1e9 / pOptions->rate);
+        if ( interval == 0 ) {
+            interval = 1;
+        }
+        nextTick += interval * pThread->threadId / pOptions->nThreads;
+    } else {
+        for ( i = 0; i < pThread->nConnections; ++ i ) {
+            scheduleRequest(pThread, &pThread->connections[i], startTime);
+        }
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    uint64_t now = startTime;
+    uint64_t armedTime = 0;
+    while ( now < endTime && pThread->epollFileDescriptor != -1 && pThread->timerFileDescriptor != -1 ) {
+        for ( ; interval > 0 && nextTick <= now; nextTick += interval ) {
+            scheduleRequest(pThread, &pThread->connections[nextConnection], nextTick);
+            nextConnection = (nextConnection + 1) % pThread->nConnections;
+        }
+
+        // Give up the datagrams which had no reply in time
+        if ( pOptions->mode == MODE_UDP && now >= nextScan ) {
+            for ( i = 0; i < pThread->nConnections; ++ i ) {
+                BenchConnection* pConnection = &pThread->connections[i];
+                while ( pConnection->nSent > 0 && now - pConnection->startTimes[pConnection->head] > UDP_TIMEOUT ) {
+                    completeRequest(pThread, pConnection, TRUE);
+                }
+            }
+            nextScan = now + UDP_SCAN_INTERVAL;
+        }
+
+        uint64_t wakeTime = endTime;
+        if ( interval > 0 && nextTick < wakeTime ) {
+            wakeTime = nextTick;
+        }
+        if ( pOptions->mode == MODE_UDP && nextScan < wakeTime ) {
+            wakeTime = nextScan;
+        }
+        if ( wakeTime != armedTime ) {
+            // The timeout of epoll_wait() counts in milliseconds, which would delay requests of the open loop
+            struct itimerspec timerSpec;
+            memset(&timerSpec, 0, sizeof(timerSpec));
+            timerSpec.it_value.tv_sec = (time_t) (wakeTime / 1000000000ULL);
+            timerSpec.it_value.tv_nsec = (long) (wakeTime % 1000000000ULL);
+            timerfd_settime(pThread->timerFileDescriptor, TFD_TIMER_ABSTIME, &timerSpec, NULL);
+            armedTime = wakeTime;
+        }
+
+        int nEvents = epoll_wait(pThread->epollFileDescriptor, events, MAX_EPOLL_EVENTS, -1);
+        for ( i = 0; i < nEvents; ++ i ) {
+            if ( events[i].data.ptr == &pThread->timerFileDescriptor ) {
+                uint64_t nExpirations = 0;
+                if ( read(pThread->timerFileDescriptor, &nExpirations, sizeof(nExpirations)) == -1 ) {
+                    // Nothing to clear, the timer was armed again
+                }
+                armedTime = 0;
+                continue;
+            }
+
+            BenchConnection* pConnection = (BenchConnection*) events[i].data.ptr;
+            int result = 0;
+            if ( !pConnection->isClosed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ) {
+                result = pOptions->mode == MODE_UDP ? receiveDatagrams(pThread, pConnection) : receiveResponses(pThread, pConnection);
+            }
+            if ( result != -1 && !pConnection->isClosed && (events[i].events & EPOLLOUT) ) {
+                result = sendRequests(pThread, pConnection);
+            }
+            if ( result == -1 ) {
+                closeBenchConnection(pThread, pConnection);
+            }
+        }
+        now = getMonotonicTime();
+    }
+    pThread->elapsedTime = now - startTime;
+
+    for ( i = 0; i < pThread->nConnections; ++ i ) {
+        BenchConnection* pConnection = &pThread->connections[i];
+        pThread->nUnfinished += pConnection->nQueued;
+        if ( !pConnection->isClosed ) {
+            close(pConnection->socketFileDescriptor);
+        }
+    }
+    if ( pThread->epollFileDescriptor != -1 ) {
+        close(pThread->epollFileDescriptor);
+    }
+    if ( pThread->timerFileDescriptor != -1 ) {
+        close(pThread->timerFileDescriptor);
+    }
+    free(pThread->receiveBuffer);
+    return NULL;
+}
+
+/**
+ * Queue a request on a connection and send it if the socket accepts it.
+ * @param pThread     the thread of the connection
+ * @param pConnection the connection
+ * @param startTime   the time the request is due
+ */
+void scheduleRequest(BenchThread* pThread, BenchConnection* pConnection, uint64_t startTime) {
+    if ( pConnection->isClosed || pConnection->nQueued == MAX_OUTSTANDING_REQUESTS ) {
+        ++ pThread->nUnsent;
+        return;
+    }
+    pConnection->startTimes[(pConnection->head + pConnection->nQueued) % MAX_OUTSTANDING_REQUESTS] = startTime;
+    ++ pConnection->nQueued;
+
+    if ( sendRequests(pThread, pConnection) == -1 ) {
+        closeBenchConnection(pThread, pConnection);
+    }
+}
+
+/**
+ * Send the queued requests of a connection until they are sent or the socket is full.
+ * TCP requests are framed into the output buffer, so a burst takes one system call.
+ * @param  pThread     the thread of the connection
+ * @param  pConnection the connection
+ * @return -1 if the connection is broken
+ */
+int sendRequests(BenchThread* pThread, BenchConnection* pConnection) {
+    const BenchOptions* pOptions = pThread->pOptions;
+
+    if ( pOptions->mode == MODE_UDP ) {
+        while ( pConnection->nSent < pConnection->nQueued ) {
+            char datagram[BUFFER_SIZE + 1];
+            memcpy(datagram, pOptions->payload, pOptions->payloadSize);
+            snprintf(datagram, sizeof(datagram), "%016llX", (unsigned long long) (pConnection->firstSequence + pConnection->nSent));
+            datagram[SEQUENCE_LENGTH] = pOptions->payload[SEQUENCE_LENGTH];
+
+            if ( send(pConnection->socketFileDescriptor, datagram, pOptions->payloadSize, 0) == -1 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                    return 0;
+                }
+                // Refused by the host, the datagram is given up as lost later
+            }
+            ++ pConnection->nSent;
+        }
+        return 0;
+    }
+
+    const char* payload = pOptions->mode == MODE_GET ? pOptions->filePath : pOptions->payload;
+    size_t payloadLength = pOptions->mode == MODE_GET ? strlen(pOptions->filePath) : pOptions->payloadSize;
+    while ( TRUE ) {
+        if ( pConnection->outputOffset == pConnection->outputLength ) {
+            pConnection->outputOffset = 0;
+            pConnection->outputLength = 0;
+        }
+        while ( pConnection->nSent < pConnection->nQueued &&
+                (pConnection->outputLength == 0 || pConnection->outputLength + FRAME_HEADER_SIZE + payloadLength <= OUTPUT_BATCH_SIZE) ) {
+            FrameHeader request;
+            request.opcode = pOptions->mode == MODE_GET ? OPCODE_GET : (pOptions->mode == MODE_UPPERCASE ? OPCODE_UPPERCASE : OPCODE_ECHO);
+            request.status = STATUS_OK;
+            request.requestId = (uint32_t) (pConnection->firstSequence + pConnection->nSent);
+            request.payloadLength = payloadLength;
+            encodeFrameHeader(&request, pConnection->outputBuffer + pConnection->outputLength);
+            memcpy(pConnection->outputBuffer + pConnection->outputLength + FRAME_HEADER_SIZE, payload, payloadLength);
+            pConnection->outputLength += FRAME_HEADER_SIZE + payloadLength;
+            ++ pConnection->nSent;
+        }
+        if ( pConnection->outputOffset == pConnection->outputLength ) {
+            return 0;
+        }
+
+        ssize_t sentBytes = send(pConnection->socketFileDescriptor, pConnection->outputBuffer + pConnection->outputOffset,
+            pConnection->outputLength - pConnection->outputOffset, MSG_NOSIGNAL);
+        if ( sentBytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return 0;
+            }
+            return -1;
+        }
+        pConnection->outputOffset += (size_t) sentBytes;
+    }
+}
+
+/**
+ * Receive the responses of a TCP connection until the socket is empty.
+ * @param  pThread     the thread of the connection
+ * @param  pConnection the connection
+ * @return -1 if the connection is closed or the server violated the protocol
+ */
+int receiveResponses(BenchThread* pThread, BenchConnection* pConnection) {
+    while ( TRUE ) {
+        ssize_t readBytes = recv(pConnection->socketFileDescriptor, pThread->receiveBuffer, RECEIVE_BUFFER_SIZE, 0);
+        if ( readBytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if ( readBytes == 0 ) {
+            return -1;
+        }
+        pThread->receivedBytes += (uint64_t) readBytes;
+
+        const unsigned char* buffer = pThread->receiveBuffer;
+        size_t length = (size_t) readBytes;
+        while ( length > 0 ) {
+            if ( pConnection->headerLength < FRAME_HEADER_SIZE ) {
+                size_t copiedBytes = FRAME_HEADER_SIZE - pConnection->headerLength;
+                if ( copiedBytes > length ) {
+                    copiedBytes = length;
+                }
+                memcpy(pConnection->headerBuffer + pConnection->headerLength, buffer, copiedBytes);
+                pConnection->headerLength += copiedBytes;
+                buffer += copiedBytes;
+                length -= copiedBytes;
+                if ( pConnection->headerLength < FRAME_HEADER_SIZE ) {
+                    break;
+                }
+
+                FrameHeader response;
+                decodeFrameHeader(pConnection->headerBuffer, &response);
+                if ( response.status == STATUS_BUSY && response.requestId == 0 ) {
+                    // The server is over its connection limit, the requests of the connection count as errors
+                    return -1;
+                }
+                if ( pConnection->nSent == 0 || response.requestId != (uint32_t) pConnection->firstSequence ) {
+                    fprintf(stderr, "[ERROR] Received an unexpected response #%u from the server.\n", response.requestId);
+                    return -1;
+                }
+                if ( response.status != STATUS_OK ) {
+                    ++ pThread->nErrors;
+                }
+                pConnection->payloadRemaining = response.payloadLength;
+            }
+
+            size_t payloadBytes = length;
+            if ( payloadBytes > pConnection->payloadRemaining ) {
+                payloadBytes = (size_t) pConnection->payloadRemaining;
+            }
+            pConnection->payloadRemaining -= payloadBytes;
+            buffer += payloadBytes;
+            length -= payloadBytes;
+
+            if ( pConnection->payloadRemaining == 0 ) {
+                pConnection->headerLength = 0;
+                completeRequest(pThread, pConnection, FALSE);
+                if ( pConnection->isClosed ) {
+                    return 0;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Receive the replies of a UDP flow until the socket is empty. Requests older than
+ * a reply were lost or overtaken, they are counted as lost.
+ * @param  pThread     the thread of the flow
+ * @param  pConnection the flow
+ * @return 0, replies never break a flow
+ */
+int receiveDatagrams(BenchThread* pThread, BenchConnection* pConnection) {
+    while ( TRUE ) {
+        char datagram[BUFFER_SIZE + 1];
+        ssize_t readBytes = recv(pConnection->socketFileDescriptor, datagram, BUFFER_SIZE, 0);
+        if ( readBytes == -1 ) {
+            if ( errno == EINTR || errno == ECONNREFUSED ) {
+                continue;
+            }
+            return 0;
+        }
+        pThread->receivedBytes += (uint64_t) readBytes;
+        if ( readBytes < SEQUENCE_LENGTH ) {
+            continue;
+        }
+
+        datagram[SEQUENCE_LENGTH] = 0;
+        uint64_t sequence = strtoull(datagram, NULL, 16);
+        if ( sequence < pConnection->firstSequence || sequence >= pConnection->firstSequence + pConnection->nSent ) {
+            // A reply which arrived after its request was given up
+            continue;
+        }
+        while ( pConnection->firstSequence < sequence ) {
+            completeRequest(pThread, pConnection, TRUE);
+        }
+        completeRequest(pThread, pConnection, FALSE);
+        if ( pConnection->isClosed ) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Retire the request at the head of a connection and record its latency. In the closed
+ * loop, the next request is sent right away.
+ * @param pThread     the thread of the connection
+ * @param pConnection the connection
+ * @param isLost      whether the request was given up without a response
+ */
+void completeRequest(BenchThread* pThread, BenchConnection* pConnection, int isLost) {
+    uint64_t now = getMonotonicTime();
+    uint64_t startTime = pConnection->startTimes[pConnection->head];
+    if ( isLost ) {
+        ++ pThread->nLost;
+    } else {
+        ++ pThread->nCompleted;
+        ++ pThread->histogram[getHistogramBucket(now > startTime ? now - startTime : 0)];
+    }
+
+    pConnection->head = (pConnection->head + 1) % MAX_OUTSTANDING_REQUESTS;
+    -- pConnection->nQueued;
+    -- pConnection->nSent;
+    ++ pConnection->firstSequence;
+
+    if ( pThread->pOptions->rate <= 0 ) {
+        scheduleRequest(pThread, pConnection, now);
+    }
+}
+
+/**
+ * Close a broken connection, its requests are counted as errors.
+ * @param pThread     the thread of the connection
+ * @param pConnection the connection
+ */
+void closeBenchConnection(BenchThread* pThread, BenchConnection* pConnection) {
+    if ( pConnection->isClosed ) {
+        return;
+    }
+    close(pConnection->socketFileDescriptor);
+    pConnection->isClosed = TRUE;
+    pThread->nErrors += 1 + pConnection->nQueued;
+    pConnection->nQueued = 0;
+    pConnection->nSent = 0;
+}
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hw5_buffer.h"
+#include "hw5_log.h"
+#include "hw5_server.h"
+
+/**
+ * The size of each class, every class is 8 times larger than the previous one.
+ */
+static const size_t bufferClassSizes[N_BUFFER_CLASSES] = { MIN_BUFFER_SIZE, MIN_BUFFER_SIZE * 8, MAX_BUFFER_SIZE };
+
+/**
+ * The free buffers of a worker. A free buffer holds the pointer of the next free
+ * buffer of its class in its first bytes. New buffers are carved from the current
+ * slab of the class, slabs are kept for the lifetime of the worker.
+ */
+typedef struct {
+    unsigned char*  pFreeBuffers[N_BUFFER_CLASSES];
+    unsigned char*  pSlabCursors[N_BUFFER_CLASSES];
+    size_t          slabRemaining[N_BUFFER_CLASSES];
+} BufferPool;
+
+static int isHugePageRequested = FALSE;
+static __thread BufferPool threadPool;
+
+/**
+ * Prototypes of functions.
+ */
+static int getBufferClass(size_t size);
+static unsigned char* takeBuffer(int bufferClass);
+static void giveBuffer(unsigned char* buffer, size_t capacity);
+static unsigned char* allocateSlab(void);
+
+/**
+ * Choose how slabs are backed, before the workers are started.
+ * @param isHugePageEnabled whether slabs are backed by huge pages
+ */
+void configureBufferPool(int isHugePageEnabled) {
+    isHugePageRequested = isHugePageEnabled;
+}
+
+/**
+ * Make room for more bytes at the end of a buffer. The bytes of the buffer are moved
+ * to the front if that is enough, otherwise they are moved to a buffer of a larger class.
+ * @param  pBuffer the buffer, a buffer which holds no memory takes one from the pool
+ * @param  length  the number of bytes which have to fit after the end
+ * @return -1 if the bytes do not fit into the largest class or the memory is exhausted
+ */
+int reserveBuffer(ByteBuffer* pBuffer, size_t length) {
+    size_t usedLength = pBuffer->end - pBuffer->start;
+    if ( pBuffer->data != NULL && pBuffer->capacity - pBuffer->end >= length ) {
+        return 0;
+    }
+    if ( pBuffer->data != NULL && pBuffer->capacity - usedLength >= length ) {
+        memmove(pBuffer->data, pBuffer->data + pBuffer->start, usedLength);
+        pBuffer->start = 0;
+        pBuffer->end = usedLength;
+        return 0;
+    }
+
+    int bufferClass = getBufferClass(usedLength + length);
+    unsigned char* data = bufferClass == -1 ? NULL : takeBuffer(bufferClass);
+    if ( data == NULL ) {
+        return -1;
+    }
+    if ( pBuffer->data != NULL ) {
+        memcpy(data, pBuffer->data + pBuffer->start, usedLength);
+        giveBuffer(pBuffer->data, pBuffer->capacity);
+    }
+    pBuffer->data = data;
+    pBuffer->capacity = bufferClassSizes[bufferClass];
+    pBuffer->start = 0;
+    pBuffer->end = usedLength;
+    return 0;
+}
+
+/**
+ * Drop bytes from the start of a buffer, the buffer goes back to the pool once it is empty.
+ * @param pBuffer the buffer
+ * @param length  the number of bytes to drop, at most the length of the buffer
+ */
+void consumeBuffer(ByteBuffer* pBuffer, size_t length) {
+    pBuffer->start += length;
+    if ( pBuffer->start == pBuffer->end ) {
+        releaseBuffer(pBuffer);
+    }
+}
+
+/**
+ * Give the memory of a buffer back to the pool of the calling thread and empty it.
+ * @param pBuffer the buffer, it may hold no memory
+ */
+void releaseBuffer(ByteBuffer* pBuffer) {
+    if ( pBuffer->data != NULL ) {
+        giveBuffer(pBuffer->data, pBuffer->capacity);
+    }
+    memset(pBuffer, 0, sizeof(ByteBuffer));
+}
+
+/**
+ * Find the smallest class which holds a number of bytes.
+ * @param  size the number of bytes
+ * @return the class, -1 if the bytes do not fit into the largest class
+ */
+static int getBufferClass(size_t size) {
+    int i = 0;
+    for ( i = 0; i < N_BUFFER_CLASSES; ++ i ) {
+        if ( size <= bufferClassSizes[i] ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Take a free buffer of a class, or carve a new one.
+ * @param  bufferClass the class of the buffer
+ * @return the buffer, NULL if the memory is exhausted
+ */
+static unsigned char* takeBuffer(int bufferClass) {
+    BufferPool* pPool = &threadPool;
+    unsigned char* buffer = pPool->pFreeBuffers[bufferClass];
+    if ( buffer != NULL ) {
+        memcpy(&pPool->pFreeBuffers[bufferClass], buffer, sizeof(unsigned char*));
+        return buffer;
+    }
+
+    size_t size = bufferClassSizes[bufferClass];
+    if ( pPool->slabRemaining[bufferClass] < size ) {
+        pPool->pSlabCursors[bufferClass] = allocateSlab();
+        if ( pPool->pSlabCursors[bufferClass] == NULL ) {
+            pPool->slabRemaining[bufferClass] = 0;
+            return NULL;
+        }
+        pPool->slabRemaining[bufferClass] = BUFFER_SLAB_SIZE;
+    }
+    buffer = pPool->pSlabCursors[bufferClass];
+    pPool->pSlabCursors[bufferClass] += size;
+    pPool->slabRemaining[bufferClass] -= size;
+    return buffer;
+}
+
+/**
+ * Give a buffer back to the free buffers of its class.
+ * @param buffer   the buffer
+ * @param capacity the size of its class
+ */
+static void giveBuffer(unsigned char* buffer, size_t capacity) {
+    BufferPool* pPool = &threadPool;
+    int bufferClass = getBufferClass(capacity);
+    memcpy(buffer, &pPool->pFreeBuffers[bufferClass], sizeof(unsigned char*));
+    pPool->pFreeBuffers[bufferClass] = buffer;
+}
+
+/**
+ * Map a slab, from the reserved huge pages if requested. Transparent huge pages are
+ * asked for if no huge page is reserved.
+ * @return the slab, NULL if the memory is exhausted
+ */
+static unsigned char* allocateSlab(void) {
+    void* pSlab = MAP_FAILED;
+    if ( isHugePageRequested ) {
+        pSlab = mmap(NULL, BUFFER_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if ( pSlab == MAP_FAILED ) {
+        pSlab = mmap(NULL, BUFFER_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( pSlab != MAP_FAILED && isHugePageRequested ) {
+            madvise(pSlab, BUFFER_SLAB_SIZE, MADV_HUGEPAGE);
+        }
+    }
+    if ( pSlab == MAP_FAILED ) {
+        LOG_WARN("Failed to map a slab of buffers: %s\n", strerror(errno));
+        return NULL;
+    }
+    return (unsigned char*) pSlab;
+}
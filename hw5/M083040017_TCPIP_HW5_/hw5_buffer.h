@@ -0,0 +1,46 @@
+#ifndef HW5_BUFFER_H
+#define HW5_BUFFER_H
+
+#include <stddef.h>
+
+/**
+ * Buffers come in a few size classes and are carved from slabs of BUFFER_SLAB_SIZE,
+ * the size of a huge page. Each worker keeps the free buffers of every class, so a
+ * buffer is taken and given back without a lock or malloc().
+ */
+#define N_BUFFER_CLASSES        3
+#define MIN_BUFFER_SIZE         2048
+#define MAX_BUFFER_SIZE         131072
+#define BUFFER_SLAB_SIZE        2097152
+
+/**
+ * The bytes of a connection waiting to be handled or sent, from start to end. Bytes
+ * are consumed from start in O(1); the rest is only moved to the front when more room
+ * is reserved at the end, so a frame always stays contiguous. An empty buffer goes
+ * back to the pool, idle connections hold no memory.
+ */
+typedef struct {
+    unsigned char*  data;                   // NULL if the connection holds no buffer
+    size_t          capacity;
+    size_t          start;
+    size_t          end;
+} ByteBuffer;
+
+/**
+ * Prototypes of functions.
+ */
+void configureBufferPool(int isHugePageEnabled);
+int reserveBuffer(ByteBuffer* pBuffer, size_t length);
+void consumeBuffer(ByteBuffer* pBuffer, size_t length);
+void releaseBuffer(ByteBuffer* pBuffer);
+
+/**
+ * Get the number of bytes in a buffer.
+ * @param  pBuffer the buffer
+ * @return the number of bytes from start to end
+ */
+static inline size_t getBufferLength(const ByteBuffer* pBuffer) {
+    return pBuffer->end - pBuffer->start;
+}
+
+#endif
@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hw5_cache.h"
+#include "hw5_log.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+
+/**
+ * The changes which make a cached file stale. A file replaced by rename() changes
+ * the link count of the old inode, which is reported as IN_ATTRIB.
+ */
+#define CACHE_WATCH_EVENTS      (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define INOTIFY_BUFFER_SIZE     4096
+
+/**
+ * The cache of a worker. Entries are found by the hash of their path and kept in
+ * the order of their last use, the least recently used entry is evicted first.
+ * Only the worker touches its cache, so no lock is needed.
+ */
+typedef struct {
+    CachedFile**    buckets;
+    size_t          bucketMask;
+    CachedFile*     pNewest;
+    CachedFile*     pOldest;
+    int             nEntries;
+    int             inotifyFileDescriptor;  // -1 if every hit is revalidated with stat()
+} FileCache;
+
+static int maxCacheEntries = DEFAULT_CACHE_ENTRIES;
+static size_t maxSmallFileSize = DEFAULT_SMALL_FILE_SIZE;
+static __thread FileCache* pThreadCache = NULL;
+
+/**
+ * Prototypes of functions.
+ */
+static uint64_t hashPath(const unsigned char* path, size_t pathLength);
+static CachedFile* findEntry(FileCache* pCache, const unsigned char* path, size_t pathLength, uint64_t hash);
+static int readContent(CachedFile* pEntry, int fileFileDescriptor);
+static int isEntryValid(const CachedFile* pEntry);
+static void processFileEvents(FileCache* pCache);
+static void touchEntry(FileCache* pCache, CachedFile* pEntry);
+static void dropEntry(FileCache* pCache, CachedFile* pEntry);
+static void unwatchFile(FileCache* pCache, int watchDescriptor);
+
+/**
+ * Set the limits of the caches, before the workers are started.
+ * @param maxEntries    the number of files a worker keeps, 0 disables the cache
+ * @param smallFileSize the size up to which the content of a file is kept in memory
+ */
+void configureFileCache(int maxEntries, size_t smallFileSize) {
+    maxCacheEntries = maxEntries;
+    maxSmallFileSize = smallFileSize;
+}
+
+/**
+ * Give the calling thread its own file cache.
+ * @return -1 if the memory is exhausted, the thread opens every file itself then
+ */
+int attachFileCache(void) {
+    if ( pThreadCache != NULL || maxCacheEntries <= 0 ) {
+        return 0;
+    }
+
+    FileCache* pCache = (FileCache*) calloc(1, sizeof(FileCache));
+    size_t nBuckets = 1;
+    while ( nBuckets < 2 * (size_t) maxCacheEntries ) {
+        nBuckets <<= 1;
+    }
+    CachedFile** buckets = (CachedFile**) calloc(nBuckets, sizeof(CachedFile*));
+    if ( pCache == NULL || buckets == NULL ) {
+        LOG_WARN("Failed to allocate the file cache: %s\n", strerror(errno));
+        free(pCache);
+        free(buckets);
+        return -1;
+    }
+    pCache->buckets = buckets;
+    pCache->bucketMask = nBuckets - 1;
+
+    pCache->inotifyFileDescriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ( pCache->inotifyFileDescriptor == -1 ) {
+        LOG_WARN("Failed to watch cached files, they are checked on every hit instead: %s\n", strerror(errno));
+    }
+    pThreadCache = pCache;
+    return 0;
+}
+
+/**
+ * Get the inotify instance of the cache of the calling thread. The event loop watches
+ * it and calls handleFileCacheEvents() when it is readable.
+ * @return the file descriptor, -1 if the thread has no cache or files are checked with stat()
+ */
+int getFileCacheEventDescriptor(void) {
+    return pThreadCache == NULL ? -1 : pThreadCache->inotifyFileDescriptor;
+}
+
+/**
+ * Drop the cached files which changed, called when the inotify instance is readable.
+ */
+void handleFileCacheEvents(void) {
+    if ( pThreadCache != NULL ) {
+        processFileEvents(pThreadCache);
+    }
+}
+
+/**
+ * Find a file in the cache of the calling thread. Only a file which is checked with
+ * stat() costs a system call, so a hit never waits for the disk. Changes of watched
+ * files are applied by the event loop as soon as it sees them.
+ * @param  path       the path of the file, not terminated by the end character
+ * @param  pathLength the length of the path
+ * @return the file with a reference held for the caller, NULL if it is not cached
+ */
+CachedFile* findCachedFile(const unsigned char* path, size_t pathLength) {
+    FileCache* pCache = pThreadCache;
+    if ( pCache == NULL ) {
+        return NULL;
+    }
+
+    CachedFile* pEntry = findEntry(pCache, path, pathLength, hashPath(path, pathLength));
+    if ( pEntry != NULL && pEntry->watchDescriptor == -1 && !isEntryValid(pEntry) ) {
+        dropEntry(pCache, pEntry);
+        pEntry = NULL;
+    }
+    if ( pEntry == NULL ) {
+        addStat(STAT_CACHE_MISSES, 1);
+        return NULL;
+    }
+
+    addStat(STAT_CACHE_HITS, 1);
+    touchEntry(pCache, pEntry);
+    ++ pEntry->nReferences;
+    return pEntry;
+}
+
+/**
+ * Open a file and read it if it is small. This waits for the disk, so it may run on
+ * any thread, the entry is not shared until it is inserted.
+ * @param  path       the path of the file, not terminated by the end character
+ * @param  pathLength the length of the path
+ * @return the file with a reference held for the caller, NULL if it is not a readable regular file
+ */
+CachedFile* loadCachedFile(const unsigned char* path, size_t pathLength) {
+    char filePath[PATH_MAX] = {0};
+    if ( pathLength >= sizeof(filePath) ) {
+        return NULL;
+    }
+    memcpy(filePath, path, pathLength);
+
+    struct stat fileStatus;
+    int fileFileDescriptor = open(filePath, O_RDONLY | O_CLOEXEC);
+    if ( fileFileDescriptor == -1 || fstat(fileFileDescriptor, &fileStatus) == -1 || !S_ISREG(fileStatus.st_mode) ) {
+        if ( fileFileDescriptor != -1 ) {
+            close(fileFileDescriptor);
+        }
+        return NULL;
+    }
+
+    CachedFile* pEntry = (CachedFile*) malloc(sizeof(CachedFile) + pathLength + 1);
+    if ( pEntry == NULL ) {
+        LOG_WARN("Failed to allocate the cache entry of %s: %s\n", filePath, strerror(errno));
+        close(fileFileDescriptor);
+        return NULL;
+    }
+    memset(pEntry, 0, sizeof(CachedFile));
+    pEntry->device = fileStatus.st_dev;
+    pEntry->inode = fileStatus.st_ino;
+    pEntry->modifiedTime = fileStatus.st_mtim;
+    pEntry->size = fileStatus.st_size;
+    pEntry->fileFileDescriptor = fileFileDescriptor;
+    pEntry->watchDescriptor = -1;
+    pEntry->nReferences = 1;
+    pEntry->hash = hashPath(path, pathLength);
+    pEntry->pathLength = pathLength;
+    pEntry->path = (char*) (pEntry + 1);
+    memcpy(pEntry->path, filePath, pathLength + 1);
+
+    // A small file is answered from memory, it keeps the file open if it cannot be read at once
+    if ( (size_t) fileStatus.st_size <= maxSmallFileSize && readContent(pEntry, fileFileDescriptor) == 0 ) {
+        close(fileFileDescriptor);
+        pEntry->fileFileDescriptor = -1;
+    } else {
+        // A large file is streamed from the start, so the kernel may read ahead further
+        posix_fadvise(fileFileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return pEntry;
+}
+
+/**
+ * Add a loaded file to the cache of the calling thread as the most recently used entry.
+ * The file is watched before it is compared with its path once more, so a change after
+ * it was loaded either fails the comparison or is reported by inotify.
+ * @param pCachedFile the file returned by loadCachedFile()
+ */
+void insertCachedFile(CachedFile* pCachedFile) {
+    FileCache* pCache = pThreadCache;
+    if ( pCache == NULL ) {
+        return;
+    }
+
+    // Another request may have loaded the same path meanwhile
+    CachedFile* pEntry = findEntry(pCache, (const unsigned char*) pCachedFile->path, pCachedFile->pathLength, pCachedFile->hash);
+    if ( pEntry != NULL ) {
+        dropEntry(pCache, pEntry);
+    }
+
+    if ( pCache->inotifyFileDescriptor != -1 ) {
+        pCachedFile->watchDescriptor = inotify_add_watch(pCache->inotifyFileDescriptor, pCachedFile->path, CACHE_WATCH_EVENTS);
+    }
+    if ( !isEntryValid(pCachedFile) ) {
+        int watchDescriptor = pCachedFile->watchDescriptor;
+        pCachedFile->watchDescriptor = -1;
+        unwatchFile(pCache, watchDescriptor);
+        return;
+    }
+    if ( pCache->nEntries >= maxCacheEntries ) {
+        dropEntry(pCache, pCache->pOldest);
+    }
+
+    CachedFile** pBucket = &pCache->buckets[pCachedFile->hash & pCache->bucketMask];
+    pCachedFile->pNextInBucket = *pBucket;
+    *pBucket = pCachedFile;
+    pCachedFile->pNewer = NULL;
+    pCachedFile->pOlder = pCache->pNewest;
+    if ( pCache->pNewest != NULL ) {
+        pCache->pNewest->pNewer = pCachedFile;
+    } else {
+        pCache->pOldest = pCachedFile;
+    }
+    pCache->pNewest = pCachedFile;
+    ++ pCache->nEntries;
+    ++ pCachedFile->nReferences;
+}
+
+/**
+ * Release a reference to a cached file, the file is closed with the last reference.
+ * @param pCachedFile the file to release
+ */
+void releaseCachedFile(CachedFile* pCachedFile) {
+    if ( -- pCachedFile->nReferences > 0 ) {
+        return;
+    }
+    if ( pCachedFile->fileFileDescriptor != -1 ) {
+        close(pCachedFile->fileFileDescriptor);
+    }
+    free(pCachedFile->content);
+    free(pCachedFile);
+}
+
+/**
+ * Hash a path with FNV-1a.
+ * @param  path       the path of the file
+ * @param  pathLength the length of the path
+ * @return the hash of the path
+ */
+static uint64_t hashPath(const unsigned char* path, size_t pathLength) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for ( i = 0; i < pathLength; ++ i ) {
+        hash = (hash ^ path[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Find the entry of a path.
+ * @param  pCache     the cache of the worker
+ * @param  path       the path of the file
+ * @param  pathLength the length of the path
+ * @param  hash       the hash of the path
+ * @return the entry, NULL if the path is not cached
+ */
+static CachedFile* findEntry(FileCache* pCache, const unsigned char* path, size_t pathLength, uint64_t hash) {
+    CachedFile* pEntry = pCache->buckets[hash & pCache->bucketMask];
+    for ( ; pEntry != NULL; pEntry = pEntry->pNextInBucket ) {
+        if ( pEntry->hash == hash && pEntry->pathLength == pathLength && memcmp(pEntry->path, path, pathLength) == 0 ) {
+            return pEntry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read the whole content of a small file into its entry.
+ * @param  pEntry             the entry of the file, its size is known
+ * @param  fileFileDescriptor the file descriptor of the file
+ * @return -1 if the file is failed to read or changed its size
+ */
+static int readContent(CachedFile* pEntry, int fileFileDescriptor) {
+    size_t size = (size_t) pEntry->size;
+    unsigned char* content = (unsigned char*) malloc(size > 0 ? size : 1);
+    if ( content == NULL ) {
+        return -1;
+    }
+
+    size_t readBytes = 0;
+    while ( readBytes < size ) {
+        ssize_t result = pread(fileFileDescriptor, content + readBytes, size - readBytes, (off_t) readBytes);
+        if ( result == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( result <= 0 ) {
+            free(content);
+            return -1;
+        }
+        readBytes += (size_t) result;
+    }
+    pEntry->content = content;
+    return 0;
+}
+
+/**
+ * Check whether the path of an entry still names the same unchanged file.
+ * @param  pEntry the entry to check
+ * @return TRUE if the entry is still valid
+ */
+static int isEntryValid(const CachedFile* pEntry) {
+    struct stat fileStatus;
+    return stat(pEntry->path, &fileStatus) == 0 && fileStatus.st_dev == pEntry->device && fileStatus.st_ino == pEntry->inode &&
+        fileStatus.st_size == pEntry->size && fileStatus.st_mtim.tv_sec == pEntry->modifiedTime.tv_sec &&
+        fileStatus.st_mtim.tv_nsec == pEntry->modifiedTime.tv_nsec;
+}
+
+/**
+ * Drop the entries of the files which changed, until the inotify instance is empty.
+ * Changes are rare, so the entries of a watch are found by walking the whole cache.
+ * @param pCache the cache of the worker
+ */
+static void processFileEvents(FileCache* pCache) {
+    if ( pCache->inotifyFileDescriptor == -1 ) {
+        return;
+    }
+
+    char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = 0;
+    while ( (length = read(pCache->inotifyFileDescriptor, buffer, sizeof(buffer))) > 0 ) {
+        char* pEvent = buffer;
+        for ( ; pEvent < buffer + length; pEvent += sizeof(struct inotify_event) + ((struct inotify_event*) pEvent)->len ) {
+            const struct inotify_event* pFileEvent = (const struct inotify_event*) pEvent;
+            CachedFile* pEntry = pCache->pNewest;
+            while ( pEntry != NULL ) {
+                CachedFile* pOlder = pEntry->pOlder;
+                if ( pEntry->watchDescriptor == pFileEvent->wd ) {
+                    LOG_DEBUG("[CACHE] The file %s changed, it is dropped from the cache\n", pEntry->path);
+                    // A watch removed by the kernel must not be removed again
+                    if ( pFileEvent->mask & IN_IGNORED ) {
+                        pEntry->watchDescriptor = -1;
+                    }
+                    dropEntry(pCache, pEntry);
+                }
+                pEntry = pOlder;
+            }
+        }
+    }
+}
+
+/**
+ * Make an entry the most recently used one.
+ * @param pCache the cache of the worker
+ * @param pEntry the entry which is used
+ */
+static void touchEntry(FileCache* pCache, CachedFile* pEntry) {
+    if ( pCache->pNewest == pEntry ) {
+        return;
+    }
+
+    // The entry is not the newest, so it has a newer neighbour
+    pEntry->pNewer->pOlder = pEntry->pOlder;
+    if ( pEntry->pOlder != NULL ) {
+        pEntry->pOlder->pNewer = pEntry->pNewer;
+    } else {
+        pCache->pOldest = pEntry->pNewer;
+    }
+    pEntry->pNewer = NULL;
+    pEntry->pOlder = pCache->pNewest;
+    pCache->pNewest->pNewer = pEntry;
+    pCache->pNewest = pEntry;
+}
+
+/**
+ * Remove an entry from the cache, it is released when no response sends from it anymore.
+ * @param pCache the cache of the worker
+ * @param pEntry the entry to remove
+ */
+static void dropEntry(FileCache* pCache, CachedFile* pEntry) {
+    CachedFile** ppLink = &pCache->buckets[pEntry->hash & pCache->bucketMask];
+    while ( *ppLink != pEntry ) {
+        ppLink = &(*ppLink)->pNextInBucket;
+    }
+    *ppLink = pEntry->pNextInBucket;
+
+    if ( pEntry->pNewer != NULL ) {
+        pEntry->pNewer->pOlder = pEntry->pOlder;
+    } else {
+        pCache->pNewest = pEntry->pOlder;
+    }
+    if ( pEntry->pOlder != NULL ) {
+        pEntry->pOlder->pNewer = pEntry->pNewer;
+    } else {
+        pCache->pOldest = pEntry->pNewer;
+    }
+    -- pCache->nEntries;
+
+    int watchDescriptor = pEntry->watchDescriptor;
+    pEntry->watchDescriptor = -1;
+    unwatchFile(pCache, watchDescriptor);
+    releaseCachedFile(pEntry);
+}
+
+/**
+ * Stop watching a file unless another entry still uses the watch. Paths which name
+ * the same file share a watch, the kernel has one watch for each inode.
+ * @param pCache          the cache of the worker
+ * @param watchDescriptor the watch to remove, -1 if there is none
+ */
+static void unwatchFile(FileCache* pCache, int watchDescriptor) {
+    if ( watchDescriptor == -1 ) {
+        return;
+    }
+
+    const CachedFile* pEntry = pCache->pNewest;
+    for ( ; pEntry != NULL; pEntry = pEntry->pOlder ) {
+        if ( pEntry->watchDescriptor == watchDescriptor ) {
+            return;
+        }
+    }
+    inotify_rm_watch(pCache->inotifyFileDescriptor, watchDescriptor);
+}
@@ -0,0 +1,51 @@
+#ifndef HW5_CACHE_H
+#define HW5_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * The default limits of the cache of a worker. Files up to the small file size are
+ * kept in memory, larger files keep an open file descriptor.
+ */
+#define DEFAULT_CACHE_ENTRIES   256
+#define DEFAULT_SMALL_FILE_SIZE 16384
+
+/**
+ * A file in the cache of a worker. Responses hold a reference while they send from
+ * it, an entry which is evicted or invalidated is released by the last reference.
+ * A file is loaded by any thread, but only the worker which owns the cache inserts
+ * it, finds it and releases it.
+ */
+typedef struct CachedFile {
+    dev_t                   device;
+    ino_t                   inode;
+    struct timespec         modifiedTime;
+    off_t                   size;
+    int                     fileFileDescriptor;     // -1 if the content is kept in memory
+    unsigned char*          content;                // NULL if the file is sent from fileFileDescriptor
+    int                     watchDescriptor;        // -1 if the file is revalidated with stat()
+    int                     nReferences;            // the cache holds one reference while the entry is inserted
+    uint64_t                hash;
+    size_t                  pathLength;
+    char*                   path;
+    struct CachedFile*      pNextInBucket;
+    struct CachedFile*      pNewer;
+    struct CachedFile*      pOlder;
+} CachedFile;
+
+/**
+ * Prototypes of functions.
+ */
+void configureFileCache(int maxEntries, size_t smallFileSize);
+int attachFileCache(void);
+int getFileCacheEventDescriptor(void);
+void handleFileCacheEvents(void);
+CachedFile* findCachedFile(const unsigned char* path, size_t pathLength);
+CachedFile* loadCachedFile(const unsigned char* path, size_t pathLength);
+void insertCachedFile(CachedFile* pCachedFile);
+void releaseCachedFile(CachedFile* pCachedFile);
+
+#endif
@@ -4,49 +4,222 @@
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>     // for closing socket
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 
-#define BUFFER_SIZE 1024
+#include "hw5_protocol.h"
+
+#define TRUE                    1
+#define FALSE                   0
+
+#define BUFFER_SIZE             1024
+#define RECEIVE_BUFFER_SIZE     65536
+
+/**
+ * The maximum number of requests which are sent but not answered yet,
+ * the client stops reading commands when this limit is reached.
+ */
+#define MAX_PENDING_REQUESTS    256
+
+/**
+ * A segmented download fetches each segment over its own connection and reconnects
+ * from the last received byte if the connection fails or stalls.
+ */
+#define MAX_SEGMENTS            64
+#define MAX_SEGMENT_ATTEMPTS    5
+#define SEGMENT_TIMEOUT_SECONDS 10
+
+/**
+ * The progress of an unfinished download is kept in "<save path>.part", so a later run
+ * with the same arguments only fetches the missing bytes.
+ */
+#define PROGRESS_FILE_SUFFIX    ".part"
+#define PROGRESS_FILE_MAGIC     0x48355347
+
+/**
+ * A TCP throughput test asks the server for an endless stream on every connection and
+ * closes the connections when the test is over. A UDP throughput test sends datagrams
+ * at a target bitrate, the server echoes them and the client measures what comes back.
+ */
+#define MAX_STREAMS             128
+#define STREAM_LENGTH           (1ULL << 62)
+#define DATAGRAM_HEADER_SIZE    32          // the sequence number and the send time in upper case hexadecimal
+#define UDP_GRACE_SECONDS       0.5         // how long to wait for late replies after the last datagram
+
+#define USAGE                   "Usage: %s [-d FilePath [-o SavePath] [-k Segments]] [-T Streams | -u Bitrate [-l Size]] [-t Seconds] [-i Seconds] Host PortNumber\n" \
+                                "  -d FilePath  download the file over parallel connections instead of reading commands\n" \
+                                "  -o SavePath  the path to save the file, defaults to the file name\n" \
+                                "  -k Segments  the number of segments and connections, defaults to 4\n" \
+                                "  -T Streams   measure the TCP throughput from the server over parallel streams\n" \
+                                "  -u Bitrate   measure the UDP throughput at a bitrate in bits per second, K, M and G are accepted\n" \
+                                "  -l Size      the size of the datagrams of the UDP test, defaults to 1024\n" \
+                                "  -t Seconds   the duration of the throughput test, defaults to 10\n" \
+                                "  -i Seconds   the interval between the reports of the throughput test, defaults to 1\n"
+
+/**
+ * A request which waits for its response.
+ */
+typedef struct {
+    uint32_t    requestId;
+    uint8_t     opcode;
+    char        savePath[BUFFER_SIZE];
+} PendingRequest;
+
+/**
+ * The state of the connection to the server.
+ */
+typedef struct {
+    int             socketFileDescriptor;
+    uint32_t        nextRequestId;
+
+    // Requests in the order they were sent, the server answers in the same order
+    PendingRequest  pendingRequests[MAX_PENDING_REQUESTS];
+    int             pendingHead;
+    int             nPendingRequests;
+
+    // Frames which are not sent yet
+    unsigned char*  outputBuffer;
+    size_t          outputLength;
+    size_t          outputCapacity;
+
+    // The response which is being received
+    unsigned char   headerBuffer[FRAME_HEADER_SIZE];
+    size_t          headerLength;
+    FrameHeader     response;
+    uint64_t        payloadReceived;
+    char            echoBuffer[MAX_REQUEST_PAYLOAD + 1];
+    FILE*           pOutputFile;
+} Client;
+
+/**
+ * The header of the progress file, followed by the number of bytes received in each segment.
+ */
+typedef struct {
+    uint32_t    magic;
+    uint32_t    nSegments;
+    uint64_t    fileSize;
+} ProgressHeader;
+
+/**
+ * A file which is downloaded in segments.
+ */
+typedef struct {
+    const struct sockaddr_in*   pServerSocketAddress;
+    const char*                 filePath;
+    int                         outputFileDescriptor;
+    int                         progressFileDescriptor;
+} Download;
+
+/**
+ * A byte range of the file which is fetched by a thread.
+ */
+typedef struct {
+    Download*   pDownload;
+    int         segmentId;
+    uint64_t    offset;
+    uint64_t    length;
+    uint64_t    receivedBytes;
+    pthread_t   thread;
+} Segment;
+
+/**
+ * Prototypes of functions.
+ */
+int connectToServer(const struct sockaddr_in* pServerSocketAddress);
+int sendAll(int socketFileDescriptor, const unsigned char* buffer, size_t length);
+int receiveAll(int socketFileDescriptor, unsigned char* buffer, size_t length);
+int downloadFile(const struct sockaddr_in* pServerSocketAddress, const char* filePath, const char* savePath, int nSegments);
+int statRemoteFile(const struct sockaddr_in* pServerSocketAddress, const char* filePath, uint64_t* pFileSize);
+void* downloadSegment(void* pArgument);
+int fetchSegment(Segment* pSegment);
+int handleCommand(Client* pClient, char* command);
+int queueFrame(Client* pClient, uint8_t opcode, const char* payload, size_t payloadLength);
+int flushFrames(Client* pClient);
+int handleResponseBytes(Client* pClient, const unsigned char* buffer, size_t length);
+void finishResponse(Client* pClient);
+int measureTcpThroughput(const struct sockaddr_in* pServerSocketAddress, int nStreams, double duration, double interval);
+int measureUdpThroughput(const struct sockaddr_in* pServerSocketAddress, double bitrate, size_t datagramSize,
+                         double duration, double interval);
+double getMonotonicSeconds(void);
+void printThroughput(const char* label, double startTime, double endTime, uint64_t bytes);
 
 /**
  * The entrance of the server application.
- * 
+ *
  * @param  argc the number of arguments
  * @param  argv a pointer to a char array that stores arguments
  * @return 0 if the application exited normally
  */
 int main(int argc, char *argv[]) {
-    if ( argc != 3 ) {
-        fprintf(stderr," Usage: %s Host PortNumber\n",argv[0]);
+    const char* downloadPath = NULL;
+    const char* savePath = NULL;
+    int nSegments = 4;
+    int nStreams = 0;
+    double bitrate = 0;
+    size_t datagramSize = BUFFER_SIZE;
+    double duration = 10;
+    double interval = 1;
+    char* pUnit = NULL;
+    int option = 0;
+    while ( (option = getopt(argc, argv, "d:o:k:T:u:l:t:i:")) != -1 ) {
+        switch ( option ) {
+            case 'd':
+                downloadPath = optarg;
+                break;
+            case 'o':
+                savePath = optarg;
+                break;
+            case 'k':
+                nSegments = atoi(optarg);
+                break;
+            case 'T':
+                nStreams = atoi(optarg);
+                break;
+            case 'u':
+                bitrate = strtod(optarg, &pUnit);
+                if ( *pUnit == 'K' || *pUnit == 'k' ) {
+                    bitrate *= 1e3;
+                } else if ( *pUnit == 'M' || *pUnit == 'm' ) {
+                    bitrate *= 1e6;
+                } else if ( *pUnit == 'G' || *pUnit == 'g' ) {
+                    bitrate *= 1e9;
+                }
+                break;
+            case 'l':
+                datagramSize = (size_t) atol(optarg);
+                break;
+            case 't':
+                duration = atof(optarg);
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( optind != argc - 2 || nSegments <= 0 || nSegments > MAX_SEGMENTS || nStreams < 0 || nStreams > MAX_STREAMS ||
+         bitrate < 0 || datagramSize < DATAGRAM_HEADER_SIZE || datagramSize > BUFFER_SIZE || duration <= 0 || interval <= 0 ) {
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
-    
-    struct hostent* pHost = gethostbyname(argv[1]);
+
+    struct hostent* pHost = gethostbyname(argv[optind]);
     if ( pHost == NULL ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
-    int portNumber = atoi(argv[2]);
+    int portNumber = atoi(argv[optind + 1]);
     if ( portNumber <= 0 ) {
-        fprintf(stderr, "Usage: %s Host PortNumber\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    /*
-     * Create socket file descriptor.
-     * Function Prototype: int socket(int domain, int type,int protocol)
-     * Defined in sys/socket.h
-     *
-     * @param domain:   AF_INET stands for Internet, AF_UNIX can only communicate between UNIX systems.
-     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP
-     * @param protocol  if type is specified, this parameter can be assigned to 0.
-     * @return -1 if socket is failed to create
-     */
-    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if ( tcpSocketFileDescriptor == -1 ) {
-        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -54,7 +227,7 @@ int main(int argc, char *argv[]) {
      * Initialize sockaddr struct.
      *
      * The structure of sockaddr:
-     * 
+     *
      * struct sockaddr{
      *     unisgned short  as_family;
      *     char            sa_data[14];
@@ -71,13 +244,177 @@ int main(int argc, char *argv[]) {
      *
      * Both of them are defined in netinet/in.h
      */
-    socklen_t sockaddrSize = sizeof(struct sockaddr);
     struct sockaddr_in serverSocketAddress;
-    bzero(&serverSocketAddress, sockaddrSize);
+    bzero(&serverSocketAddress, sizeof(serverSocketAddress));
     serverSocketAddress.sin_family = AF_INET;
     serverSocketAddress.sin_addr=*((struct in_addr *)pHost->h_addr);
     serverSocketAddress.sin_port = htons(portNumber);
 
+    if ( nStreams > 0 ) {
+        return measureTcpThroughput(&serverSocketAddress, nStreams, duration, interval) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if ( bitrate > 0 ) {
+        return measureUdpThroughput(&serverSocketAddress, bitrate, datagramSize, duration, interval) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if ( downloadPath != NULL ) {
+        if ( savePath == NULL ) {
+            // Save to the current directory with the same file name
+            const char* pFileName = strrchr(downloadPath, '/');
+            savePath = pFileName == NULL ? downloadPath : pFileName + 1;
+        }
+        return downloadFile(&serverSocketAddress, downloadPath, savePath, nSegments) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    int tcpSocketFileDescriptor = connectToServer(&serverSocketAddress);
+    if ( tcpSocketFileDescriptor == -1 ) {
+        return EXIT_FAILURE;
+    }
+    // Requests are sent without waiting for responses, so the socket must never block
+    fcntl(tcpSocketFileDescriptor, F_SETFL, fcntl(tcpSocketFileDescriptor, F_GETFL) | O_NONBLOCK);
+
+    Client* pClient = (Client*) calloc(1, sizeof(Client));
+    if ( pClient == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to allocate the client: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    pClient->socketFileDescriptor = tcpSocketFileDescriptor;
+    pClient->nextRequestId = 1;
+
+    int isInteractive = isatty(STDIN_FILENO);
+    fprintf(stderr, "[INFO] Connection established with server.\n"
+                    "Type \'GET path [save path]\' to download a file, \'UPPER message\' to convert a message to upper case,\n"
+                    "\'STATS\' to show the statistics of the server, \'BYE\' to disconnect, or any other message to echo.\n"
+                    "Commands are sent immediately, responses are printed as they arrive.\n");
+
+    /*
+     * Read commands and responses at the same time, so many requests can be in flight.
+     */
+    char commandBuffer[BUFFER_SIZE * 4] = {0};
+    size_t commandLength = 0;
+    unsigned char* receiveBuffer = (unsigned char*) malloc(RECEIVE_BUFFER_SIZE);
+    int isInputClosed = FALSE;
+    int isPromptShown = FALSE;
+    int exitCode = EXIT_SUCCESS;
+    while ( receiveBuffer != NULL && (!isInputClosed || commandLength > 0 || pClient->nPendingRequests > 0 || pClient->outputLength > 0) ) {
+        // Send every complete line as a request, a command is sent as soon as its line is typed
+        char* pLineEnd = NULL;
+        while ( pClient->nPendingRequests < MAX_PENDING_REQUESTS && commandLength > 0 &&
+                ((pLineEnd = (char*) memchr(commandBuffer, '\n', commandLength)) != NULL ||
+                 isInputClosed || commandLength >= BUFFER_SIZE - 1) ) {
+            size_t lineLength = pLineEnd != NULL ? (size_t) (pLineEnd - commandBuffer) : commandLength;
+            if ( lineLength > BUFFER_SIZE - 1 ) {
+                lineLength = BUFFER_SIZE - 1;
+            }
+            char command[BUFFER_SIZE] = {0};
+            memcpy(command, commandBuffer, lineLength);
+            if ( pLineEnd != NULL && lineLength == (size_t) (pLineEnd - commandBuffer) ) {
+                ++ lineLength;
+            }
+            commandLength -= lineLength;
+            memmove(commandBuffer, commandBuffer + lineLength, commandLength);
+            isPromptShown = FALSE;
+
+            if ( handleCommand(pClient, command) == -1 ) {
+                // Stop sending message to server
+                isInputClosed = TRUE;
+                commandLength = 0;
+            }
+        }
+        if ( pClient->outputLength > 0 && flushFrames(pClient) == -1 ) {
+            fprintf(stderr, "[ERROR] An error occurred while sending message to the server: %s\nThe connection is going to close.\n", strerror(errno));
+            exitCode = EXIT_FAILURE;
+            break;
+        }
+        if ( isInputClosed && commandLength == 0 && pClient->nPendingRequests == 0 && pClient->outputLength == 0 ) {
+            break;
+        }
+
+        if ( isInteractive && !isInputClosed && !isPromptShown && pClient->nPendingRequests == 0 ) {
+            fprintf(stderr, "Please Type unique message to server: ");
+            isPromptShown = TRUE;
+        }
+
+        struct pollfd pollFileDescriptors[2];
+        pollFileDescriptors[0].fd = tcpSocketFileDescriptor;
+        pollFileDescriptors[0].events = POLLIN | (pClient->outputLength > 0 ? POLLOUT : 0);
+        pollFileDescriptors[0].revents = 0;
+        pollFileDescriptors[1].fd = (isInputClosed || commandLength == sizeof(commandBuffer)) ? -1 : STDIN_FILENO;
+        pollFileDescriptors[1].events = POLLIN;
+        pollFileDescriptors[1].revents = 0;
+        if ( poll(pollFileDescriptors, 2, -1) == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            fprintf(stderr, "[ERROR] Failed to wait for events: %s\n", strerror(errno));
+            exitCode = EXIT_FAILURE;
+            break;
+        }
+
+        // Receive responses
+        if ( pollFileDescriptors[0].revents & (POLLIN | POLLHUP | POLLERR) ) {
+            ssize_t readBytes = recv(tcpSocketFileDescriptor, receiveBuffer, RECEIVE_BUFFER_SIZE, 0);
+            if ( readBytes == 0 || (readBytes == -1 && errno != EAGAIN && errno != EINTR) ) {
+                if ( readBytes == -1 ) {
+                    fprintf(stderr, "[ERROR] An error occurred while receiving message from the server: %s\nThe connection is going to close.\n", strerror(errno));
+                } else if ( pClient->nPendingRequests > 0 ) {
+                    fprintf(stderr, "[WARN] Server closed the connection with %d request(s) unanswered.\n", pClient->nPendingRequests);
+                }
+                exitCode = pClient->nPendingRequests > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+                break;
+            }
+            if ( readBytes > 0 && handleResponseBytes(pClient, receiveBuffer, (size_t) readBytes) == -1 ) {
+                exitCode = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        // Read commands
+        if ( pollFileDescriptors[1].revents & (POLLIN | POLLHUP | POLLERR) ) {
+            ssize_t readBytes = read(STDIN_FILENO, commandBuffer + commandLength, sizeof(commandBuffer) - commandLength);
+            if ( readBytes <= 0 ) {
+                isInputClosed = TRUE;
+            } else {
+                commandLength += (size_t) readBytes;
+            }
+        }
+    }
+
+    /*
+     * Close socket for client.
+     */
+    close(tcpSocketFileDescriptor);
+    if ( pClient->pOutputFile != NULL ) {
+        fclose(pClient->pOutputFile);
+    }
+    free(receiveBuffer);
+    free(pClient->outputBuffer);
+    free(pClient);
+
+    return exitCode;
+}
+
+/**
+ * Open a TCP connection to the server.
+ * @param  pServerSocketAddress the address of the server
+ * @return the file descriptor of the socket, -1 if the connection failed
+ */
+int connectToServer(const struct sockaddr_in* pServerSocketAddress) {
+    /*
+     * Create socket file descriptor.
+     * Function Prototype: int socket(int domain, int type,int protocol)
+     * Defined in sys/socket.h
+     *
+     * @param domain:   AF_INET stands for Internet, AF_UNIX can only communicate between UNIX systems.
+     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP
+     * @param protocol  if type is specified, this parameter can be assigned to 0.
+     * @return -1 if socket is failed to create
+     */
+    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if ( tcpSocketFileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
     /*
      * Connect to server.
      * Function prototype: int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
@@ -88,69 +425,810 @@ int main(int argc, char *argv[]) {
      * @param addrlen the size of the struct sockaddr
      * @return -1 if the operation failed
      */
-    if ( connect(tcpSocketFileDescriptor, (struct sockaddr *)(&serverSocketAddress), sockaddrSize) == -1 ) {
+    if ( connect(tcpSocketFileDescriptor, (const struct sockaddr *) pServerSocketAddress, sizeof(struct sockaddr)) == -1 ) {
         fprintf(stderr, "[ERROR] Failed to connect to server: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        close(tcpSocketFileDescriptor);
+        return -1;
     }
+    return tcpSocketFileDescriptor;
+}
 
-    char inputBuffer[BUFFER_SIZE] = {0};
-    char outputBuffer[BUFFER_SIZE] = {0};
-    fprintf(stderr, "[INFO] Connection established with server.\nType \'BYE\' to disconnect.\n");
-    do {
-        // Send a message to server
-        fprintf(stderr, "Please Type unique message to server: ");
-        fgets(outputBuffer, BUFFER_SIZE, stdin);
-        // Remove \n character at the end of the string
-        outputBuffer[strlen(outputBuffer) - 1] = 0;
+/**
+ * Send a buffer over a blocking socket.
+ * @param  socketFileDescriptor the socket to send to
+ * @param  buffer               the bytes to send
+ * @param  length               the number of bytes to send
+ * @return -1 if the connection is broken
+ */
+int sendAll(int socketFileDescriptor, const unsigned char* buffer, size_t length) {
+    while ( length > 0 ) {
+        ssize_t writtenBytes = send(socketFileDescriptor, buffer, length, MSG_NOSIGNAL);
+        if ( writtenBytes == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( writtenBytes <= 0 ) {
+            return -1;
+        }
+        buffer += writtenBytes;
+        length -= (size_t) writtenBytes;
+    }
+    return 0;
+}
 
-        if ( send(tcpSocketFileDescriptor, outputBuffer, strlen(outputBuffer) + 1, 0) == -1 ) {
-            fprintf(stderr, "[ERROR] An error occurred while sending message to the server: %s\nThe connection is going to close.\n", strerror(errno));
-            break;
+/**
+ * Receive an exact number of bytes from a blocking socket.
+ * @param  socketFileDescriptor the socket to receive from
+ * @param  buffer               the buffer which receives the bytes
+ * @param  length               the number of bytes to receive
+ * @return -1 if the connection is closed, broken or timed out
+ */
+int receiveAll(int socketFileDescriptor, unsigned char* buffer, size_t length) {
+    while ( length > 0 ) {
+        ssize_t readBytes = recv(socketFileDescriptor, buffer, length, 0);
+        if ( readBytes == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( readBytes <= 0 ) {
+            return -1;
+        }
+        buffer += readBytes;
+        length -= (size_t) readBytes;
+    }
+    return 0;
+}
+
+/**
+ * Download a file over parallel connections, each connection fetches a segment of the file
+ * with a GET_RANGE request and writes it at its offset. Unfinished segments of an earlier
+ * run are resumed from the progress file.
+ * @param  pServerSocketAddress the address of the server
+ * @param  filePath             the path of the file on the server
+ * @param  savePath             the path to save the file
+ * @param  nSegments            the number of segments, ignored when resuming
+ * @return -1 if the download is incomplete
+ */
+int downloadFile(const struct sockaddr_in* pServerSocketAddress, const char* filePath, const char* savePath, int nSegments) {
+    uint64_t fileSize = 0;
+    if ( statRemoteFile(pServerSocketAddress, filePath, &fileSize) == -1 ) {
+        return -1;
+    }
+
+    char progressPath[BUFFER_SIZE] = {0};
+    snprintf(progressPath, sizeof(progressPath), "%s%s", savePath, PROGRESS_FILE_SUFFIX);
+    int outputFileDescriptor = open(savePath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    int progressFileDescriptor = open(progressPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ( outputFileDescriptor == -1 || progressFileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to open %s: %s\n", outputFileDescriptor == -1 ? savePath : progressPath, strerror(errno));
+        if ( outputFileDescriptor != -1 ) {
+            close(outputFileDescriptor);
+        }
+        return -1;
+    }
+
+    /*
+     * Resume the segments of an earlier run if it was downloading the same file.
+     */
+    uint64_t receivedBytes[MAX_SEGMENTS] = {0};
+    ProgressHeader progressHeader;
+    struct stat outputStatus;
+    int isResumed = fstat(outputFileDescriptor, &outputStatus) == 0 && (uint64_t) outputStatus.st_size == fileSize &&
+        pread(progressFileDescriptor, &progressHeader, sizeof(progressHeader), 0) == (ssize_t) sizeof(progressHeader) &&
+        progressHeader.magic == PROGRESS_FILE_MAGIC && progressHeader.fileSize == fileSize &&
+        progressHeader.nSegments > 0 && progressHeader.nSegments <= MAX_SEGMENTS &&
+        pread(progressFileDescriptor, receivedBytes, progressHeader.nSegments * sizeof(uint64_t), sizeof(progressHeader)) ==
+            (ssize_t) (progressHeader.nSegments * sizeof(uint64_t));
+    if ( isResumed ) {
+        nSegments = (int) progressHeader.nSegments;
+        fprintf(stderr, "[INFO] Resume the download of %s in %d segment(s).\n", filePath, nSegments);
+    } else {
+        progressHeader.magic = PROGRESS_FILE_MAGIC;
+        progressHeader.nSegments = (uint32_t) nSegments;
+        progressHeader.fileSize = fileSize;
+        memset(receivedBytes, 0, sizeof(receivedBytes));
+        if ( ftruncate(progressFileDescriptor, 0) == -1 || ftruncate(outputFileDescriptor, (off_t) fileSize) == -1 ||
+             pwrite(progressFileDescriptor, &progressHeader, sizeof(progressHeader), 0) != (ssize_t) sizeof(progressHeader) ||
+             pwrite(progressFileDescriptor, receivedBytes, nSegments * sizeof(uint64_t), sizeof(progressHeader)) !=
+                (ssize_t) (nSegments * sizeof(uint64_t)) ) {
+            fprintf(stderr, "[ERROR] Failed to prepare %s: %s\n", savePath, strerror(errno));
+            close(outputFileDescriptor);
+            close(progressFileDescriptor);
+            return -1;
+        }
+    }
+
+    Download download;
+    download.pServerSocketAddress = pServerSocketAddress;
+    download.filePath = filePath;
+    download.outputFileDescriptor = outputFileDescriptor;
+    download.progressFileDescriptor = progressFileDescriptor;
+
+    struct timeval startTime;
+    gettimeofday(&startTime, NULL);
+
+    Segment segments[MAX_SEGMENTS];
+    int i = 0;
+    for ( i = 0; i < nSegments; ++ i ) {
+        segments[i].pDownload = &download;
+        segments[i].segmentId = i;
+        segments[i].offset = fileSize * i / nSegments;
+        segments[i].length = fileSize * (i + 1) / nSegments - segments[i].offset;
+        segments[i].receivedBytes = receivedBytes[i] > segments[i].length ? segments[i].length : receivedBytes[i];
+
+        int errorCode = pthread_create(&segments[i].thread, NULL, downloadSegment, &segments[i]);
+        if ( errorCode != 0 ) {
+            // Fetch the segment on this thread instead
+            fprintf(stderr, "[WARN] Failed to start the thread of segment #%d: %s\n", i, strerror(errorCode));
+            downloadSegment(&segments[i]);
+            segments[i].thread = pthread_self();
+        }
+    }
+
+    uint64_t totalReceivedBytes = 0;
+    int isComplete = TRUE;
+    for ( i = 0; i < nSegments; ++ i ) {
+        if ( !pthread_equal(segments[i].thread, pthread_self()) ) {
+            pthread_join(segments[i].thread, NULL);
+        }
+        totalReceivedBytes += segments[i].receivedBytes - (receivedBytes[i] > segments[i].length ? segments[i].length : receivedBytes[i]);
+        if ( segments[i].receivedBytes < segments[i].length ) {
+            isComplete = FALSE;
+        }
+    }
+
+    struct timeval endTime;
+    gettimeofday(&endTime, NULL);
+    double elapsedSeconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_usec - startTime.tv_usec) / 1e6;
+
+    close(outputFileDescriptor);
+    close(progressFileDescriptor);
+    if ( !isComplete ) {
+        fprintf(stderr, "[ERROR] The download of %s is incomplete, run the same command again to resume.\n", filePath);
+        return -1;
+    }
+    unlink(progressPath);
+    fprintf(stderr, "[INFO] Received %llu bytes in %.3f seconds (%.2f MB/s), saved to %s\n", (unsigned long long) totalReceivedBytes,
+        elapsedSeconds, elapsedSeconds > 0 ? totalReceivedBytes / elapsedSeconds / 1e6 : 0.0, savePath);
+    return 0;
+}
+
+/**
+ * Ask the server for the size of a file.
+ * @param  pServerSocketAddress the address of the server
+ * @param  filePath             the path of the file on the server
+ * @param  pFileSize            the pointer which receives the size of the file
+ * @return -1 if the file does not exist or the request failed
+ */
+int statRemoteFile(const struct sockaddr_in* pServerSocketAddress, const char* filePath, uint64_t* pFileSize) {
+    size_t pathLength = strlen(filePath);
+    if ( pathLength > MAX_REQUEST_PAYLOAD ) {
+        fprintf(stderr, "[ERROR] The path of the file is too long.\n");
+        return -1;
+    }
+    int tcpSocketFileDescriptor = connectToServer(pServerSocketAddress);
+    if ( tcpSocketFileDescriptor == -1 ) {
+        return -1;
+    }
+
+    unsigned char buffer[FRAME_HEADER_SIZE + MAX_REQUEST_PAYLOAD];
+    FrameHeader frame;
+    frame.opcode = OPCODE_STAT;
+    frame.status = STATUS_OK;
+    frame.requestId = 1;
+    frame.payloadLength = pathLength;
+    encodeFrameHeader(&frame, buffer);
+    memcpy(buffer + FRAME_HEADER_SIZE, filePath, pathLength);
+
+    int result = -1;
+    if ( sendAll(tcpSocketFileDescriptor, buffer, FRAME_HEADER_SIZE + pathLength) == -1 ||
+         receiveAll(tcpSocketFileDescriptor, buffer, FRAME_HEADER_SIZE) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to query the size of %s: %s\n", filePath, strerror(errno));
+    } else {
+        decodeFrameHeader(buffer, &frame);
+        if ( frame.status != STATUS_OK || frame.payloadLength != sizeof(uint64_t) ) {
+            fprintf(stderr, "[WARN] Server refused to send this file. Maybe file does not exist.\n");
+        } else if ( receiveAll(tcpSocketFileDescriptor, buffer, sizeof(uint64_t)) == 0 ) {
+            *pFileSize = decodeUint64(buffer);
+            result = 0;
+        }
+    }
+    close(tcpSocketFileDescriptor);
+    return result;
+}
+
+/**
+ * The entrance of segment threads, fetch the rest of a segment and reconnect on failures.
+ * @param  pArgument the pointer to the Segment struct of this thread
+ * @return NULL
+ */
+void* downloadSegment(void* pArgument) {
+    Segment* pSegment = (Segment*) pArgument;
+
+    int nAttempts = 0;
+    while ( pSegment->receivedBytes < pSegment->length && nAttempts < MAX_SEGMENT_ATTEMPTS ) {
+        if ( nAttempts ++ > 0 ) {
+            fprintf(stderr, "[WARN] Retry segment #%d from byte %llu.\n", pSegment->segmentId,
+                (unsigned long long) (pSegment->offset + pSegment->receivedBytes));
+            sleep(1);
         }
+        if ( fetchSegment(pSegment) == 0 ) {
+            nAttempts = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Fetch the rest of a segment over a new connection.
+ * @param  pSegment the segment to fetch
+ * @return -1 if the connection failed before the segment is complete
+ */
+int fetchSegment(Segment* pSegment) {
+    Download* pDownload = pSegment->pDownload;
+    int tcpSocketFileDescriptor = connectToServer(pDownload->pServerSocketAddress);
+    if ( tcpSocketFileDescriptor == -1 ) {
+        return -1;
+    }
+    // A stalled connection is dropped and the segment resumes over a new one
+    struct timeval timeout;
+    timeout.tv_sec = SEGMENT_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    setsockopt(tcpSocketFileDescriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        if ( strcmp("BYE", outputBuffer) == 0 ) {
-            // Stop sending message to server
+    size_t pathLength = strlen(pDownload->filePath);
+    uint64_t remainingBytes = pSegment->length - pSegment->receivedBytes;
+    unsigned char* buffer = (unsigned char*) malloc(RECEIVE_BUFFER_SIZE);
+    if ( buffer == NULL ) {
+        close(tcpSocketFileDescriptor);
+        return -1;
+    }
+
+    FrameHeader frame;
+    frame.opcode = OPCODE_GET_RANGE;
+    frame.status = STATUS_OK;
+    frame.requestId = (uint32_t) pSegment->segmentId;
+    frame.payloadLength = RANGE_HEADER_SIZE + pathLength;
+    encodeFrameHeader(&frame, buffer);
+    encodeUint64(pSegment->offset + pSegment->receivedBytes, buffer + FRAME_HEADER_SIZE);
+    encodeUint64(remainingBytes, buffer + FRAME_HEADER_SIZE + 8);
+    memcpy(buffer + FRAME_HEADER_SIZE + RANGE_HEADER_SIZE, pDownload->filePath, pathLength);
+
+    int result = -1;
+    if ( sendAll(tcpSocketFileDescriptor, buffer, FRAME_HEADER_SIZE + RANGE_HEADER_SIZE + pathLength) == -1 ||
+         receiveAll(tcpSocketFileDescriptor, buffer, FRAME_HEADER_SIZE) == -1 ) {
+        fprintf(stderr, "[WARN] Segment #%d failed to send the request: %s\n", pSegment->segmentId, strerror(errno));
+    } else {
+        decodeFrameHeader(buffer, &frame);
+        if ( frame.status != STATUS_OK || frame.payloadLength != remainingBytes ) {
+            fprintf(stderr, "[WARN] Server rejected segment #%d with status %d.\n", pSegment->segmentId, frame.status);
+        } else {
+            result = 0;
+        }
+    }
+
+    // Write every chunk at its offset, then record the progress of the segment
+    while ( result == 0 && remainingBytes > 0 ) {
+        size_t chunkLength = remainingBytes < RECEIVE_BUFFER_SIZE ? (size_t) remainingBytes : RECEIVE_BUFFER_SIZE;
+        ssize_t readBytes = recv(tcpSocketFileDescriptor, buffer, chunkLength, 0);
+        if ( readBytes == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( readBytes <= 0 ) {
+            fprintf(stderr, "[WARN] Segment #%d lost the connection: %s\n", pSegment->segmentId,
+                readBytes == 0 ? "closed by server" : strerror(errno));
+            result = -1;
+            break;
+        }
+        off_t fileOffset = (off_t) (pSegment->offset + pSegment->receivedBytes);
+        if ( pwrite(pDownload->outputFileDescriptor, buffer, (size_t) readBytes, fileOffset) != readBytes ) {
+            fprintf(stderr, "[ERROR] Segment #%d failed to write: %s\n", pSegment->segmentId, strerror(errno));
+            result = -1;
             break;
-        } else if ( strncmp("GET", outputBuffer, 3) ==0 ) {
-            // Receive a message to confirm whether the file exists
-            recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0);
-            if ( strncmp("ACCEPT", inputBuffer, 6) != 0 ) {
-                fprintf(stderr, "[WARN] Server refused to send this file. Maybe file does not exist.\n");
+        }
+        pSegment->receivedBytes += (uint64_t) readBytes;
+        remainingBytes -= (uint64_t) readBytes;
+        pwrite(pDownload->progressFileDescriptor, &pSegment->receivedBytes, sizeof(uint64_t),
+            sizeof(ProgressHeader) + pSegment->segmentId * sizeof(uint64_t));
+    }
+
+    if ( result == 0 ) {
+        frame.opcode = OPCODE_BYE;
+        frame.payloadLength = 0;
+        encodeFrameHeader(&frame, buffer);
+        sendAll(tcpSocketFileDescriptor, buffer, FRAME_HEADER_SIZE);
+    }
+    free(buffer);
+    close(tcpSocketFileDescriptor);
+    return result;
+}
+
+/**
+ * Turn a line typed by the user into a request.
+ * @param  pClient the client
+ * @param  command the line without the new line character
+ * @return -1 if the user asked to disconnect
+ */
+int handleCommand(Client* pClient, char* command) {
+    if ( strcmp("BYE", command) == 0 ) {
+        queueFrame(pClient, OPCODE_BYE, NULL, 0);
+        return -1;
+    } else if ( strncmp("GET ", command, 4) == 0 ) {
+        char filePath[BUFFER_SIZE] = {0};
+        char savePath[BUFFER_SIZE] = {0};
+        int nFields = sscanf(command + 4, "%1023s %1023s", filePath, savePath);
+        if ( nFields < 1 ) {
+            fprintf(stderr, "[WARN] Usage: GET path [save path]\n");
+            return 0;
+        }
+        if ( nFields == 1 ) {
+            // Save to the current directory with the same file name
+            const char* pFileName = strrchr(filePath, '/');
+            strcpy(savePath, pFileName == NULL ? filePath : pFileName + 1);
+        }
+
+        PendingRequest* pRequest = &pClient->pendingRequests[(pClient->pendingHead + pClient->nPendingRequests) % MAX_PENDING_REQUESTS];
+        strcpy(pRequest->savePath, savePath);
+        queueFrame(pClient, OPCODE_GET, filePath, strlen(filePath));
+    } else if ( strcmp("STATS", command) == 0 ) {
+        queueFrame(pClient, OPCODE_STATS, NULL, 0);
+    } else if ( strncmp("UPPER ", command, 6) == 0 ) {
+        queueFrame(pClient, OPCODE_UPPERCASE, command + 6, strlen(command + 6));
+    } else {
+        queueFrame(pClient, OPCODE_ECHO, command, strlen(command));
+    }
+    return 0;
+}
+
+/**
+ * Append a request to the frames which wait to be sent.
+ * @param  pClient       the client
+ * @param  opcode        the opcode of the request
+ * @param  payload       the payload of the request
+ * @param  payloadLength the length of the payload, at most MAX_REQUEST_PAYLOAD bytes
+ * @return -1 if the memory is exhausted
+ */
+int queueFrame(Client* pClient, uint8_t opcode, const char* payload, size_t payloadLength) {
+    if ( pClient->outputLength + FRAME_HEADER_SIZE + payloadLength > pClient->outputCapacity ) {
+        size_t capacity = (pClient->outputCapacity == 0 ? BUFFER_SIZE : pClient->outputCapacity) * 2;
+        unsigned char* outputBuffer = (unsigned char*) realloc(pClient->outputBuffer, capacity);
+        if ( outputBuffer == NULL ) {
+            fprintf(stderr, "[ERROR] Failed to queue the request: %s\n", strerror(errno));
+            return -1;
+        }
+        pClient->outputBuffer = outputBuffer;
+        pClient->outputCapacity = capacity;
+    }
+
+    FrameHeader request;
+    request.opcode = opcode;
+    request.status = STATUS_OK;
+    request.requestId = pClient->nextRequestId ++;
+    request.payloadLength = payloadLength;
+    encodeFrameHeader(&request, pClient->outputBuffer + pClient->outputLength);
+    memcpy(pClient->outputBuffer + pClient->outputLength + FRAME_HEADER_SIZE, payload, payloadLength);
+    pClient->outputLength += FRAME_HEADER_SIZE + payloadLength;
+
+    // The server answers every request but BYE
+    if ( opcode != OPCODE_BYE ) {
+        PendingRequest* pRequest = &pClient->pendingRequests[(pClient->pendingHead + pClient->nPendingRequests) % MAX_PENDING_REQUESTS];
+        pRequest->requestId = request.requestId;
+        pRequest->opcode = opcode;
+        ++ pClient->nPendingRequests;
+    }
+    return 0;
+}
+
+/**
+ * Send as many queued frames as the socket accepts.
+ * @param  pClient the client
+ * @return -1 if the connection is broken
+ */
+int flushFrames(Client* pClient) {
+    size_t sentBytes = 0;
+    while ( sentBytes < pClient->outputLength ) {
+        ssize_t writtenBytes = send(pClient->socketFileDescriptor, pClient->outputBuffer + sentBytes,
+            pClient->outputLength - sentBytes, MSG_NOSIGNAL);
+        if ( writtenBytes == -1 ) {
+            if ( errno == EINTR ) {
                 continue;
             }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                break;
+            }
+            return -1;
+        }
+        sentBytes += (size_t) writtenBytes;
+    }
+
+    pClient->outputLength -= sentBytes;
+    memmove(pClient->outputBuffer, pClient->outputBuffer + sentBytes, pClient->outputLength);
+    return 0;
+}
+
+/**
+ * Parse the responses in a chunk of bytes received from the server.
+ * A response may span many chunks, and a chunk may hold many responses.
+ * @param  pClient the client
+ * @param  buffer  the received bytes
+ * @param  length  the number of received bytes
+ * @return -1 if the server violated the protocol
+ */
+int handleResponseBytes(Client* pClient, const unsigned char* buffer, size_t length) {
+    while ( length > 0 ) {
+        // Collect the header of the next response
+        if ( pClient->headerLength < FRAME_HEADER_SIZE ) {
+            size_t copiedBytes = FRAME_HEADER_SIZE - pClient->headerLength;
+            if ( copiedBytes > length ) {
+                copiedBytes = length;
+            }
+            memcpy(pClient->headerBuffer + pClient->headerLength, buffer, copiedBytes);
+            pClient->headerLength += copiedBytes;
+            buffer += copiedBytes;
+            length -= copiedBytes;
+            if ( pClient->headerLength < FRAME_HEADER_SIZE ) {
+                break;
+            }
+
+            decodeFrameHeader(pClient->headerBuffer, &pClient->response);
+            if ( pClient->response.status == STATUS_BUSY && pClient->response.requestId == 0 ) {
+                fprintf(stderr, "[ERROR] The server is busy, try again later.\n");
+                return -1;
+            }
+            PendingRequest* pRequest = &pClient->pendingRequests[pClient->pendingHead];
+            if ( pClient->nPendingRequests == 0 || pClient->response.requestId != pRequest->requestId ) {
+                fprintf(stderr, "[ERROR] Received an unexpected response #%u from the server.\n", pClient->response.requestId);
+                return -1;
+            }
+            if ( pRequest->opcode != OPCODE_GET && pClient->response.payloadLength > MAX_REQUEST_PAYLOAD ) {
+                fprintf(stderr, "[ERROR] Received an oversized echo #%u from the server.\n", pClient->response.requestId);
+                return -1;
+            }
+            pClient->payloadReceived = 0;
 
-            // Receive file stream
-            fprintf(stderr, "> Save to: ");
-            scanf("%s", outputBuffer);
-            FILE* outputFile = fopen(outputBuffer, "wb");
+            if ( pRequest->opcode == OPCODE_GET && pClient->response.status == STATUS_OK ) {
+                pClient->pOutputFile = fopen(pRequest->savePath, "wb");
+                if ( pClient->pOutputFile == NULL ) {
+                    fprintf(stderr, "[WARN] Failed to open %s, the file is discarded: %s\n", pRequest->savePath, strerror(errno));
+                }
+            }
+        }
+
+        // Consume the payload of the response
+        size_t payloadBytes = length;
+        if ( payloadBytes > pClient->response.payloadLength - pClient->payloadReceived ) {
+            payloadBytes = (size_t) (pClient->response.payloadLength - pClient->payloadReceived);
+        }
+        if ( pClient->pendingRequests[pClient->pendingHead].opcode != OPCODE_GET ) {
+            memcpy(pClient->echoBuffer + pClient->payloadReceived, buffer, payloadBytes);
+        } else if ( pClient->pOutputFile != NULL ) {
+            fwrite(buffer, sizeof(char), payloadBytes, pClient->pOutputFile);
+        }
+        pClient->payloadReceived += payloadBytes;
+        buffer += payloadBytes;
+        length -= payloadBytes;
+
+        if ( pClient->payloadReceived == pClient->response.payloadLength ) {
+            finishResponse(pClient);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Report a completed response and retire its request.
+ * @param pClient the client
+ */
+void finishResponse(Client* pClient) {
+    PendingRequest* pRequest = &pClient->pendingRequests[pClient->pendingHead];
+    if ( pClient->response.status == STATUS_NOT_FOUND ) {
+        fprintf(stderr, "[WARN] Server refused to send this file. Maybe file does not exist.\n");
+    } else if ( pClient->response.status != STATUS_OK ) {
+        fprintf(stderr, "[WARN] Server rejected request #%u with status %d.\n", pRequest->requestId, pClient->response.status);
+    } else if ( pRequest->opcode == OPCODE_GET ) {
+        if ( pClient->pOutputFile != NULL ) {
+            fclose(pClient->pOutputFile);
+            pClient->pOutputFile = NULL;
+        }
+        fprintf(stderr, "[INFO] Received %llu bytes, saved to %s\n",
+            (unsigned long long) pClient->response.payloadLength, pRequest->savePath);
+    } else if ( pRequest->opcode == OPCODE_STATS ) {
+        pClient->echoBuffer[pClient->payloadReceived] = 0;
+        fprintf(stderr, "[INFO] Statistics of the server:\n%s", pClient->echoBuffer);
+    } else {
+        pClient->echoBuffer[pClient->payloadReceived] = 0;
+        fprintf(stderr, "[INFO] Received a message from server: %s\n", pClient->echoBuffer);
+    }
+
+    pClient->headerLength = 0;
+    pClient->pendingHead = (pClient->pendingHead + 1) % MAX_PENDING_REQUESTS;
+    -- pClient->nPendingRequests;
+}
+
+/**
+ * Measure the goodput of TCP streams from the server, like iperf in reverse mode.
+ * Every connection asks for an endless STREAM response and counts its payload.
+ * @param  pServerSocketAddress the address of the server
+ * @param  nStreams             the number of parallel connections
+ * @param  duration             the number of seconds to measure
+ * @param  interval             the number of seconds between reports
+ * @return -1 if a connection failed
+ */
+int measureTcpThroughput(const struct sockaddr_in* pServerSocketAddress, int nStreams, double duration, double interval) {
+    struct pollfd pollFileDescriptors[MAX_STREAMS];
+    uint64_t intervalBytes[MAX_STREAMS] = {0};
+    uint64_t totalBytes[MAX_STREAMS] = {0};
+    size_t headerLengths[MAX_STREAMS] = {0};
+    unsigned char headers[MAX_STREAMS][FRAME_HEADER_SIZE];
+    unsigned char* receiveBuffer = (unsigned char*) malloc(RECEIVE_BUFFER_SIZE);
+    int result = receiveBuffer == NULL ? -1 : 0;
+
+    int i = 0;
+    for ( i = 0; i < nStreams; ++ i ) {
+        pollFileDescriptors[i].fd = -1;
+        pollFileDescriptors[i].events = POLLIN;
+    }
+    for ( i = 0; i < nStreams && result == 0; ++ i ) {
+        int tcpSocketFileDescriptor = connectToServer(pServerSocketAddress);
+        if ( tcpSocketFileDescriptor == -1 ) {
+            result = -1;
+            break;
+        }
+        pollFileDescriptors[i].fd = tcpSocketFileDescriptor;
 
-            int readBytes = 0;
-            while ( (readBytes = recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0)) > 0 ) {
-                fprintf(stderr, "[INFO] Received %lu bytes\n", strlen(inputBuffer));
-                fwrite(inputBuffer, sizeof(char), readBytes, outputFile);
-                memset(inputBuffer, 0, BUFFER_SIZE);
+        unsigned char request[FRAME_HEADER_SIZE + sizeof(uint64_t)];
+        FrameHeader header;
+        header.opcode = OPCODE_STREAM;
+        header.status = STATUS_OK;
+        header.requestId = (uint32_t) i + 1;
+        header.payloadLength = sizeof(uint64_t);
+        encodeFrameHeader(&header, request);
+        encodeUint64(STREAM_LENGTH, request + FRAME_HEADER_SIZE);
+        if ( sendAll(tcpSocketFileDescriptor, request, sizeof(request)) == -1 ) {
+            fprintf(stderr, "[ERROR] Failed to start stream #%d: %s\n", i + 1, strerror(errno));
+            result = -1;
+        }
+        fcntl(tcpSocketFileDescriptor, F_SETFL, fcntl(tcpSocketFileDescriptor, F_GETFL) | O_NONBLOCK);
+    }
 
-                if ( readBytes < BUFFER_SIZE ) {
+    fprintf(stderr, "[INFO] Measuring the TCP throughput from the server over %d stream(s) for %.1f s.\n", nStreams, duration);
+    double startTime = getMonotonicSeconds();
+    double reportTime = startTime;
+    double endTime = startTime + duration;
+    double now = startTime;
+    while ( result == 0 && now < endTime ) {
+        double wakeTime = reportTime + interval < endTime ? reportTime + interval : endTime;
+        int timeout = (int) ceil((wakeTime - now) * 1000);
+        if ( poll(pollFileDescriptors, nStreams, timeout) == -1 && errno != EINTR ) {
+            fprintf(stderr, "[ERROR] Failed to wait for events: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+
+        for ( i = 0; i < nStreams; ++ i ) {
+            if ( !(pollFileDescriptors[i].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+                continue;
+            }
+            ssize_t readBytes = recv(pollFileDescriptors[i].fd, receiveBuffer, RECEIVE_BUFFER_SIZE, 0);
+            if ( readBytes == 0 || (readBytes == -1 && errno != EAGAIN && errno != EINTR) ) {
+                fprintf(stderr, "[ERROR] Stream #%d was closed by the server.\n", i + 1);
+                result = -1;
+                break;
+            }
+            if ( readBytes <= 0 ) {
+                continue;
+            }
+
+            // Only the payload counts, the response header is checked once
+            size_t headerBytes = 0;
+            if ( headerLengths[i] < FRAME_HEADER_SIZE ) {
+                headerBytes = FRAME_HEADER_SIZE - headerLengths[i] < (size_t) readBytes ? FRAME_HEADER_SIZE - headerLengths[i] : (size_t) readBytes;
+                memcpy(headers[i] + headerLengths[i], receiveBuffer, headerBytes);
+                headerLengths[i] += headerBytes;
+                if ( headerLengths[i] == FRAME_HEADER_SIZE && headers[i][1] != STATUS_OK ) {
+                    fprintf(stderr, "[ERROR] Server rejected stream #%d with status %d.\n", i + 1, headers[i][1]);
+                    result = -1;
                     break;
                 }
             }
-            fclose(outputFile);
-        } else {
-            // Receive a message from client
-            int readBytes = recv(tcpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0);
-            if ( readBytes < 0 ) {
-                fprintf(stderr, "[ERROR] An error occurred while receiving message from the server: %s\nThe connection is going to close.\n", strerror(errno));
+            intervalBytes[i] += (uint64_t) readBytes - headerBytes;
+        }
+
+        now = getMonotonicSeconds();
+        if ( now >= reportTime + interval || now >= endTime ) {
+            uint64_t sumBytes = 0;
+            for ( i = 0; i < nStreams; ++ i ) {
+                if ( nStreams > 1 ) {
+                    char label[8];
+                    snprintf(label, sizeof(label), "[%3d]", i + 1);
+                    printThroughput(label, reportTime - startTime, now - startTime, intervalBytes[i]);
+                }
+                sumBytes += intervalBytes[i];
+                totalBytes[i] += intervalBytes[i];
+                intervalBytes[i] = 0;
+            }
+            printThroughput(nStreams > 1 ? "[SUM]" : "[  1]", reportTime - startTime, now - startTime, sumBytes);
+            reportTime = now;
+        }
+    }
+
+    if ( result == 0 ) {
+        uint64_t sumBytes = 0;
+        printf("- - - - - - - - - - - - - - - - - - - - - - - - -\n");
+        for ( i = 0; i < nStreams; ++ i ) {
+            if ( nStreams > 1 ) {
+                char label[8];
+                snprintf(label, sizeof(label), "[%3d]", i + 1);
+                printThroughput(label, 0, now - startTime, totalBytes[i]);
+            }
+            sumBytes += totalBytes[i];
+        }
+        printThroughput(nStreams > 1 ? "[SUM]" : "[  1]", 0, now - startTime, sumBytes);
+    }
+
+    // Closing the connections ends the streams
+    for ( i = 0; i < nStreams; ++ i ) {
+        if ( pollFileDescriptors[i].fd != -1 ) {
+            close(pollFileDescriptors[i].fd);
+        }
+    }
+    free(receiveBuffer);
+    return result;
+}
+
+/**
+ * Measure a UDP path at a target bitrate. Every datagram carries its sequence number and
+ * the time it was sent, so the echoes tell the goodput, the loss, the datagrams which
+ * arrived out of order and the jitter as defined in RFC 3550.
+ * @param  pServerSocketAddress the address of the server
+ * @param  bitrate              the number of bits to send per second
+ * @param  datagramSize         the size of every datagram
+ * @param  duration             the number of seconds to send
+ * @param  interval             the number of seconds between reports
+ * @return -1 if the socket failed
+ */
+int measureUdpThroughput(const struct sockaddr_in* pServerSocketAddress, double bitrate, size_t datagramSize,
+                         double duration, double interval) {
+    int udpSocketFileDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( udpSocketFileDescriptor == -1 ||
+         connect(udpSocketFileDescriptor, (const struct sockaddr *) pServerSocketAddress, sizeof(struct sockaddr)) == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create UDP socket: %s\n", strerror(errno));
+        if ( udpSocketFileDescriptor != -1 ) {
+            close(udpSocketFileDescriptor);
+        }
+        return -1;
+    }
+
+    // Upper case text survives the conversion of the server unchanged
+    char datagram[BUFFER_SIZE + 1];
+    memset(datagram, 'X', sizeof(datagram));
+
+    uint64_t nSent = 0;
+    uint64_t nReceived = 0;
+    uint64_t nReordered = 0;
+    uint64_t receivedBytes = 0;
+    uint64_t intervalReceived = 0;
+    uint64_t intervalReordered = 0;
+    uint64_t intervalBytes = 0;
+    uint64_t nextExpected = 0;          // one past the highest sequence number received
+    uint64_t intervalExpected = 0;      // nextExpected when the interval started
+    double jitter = 0;
+    double previousTransit = -1;
+
+    fprintf(stderr, "[INFO] Measuring the UDP throughput at %.3f Mbit/s with %lu-byte datagrams for %.1f s.\n",
+        bitrate / 1e6, (unsigned long) datagramSize, duration);
+    double gap = datagramSize * 8 / bitrate;
+    double startTime = getMonotonicSeconds();
+    double reportTime = startTime;
+    double endTime = startTime + duration;
+    double nextSendTime = startTime;
+    double now = startTime;
+    while ( now < endTime + UDP_GRACE_SECONDS ) {
+        // Send the datagrams which are due, a late sender catches up to keep the bitrate
+        while ( now < endTime && nextSendTime <= now ) {
+            char header[DATAGRAM_HEADER_SIZE + 1];
+            snprintf(header, sizeof(header), "%016llX%016llX", (unsigned long long) nSent,
+                (unsigned long long) (getMonotonicSeconds() * 1e9));
+            memcpy(datagram, header, DATAGRAM_HEADER_SIZE);
+            if ( send(udpSocketFileDescriptor, datagram, datagramSize, 0) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
                 break;
             }
-            fprintf(stderr, "[INFO] Received a message from server: %s\n", inputBuffer);
-            memset(inputBuffer, 0, BUFFER_SIZE);
+            ++ nSent;
+            nextSendTime += gap;
         }
-    } while ( 1 );
 
-    /*
-     * Close socket for client.
-     */
-    close(tcpSocketFileDescriptor);
+        double wakeTime = now < endTime ? nextSendTime : endTime + UDP_GRACE_SECONDS;
+        if ( reportTime + interval < wakeTime ) {
+            wakeTime = reportTime + interval;
+        }
+        struct timespec timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_nsec = 0;
+        if ( wakeTime > now ) {
+            timeout.tv_sec = (time_t) (wakeTime - now);
+            timeout.tv_nsec = (long) ((wakeTime - now - timeout.tv_sec) * 1e9);
+        }
+        struct pollfd pollFileDescriptor;
+        pollFileDescriptor.fd = udpSocketFileDescriptor;
+        pollFileDescriptor.events = POLLIN;
+        pollFileDescriptor.revents = 0;
+        ppoll(&pollFileDescriptor, 1, &timeout, NULL);
+
+        // Receive the echoes
+        char reply[BUFFER_SIZE + 1];
+        ssize_t readBytes = 0;
+        while ( (readBytes = recv(udpSocketFileDescriptor, reply, BUFFER_SIZE, 0)) >= DATAGRAM_HEADER_SIZE ) {
+            double receiveTime = getMonotonicSeconds();
+            char sequenceText[17] = {0};
+            char timeText[17] = {0};
+            memcpy(sequenceText, reply, 16);
+            memcpy(timeText, reply + 16, 16);
+            uint64_t sequence = strtoull(sequenceText, NULL, 16);
+            double sendTime = strtoull(timeText, NULL, 16) / 1e9;
 
-    return EXIT_SUCCESS;
+            if ( sequence < nextExpected ) {
+                ++ intervalReordered;
+            } else {
+                nextExpected = sequence + 1;
+            }
+            ++ intervalReceived;
+            intervalBytes += (uint64_t) readBytes;
+
+            // J = J + (|D(i-1,i)| - J) / 16, where D is the difference of the transit times
+            double transit = receiveTime - sendTime;
+            if ( previousTransit >= 0 ) {
+                jitter += (fabs(transit - previousTransit) - jitter) / 16;
+            }
+            previousTransit = transit;
+        }
+
+        now = getMonotonicSeconds();
+        if ( now >= reportTime + interval || now >= endTime + UDP_GRACE_SECONDS ) {
+            uint64_t expected = nextExpected - intervalExpected;
+            uint64_t nLost = expected > intervalReceived - intervalReordered ? expected - (intervalReceived - intervalReordered) : 0;
+            printThroughput("[  1]", reportTime - startTime, now - startTime, intervalBytes);
+            printf("      jitter %.3f ms  lost %llu/%llu (%.2f%%)  reordered %llu\n", jitter * 1e3,
+                (unsigned long long) nLost, (unsigned long long) expected, expected == 0 ? 0 : 100.0 * nLost / expected,
+                (unsigned long long) intervalReordered);
+
+            nReceived += intervalReceived;
+            nReordered += intervalReordered;
+            receivedBytes += intervalBytes;
+            intervalReceived = 0;
+            intervalReordered = 0;
+            intervalBytes = 0;
+            intervalExpected = nextExpected;
+            reportTime = now;
+        }
+    }
+
+    uint64_t nLost = nSent > nReceived ? nSent - nReceived : 0;
+    printf("- - - - - - - - - - - - - - - - - - - - - - - - -\n");
+    printThroughput("[  1]", 0, duration, receivedBytes);
+    printf("      jitter %.3f ms  lost %llu/%llu (%.2f%%)  reordered %llu\n", jitter * 1e3,
+        (unsigned long long) nLost, (unsigned long long) nSent, nSent == 0 ? 0 : 100.0 * nLost / nSent,
+        (unsigned long long) nReordered);
+
+    close(udpSocketFileDescriptor);
+    return 0;
+}
+
+/**
+ * Read the monotonic clock.
+ * @return the current time in seconds
+ */
+double getMonotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Print a line of a throughput report.
+ * @param label     the stream the line is about
+ * @param startTime the start of the interval, in seconds since the test started
+ * @param endTime   the end of the interval, in seconds since the test started
+ * @param bytes     the number of payload bytes received in the interval
+ */
+void printThroughput(const char* label, double startTime, double endTime, uint64_t bytes) {
+    double seconds = endTime > startTime ? endTime - startTime : 1;
+    printf("%s %5.1f-%5.1f s  %10.2f MB  %10.2f Mbit/s\n", label, startTime, endTime, bytes / 1e6, bytes * 8 / seconds / 1e6);
 }
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "hw5_connection.h"
+#include "hw5_log.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+
+#define MIN_TABLE_CAPACITY      1024
+#define NANOSECONDS_PER_SECOND  1000000000ULL
+
+/**
+ * The limits of all workers and the number of connections they hold, which is
+ * updated with atomic operations since every worker admits its own clients.
+ */
+static ConnectionLimits connectionLimits = {
+    0,
+    DEFAULT_IDLE_TIMEOUT * NANOSECONDS_PER_SECOND,
+    DEFAULT_READ_TIMEOUT * NANOSECONDS_PER_SECOND,
+    DEFAULT_WRITE_TIMEOUT * NANOSECONDS_PER_SECOND
+};
+static int nConnections = 0;
+
+/**
+ * Prototypes of functions.
+ */
+static void* takeConnection(ConnectionTable* pTable);
+static int growTable(ConnectionTable* pTable, int socketFileDescriptor);
+
+/**
+ * Initialize the empty connections of a worker.
+ * @param pTable     the table to initialize
+ * @param objectSize the size of a connection of the I/O engine
+ */
+void createConnectionTable(ConnectionTable* pTable, size_t objectSize) {
+    memset(pTable, 0, sizeof(ConnectionTable));
+    // A free connection holds the pointer of the next free connection
+    pTable->objectSize = objectSize < sizeof(void*) ? sizeof(void*) : objectSize;
+}
+
+/**
+ * Create the connection of an accepted socket.
+ * @param  pTable               the connections of the worker
+ * @param  socketFileDescriptor the file descriptor of the socket
+ * @return the zeroed connection, NULL if the memory is exhausted
+ */
+void* addConnection(ConnectionTable* pTable, int socketFileDescriptor) {
+    if ( socketFileDescriptor >= pTable->capacity && growTable(pTable, socketFileDescriptor) == -1 ) {
+        return NULL;
+    }
+    void* pConnection = takeConnection(pTable);
+    if ( pConnection == NULL ) {
+        return NULL;
+    }
+    memset(pConnection, 0, pTable->objectSize);
+    pTable->connections[socketFileDescriptor] = pConnection;
+    ++ pTable->nConnections;
+    return pConnection;
+}
+
+/**
+ * Remove a connection from the index when its socket is closed. The connection itself is
+ * kept until freeConnection(), so it may be released after pending work is done.
+ * @param pTable               the connections of the worker
+ * @param socketFileDescriptor the file descriptor of the socket
+ */
+void removeConnection(ConnectionTable* pTable, int socketFileDescriptor) {
+    if ( socketFileDescriptor >= 0 && socketFileDescriptor < pTable->capacity && pTable->connections[socketFileDescriptor] != NULL ) {
+        pTable->connections[socketFileDescriptor] = NULL;
+        -- pTable->nConnections;
+    }
+}
+
+/**
+ * Give a removed connection back to the slabs of the worker.
+ * @param pTable      the connections of the worker
+ * @param pConnection the connection to free
+ */
+void freeConnection(ConnectionTable* pTable, void* pConnection) {
+    memcpy(pConnection, &pTable->pFreeConnections, sizeof(void*));
+    pTable->pFreeConnections = pConnection;
+}
+
+/**
+ * Format the address of a peer once, so logs do not format it again for every line.
+ * @param pSocketAddress the address of the peer
+ * @param name           the buffer which receives PEER_NAME_SIZE bytes at most
+ */
+void formatPeerName(const struct sockaddr_in* pSocketAddress, char* name) {
+    char address[INET_ADDRSTRLEN] = {0};
+    inet_ntop(AF_INET, &pSocketAddress->sin_addr, address, sizeof(address));
+    snprintf(name, PEER_NAME_SIZE, "%s:%d", address, ntohs(pSocketAddress->sin_port));
+}
+
+/**
+ * Set the limits of TCP connections, it is called before the workers start.
+ * @param maxConnections the most connections the server holds, 0 if they are unlimited
+ * @param idleSeconds    the idle timeout, 0 disables it
+ * @param readSeconds    the time a client has to complete a request, 0 disables it
+ * @param writeSeconds   the time a client has to take more of a response, 0 disables it
+ */
+void configureConnectionLimits(int maxConnections, int idleSeconds, int readSeconds, int writeSeconds) {
+    connectionLimits.maxConnections = maxConnections;
+    connectionLimits.idleTimeout = (uint64_t) idleSeconds * NANOSECONDS_PER_SECOND;
+    connectionLimits.readTimeout = (uint64_t) readSeconds * NANOSECONDS_PER_SECOND;
+    connectionLimits.writeTimeout = (uint64_t) writeSeconds * NANOSECONDS_PER_SECOND;
+}
+
+/**
+ * Get the limits of TCP connections.
+ * @return the limits, they do not change while the workers run
+ */
+const ConnectionLimits* getConnectionLimits(void) {
+    return &connectionLimits;
+}
+
+/**
+ * Count an accepted client unless the server holds as many connections as it may.
+ * @return TRUE if the client is admitted, it is given back with dismissConnection()
+ */
+int admitConnection(void) {
+    int nCurrent = __atomic_add_fetch(&nConnections, 1, __ATOMIC_RELAXED);
+    if ( connectionLimits.maxConnections > 0 && nCurrent > connectionLimits.maxConnections ) {
+        __atomic_sub_fetch(&nConnections, 1, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Give back the place of an admitted client whose socket is closed.
+ */
+void dismissConnection(void) {
+    __atomic_sub_fetch(&nConnections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Turn away a client which is over the limit. It gets a frame with STATUS_BUSY at once
+ * instead of waiting in the backlog, the send never blocks and may fail if the socket
+ * is gone already.
+ * @param socketFileDescriptor the file descriptor of the accepted socket, it is closed
+ * @param peerName             the printable address of the client
+ */
+void rejectConnection(int socketFileDescriptor, const char* peerName) {
+    FrameHeader response;
+    response.opcode = 0;
+    response.status = STATUS_BUSY;
+    response.requestId = 0;
+    response.payloadLength = 0;
+    unsigned char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(&response, header);
+
+    send(socketFileDescriptor, header, sizeof(header), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(socketFileDescriptor);
+    addStat(STAT_REJECTIONS, 1);
+    LOG_WARN("[TCP] Rejected the client %s, the server holds %d connections.\n", peerName, connectionLimits.maxConnections);
+}
+
+/**
+ * Compute when a timeout which started at some time expires.
+ * @param  startTime the monotonic time in nanoseconds when the timeout started
+ * @param  timeout   the timeout in nanoseconds, 0 if it is disabled
+ * @return the deadline, UINT64_MAX if the timeout is disabled
+ */
+uint64_t getTimeoutDeadline(uint64_t startTime, uint64_t timeout) {
+    return timeout == 0 ? UINT64_MAX : startTime + timeout;
+}
+
+/**
+ * Take a free connection, or carve a new one.
+ * @param  pTable the connections of the worker
+ * @return the connection, NULL if the memory is exhausted
+ */
+static void* takeConnection(ConnectionTable* pTable) {
+    void* pConnection = pTable->pFreeConnections;
+    if ( pConnection != NULL ) {
+        memcpy(&pTable->pFreeConnections, pConnection, sizeof(void*));
+        return pConnection;
+    }
+
+    if ( pTable->nSlabRemaining == 0 ) {
+        pTable->pSlabCursor = (unsigned char*) malloc(pTable->objectSize * CONNECTION_SLAB_SIZE);
+        if ( pTable->pSlabCursor == NULL ) {
+            LOG_WARN("Failed to allocate a slab of connections: %s\n", strerror(errno));
+            return NULL;
+        }
+        pTable->nSlabRemaining = CONNECTION_SLAB_SIZE;
+    }
+    pConnection = pTable->pSlabCursor;
+    pTable->pSlabCursor += pTable->objectSize;
+    -- pTable->nSlabRemaining;
+    return pConnection;
+}
+
+/**
+ * Grow the index, so it holds a file descriptor.
+ * @param  pTable               the connections of the worker
+ * @param  socketFileDescriptor the file descriptor which has to fit
+ * @return -1 if the memory is exhausted
+ */
+static int growTable(ConnectionTable* pTable, int socketFileDescriptor) {
+    int capacity = pTable->capacity < MIN_TABLE_CAPACITY ? MIN_TABLE_CAPACITY : pTable->capacity;
+    while ( capacity <= socketFileDescriptor ) {
+        capacity *= 2;
+    }
+
+    void** connections = (void**) realloc(pTable->connections, sizeof(void*) * capacity);
+    if ( connections == NULL ) {
+        LOG_WARN("Failed to grow the connections to %d sockets: %s\n", capacity, strerror(errno));
+        return -1;
+    }
+    memset(connections + pTable->capacity, 0, sizeof(void*) * (capacity - pTable->capacity));
+    pTable->connections = connections;
+    pTable->capacity = capacity;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef HW5_CONNECTION_H
+#define HW5_CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/**
+ * The size of the printable address of a peer, "255.255.255.255:65535" and the end character.
+ */
+#define PEER_NAME_SIZE          (INET_ADDRSTRLEN + 6)
+
+/**
+ * The number of connections carved from each slab.
+ */
+#define CONNECTION_SLAB_SIZE    64
+
+/**
+ * The default limits of TCP connections, a timeout of 0 disables it.
+ * - idle:  no request is in progress and nothing is left to send.
+ * - read:  a request started to arrive but is not complete yet.
+ * - write: a response is waiting for the client to make room in its socket.
+ */
+#define DEFAULT_BACKLOG         1024
+#define DEFAULT_IDLE_TIMEOUT    60
+#define DEFAULT_READ_TIMEOUT    10
+#define DEFAULT_WRITE_TIMEOUT   30
+
+/**
+ * The connections of a worker, indexed by the file descriptors of their sockets. The
+ * objects are carved from slabs and recycled through a free list, slabs are kept for the
+ * lifetime of the worker, so accepting a client does not call malloc() in the steady state.
+ * The index only grows, it follows the largest file descriptor the worker has seen.
+ */
+typedef struct {
+    size_t          objectSize;
+    void*           pFreeConnections;
+    unsigned char*  pSlabCursor;
+    int             nSlabRemaining;
+    void**          connections;            // NULL for a file descriptor without a connection
+    int             capacity;
+    int             nConnections;           // the connections in the index
+} ConnectionTable;
+
+/**
+ * The limits of TCP connections shared by all workers, timeouts are in nanoseconds.
+ */
+typedef struct {
+    int         maxConnections;         // 0 if the number of connections is unlimited
+    uint64_t    idleTimeout;
+    uint64_t    readTimeout;
+    uint64_t    writeTimeout;
+} ConnectionLimits;
+
+/**
+ * Prototypes of functions.
+ */
+void createConnectionTable(ConnectionTable* pTable, size_t objectSize);
+void* addConnection(ConnectionTable* pTable, int socketFileDescriptor);
+void removeConnection(ConnectionTable* pTable, int socketFileDescriptor);
+void freeConnection(ConnectionTable* pTable, void* pConnection);
+void formatPeerName(const struct sockaddr_in* pSocketAddress, char* name);
+void configureConnectionLimits(int maxConnections, int idleSeconds, int readSeconds, int writeSeconds);
+const ConnectionLimits* getConnectionLimits(void);
+int admitConnection(void);
+void dismissConnection(void);
+void rejectConnection(int socketFileDescriptor, const char* peerName);
+uint64_t getTimeoutDeadline(uint64_t startTime, uint64_t timeout);
+
+/**
+ * Find the connection of a socket.
+ * @param  pTable               the connections of the worker
+ * @param  socketFileDescriptor the file descriptor of the socket
+ * @return the connection, NULL if the socket has none
+ */
+static inline void* findConnection(const ConnectionTable* pTable, int socketFileDescriptor) {
+    return socketFileDescriptor >= 0 && socketFileDescriptor < pTable->capacity ? pTable->connections[socketFileDescriptor] : NULL;
+}
+
+#endif
@@ -0,0 +1,1144 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for accept4() and splice()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "hw5_log.h"
+#include "hw5_restart.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+#include "hw5_timer.h"
+
+#define MAX_EPOLL_EVENTS        256
+#define MAX_SENDFILE_SIZE       0x7ffff000  // the most bytes sendfile() transfers in a single call
+#define PIPE_CAPACITY           65536       // the default capacity of a pipe on Linux
+#define MIN_RECEIVE_SIZE        1024        // the least room offered to recv(), the input buffer grows for larger frames
+
+/**
+ * The share of a connection in a turn of the event loop. A connection which uses
+ * up its share is resumed after the other ready connections had their turn.
+ */
+#define MAX_BYTES_PER_TURN      262144
+#define MAX_REQUESTS_PER_TURN   16
+
+/**
+ * A file is checked against the page cache one window at a time, a window which is
+ * not cached is read by the disk I/O pool before it is sent.
+ */
+#define PREFETCH_WINDOW_SIZE    1048576
+
+/**
+ * The number of datagrams received with one recvmmsg() and answered with one sendmmsg().
+ */
+#define UDP_BATCH_SIZE          64
+
+/**
+ * Results of the steps which move data for a connection.
+ */
+#define PROGRESS_FAILED         -1  // the connection has to be closed
+#define PROGRESS_DONE           0   // the step is completed
+#define PROGRESS_BLOCKED        1   // the socket is full or empty, wait for epoll
+#define PROGRESS_YIELD          2   // the share of this turn is used up
+#define PROGRESS_OFFLOADED      3   // waiting for the disk I/O pool, the completion resumes the connection
+
+/**
+ * The states of a TCP connection.
+ */
+typedef enum {
+    CONNECTION_IDLE,        // waiting for the next request
+    CONNECTION_DRAINING,    // sending the response in the output buffer, then the cached content
+    CONNECTION_STREAMING    // sending the response header, then the file from fileOffset
+} ConnectionState;
+
+/**
+ * A TCP client served by the epoll engine.
+ */
+typedef struct Connection {
+    int                 socketFileDescriptor;
+    char                peerName[PEER_NAME_SIZE];   // formatted once when the client is accepted
+    uint64_t            connectedTime;
+    ConnectionState     state;
+
+    /**
+     * The timer is armed for the earliest deadline the connection may have, when it
+     * fires the deadline of the current state is checked against the activity.
+     */
+    TimerEntry          timer;
+    uint64_t            lastActivityTime;
+    uint64_t            requestArrivalTime;     // when the first bytes of an incomplete request arrived
+
+    /**
+     * Pipelined requests wait in the input buffer until the previous response is sent.
+     * Both buffers go back to the pool of the worker once they are empty.
+     */
+    ByteBuffer          input;
+    size_t              frameLength;            // the bytes of the first request, as far as they are known
+
+    ByteBuffer          output;
+    const unsigned char* pContent;              // the body of a small cached file, NULL if there is none
+    size_t              contentOffset;
+    size_t              contentLength;
+    CachedFile*         pCachedFile;            // the owner of the content or the file, NULL if there is none
+    ZeroCopyResponse*   pZeroCopyResponse;      // NULL if the response is copied into the kernel
+
+    int                 fileFileDescriptor;     // -1 if no file is being streamed
+    off_t               fileOffset;
+    off_t               fileEnd;
+    int                 pipeFileDescriptors[2]; // only created if sendfile() is not supported
+    size_t              pipedBytes;
+    off_t               cachedEnd;              // the file is in the page cache up to this offset
+
+    /**
+     * Events of a connection which waits for the disk I/O pool are ignored, it tries
+     * every step again when the job completes.
+     */
+    OffloadJob          offloadJob;
+    int                 isOffloaded;
+
+    /**
+     * A closed connection whose zero-copy sends are still read by the kernel lingers
+     * with its socket shut down, until the error queue reports them done.
+     */
+    const TransmitPolicy* pPolicy;
+    ZeroCopyState       zeroCopy;
+    int                 isLingering;
+
+    int                 latencyHistogram;       // HISTOGRAM_NONE if the latency of the response is recorded
+    uint64_t            requestStartTime;
+
+    int                 isQueued;
+    int                 isClosed;
+    struct Connection*  pNextReady;
+} Connection;
+
+/**
+ * The buffers of a batch of UDP datagrams, each datagram is converted in place and
+ * answered from the same slot.
+ */
+typedef struct {
+    struct mmsghdr      requests[UDP_BATCH_SIZE];
+    struct mmsghdr      replies[UDP_BATCH_SIZE];
+    struct iovec        requestVectors[UDP_BATCH_SIZE];
+    struct iovec        replyVectors[UDP_BATCH_SIZE];
+    struct sockaddr_in  clientSocketAddresses[UDP_BATCH_SIZE];
+    char                buffers[UDP_BATCH_SIZE][BUFFER_SIZE];
+} DatagramBatch;
+
+/**
+ * The event loop of a worker.
+ */
+typedef struct {
+    int         epollFileDescriptor;
+    int         tcpSocketFileDescriptor;
+    int         udpSocketFileDescriptor;
+    DatagramBatch* pDatagramBatch;
+    OffloadCompletions completions;
+    ConnectionTable connections;
+    const TransmitPolicy* pPolicy;
+
+    /**
+     * The timeouts of connections, the time is read once for each turn of the loop.
+     */
+    TimerWheel  timers;
+    const ConnectionLimits* pLimits;
+    uint64_t    loopTime;
+
+    /**
+     * A hot restart makes the worker stop accepting, then it exits once its connections are closed.
+     */
+    int         drainFileDescriptor;
+    int         isDraining;
+
+    /**
+     * The inotify instance of the file cache, -1 if cached files are checked with stat().
+     */
+    int         fileEventsFileDescriptor;
+
+    /**
+     * Connections which still have work to do but yielded to others.
+     */
+    Connection* pReadyHead;
+    Connection* pReadyTail;
+} Reactor;
+
+/**
+ * Prototypes of functions.
+ */
+static int registerSocket(int epollFileDescriptor, int socketFileDescriptor, uint32_t events);
+static void acceptClients(Reactor* pReactor);
+static void handleDatagrams(Reactor* pReactor);
+static void startDraining(Reactor* pReactor);
+static void handleCompletions(Reactor* pReactor);
+static void serveConnection(Reactor* pReactor, Connection* pConnection);
+static int handleFrame(Connection* pConnection);
+static int flushOutput(Connection* pConnection);
+static int streamFile(Connection* pConnection, long* pBudget);
+static int prefetchFile(Connection* pConnection);
+static ssize_t spliceFile(Connection* pConnection, size_t length);
+static void enqueueReady(Reactor* pReactor, Connection* pConnection);
+static void finishLatency(Connection* pConnection);
+static int checkSocketErrors(Connection* pConnection);
+static uint64_t getConnectionDeadline(Reactor* pReactor, Connection* pConnection);
+static void armConnectionTimer(Reactor* pReactor, Connection* pConnection);
+static void expireConnection(TimerEntry* pEntry, void* pArgument);
+static void closeConnection(Reactor* pReactor, Connection* pConnection);
+static void destroyConnection(Reactor* pReactor, Connection* pConnection);
+
+/**
+ * Connections handler for the server.
+ *
+ * All sockets are non-blocking and registered in edge-triggered mode, so every
+ * notification has to be drained until the kernel reports EAGAIN. A connection
+ * only moves as much data as its socket accepts, then waits for EPOLLOUT, so a
+ * large download never stalls the other clients. Idle and stalled clients are
+ * closed by the timers of the worker. When a new process takes over the listeners,
+ * the worker stops accepting and returns once its connections are closed.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param  pPolicy                 the transmit policy of the TCP listener
+ * @return -1 if a severe error occurred in this procedure, 0 if the worker drained
+ */
+int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, const TransmitPolicy* pPolicy) {
+    Reactor reactor;
+    memset(&reactor, 0, sizeof(reactor));
+    reactor.tcpSocketFileDescriptor = tcpSocketFileDescriptor;
+    reactor.udpSocketFileDescriptor = udpSocketFileDescriptor;
+    reactor.pPolicy = pPolicy;
+    reactor.pLimits = getConnectionLimits();
+    reactor.loopTime = getMonotonicTime();
+    reactor.drainFileDescriptor = getDrainFileDescriptor();
+    reactor.fileEventsFileDescriptor = getFileCacheEventDescriptor();
+    createConnectionTable(&reactor.connections, sizeof(Connection));
+    createTimerWheel(&reactor.timers, reactor.loopTime);
+
+    /*
+     * Create the epoll instance which keeps the interest list in the kernel.
+     * Function Prototype: int epoll_create1(int flags);
+     * Defined in sys/epoll.h
+     *
+     * @param flags EPOLL_CLOEXEC closes the descriptor automatically on execve()
+     * @return -1 if the epoll instance is failed to create
+     */
+    reactor.epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC);
+    if ( reactor.epollFileDescriptor == -1 ) {
+        return -1;
+    }
+    reactor.pDatagramBatch = (DatagramBatch*) malloc(sizeof(DatagramBatch));
+    if ( reactor.pDatagramBatch == NULL ) {
+        close(reactor.epollFileDescriptor);
+        return -1;
+    }
+    if ( createOffloadCompletions(&reactor.completions) == -1 ) {
+        free(reactor.pDatagramBatch);
+        close(reactor.epollFileDescriptor);
+        return -1;
+    }
+
+    /*
+     * Events carry the file descriptor, connections are found in the table of the worker.
+     */
+    if ( registerSocket(reactor.epollFileDescriptor, tcpSocketFileDescriptor, EPOLLIN | EPOLLET) == -1 ||
+         registerSocket(reactor.epollFileDescriptor, udpSocketFileDescriptor, EPOLLIN | EPOLLET) == -1 ||
+         registerSocket(reactor.epollFileDescriptor, reactor.completions.eventFileDescriptor, EPOLLIN | EPOLLET) == -1 ||
+         (reactor.drainFileDescriptor != -1 &&
+          registerSocket(reactor.epollFileDescriptor, reactor.drainFileDescriptor, EPOLLIN | EPOLLET) == -1) ||
+         (reactor.fileEventsFileDescriptor != -1 &&
+          registerSocket(reactor.epollFileDescriptor, reactor.fileEventsFileDescriptor, EPOLLIN | EPOLLET) == -1) ) {
+        free(reactor.pDatagramBatch);
+        close(reactor.completions.eventFileDescriptor);
+        close(reactor.epollFileDescriptor);
+        return -1;
+    }
+
+    /**
+     * Handle TCP and UDP connections.
+     */
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while ( TRUE ) {
+        /*
+         * Wait for an activity on one of the sockets, wait indefinitely unless some connections yielded
+         * or some timers are scheduled.
+         * Function Prototype: int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+         * Defined in sys/epoll.h
+         *
+         * @param epfd      the file descriptor of the epoll instance
+         * @param events    the buffer which receives the ready events
+         * @param maxevents the capacity of the events buffer
+         * @param timeout   the number of milliseconds to block
+         * @return the number of file descriptors ready for the requested I/O
+         */
+        int timeout = reactor.pReadyHead != NULL ? 0 : (reactor.timers.nTimers > 0 ? TIMER_TICK_MS : -1);
+        int nEvents = epoll_wait(reactor.epollFileDescriptor, events, MAX_EPOLL_EVENTS, timeout);
+        if ( nEvents == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            LOG_ERROR("An error occurred while monitoring sockets: %s\n", strerror(errno));
+            free(reactor.pDatagramBatch);
+            close(reactor.completions.eventFileDescriptor);
+            close(reactor.epollFileDescriptor);
+            return -1;
+        }
+        reactor.loopTime = getMonotonicTime();
+        advanceTimerWheel(&reactor.timers, reactor.loopTime, expireConnection, &reactor);
+
+        int i = 0;
+        for ( i = 0; i < nEvents; ++ i ) {
+            int fileDescriptor = events[i].data.fd;
+
+            if ( fileDescriptor == reactor.tcpSocketFileDescriptor ) {
+                acceptClients(&reactor);
+            } else if ( fileDescriptor == reactor.udpSocketFileDescriptor ) {
+                handleDatagrams(&reactor);
+            } else if ( fileDescriptor == reactor.completions.eventFileDescriptor ) {
+                handleCompletions(&reactor);
+            } else if ( fileDescriptor == reactor.drainFileDescriptor ) {
+                startDraining(&reactor);
+            } else if ( fileDescriptor == reactor.fileEventsFileDescriptor ) {
+                handleFileCacheEvents();
+            } else {
+                Connection* pConnection = (Connection*) findConnection(&reactor.connections, fileDescriptor);
+
+                // EPOLLERR also reports the notifications of zero-copy sends in the error queue
+                int isFailed = pConnection != NULL && ((events[i].events & EPOLLHUP) ||
+                    ((events[i].events & EPOLLERR) && checkSocketErrors(pConnection) == -1));
+
+                if ( pConnection == NULL ) {
+                    // The connection was closed by an earlier event of this batch
+                } else if ( pConnection->isLingering ) {
+                    if ( pConnection->zeroCopy.nPending == 0 ) {
+                        destroyConnection(&reactor, pConnection);
+                    }
+                } else if ( pConnection->isOffloaded ) {
+                    // The job still uses the connection, it is served when the job completes
+                } else if ( isFailed ) {
+                    closeConnection(&reactor, pConnection);
+                } else {
+                    serveConnection(&reactor, pConnection);
+                }
+            }
+        }
+
+        /*
+         * Resume the connections which yielded, they may yield again for the next turn.
+         */
+        Connection* pConnection = reactor.pReadyHead;
+        reactor.pReadyHead = NULL;
+        reactor.pReadyTail = NULL;
+        while ( pConnection != NULL ) {
+            Connection* pNextConnection = pConnection->pNextReady;
+            pConnection->pNextReady = NULL;
+            pConnection->isQueued = FALSE;
+
+            if ( pConnection->isClosed ) {
+                freeConnection(&reactor.connections, pConnection);
+            } else if ( !pConnection->isLingering ) {
+                serveConnection(&reactor, pConnection);
+            }
+            pConnection = pNextConnection;
+        }
+
+        if ( reactor.isDraining && reactor.connections.nConnections == 0 ) {
+            free(reactor.pDatagramBatch);
+            close(reactor.completions.eventFileDescriptor);
+            close(reactor.epollFileDescriptor);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Register a non-blocking socket in the epoll instance with edge-triggered notifications.
+ * @param  epollFileDescriptor  the file descriptor of the epoll instance
+ * @param  socketFileDescriptor the file descriptor to register
+ * @param  events               the events to monitor
+ * @return -1 if the socket is failed to register
+ */
+static int registerSocket(int epollFileDescriptor, int socketFileDescriptor, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = socketFileDescriptor;
+
+    return epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, socketFileDescriptor, &event);
+}
+
+/**
+ * Accept all pending TCP connections.
+ * @param pReactor the event loop of the worker
+ */
+static void acceptClients(Reactor* pReactor) {
+    while ( TRUE ) {
+        // Establish connection with client
+        struct sockaddr_in clientSocketAddress;
+        socklen_t sockaddrSize = sizeof(clientSocketAddress);
+        int clientSocketFD = accept4(pReactor->tcpSocketFileDescriptor, (struct sockaddr *)(&clientSocketAddress),
+            &sockaddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if ( clientSocketFD == -1 ) {
+            if ( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                LOG_WARN("[TCP] Failed to accpet a socket from client: %s\n", strerror(errno));
+            }
+            return;
+        }
+        char peerName[PEER_NAME_SIZE];
+        formatPeerName(&clientSocketAddress, peerName);
+        if ( !admitConnection() ) {
+            rejectConnection(clientSocketFD, peerName);
+            continue;
+        }
+        LOG_INFO("[TCP] Connection established with %s\n", peerName);
+
+        Connection* pConnection = (Connection*) addConnection(&pReactor->connections, clientSocketFD);
+        if ( pConnection == NULL ) {
+            LOG_WARN("[TCP] Failed to allocate the connection for client: %s\n", peerName);
+            close(clientSocketFD);
+            dismissConnection();
+            continue;
+        }
+        pConnection->socketFileDescriptor = clientSocketFD;
+        memcpy(pConnection->peerName, peerName, sizeof(peerName));
+        pConnection->connectedTime = getMonotonicTime();
+        pConnection->state = CONNECTION_IDLE;
+        pConnection->fileFileDescriptor = -1;
+        pConnection->pipeFileDescriptors[0] = -1;
+        pConnection->pipeFileDescriptors[1] = -1;
+        pConnection->latencyHistogram = HISTOGRAM_NONE;
+        pConnection->offloadJob.pOwner = pConnection;
+        pConnection->offloadJob.pCompletions = &pReactor->completions;
+        pConnection->pPolicy = pReactor->pPolicy;
+        pConnection->zeroCopy.isEnabled = pReactor->pPolicy->zeroCopyThreshold > 0;
+        pConnection->timer.pOwner = pConnection;
+        pConnection->lastActivityTime = pReactor->loopTime;
+
+        // Register file descriptors for sockets, EPOLLOUT only fires when a full socket becomes writable again
+        if ( registerSocket(pReactor->epollFileDescriptor, clientSocketFD, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) == -1 ) {
+            LOG_WARN("[TCP] Failed to register the socket for client: %s: %s\n", peerName, strerror(errno));
+            close(clientSocketFD);
+            removeConnection(&pReactor->connections, clientSocketFD);
+            freeConnection(&pReactor->connections, pConnection);
+            dismissConnection();
+        } else {
+            armConnectionTimer(pReactor, pConnection);
+            addStat(STAT_CONNECTIONS_OPENED, 1);
+            LOG_INFO("[TCP] Socket #%d registered for the client: %s\n", clientSocketFD, peerName);
+        }
+    }
+}
+
+/**
+ * Reply to all pending UDP datagrams.
+ *
+ * Datagrams are received in batches with recvmmsg() and the replies of a batch are sent
+ * with a single sendmmsg(), so the cost of a system call is shared by the whole batch.
+ *
+ * @param pReactor the event loop of the worker
+ */
+static void handleDatagrams(Reactor* pReactor) {
+    DatagramBatch* pBatch = pReactor->pDatagramBatch;
+
+    while ( TRUE ) {
+        int i = 0;
+        for ( i = 0; i < UDP_BATCH_SIZE; ++ i ) {
+            pBatch->requestVectors[i].iov_base = pBatch->buffers[i];
+            pBatch->requestVectors[i].iov_len = BUFFER_SIZE;
+            memset(&pBatch->requests[i], 0, sizeof(struct mmsghdr));
+            pBatch->requests[i].msg_hdr.msg_name = &pBatch->clientSocketAddresses[i];
+            pBatch->requests[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            pBatch->requests[i].msg_hdr.msg_iov = &pBatch->requestVectors[i];
+            pBatch->requests[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /*
+         * Receive many messages from clients.
+         * Function Prototype: int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+         * Defined in sys/socket.h
+         *
+         * @param sockfd  the socket file descriptor
+         * @param msgvec  the headers which receive the datagrams and their senders
+         * @param vlen    the capacity of msgvec
+         * @param flags   the flags of recvmsg(), the socket is non-blocking already
+         * @param timeout NULL, the call returns as soon as the socket is empty
+         * @return the number of received datagrams, -1 if none is received
+         */
+        int nDatagrams = recvmmsg(pReactor->udpSocketFileDescriptor, pBatch->requests, UDP_BATCH_SIZE, 0, NULL);
+        if ( nDatagrams < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                LOG_ERROR("[UDP] An error occurred while receiving message: %s\n", strerror(errno));
+            }
+            return;
+        }
+        LOG_DEBUG("[UDP] Received a batch of %d message(s)\n", nDatagrams);
+
+        uint64_t receivedBytes = 0;
+        for ( i = 0; i < nDatagrams; ++ i ) {
+            receivedBytes += pBatch->requests[i].msg_len;
+            toUppercaseString(pBatch->buffers[i], pBatch->buffers[i], pBatch->requests[i].msg_len);
+
+            pBatch->replyVectors[i].iov_base = pBatch->buffers[i];
+            pBatch->replyVectors[i].iov_len = pBatch->requests[i].msg_len;
+            memset(&pBatch->replies[i], 0, sizeof(struct mmsghdr));
+            pBatch->replies[i].msg_hdr.msg_name = &pBatch->clientSocketAddresses[i];
+            pBatch->replies[i].msg_hdr.msg_namelen = pBatch->requests[i].msg_hdr.msg_namelen;
+            pBatch->replies[i].msg_hdr.msg_iov = &pBatch->replyVectors[i];
+            pBatch->replies[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // Send the replies, sendmmsg() stops at the first datagram which fails
+        int nSentDatagrams = 0;
+        uint64_t droppedBytes = 0;
+        while ( nSentDatagrams < nDatagrams ) {
+            int sentDatagrams = sendmmsg(pReactor->udpSocketFileDescriptor, pBatch->replies + nSentDatagrams,
+                nDatagrams - nSentDatagrams, 0);
+            if ( sentDatagrams == -1 && errno == EINTR ) {
+                continue;
+            }
+            if ( sentDatagrams == -1 ) {
+                struct sockaddr_in* pClientSocketAddress = &pBatch->clientSocketAddresses[nSentDatagrams];
+                LOG_ERROR("[UDP] An error occurred while sending message to the client %s:%d: %s\n",
+                    inet_ntoa(pClientSocketAddress->sin_addr), ntohs(pClientSocketAddress->sin_port), strerror(errno));
+                // Drop this reply, a client has to retry lost datagrams anyway
+                droppedBytes += pBatch->replyVectors[nSentDatagrams].iov_len;
+                sentDatagrams = 1;
+            }
+            nSentDatagrams += sentDatagrams;
+        }
+        addStat(STAT_DATAGRAMS, nDatagrams);
+        addStat(STAT_BYTES_IN, receivedBytes);
+        addStat(STAT_BYTES_OUT, receivedBytes - droppedBytes);
+
+        if ( nDatagrams < UDP_BATCH_SIZE ) {
+            // The socket is empty, no need for another call to learn about EAGAIN
+            return;
+        }
+    }
+}
+
+/**
+ * Stop taking clients and datagrams after a new process took over the listeners, which
+ * serves them from now on. The connections are kept until they finish, a connection
+ * waiting for its next request is closed by its timer on the next tick.
+ * @param pReactor the event loop of the worker
+ */
+static void startDraining(Reactor* pReactor) {
+    if ( pReactor->isDraining ) {
+        return;
+    }
+    epoll_ctl(pReactor->epollFileDescriptor, EPOLL_CTL_DEL, pReactor->tcpSocketFileDescriptor, NULL);
+    epoll_ctl(pReactor->epollFileDescriptor, EPOLL_CTL_DEL, pReactor->udpSocketFileDescriptor, NULL);
+    pReactor->isDraining = TRUE;
+    LOG_INFO("The worker drains %d connection(s).\n", pReactor->connections.nConnections);
+
+    int i = 0;
+    for ( i = 0; i < pReactor->connections.capacity; ++ i ) {
+        Connection* pConnection = (Connection*) pReactor->connections.connections[i];
+        if ( pConnection != NULL ) {
+            armConnectionTimer(pReactor, pConnection);
+        }
+    }
+}
+
+/**
+ * Resume the connections whose jobs were completed by the disk I/O pool.
+ * @param pReactor the event loop of the worker
+ */
+static void handleCompletions(Reactor* pReactor) {
+    OffloadJob* pJob = takeOffloadCompletions(&pReactor->completions);
+    while ( pJob != NULL ) {
+        OffloadJob* pNextJob = pJob->pNext;
+        Connection* pConnection = (Connection*) pJob->pOwner;
+        pConnection->isOffloaded = FALSE;
+
+        if ( pJob->type == OFFLOAD_PREFETCH ) {
+            pConnection->cachedEnd = pJob->fileOffset + (off_t) pJob->length;
+            pJob->isCompleted = FALSE;
+        }
+        // A loaded file is picked up when the request is handled again
+        serveConnection(pReactor, pConnection);
+        pJob = pNextJob;
+    }
+}
+
+/**
+ * Advance the state machine of a connection as far as its sockets and its share of the turn allow.
+ * @param pReactor    the event loop of the worker
+ * @param pConnection the connection to serve
+ */
+static void serveConnection(Reactor* pReactor, Connection* pConnection) {
+    long budget = MAX_BYTES_PER_TURN;
+    int nRequests = 0;
+    // Every event of a connection means the client sent data or took some
+    pConnection->lastActivityTime = pReactor->loopTime;
+
+    while ( TRUE ) {
+        int progress = PROGRESS_DONE;
+
+        if ( getBufferLength(&pConnection->output) > 0 || pConnection->contentOffset < pConnection->contentLength ) {
+            progress = flushOutput(pConnection);
+            if ( progress == PROGRESS_DONE && pConnection->state != CONNECTION_STREAMING ) {
+                finishLatency(pConnection);
+            }
+        } else if ( pConnection->state == CONNECTION_STREAMING ) {
+            progress = streamFile(pConnection, &budget);
+            if ( progress == PROGRESS_DONE ) {
+                LOG_INFO("[TCP] Send file stream (until byte %lld) to client %s\n", (long long) pConnection->fileEnd,
+                    pConnection->peerName);
+                releaseBodySource(pConnection->fileFileDescriptor, pConnection->pCachedFile);
+                pConnection->fileFileDescriptor = -1;
+                pConnection->pCachedFile = NULL;
+                pConnection->state = CONNECTION_IDLE;
+            }
+        } else {
+            pConnection->state = CONNECTION_IDLE;
+            if ( nRequests == MAX_REQUESTS_PER_TURN || budget <= 0 ) {
+                progress = PROGRESS_YIELD;
+            } else if ( (progress = handleFrame(pConnection)) != PROGRESS_BLOCKED ) {
+                ++ nRequests;
+            } else {
+                // Receive the rest of the next request from client, the input buffer grows to hold the whole frame
+                ByteBuffer* pInput = &pConnection->input;
+                size_t missingLength = pConnection->frameLength - getBufferLength(pInput);
+                if ( reserveBuffer(pInput, missingLength > MIN_RECEIVE_SIZE ? missingLength : MIN_RECEIVE_SIZE) == -1 ) {
+                    LOG_ERROR("[TCP] Failed to reserve %zu bytes for the request of client %s\nThe connection is going to close.\n",
+                        missingLength, pConnection->peerName);
+                    addStat(STAT_CONNECTION_ERRORS, 1);
+                    closeConnection(pReactor, pConnection);
+                    return;
+                }
+                int readBytes = recv(pConnection->socketFileDescriptor, pInput->data + pInput->end, pInput->capacity - pInput->end, 0);
+
+                if ( readBytes < 0 ) {
+                    if ( errno == EINTR ) {
+                        continue;
+                    }
+                    if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                        armConnectionTimer(pReactor, pConnection);
+                        return;
+                    }
+                    LOG_ERROR("[TCP] An error occurred while receiving message from the client %s: %s\nThe connection is going to close.\n",
+                        pConnection->peerName, strerror(errno));
+                    addStat(STAT_CONNECTION_ERRORS, 1);
+                    progress = PROGRESS_FAILED;
+                } else if ( readBytes == 0 ) {
+                    // Complete receiving message from client
+                    progress = PROGRESS_FAILED;
+                } else {
+                    if ( pConnection->requestArrivalTime == 0 ) {
+                        pConnection->requestArrivalTime = pReactor->loopTime;
+                    }
+                    pInput->end += readBytes;
+                    budget -= readBytes;
+                    addStat(STAT_BYTES_IN, readBytes);
+                    progress = PROGRESS_DONE;
+                }
+            }
+        }
+
+        if ( progress == PROGRESS_FAILED ) {
+            closeConnection(pReactor, pConnection);
+            return;
+        } else if ( progress == PROGRESS_BLOCKED ) {
+            // EPOLLOUT resumes the connection when the socket drains
+            armConnectionTimer(pReactor, pConnection);
+            return;
+        } else if ( progress == PROGRESS_YIELD ) {
+            enqueueReady(pReactor, pConnection);
+            return;
+        } else if ( progress == PROGRESS_OFFLOADED ) {
+            pConnection->isOffloaded = TRUE;
+            return;
+        }
+    }
+}
+
+/**
+ * Handle the first request in the input buffer of a connection and queue the response.
+ * @param  pConnection the connection which received the request
+ * @return PROGRESS_BLOCKED if the request is incomplete, PROGRESS_FAILED if the connection has to be closed,
+ *         PROGRESS_OFFLOADED if the file of the request is loaded by the disk I/O pool
+ */
+static int handleFrame(Connection* pConnection) {
+    ByteBuffer* pInput = &pConnection->input;
+    pConnection->frameLength = FRAME_HEADER_SIZE;
+    if ( getBufferLength(pInput) < FRAME_HEADER_SIZE ) {
+        return PROGRESS_BLOCKED;
+    }
+
+    FrameHeader request;
+    decodeFrameHeader(pInput->data + pInput->start, &request);
+    if ( request.payloadLength > MAX_REQUEST_PAYLOAD ) {
+        LOG_ERROR("[TCP] The client %s sent a request of %llu bytes.\nThe connection is going to close.\n",
+            pConnection->peerName, (unsigned long long) request.payloadLength);
+        addStat(STAT_CONNECTION_ERRORS, 1);
+        return PROGRESS_FAILED;
+    }
+    size_t frameLength = FRAME_HEADER_SIZE + (size_t) request.payloadLength;
+    pConnection->frameLength = frameLength;
+    if ( getBufferLength(pInput) < frameLength ) {
+        return PROGRESS_BLOCKED;
+    }
+    LOG_DEBUG("[TCP] Received request #%u (opcode %d, %llu bytes) from client %s\n",
+        request.requestId, request.opcode, (unsigned long long) request.payloadLength, pConnection->peerName);
+
+    // A request handled again after its file is loaded keeps its start time
+    ResponseBody body;
+    if ( !pConnection->offloadJob.isCompleted ) {
+        pConnection->requestStartTime = getMonotonicTime();
+    }
+    ByteBuffer* pOutput = &pConnection->output;
+    if ( reserveBuffer(pOutput, getResponseCapacity(&request)) == -1 ) {
+        LOG_ERROR("[TCP] Failed to reserve the response for client %s\nThe connection is going to close.\n",
+            pConnection->peerName);
+        addStat(STAT_CONNECTION_ERRORS, 1);
+        return PROGRESS_FAILED;
+    }
+    int responseLength = handleRequest(&request, pInput->data + pInput->start + FRAME_HEADER_SIZE, pOutput->data + pOutput->end, &body,
+        &pConnection->offloadJob);
+    if ( responseLength == REQUEST_OFFLOADED ) {
+        return PROGRESS_OFFLOADED;
+    }
+    if ( responseLength == -1 ) {
+        return PROGRESS_FAILED;
+    }
+
+    // Keep the pipelined requests which follow this one, they arrived with this request
+    consumeBuffer(pInput, frameLength);
+    pConnection->requestArrivalTime = getBufferLength(pInput) > 0 ? pConnection->lastActivityTime : 0;
+
+    pOutput->end += (size_t) responseLength;
+    pConnection->pContent = body.content;
+    pConnection->contentOffset = 0;
+    pConnection->contentLength = body.contentLength;
+    pConnection->pCachedFile = body.pCachedFile;
+    pConnection->state = CONNECTION_DRAINING;
+    pConnection->latencyHistogram = HISTOGRAM_NONE;
+    if ( request.opcode == OPCODE_ECHO || request.opcode == OPCODE_UPPERCASE ) {
+        pConnection->latencyHistogram = HISTOGRAM_ECHO;
+    } else if ( request.opcode == OPCODE_GET || request.opcode == OPCODE_GET_RANGE ) {
+        pConnection->latencyHistogram = HISTOGRAM_GET_TTFB;
+    }
+    if ( body.fileFileDescriptor != -1 ) {
+        pConnection->fileFileDescriptor = body.fileFileDescriptor;
+        pConnection->fileOffset = body.fileOffset;
+        pConnection->fileEnd = body.fileOffset + body.fileLength;
+        pConnection->cachedEnd = body.fileOffset;
+        pConnection->state = CONNECTION_STREAMING;
+    } else if ( (size_t) responseLength + body.contentLength >= pConnection->pPolicy->zeroCopyThreshold ) {
+        // A file is sent by sendfile() without a copy already, only large responses from memory pin their pages
+        pConnection->pZeroCopyResponse = beginZeroCopyResponse(&pConnection->zeroCopy);
+    }
+    return PROGRESS_DONE;
+}
+
+/**
+ * Send the output buffer of a connection and the cached content which follows it,
+ * until both are sent or the socket is full. They are gathered into one sendmsg(),
+ * which is writev() with MSG_NOSIGNAL, so a small file costs a single system call.
+ *
+ * The header of a file is corked with MSG_MORE, so it shares a segment with the start
+ * of the file. A zero-copy response keeps its memory until the kernel is done with it.
+ *
+ * @param  pConnection the connection to send to
+ * @return PROGRESS_DONE, PROGRESS_BLOCKED or PROGRESS_FAILED
+ */
+static int flushOutput(Connection* pConnection) {
+    ByteBuffer* pOutput = &pConnection->output;
+    ZeroCopyResponse* pZeroCopyResponse = pConnection->pZeroCopyResponse;
+    int flags = MSG_NOSIGNAL;
+    if ( pConnection->state == CONNECTION_STREAMING && pConnection->pPolicy->isCorked ) {
+        flags |= MSG_MORE;
+    }
+    if ( pZeroCopyResponse != NULL ) {
+        flags |= MSG_ZEROCOPY;
+    }
+
+    while ( getBufferLength(pOutput) > 0 || pConnection->contentOffset < pConnection->contentLength ) {
+        struct iovec vectors[2];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = vectors;
+        if ( getBufferLength(pOutput) > 0 ) {
+            vectors[message.msg_iovlen].iov_base = pOutput->data + pOutput->start;
+            vectors[message.msg_iovlen].iov_len = getBufferLength(pOutput);
+            ++ message.msg_iovlen;
+        }
+        if ( pConnection->contentOffset < pConnection->contentLength ) {
+            vectors[message.msg_iovlen].iov_base = (void*) (pConnection->pContent + pConnection->contentOffset);
+            vectors[message.msg_iovlen].iov_len = pConnection->contentLength - pConnection->contentOffset;
+            ++ message.msg_iovlen;
+        }
+        ssize_t sentBytes = sendmsg(pConnection->socketFileDescriptor, &message, flags);
+
+        if ( sentBytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return PROGRESS_BLOCKED;
+            }
+            if ( errno == ENOBUFS && (flags & MSG_ZEROCOPY) ) {
+                // The pinned pages exceed the limit of the socket, copy the rest of this response
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            LOG_ERROR("An error occurred while sending message to the client %s: %s\nThe connection is going to close.\n",
+                pConnection->peerName, strerror(errno));
+            addStat(STAT_CONNECTION_ERRORS, 1);
+            return PROGRESS_FAILED;
+        }
+        addStat(STAT_BYTES_OUT, sentBytes);
+        if ( flags & MSG_ZEROCOPY ) {
+            countZeroCopySend(&pConnection->zeroCopy, pZeroCopyResponse);
+        }
+
+        // The rest of a partial write stays in the buffer, the header goes out before the content
+        size_t headerBytes = (size_t) sentBytes < getBufferLength(pOutput) ? (size_t) sentBytes : getBufferLength(pOutput);
+        if ( headerBytes > 0 && pZeroCopyResponse != NULL ) {
+            // The kernel may still read the sent bytes, the buffer must not go back to the pool
+            pOutput->start += headerBytes;
+        } else if ( headerBytes > 0 ) {
+            consumeBuffer(pOutput, headerBytes);
+        }
+        pConnection->contentOffset += (size_t) sentBytes - headerBytes;
+    }
+
+    if ( pZeroCopyResponse != NULL ) {
+        finishZeroCopyResponse(&pConnection->zeroCopy, pZeroCopyResponse, pOutput, pConnection->pContent == NULL ? NULL : pConnection->pCachedFile);
+        pConnection->pZeroCopyResponse = NULL;
+        pConnection->pContent = NULL;
+        pConnection->contentOffset = 0;
+        pConnection->contentLength = 0;
+        pConnection->pCachedFile = NULL;
+    } else if ( pConnection->pContent != NULL ) {
+        releaseBodySource(-1, pConnection->pCachedFile);
+        pConnection->pContent = NULL;
+        pConnection->contentOffset = 0;
+        pConnection->contentLength = 0;
+        pConnection->pCachedFile = NULL;
+    }
+    return PROGRESS_DONE;
+}
+
+/**
+ * Send the file of a connection without copying it to user space, until the file is
+ * sent, the socket is full or the budget of the turn is used up. sendfile() is used
+ * if the file system supports it, otherwise the file is spliced through a pipe.
+ * @param  pConnection the connection streaming a file
+ * @param  pBudget     the number of bytes the connection may still send in this turn
+ * @return PROGRESS_DONE, PROGRESS_BLOCKED, PROGRESS_YIELD, PROGRESS_OFFLOADED or PROGRESS_FAILED
+ */
+static int streamFile(Connection* pConnection, long* pBudget) {
+    while ( pConnection->fileOffset < pConnection->fileEnd || pConnection->pipedBytes > 0 ) {
+        if ( *pBudget <= 0 ) {
+            return PROGRESS_YIELD;
+        }
+        if ( pConnection->fileOffset >= pConnection->cachedEnd && pConnection->fileOffset < pConnection->fileEnd &&
+             prefetchFile(pConnection) == PROGRESS_OFFLOADED ) {
+            return PROGRESS_OFFLOADED;
+        }
+
+        size_t length = (size_t) (pConnection->fileEnd - pConnection->fileOffset);
+        if ( length > (size_t) *pBudget ) {
+            length = (size_t) *pBudget;
+        }
+        if ( length > MAX_SENDFILE_SIZE ) {
+            length = MAX_SENDFILE_SIZE;
+        }
+
+        ssize_t sentBytes = 0;
+        if ( pConnection->pipeFileDescriptors[0] == -1 ) {
+            sentBytes = sendfile(pConnection->socketFileDescriptor, pConnection->fileFileDescriptor, &pConnection->fileOffset, length);
+            if ( sentBytes == -1 && (errno == EINVAL || errno == ENOSYS) ) {
+                if ( pipe2(pConnection->pipeFileDescriptors, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+                    return PROGRESS_FAILED;
+                }
+                continue;
+            }
+        } else {
+            sentBytes = spliceFile(pConnection, length);
+        }
+
+        if ( sentBytes == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return PROGRESS_BLOCKED;
+            }
+            LOG_ERROR("An error occurred while sending file stream to the client %s: %s\nThe connection is going to close.\n",
+                pConnection->peerName, strerror(errno));
+            addStat(STAT_CONNECTION_ERRORS, 1);
+            return PROGRESS_FAILED;
+        }
+        if ( sentBytes == 0 ) {
+            LOG_ERROR("The file was truncated while sending it to the client %s\n", pConnection->peerName);
+            addStat(STAT_CONNECTION_ERRORS, 1);
+            return PROGRESS_FAILED;
+        }
+        *pBudget -= sentBytes;
+        addStat(STAT_BYTES_OUT, sentBytes);
+        finishLatency(pConnection);
+    }
+    return PROGRESS_DONE;
+}
+
+/**
+ * Make sure the next window of the file of a connection is in the page cache, so sending
+ * it never blocks the event loop on the disk. Only files from disk are checked, the memory
+ * file of a STREAM request has nothing to wait for.
+ * @param  pConnection the connection streaming a file
+ * @return PROGRESS_OFFLOADED if the window is read by the disk I/O pool, PROGRESS_DONE if it can be sent now
+ */
+static int prefetchFile(Connection* pConnection) {
+    size_t length = (size_t) (pConnection->fileEnd - pConnection->fileOffset);
+    if ( length > PREFETCH_WINDOW_SIZE ) {
+        length = PREFETCH_WINDOW_SIZE;
+    }
+
+    if ( pConnection->pCachedFile != NULL && !isFileRangeCached(pConnection->fileFileDescriptor, pConnection->fileOffset, length) ) {
+        OffloadJob* pJob = &pConnection->offloadJob;
+        pJob->type = OFFLOAD_PREFETCH;
+        pJob->fileFileDescriptor = pConnection->fileFileDescriptor;
+        pJob->fileOffset = pConnection->fileOffset;
+        pJob->length = length;
+        if ( submitOffloadJob(pJob) == 0 ) {
+            return PROGRESS_OFFLOADED;
+        }
+    }
+    pConnection->cachedEnd = pConnection->fileOffset + (off_t) length;
+    return PROGRESS_DONE;
+}
+
+/**
+ * Move a part of the file of a connection into its socket through the pipe of the connection.
+ * Bytes left in the pipe by a full socket are sent before more of the file is read.
+ * @param  pConnection the connection streaming a file
+ * @param  length      the maximum number of bytes to read from the file
+ * @return the number of bytes sent, or -1 with errno set
+ */
+static ssize_t spliceFile(Connection* pConnection, size_t length) {
+    if ( pConnection->pipedBytes == 0 ) {
+        if ( length > PIPE_CAPACITY ) {
+            length = PIPE_CAPACITY;
+        }
+        ssize_t pipedBytes = splice(pConnection->fileFileDescriptor, &pConnection->fileOffset, pConnection->pipeFileDescriptors[1], NULL,
+            length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if ( pipedBytes <= 0 ) {
+            return pipedBytes;
+        }
+        pConnection->pipedBytes = (size_t) pipedBytes;
+    }
+
+    ssize_t sentBytes = splice(pConnection->pipeFileDescriptors[0], NULL, pConnection->socketFileDescriptor, NULL,
+        pConnection->pipedBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if ( sentBytes > 0 ) {
+        pConnection->pipedBytes -= sentBytes;
+    }
+    return sentBytes;
+}
+
+/**
+ * Queue a connection which yielded, so it is resumed after the other ready connections.
+ * @param pReactor    the event loop of the worker
+ * @param pConnection the connection to queue
+ */
+static void enqueueReady(Reactor* pReactor, Connection* pConnection) {
+    if ( pConnection->isQueued ) {
+        return;
+    }
+    pConnection->isQueued = TRUE;
+    pConnection->pNextReady = NULL;
+
+    if ( pReactor->pReadyTail == NULL ) {
+        pReactor->pReadyHead = pConnection;
+    } else {
+        pReactor->pReadyTail->pNextReady = pConnection;
+    }
+    pReactor->pReadyTail = pConnection;
+}
+
+/**
+ * Record the latency of the response of a connection, unless it is recorded already.
+ * @param pConnection the connection which sent a part of the response
+ */
+static void finishLatency(Connection* pConnection) {
+    if ( pConnection->latencyHistogram != HISTOGRAM_NONE ) {
+        recordLatency(pConnection->latencyHistogram, pConnection->requestStartTime);
+        pConnection->latencyHistogram = HISTOGRAM_NONE;
+    }
+}
+
+/**
+ * Drain the error queue of a socket after EPOLLERR and tell a failed socket from one
+ * which only reported zero-copy sends.
+ * @param  pConnection the connection of the socket
+ * @return -1 if the socket failed
+ */
+static int checkSocketErrors(Connection* pConnection) {
+    if ( reapZeroCopyCompletions(&pConnection->zeroCopy, pConnection->socketFileDescriptor) == -1 ) {
+        return -1;
+    }
+    int error = 0;
+    socklen_t errorSize = sizeof(error);
+    if ( getsockopt(pConnection->socketFileDescriptor, SOL_SOCKET, SO_ERROR, &error, &errorSize) == -1 || error != 0 ) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compute when a connection times out in its current state. A response is bounded by the
+ * write timeout from the last time the client took some of it, an incomplete request by
+ * the read timeout from its first bytes, and a connection with nothing to do by the idle
+ * timeout. A connection waiting for the disk is not timed out, the disk is not the client.
+ * A draining worker closes a connection with nothing to do right away.
+ * @param  pReactor    the event loop of the worker
+ * @param  pConnection the connection
+ * @return the monotonic time in nanoseconds, UINT64_MAX if the connection has no deadline
+ */
+static uint64_t getConnectionDeadline(Reactor* pReactor, Connection* pConnection) {
+    const ConnectionLimits* pLimits = pReactor->pLimits;
+    if ( pConnection->isOffloaded ) {
+        return UINT64_MAX;
+    }
+    if ( pConnection->isLingering || pConnection->state == CONNECTION_STREAMING || getBufferLength(&pConnection->output) > 0 ||
+         pConnection->contentOffset < pConnection->contentLength ) {
+        return getTimeoutDeadline(pConnection->lastActivityTime, pLimits->writeTimeout);
+    }
+    if ( getBufferLength(&pConnection->input) > 0 ) {
+        return getTimeoutDeadline(pConnection->requestArrivalTime, pLimits->readTimeout);
+    }
+    if ( pReactor->isDraining ) {
+        return pConnection->lastActivityTime;
+    }
+    return getTimeoutDeadline(pConnection->lastActivityTime, pLimits->idleTimeout);
+}
+
+/**
+ * Make sure the timer of a connection fires by its deadline, it is called whenever the
+ * connection waits for its socket. A timer which fires early is armed again, so in the
+ * steady state a busy connection touches the wheel once for each timeout.
+ * @param pReactor    the event loop of the worker
+ * @param pConnection the connection
+ */
+static void armConnectionTimer(Reactor* pReactor, Connection* pConnection) {
+    uint64_t deadline = getConnectionDeadline(pReactor, pConnection);
+    if ( deadline != UINT64_MAX ) {
+        armTimer(&pReactor->timers, &pConnection->timer, deadline);
+    }
+}
+
+/**
+ * Close a connection whose timer fired if it passed its deadline, or arm the timer again.
+ * A lingering connection whose client stopped taking data is reset, so the kernel drops
+ * the zero-copy sends and their memory is released.
+ * @param pEntry    the timer of the connection
+ * @param pArgument the event loop of the worker
+ */
+static void expireConnection(TimerEntry* pEntry, void* pArgument) {
+    Reactor* pReactor = (Reactor*) pArgument;
+    Connection* pConnection = (Connection*) pEntry->pOwner;
+
+    uint64_t deadline = getConnectionDeadline(pReactor, pConnection);
+    if ( deadline > pReactor->loopTime ) {
+        if ( deadline != UINT64_MAX ) {
+            scheduleTimer(&pReactor->timers, pEntry, deadline);
+        }
+        return;
+    }
+
+    int isIdle = pConnection->state == CONNECTION_IDLE && getBufferLength(&pConnection->output) == 0;
+    if ( pReactor->isDraining && isIdle && getBufferLength(&pConnection->input) == 0 ) {
+        closeConnection(pReactor, pConnection);
+        return;
+    }
+    addStat(STAT_TIMEOUTS, 1);
+    if ( pConnection->isLingering ) {
+        LOG_WARN("[TCP] The client %s stopped taking data, its connection is reset.\n", pConnection->peerName);
+        struct linger lingerOption = { 1, 0 };
+        setsockopt(pConnection->socketFileDescriptor, SOL_SOCKET, SO_LINGER, &lingerOption, sizeof(lingerOption));
+        dropZeroCopyResponses(&pConnection->zeroCopy);
+        destroyConnection(pReactor, pConnection);
+        return;
+    }
+    LOG_INFO("[TCP] The client %s timed out while %s.\n", pConnection->peerName,
+        isIdle ? (getBufferLength(&pConnection->input) > 0 ? "sending a request" : "idle") : "receiving a response");
+    closeConnection(pReactor, pConnection);
+}
+
+/**
+ * Close a connection and release its resources. A connection whose zero-copy sends
+ * are still read by the kernel lingers until they are done, so their memory is not
+ * reused under the kernel. The socket is shut down meanwhile, which still lets the
+ * kernel deliver the sent data.
+ * @param pReactor    the event loop of the worker
+ * @param pConnection the connection to close
+ */
+static void closeConnection(Reactor* pReactor, Connection* pConnection) {
+    LOG_INFO("[TCP] Client %s disconnected after %.3f s.\n", pConnection->peerName,
+        (getMonotonicTime() - pConnection->connectedTime) / 1e9);
+    addStat(STAT_CONNECTIONS_CLOSED, 1);
+
+    if ( pConnection->pZeroCopyResponse != NULL ) {
+        finishZeroCopyResponse(&pConnection->zeroCopy, pConnection->pZeroCopyResponse, &pConnection->output,
+            pConnection->pContent == NULL ? NULL : pConnection->pCachedFile);
+        pConnection->pZeroCopyResponse = NULL;
+        pConnection->pCachedFile = pConnection->pContent == NULL ? pConnection->pCachedFile : NULL;
+    }
+    releaseBodySource(pConnection->fileFileDescriptor, pConnection->pCachedFile);
+    pConnection->fileFileDescriptor = -1;
+    pConnection->pCachedFile = NULL;
+    releaseBuffer(&pConnection->input);
+    releaseBuffer(&pConnection->output);
+    if ( pConnection->pipeFileDescriptors[0] != -1 ) {
+        close(pConnection->pipeFileDescriptors[0]);
+        close(pConnection->pipeFileDescriptors[1]);
+    }
+
+    if ( pConnection->zeroCopy.nPending > 0 ) {
+        shutdown(pConnection->socketFileDescriptor, SHUT_WR);
+        pConnection->isLingering = TRUE;
+        pConnection->lastActivityTime = pReactor->loopTime;
+        scheduleTimer(&pReactor->timers, &pConnection->timer, getConnectionDeadline(pReactor, pConnection));
+        return;
+    }
+    destroyConnection(pReactor, pConnection);
+}
+
+/**
+ * Close the socket of a connection and free it. A queued connection is freed when it
+ * is taken off the ready queue.
+ * @param pReactor    the event loop of the worker
+ * @param pConnection the connection to free
+ */
+static void destroyConnection(Reactor* pReactor, Connection* pConnection) {
+    // Closing the descriptor also removes it from the epoll interest list
+    close(pConnection->socketFileDescriptor);
+    removeConnection(&pReactor->connections, pConnection->socketFileDescriptor);
+    cancelTimer(&pReactor->timers, &pConnection->timer);
+    dismissConnection();
+
+    pConnection->isClosed = TRUE;
+    if ( !pConnection->isQueued ) {
+        freeConnection(&pReactor->connections, pConnection);
+    }
+}
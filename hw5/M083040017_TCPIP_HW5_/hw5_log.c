@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "hw5_server.h"
+#include "hw5_log.h"
+
+/**
+ * Every thread owns a ring of fixed-size records. The thread is the only producer and
+ * the writer thread is the only consumer, so the ring needs no lock: the producer
+ * publishes a record by moving the tail, the consumer releases it by moving the head.
+ * A record which does not fit is dropped instead of blocking the thread.
+ */
+#define LOG_RING_CAPACITY       4096        // a power of 2
+#define LOG_RECORD_SIZE         256
+#define LOG_MAX_ARGUMENTS       12
+#define LOG_STRINGS_SIZE        (LOG_RECORD_SIZE - 16 - LOG_MAX_ARGUMENTS * 8)
+
+#define LOG_OUTPUT_BUFFER_SIZE  65536
+#define LOG_LINE_SIZE           1024
+
+/**
+ * A log record in binary form, the writer formats it later.
+ * Integers, doubles and pointers are kept in arguments, strings are copied into
+ * strings and their arguments hold the offset of the copy.
+ */
+typedef struct {
+    const char* format;
+    uint8_t     level;
+    uint8_t     nArguments;
+    uint16_t    stringsLength;
+    uint64_t    arguments[LOG_MAX_ARGUMENTS];
+    char        strings[LOG_STRINGS_SIZE];
+} LogRecord;
+
+/**
+ * The ring of a thread.
+ */
+typedef struct LogRing {
+    LogRecord       records[LOG_RING_CAPACITY];
+    uint64_t        head;
+    uint64_t        tail;
+    uint64_t        nDroppedRecords;
+    struct LogRing* pNext;
+} LogRing;
+
+/**
+ * A conversion of a format, like "%-5.*lu".
+ */
+typedef struct {
+    const char* pStart;             // the '%'
+    const char* pEnd;               // the character after the conversion
+    int         hasStarWidth;
+    int         hasStarPrecision;
+    int         precision;          // -1 if there is none
+    char        lengthModifier[3];
+    char        conversion;
+} FormatSpecifier;
+
+int logLevel = LOG_LEVEL_INFO;
+
+static LogRing* pRings = NULL;
+static __thread LogRing* pThreadRing = NULL;
+static int isLoggerRunning = FALSE;
+static pthread_t writerThread;
+
+/**
+ * The writer blocks on the eventfd when all rings are empty. It raises isWriterSleeping
+ * before it checks the rings for the last time, and a producer checks the flag after it
+ * publishes a record, so either the writer sees the record or the producer wakes it.
+ */
+static int wakeFileDescriptor = -1;
+static int isWriterSleeping = FALSE;
+
+static const char* levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/**
+ * Prototypes of functions.
+ */
+static LogRing* getThreadRing(void);
+static const char* parseFormatSpecifier(const char* pFormat, FormatSpecifier* pSpecifier);
+static void* runWriter(void* pArgument);
+static int drainRings(char* outputBuffer, size_t* pOutputLength);
+static size_t formatRecord(const LogRecord* pRecord, char* line, size_t lineSize);
+static void flushOutput(char* outputBuffer, size_t* pOutputLength);
+static void wakeWriter(void);
+
+/**
+ * Translate the name of a level.
+ * @param  levelName debug, info, warn or error
+ * @return the level, -1 if the name is unknown
+ */
+int parseLogLevel(const char* levelName) {
+    int i = 0;
+    for ( i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; ++ i ) {
+        if ( strcasecmp(levelName, levelNames[i]) == 0 ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Start the writer thread, records are written synchronously before this call.
+ * @param  level the level of the logger
+ * @return -1 if the writer thread is failed to start
+ */
+int startLogger(int level) {
+    logLevel = level;
+    if ( LOG_COMPILE_LEVEL > LOG_LEVEL_DEBUG && level == LOG_LEVEL_DEBUG ) {
+        fprintf(stderr, "[WARN] Debug logs are compiled out, build with -DLOG_COMPILE_LEVEL=0 to enable them.\n");
+    }
+
+    wakeFileDescriptor = eventfd(0, EFD_CLOEXEC);
+    if ( wakeFileDescriptor == -1 ) {
+        fprintf(stderr, "[ERROR] Failed to create the eventfd of the log writer: %s\n", strerror(errno));
+        return -1;
+    }
+    __atomic_store_n(&isLoggerRunning, TRUE, __ATOMIC_RELEASE);
+    int errorCode = pthread_create(&writerThread, NULL, runWriter, NULL);
+    if ( errorCode != 0 ) {
+        __atomic_store_n(&isLoggerRunning, FALSE, __ATOMIC_RELEASE);
+        close(wakeFileDescriptor);
+        wakeFileDescriptor = -1;
+        fprintf(stderr, "[ERROR] Failed to start the log writer: %s\n", strerror(errorCode));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write the remaining records and stop the writer thread.
+ */
+void stopLogger(void) {
+    if ( __atomic_exchange_n(&isLoggerRunning, FALSE, __ATOMIC_SEQ_CST) ) {
+        wakeWriter();
+        pthread_join(writerThread, NULL);
+        close(wakeFileDescriptor);
+        wakeFileDescriptor = -1;
+    }
+}
+
+/**
+ * Write a record. This only copies the arguments into the ring of the calling thread,
+ * the writer thread formats the record and writes it.
+ * @param level  the level of the record
+ * @param format the format of the record, a string literal
+ */
+void writeLog(int level, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+
+    LogRing* pRing = NULL;
+    if ( !__atomic_load_n(&isLoggerRunning, __ATOMIC_ACQUIRE) || (pRing = getThreadRing()) == NULL ) {
+        // Without the writer thread, records are formatted on the spot
+        char line[LOG_LINE_SIZE];
+        vsnprintf(line, sizeof(line), format, arguments);
+        fprintf(stderr, "[%s]%s%s", levelNames[level], line[0] == '[' ? "" : " ", line);
+        va_end(arguments);
+        return;
+    }
+
+    uint64_t tail = pRing->tail;
+    if ( tail - __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE) == LOG_RING_CAPACITY ) {
+        __atomic_add_fetch(&pRing->nDroppedRecords, 1, __ATOMIC_RELAXED);
+        va_end(arguments);
+        return;
+    }
+
+    LogRecord* pRecord = &pRing->records[tail & (LOG_RING_CAPACITY - 1)];
+    pRecord->format = format;
+    pRecord->level = (uint8_t) level;
+    pRecord->nArguments = 0;
+    pRecord->stringsLength = 0;
+
+    /*
+     * Read the arguments in the order of the conversions, in the types they were passed.
+     */
+    FormatSpecifier specifier;
+    const char* pFormat = format;
+    while ( (pFormat = parseFormatSpecifier(pFormat, &specifier)) != NULL && pRecord->nArguments < LOG_MAX_ARGUMENTS ) {
+        if ( specifier.hasStarWidth ) {
+            pRecord->arguments[pRecord->nArguments ++] = (uint64_t) (int64_t) va_arg(arguments, int);
+        }
+        if ( specifier.hasStarPrecision && pRecord->nArguments < LOG_MAX_ARGUMENTS ) {
+            specifier.precision = va_arg(arguments, int);
+            pRecord->arguments[pRecord->nArguments ++] = (uint64_t) (int64_t) specifier.precision;
+        }
+        if ( pRecord->nArguments == LOG_MAX_ARGUMENTS ) {
+            break;
+        }
+
+        const char* lengthModifier = specifier.lengthModifier;
+        uint64_t* pArgument = &pRecord->arguments[pRecord->nArguments ++];
+        switch ( specifier.conversion ) {
+            case 'd':
+            case 'i':
+                if ( strcmp(lengthModifier, "ll") == 0 || strcmp(lengthModifier, "j") == 0 ) {
+                    *pArgument = (uint64_t) va_arg(arguments, long long);
+                } else if ( lengthModifier[0] == 'l' || lengthModifier[0] == 'z' || lengthModifier[0] == 't' ) {
+                    *pArgument = (uint64_t) (int64_t) va_arg(arguments, long);
+                } else {
+                    *pArgument = (uint64_t) (int64_t) va_arg(arguments, int);
+                }
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                if ( strcmp(lengthModifier, "ll") == 0 || strcmp(lengthModifier, "j") == 0 ) {
+                    *pArgument = (uint64_t) va_arg(arguments, unsigned long long);
+                } else if ( lengthModifier[0] == 'l' || lengthModifier[0] == 'z' || lengthModifier[0] == 't' ) {
+                    *pArgument = (uint64_t) va_arg(arguments, unsigned long);
+                } else {
+                    *pArgument = (uint64_t) va_arg(arguments, unsigned int);
+                }
+                break;
+            case 'c':
+                *pArgument = (uint64_t) va_arg(arguments, int);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double value = va_arg(arguments, double);
+                memcpy(pArgument, &value, sizeof(value));
+                break;
+            }
+            case 's': {
+                // Copy the string, it may not outlive the call
+                const char* string = va_arg(arguments, const char*);
+                size_t stringLength = string == NULL ? 0 : (specifier.precision >= 0 ? strnlen(string, specifier.precision) : strlen(string));
+                size_t freeLength = LOG_STRINGS_SIZE - pRecord->stringsLength - 1;
+                if ( stringLength > freeLength ) {
+                    stringLength = freeLength;
+                }
+                memcpy(pRecord->strings + pRecord->stringsLength, string, stringLength);
+                pRecord->strings[pRecord->stringsLength + stringLength] = 0;
+                *pArgument = pRecord->stringsLength;
+                pRecord->stringsLength += (uint16_t) (stringLength + (freeLength > stringLength ? 1 : 0));
+                break;
+            }
+            default:
+                // Pointers, and %n which is never followed
+                *pArgument = (uint64_t) (uintptr_t) va_arg(arguments, void*);
+                break;
+        }
+    }
+    va_end(arguments);
+
+    __atomic_store_n(&pRing->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the fence of runWriter(), the record is visible before the flag is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ( __atomic_load_n(&isWriterSleeping, __ATOMIC_RELAXED) ) {
+        wakeWriter();
+    }
+}
+
+/**
+ * Wake the writer thread from the eventfd, a wake-up which is not needed only costs
+ * the writer another look at the rings.
+ */
+static void wakeWriter(void) {
+    uint64_t value = 1;
+    if ( write(wakeFileDescriptor, &value, sizeof(value)) != sizeof(value) ) {
+        // The counter is far from overflow, the writer is woken anyway
+    }
+}
+
+/**
+ * Get the ring of the calling thread, the ring is created on the first record.
+ * Rings are never freed, the writer may still be reading them.
+ * @return the ring, NULL if the memory is exhausted
+ */
+static LogRing* getThreadRing(void) {
+    if ( pThreadRing != NULL ) {
+        return pThreadRing;
+    }
+
+    LogRing* pRing = (LogRing*) calloc(1, sizeof(LogRing));
+    if ( pRing == NULL ) {
+        return NULL;
+    }
+    pRing->pNext = __atomic_load_n(&pRings, __ATOMIC_RELAXED);
+    while ( !__atomic_compare_exchange_n(&pRings, &pRing->pNext, pRing, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {
+        // pNext was updated with the current head, try again
+    }
+    pThreadRing = pRing;
+    return pRing;
+}
+
+/**
+ * Find the next conversion in a format.
+ * @param  pFormat    the rest of the format
+ * @param  pSpecifier the conversion which receives the fields
+ * @return the format after the conversion, NULL if there are no more conversions
+ */
+static const char* parseFormatSpecifier(const char* pFormat, FormatSpecifier* pSpecifier) {
+    while ( TRUE ) {
+        pFormat = strchr(pFormat, '%');
+        if ( pFormat == NULL ) {
+            return NULL;
+        }
+        if ( pFormat[1] != '%' ) {
+            break;
+        }
+        pFormat += 2;
+    }
+
+    memset(pSpecifier, 0, sizeof(FormatSpecifier));
+    pSpecifier->pStart = pFormat ++;
+    pSpecifier->precision = -1;
+    while ( *pFormat != 0 && strchr("-+ #0'", *pFormat) != NULL ) {
+        ++ pFormat;
+    }
+    if ( *pFormat == '*' ) {
+        pSpecifier->hasStarWidth = TRUE;
+        ++ pFormat;
+    }
+    while ( *pFormat >= '0' && *pFormat <= '9' ) {
+        ++ pFormat;
+    }
+    if ( *pFormat == '.' ) {
+        ++ pFormat;
+        pSpecifier->precision = 0;
+        if ( *pFormat == '*' ) {
+            pSpecifier->hasStarPrecision = TRUE;
+            ++ pFormat;
+        }
+        while ( *pFormat >= '0' && *pFormat <= '9' ) {
+            pSpecifier->precision = pSpecifier->precision * 10 + *pFormat ++ - '0';
+        }
+    }
+    int i = 0;
+    while ( *pFormat != 0 && strchr("hlLqjzt", *pFormat) != NULL && i < 2 ) {
+        pSpecifier->lengthModifier[i ++] = *pFormat ++;
+    }
+    pSpecifier->conversion = *pFormat;
+    if ( *pFormat != 0 ) {
+        ++ pFormat;
+    }
+    pSpecifier->pEnd = pFormat;
+    return pFormat;
+}
+
+/**
+ * The entrance of the writer thread, which formats the records of all rings and writes
+ * them to stderr in batches.
+ * @param  pArgument unused
+ * @return NULL
+ */
+static void* runWriter(void* pArgument) {
+    char* outputBuffer = (char*) malloc(LOG_OUTPUT_BUFFER_SIZE);
+    size_t outputLength = 0;
+    if ( outputBuffer == NULL ) {
+        return NULL;
+    }
+
+    while ( __atomic_load_n(&isLoggerRunning, __ATOMIC_ACQUIRE) ) {
+        if ( drainRings(outputBuffer, &outputLength) > 0 ) {
+            continue;
+        }
+        flushOutput(outputBuffer, &outputLength);
+
+        // Look at the rings once more after the flag is raised, then sleep until a record comes
+        __atomic_store_n(&isWriterSleeping, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ( drainRings(outputBuffer, &outputLength) == 0 && __atomic_load_n(&isLoggerRunning, __ATOMIC_ACQUIRE) ) {
+            uint64_t value = 0;
+            while ( read(wakeFileDescriptor, &value, sizeof(value)) == -1 && errno == EINTR ) {
+            }
+        }
+        __atomic_store_n(&isWriterSleeping, FALSE, __ATOMIC_RELAXED);
+    }
+    // Write what the other threads logged before the logger stopped
+    while ( drainRings(outputBuffer, &outputLength) > 0 ) {
+    }
+    flushOutput(outputBuffer, &outputLength);
+
+    free(outputBuffer);
+    return pArgument;
+}
+
+/**
+ * Format the records of all rings into the output buffer, writing it out when it is full.
+ * @param  outputBuffer   the buffer of formatted records
+ * @param  pOutputLength  the number of bytes in the buffer
+ * @return the number of records consumed
+ */
+static int drainRings(char* outputBuffer, size_t* pOutputLength) {
+    int nRecords = 0;
+    LogRing* pRing = __atomic_load_n(&pRings, __ATOMIC_ACQUIRE);
+    for ( ; pRing != NULL; pRing = pRing->pNext ) {
+        uint64_t nDroppedRecords = __atomic_exchange_n(&pRing->nDroppedRecords, 0, __ATOMIC_RELAXED);
+        if ( nDroppedRecords > 0 ) {
+            if ( LOG_OUTPUT_BUFFER_SIZE - *pOutputLength < LOG_LINE_SIZE ) {
+                flushOutput(outputBuffer, pOutputLength);
+            }
+            *pOutputLength += snprintf(outputBuffer + *pOutputLength, LOG_OUTPUT_BUFFER_SIZE - *pOutputLength,
+                "[WARN] %llu log record(s) dropped, the ring of a thread was full.\n", (unsigned long long) nDroppedRecords);
+        }
+
+        uint64_t head = pRing->head;
+        uint64_t tail = __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; ++ head ) {
+            if ( LOG_OUTPUT_BUFFER_SIZE - *pOutputLength < LOG_LINE_SIZE ) {
+                flushOutput(outputBuffer, pOutputLength);
+            }
+            *pOutputLength += formatRecord(&pRing->records[head & (LOG_RING_CAPACITY - 1)],
+                outputBuffer + *pOutputLength, LOG_LINE_SIZE);
+            ++ nRecords;
+        }
+        __atomic_store_n(&pRing->head, head, __ATOMIC_RELEASE);
+    }
+    return nRecords;
+}
+
+/**
+ * Format a record like printf() would have formatted the original call.
+ * @param  pRecord  the record
+ * @param  line     the buffer which receives the text
+ * @param  lineSize the capacity of the buffer
+ * @return the number of bytes written to the buffer
+ */
+static size_t formatRecord(const LogRecord* pRecord, char* line, size_t lineSize) {
+    size_t lineLength = 0;
+    lineLength += snprintf(line, lineSize, "[%s]%s", levelNames[pRecord->level], pRecord->format[0] == '[' ? "" : " ");
+
+    FormatSpecifier specifier;
+    const char* pFormat = pRecord->format;
+    const char* pText = pRecord->format;
+    int nArguments = 0;
+    while ( lineLength < lineSize - 1 ) {
+        const char* pNextFormat = parseFormatSpecifier(pFormat, &specifier);
+        const char* pTextEnd = pNextFormat == NULL ? pText + strlen(pText) : specifier.pStart;
+
+        // Copy the text before the conversion, "%%" becomes "%"
+        for ( ; pText < pTextEnd && lineLength < lineSize - 1; ++ pText ) {
+            line[lineLength ++] = *pText;
+            if ( pText[0] == '%' && pText[1] == '%' ) {
+                ++ pText;
+            }
+        }
+        if ( pNextFormat == NULL || nArguments == pRecord->nArguments ) {
+            break;
+        }
+
+        /*
+         * Rebuild the conversion with the widths written out and the widest length modifier,
+         * the arguments were widened to 64 bits when they were recorded.
+         */
+        char conversion[32] = {0};
+        size_t conversionLength = 0;
+        const char* pCharacter = specifier.pStart;
+        for ( ; pCharacter < specifier.pEnd - 1 && conversionLength < sizeof(conversion) - 24; ++ pCharacter ) {
+            if ( *pCharacter == '*' ) {
+                conversionLength += snprintf(conversion + conversionLength, sizeof(conversion) - conversionLength, "%d",
+                    (int) (int64_t) pRecord->arguments[nArguments ++]);
+            } else if ( strchr("hlLqjzt", *pCharacter) == NULL ) {
+                conversion[conversionLength ++] = *pCharacter;
+            }
+        }
+        if ( nArguments == pRecord->nArguments ) {
+            break;
+        }
+
+        uint64_t argument = pRecord->arguments[nArguments ++];
+        char* pLine = line + lineLength;
+        size_t freeLength = lineSize - lineLength;
+        int formattedLength = 0;
+        switch ( specifier.conversion ) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                conversion[conversionLength ++] = 'l';
+                conversion[conversionLength ++] = 'l';
+                conversion[conversionLength ++] = specifier.conversion;
+                formattedLength = snprintf(pLine, freeLength, conversion, (unsigned long long) argument);
+                break;
+            case 'c':
+                conversion[conversionLength ++] = 'c';
+                formattedLength = snprintf(pLine, freeLength, conversion, (int) argument);
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'F':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double value = 0;
+                memcpy(&value, &argument, sizeof(value));
+                conversion[conversionLength ++] = specifier.conversion;
+                formattedLength = snprintf(pLine, freeLength, conversion, value);
+                break;
+            }
+            case 's':
+                conversion[conversionLength ++] = 's';
+                formattedLength = snprintf(pLine, freeLength, conversion, pRecord->strings + argument);
+                break;
+            case 'p':
+                conversion[conversionLength ++] = 'p';
+                formattedLength = snprintf(pLine, freeLength, conversion, (void*) (uintptr_t) argument);
+                break;
+            default:
+                break;
+        }
+        if ( formattedLength > 0 ) {
+            lineLength += (size_t) formattedLength < freeLength ? (size_t) formattedLength : freeLength - 1;
+        }
+        pFormat = pNextFormat;
+        pText = pNextFormat;
+    }
+
+    if ( lineLength >= lineSize - 1 ) {
+        // The line was truncated, keep it on its own line
+        line[lineSize - 2] = '\n';
+        lineLength = lineSize - 1;
+    }
+    line[lineLength] = 0;
+    return lineLength;
+}
+
+/**
+ * Write the output buffer to stderr.
+ * @param outputBuffer  the buffer of formatted records
+ * @param pOutputLength the number of bytes in the buffer, reset to 0
+ */
+static void flushOutput(char* outputBuffer, size_t* pOutputLength) {
+    size_t writtenLength = 0;
+    while ( writtenLength < *pOutputLength ) {
+        ssize_t writtenBytes = write(STDERR_FILENO, outputBuffer + writtenLength, *pOutputLength - writtenLength);
+        if ( writtenBytes == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( writtenBytes <= 0 ) {
+            break;
+        }
+        writtenLength += (size_t) writtenBytes;
+    }
+    *pOutputLength = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef HW5_LOG_H
+#define HW5_LOG_H
+
+/**
+ * The levels of log records, a record is written if its level is at least the level
+ * of the logger.
+ */
+#define LOG_LEVEL_DEBUG         0
+#define LOG_LEVEL_INFO          1
+#define LOG_LEVEL_WARN          2
+#define LOG_LEVEL_ERROR         3
+
+/**
+ * Records below this level are removed by the preprocessor, so they cost nothing at all.
+ * Build with -DLOG_COMPILE_LEVEL=0 to keep the debug records.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL       LOG_LEVEL_INFO
+#endif
+
+/**
+ * Write a record with printf-style arguments. The format has to be a string literal,
+ * because only its address is kept until the writer thread formats the record.
+ * Strings are copied, so the arguments may be released right after the call.
+ */
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)          do { if ( logLevel <= LOG_LEVEL_DEBUG ) writeLog(LOG_LEVEL_DEBUG, __VA_ARGS__); } while ( 0 )
+#else
+#define LOG_DEBUG(...)          do { } while ( 0 )
+#endif
+#define LOG_INFO(...)           do { if ( logLevel <= LOG_LEVEL_INFO ) writeLog(LOG_LEVEL_INFO, __VA_ARGS__); } while ( 0 )
+#define LOG_WARN(...)           do { if ( logLevel <= LOG_LEVEL_WARN ) writeLog(LOG_LEVEL_WARN, __VA_ARGS__); } while ( 0 )
+#define LOG_ERROR(...)          do { if ( logLevel <= LOG_LEVEL_ERROR ) writeLog(LOG_LEVEL_ERROR, __VA_ARGS__); } while ( 0 )
+
+/**
+ * The level of the logger, records below it are skipped before their arguments are read.
+ */
+extern int logLevel;
+
+/**
+ * Prototypes of functions.
+ */
+int parseLogLevel(const char* levelName);
+int startLogger(int level);
+void stopLogger(void);
+void writeLog(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "hw5_log.h"
+#include "hw5_offload.h"
+#include "hw5_server.h"
+
+#define PREFETCH_BUFFER_SIZE    65536
+
+/**
+ * cachestat() reports how much of a range of a file is in the page cache, it is
+ * available since Linux 6.5 and glibc does not wrap it yet.
+ */
+#ifndef __NR_cachestat
+#define __NR_cachestat          451
+#endif
+
+typedef struct {
+    uint64_t    offset;
+    uint64_t    length;
+} CacheStatRange;
+
+typedef struct {
+    uint64_t    nCachedPages;
+    uint64_t    nDirtyPages;
+    uint64_t    nWritebackPages;
+    uint64_t    nEvictedPages;
+    uint64_t    nRecentlyEvictedPages;
+} CacheStat;
+
+/**
+ * The queue of jobs waiting for a pool thread. It is bounded, an event loop does the
+ * work itself if the queue is full, so a flood of cold requests cannot pile up memory.
+ */
+typedef struct {
+    OffloadJob*     jobs[OFFLOAD_QUEUE_SIZE];
+    unsigned        head;
+    unsigned        tail;
+    int             nThreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t  condition;
+} OffloadQueue;
+
+static OffloadQueue queue = { {NULL}, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static int isCacheStatSupported = TRUE;
+
+/**
+ * Prototypes of functions.
+ */
+static void* runOffloadThread(void* pArgument);
+static void runJob(OffloadJob* pJob);
+static void completeJob(OffloadJob* pJob);
+
+/**
+ * Start the threads of the pool.
+ * @param  nThreads the number of threads, 0 makes the event loops do the blocking work themselves
+ * @return -1 if no thread is started
+ */
+int startOffloadPool(int nThreads) {
+    int i = 0;
+    for ( i = 0; i < nThreads; ++ i ) {
+        pthread_t thread;
+        int errorCode = pthread_create(&thread, NULL, runOffloadThread, NULL);
+        if ( errorCode != 0 ) {
+            LOG_ERROR("Failed to start disk I/O thread #%d: %s\n", i, strerror(errorCode));
+            break;
+        }
+        pthread_detach(thread);
+    }
+    __atomic_store_n(&queue.nThreads, i, __ATOMIC_RELEASE);
+    return nThreads > 0 && i == 0 ? -1 : 0;
+}
+
+/**
+ * Create the completions of an event loop.
+ * @param  pCompletions the completions to initialize
+ * @return -1 if the eventfd is failed to create
+ */
+int createOffloadCompletions(OffloadCompletions* pCompletions) {
+    pCompletions->pHead = NULL;
+    pCompletions->eventFileDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return pCompletions->eventFileDescriptor == -1 ? -1 : 0;
+}
+
+/**
+ * Queue a job for the pool, its owner and completions have to be set.
+ * @param  pJob the job to run
+ * @return -1 if the pool is not running or full, the caller does the work itself then
+ */
+int submitOffloadJob(OffloadJob* pJob) {
+    if ( __atomic_load_n(&queue.nThreads, __ATOMIC_ACQUIRE) == 0 ) {
+        return -1;
+    }
+    pJob->isCompleted = FALSE;
+
+    pthread_mutex_lock(&queue.mutex);
+    if ( queue.tail - queue.head == OFFLOAD_QUEUE_SIZE ) {
+        pthread_mutex_unlock(&queue.mutex);
+        return -1;
+    }
+    queue.jobs[queue.tail & (OFFLOAD_QUEUE_SIZE - 1)] = pJob;
+    ++ queue.tail;
+    pthread_cond_signal(&queue.condition);
+    pthread_mutex_unlock(&queue.mutex);
+    return 0;
+}
+
+/**
+ * Take the completed jobs of an event loop, after its eventfd became readable.
+ * @param  pCompletions the completions of the event loop
+ * @return the jobs linked by pNext in the order they completed, NULL if there is none
+ */
+OffloadJob* takeOffloadCompletions(OffloadCompletions* pCompletions) {
+    // Reset the eventfd first, a job completed after the exchange signals it again
+    uint64_t counter = 0;
+    if ( read(pCompletions->eventFileDescriptor, &counter, sizeof(counter)) == -1 && errno != EAGAIN ) {
+        LOG_WARN("Failed to read the completions of disk I/O: %s\n", strerror(errno));
+    }
+
+    // The jobs are pushed like a stack, reverse them to the order of completion
+    OffloadJob* pJob = __atomic_exchange_n(&pCompletions->pHead, (OffloadJob*) NULL, __ATOMIC_ACQUIRE);
+    OffloadJob* pJobs = NULL;
+    while ( pJob != NULL ) {
+        OffloadJob* pNextJob = pJob->pNext;
+        pJob->pNext = pJobs;
+        pJobs = pJob;
+        pJob = pNextJob;
+    }
+    return pJobs;
+}
+
+/**
+ * Check whether a range of a file can be read without waiting for the disk.
+ * @param  fileFileDescriptor the file descriptor of the file
+ * @param  offset             the offset of the range
+ * @param  length             the length of the range
+ * @return TRUE if every page of the range is in the page cache, or if the kernel cannot tell
+ */
+int isFileRangeCached(int fileFileDescriptor, off_t offset, size_t length) {
+    if ( !__atomic_load_n(&isCacheStatSupported, __ATOMIC_RELAXED) || length == 0 ) {
+        return TRUE;
+    }
+
+    CacheStatRange range = { (uint64_t) offset, (uint64_t) length };
+    CacheStat status;
+    if ( syscall(__NR_cachestat, fileFileDescriptor, &range, &status, 0) == -1 ) {
+        if ( errno == ENOSYS ) {
+            LOG_WARN("The kernel lacks cachestat(), files are sent without checking the page cache\n");
+            __atomic_store_n(&isCacheStatSupported, FALSE, __ATOMIC_RELAXED);
+        }
+        return TRUE;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t firstPage = (uint64_t) offset / pageSize;
+    uint64_t lastPage = ((uint64_t) offset + length - 1) / pageSize;
+    return status.nCachedPages >= lastPage - firstPage + 1;
+}
+
+/**
+ * The entrance of pool threads.
+ * @param  pArgument unused
+ * @return NULL
+ */
+static void* runOffloadThread(void* pArgument) {
+    (void) pArgument;
+
+    while ( TRUE ) {
+        pthread_mutex_lock(&queue.mutex);
+        while ( queue.head == queue.tail ) {
+            pthread_cond_wait(&queue.condition, &queue.mutex);
+        }
+        OffloadJob* pJob = queue.jobs[queue.head & (OFFLOAD_QUEUE_SIZE - 1)];
+        ++ queue.head;
+        pthread_mutex_unlock(&queue.mutex);
+
+        runJob(pJob);
+        completeJob(pJob);
+    }
+    return NULL;
+}
+
+/**
+ * Do the blocking work of a job.
+ * @param pJob the job to run
+ */
+static void runJob(OffloadJob* pJob) {
+    if ( pJob->type == OFFLOAD_LOAD_FILE ) {
+        pJob->pLoadedFile = loadCachedFile(pJob->path, pJob->pathLength);
+    } else if ( pJob->type == OFFLOAD_PREFETCH ) {
+        // Ask for the whole range at once, then wait until every page of it is read
+        static __thread unsigned char buffer[PREFETCH_BUFFER_SIZE];
+        posix_fadvise(pJob->fileFileDescriptor, pJob->fileOffset, (off_t) pJob->length, POSIX_FADV_WILLNEED);
+
+        size_t readBytes = 0;
+        while ( readBytes < pJob->length ) {
+            size_t length = pJob->length - readBytes < PREFETCH_BUFFER_SIZE ? pJob->length - readBytes : PREFETCH_BUFFER_SIZE;
+            ssize_t result = pread(pJob->fileFileDescriptor, buffer, length, pJob->fileOffset + (off_t) readBytes);
+            if ( result == -1 && errno == EINTR ) {
+                continue;
+            }
+            if ( result <= 0 ) {
+                // The event loop meets the same error or the end of the file when it sends the range
+                break;
+            }
+            readBytes += (size_t) result;
+        }
+    }
+}
+
+/**
+ * Hand a job back to its event loop, the eventfd is only signaled if the event loop
+ * has no completion to take yet.
+ * @param pJob the completed job
+ */
+static void completeJob(OffloadJob* pJob) {
+    OffloadCompletions* pCompletions = pJob->pCompletions;
+    pJob->isCompleted = TRUE;
+
+    OffloadJob* pHead = __atomic_load_n(&pCompletions->pHead, __ATOMIC_RELAXED);
+    do {
+        pJob->pNext = pHead;
+    } while ( !__atomic_compare_exchange_n(&pCompletions->pHead, &pHead, pJob, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED) );
+
+    if ( pHead == NULL ) {
+        uint64_t increment = 1;
+        if ( write(pCompletions->eventFileDescriptor, &increment, sizeof(increment)) == -1 ) {
+            LOG_WARN("Failed to signal the completion of disk I/O: %s\n", strerror(errno));
+        }
+    }
+}
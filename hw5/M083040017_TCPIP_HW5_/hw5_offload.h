@@ -0,0 +1,58 @@
+#ifndef HW5_OFFLOAD_H
+#define HW5_OFFLOAD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "hw5_cache.h"
+
+#define DEFAULT_OFFLOAD_THREADS 4
+#define OFFLOAD_QUEUE_SIZE      1024    // must be a power of 2
+
+/**
+ * The kinds of blocking work done by the pool.
+ * - LOAD_FILE: open a file and read it if it is small, see loadCachedFile().
+ * - PREFETCH:  read a range of a file into the page cache, so it is sent without waiting for the disk.
+ */
+#define OFFLOAD_LOAD_FILE       0
+#define OFFLOAD_PREFETCH        1
+
+/**
+ * The completed jobs of an event loop. Pool threads push them and signal the eventfd,
+ * which the event loop watches like a socket.
+ */
+typedef struct OffloadCompletions {
+    struct OffloadJob*  pHead;
+    int                 eventFileDescriptor;
+} OffloadCompletions;
+
+/**
+ * A piece of blocking work and its result. The owner of a job keeps it and everything
+ * it points to untouched until the job comes back through the completions.
+ */
+typedef struct OffloadJob {
+    int                     type;
+    int                     isCompleted;
+    void*                   pOwner;             // handed back to the event loop with the completion
+    OffloadCompletions*     pCompletions;
+    struct OffloadJob*      pNext;
+
+    const unsigned char*    path;               // LOAD_FILE, not terminated by the end character
+    size_t                  pathLength;
+    CachedFile*             pLoadedFile;        // NULL if the file is not a readable regular file
+
+    int                     fileFileDescriptor; // PREFETCH
+    off_t                   fileOffset;
+    size_t                  length;
+} OffloadJob;
+
+/**
+ * Prototypes of functions.
+ */
+int startOffloadPool(int nThreads);
+int createOffloadCompletions(OffloadCompletions* pCompletions);
+int submitOffloadJob(OffloadJob* pJob);
+OffloadJob* takeOffloadCompletions(OffloadCompletions* pCompletions);
+int isFileRangeCached(int fileFileDescriptor, off_t offset, size_t length);
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef HW5_PROTOCOL_H
+#define HW5_PROTOCOL_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Every request and response on a TCP connection is a frame:
+ *
+ *     +--------+--------+-----------+------------+----------------+
+ *     | opcode | status | reserved  | request ID | payload length |  payload ...
+ *     | 1 byte | 1 byte | 2 bytes   | 4 bytes    | 8 bytes        |
+ *     +--------+--------+-----------+------------+----------------+
+ *
+ * Integers are in network byte order. The server answers requests in the order they
+ * arrive and copies the opcode and the request ID into the response, so a client may
+ * send many requests without waiting for the replies.
+ *
+ * - ECHO: the payload is sent back.
+ * - UPPERCASE: the payload is sent back with lower case ASCII letters in upper case.
+ * - GET:  the payload is the path of a file. The payload of the response is the
+ *         content of the file and its length is the file size.
+ * - BYE:  the server closes the connection without a response.
+ * - STAT: the payload is the path of a file. The payload of the response is the file
+ *         size as an 8-byte integer.
+ * - GET_RANGE: the payload is an 8-byte offset, an 8-byte length and the path of a file.
+ *         The payload of the response is the content of the file from the offset, it
+ *         stops at the end of the file. A length of 0 reads to the end of the file.
+ * - STATS: the payload of the response is a text report of the counters and latency
+ *         percentiles of the server, one line for each group.
+ * - STREAM: the payload is an 8-byte length. The payload of the response is that many
+ *         zero bytes, a client measures the throughput of the path with it.
+ *
+ * A server which holds as many connections as it may sends a single frame with opcode 0,
+ * request ID 0 and STATUS_BUSY to a new client, then closes the connection.
+ */
+#define FRAME_HEADER_SIZE       16
+#define MAX_REQUEST_PAYLOAD     65536
+
+#define OPCODE_ECHO             1
+#define OPCODE_GET              2
+#define OPCODE_BYE              3
+#define OPCODE_STAT             4
+#define OPCODE_GET_RANGE        5
+#define OPCODE_UPPERCASE        6
+#define OPCODE_STATS            7
+#define OPCODE_STREAM           8
+
+#define RANGE_HEADER_SIZE       16
+
+#define STATUS_OK               0
+#define STATUS_NOT_FOUND        1
+#define STATUS_BAD_REQUEST      2
+#define STATUS_BAD_RANGE        3
+#define STATUS_BUSY             4
+
+/**
+ * The decoded header of a frame.
+ */
+typedef struct {
+    uint8_t     opcode;
+    uint8_t     status;
+    uint32_t    requestId;
+    uint64_t    payloadLength;
+} FrameHeader;
+
+/**
+ * Write the header of a frame in network byte order.
+ * @param pHeader the header to encode
+ * @param buffer  the buffer which receives FRAME_HEADER_SIZE bytes
+ */
+static inline void encodeFrameHeader(const FrameHeader* pHeader, unsigned char* buffer) {
+    uint32_t requestId = htobe32(pHeader->requestId);
+    uint64_t payloadLength = htobe64(pHeader->payloadLength);
+
+    buffer[0] = pHeader->opcode;
+    buffer[1] = pHeader->status;
+    buffer[2] = 0;
+    buffer[3] = 0;
+    memcpy(buffer + 4, &requestId, sizeof(requestId));
+    memcpy(buffer + 8, &payloadLength, sizeof(payloadLength));
+}
+
+/**
+ * Read the header of a frame in network byte order.
+ * @param buffer  the buffer which holds at least FRAME_HEADER_SIZE bytes
+ * @param pHeader the header which receives the decoded fields
+ */
+static inline void decodeFrameHeader(const unsigned char* buffer, FrameHeader* pHeader) {
+    uint32_t requestId = 0;
+    uint64_t payloadLength = 0;
+    memcpy(&requestId, buffer + 4, sizeof(requestId));
+    memcpy(&payloadLength, buffer + 8, sizeof(payloadLength));
+
+    pHeader->opcode = buffer[0];
+    pHeader->status = buffer[1];
+    pHeader->requestId = be32toh(requestId);
+    pHeader->payloadLength = be64toh(payloadLength);
+}
+
+/**
+ * Write an 8-byte integer in network byte order.
+ * @param value  the integer to encode
+ * @param buffer the buffer which receives 8 bytes
+ */
+static inline void encodeUint64(uint64_t value, unsigned char* buffer) {
+    value = htobe64(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+/**
+ * Read an 8-byte integer in network byte order.
+ * @param  buffer the buffer which holds at least 8 bytes
+ * @return the decoded integer
+ */
+static inline uint64_t decodeUint64(const unsigned char* buffer) {
+    uint64_t value = 0;
+    memcpy(&value, buffer, sizeof(value));
+    return be64toh(value);
+}
+
+#endif
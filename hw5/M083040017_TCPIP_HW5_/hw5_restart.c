@@ -0,0 +1,292 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for accept4()
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "hw5_log.h"
+#include "hw5_restart.h"
+#include "hw5_server.h"
+
+#define HANDOFF_TIMEOUT         10      // seconds a process waits for the other side of a handoff
+
+/**
+ * The state of the handoff thread of the running server.
+ */
+typedef struct {
+    char    path[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
+    int     listeners[2 * MAX_HANDOFF_WORKERS];
+    int     nWorkers;
+} HandoffServer;
+
+/**
+ * Signaled once the listeners are handed off, every event loop watches it. Nobody reads
+ * it, so it stays readable and wakes a loop whenever it starts to wait.
+ */
+static int drainFileDescriptor = -1;
+static HandoffServer handoffServer;
+
+/**
+ * Prototypes of functions.
+ */
+static int fillSocketAddress(const char* path, struct sockaddr_un* pSocketAddress);
+static int createControlListener(const char* path);
+static void setControlTimeout(int socketFileDescriptor);
+static void* runHandoffServer(void* pArgument);
+static int handOffListeners(int controlSocketFileDescriptor);
+
+/**
+ * Ask a running server for its listening sockets.
+ * @param  path       the path of the control socket of the running server
+ * @param  listeners  the array which receives the TCP and the UDP socket of each worker,
+ *                    2 * MAX_HANDOFF_WORKERS file descriptors at most
+ * @param  pnWorkers  the pointer which receives the number of workers
+ * @return the control connection, which finishTakeOver() closes once the new process serves,
+ *         -1 if no server is running or the handoff failed
+ */
+int takeOverListeners(const char* path, int* listeners, int* pnWorkers) {
+    struct sockaddr_un socketAddress;
+    if ( fillSocketAddress(path, &socketAddress) == -1 ) {
+        return -1;
+    }
+    int controlSocketFileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( controlSocketFileDescriptor == -1 ) {
+        LOG_WARN("Failed to create the control socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if ( connect(controlSocketFileDescriptor, (struct sockaddr*) &socketAddress, sizeof(socketAddress)) == -1 ) {
+        // No server listens on the path, the new process starts from scratch
+        close(controlSocketFileDescriptor);
+        return -1;
+    }
+    setControlTimeout(controlSocketFileDescriptor);
+
+    /*
+     * Receive the number of workers and their sockets in a single message. MSG_CMSG_CLOEXEC
+     * keeps the received sockets from leaking into programs the server may execute.
+     */
+    int nWorkers = 0;
+    struct iovec vector;
+    vector.iov_base = &nWorkers;
+    vector.iov_len = sizeof(nWorkers);
+    char control[CMSG_SPACE(sizeof(int) * 2 * MAX_HANDOFF_WORKERS)];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t readBytes = recvmsg(controlSocketFileDescriptor, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    struct cmsghdr* pControl = readBytes == sizeof(nWorkers) ? CMSG_FIRSTHDR(&message) : NULL;
+    int nFileDescriptors = 0;
+    if ( pControl != NULL && pControl->cmsg_level == SOL_SOCKET && pControl->cmsg_type == SCM_RIGHTS ) {
+        nFileDescriptors = (int) ((pControl->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        memcpy(listeners, CMSG_DATA(pControl), sizeof(int) * nFileDescriptors);
+    }
+    if ( nWorkers <= 0 || nWorkers > MAX_HANDOFF_WORKERS || nFileDescriptors != 2 * nWorkers || (message.msg_flags & MSG_CTRUNC) ) {
+        LOG_ERROR("The running server did not hand off its listeners: %s\n", readBytes == -1 ? strerror(errno) : "bad message");
+        int i = 0;
+        for ( i = 0; i < nFileDescriptors; ++ i ) {
+            close(listeners[i]);
+        }
+        close(controlSocketFileDescriptor);
+        return -1;
+    }
+
+    *pnWorkers = nWorkers;
+    LOG_INFO("Took over the listeners of %d worker(s) from the running server.\n", nWorkers);
+    return controlSocketFileDescriptor;
+}
+
+/**
+ * Tell the previous server that the new process serves the listeners, so it drains.
+ * @param controlSocketFileDescriptor the control connection from takeOverListeners()
+ */
+void finishTakeOver(int controlSocketFileDescriptor) {
+    char ready = HANDOFF_READY;
+    if ( send(controlSocketFileDescriptor, &ready, sizeof(ready), MSG_NOSIGNAL) != sizeof(ready) ) {
+        LOG_WARN("Failed to tell the previous server to drain: %s\n", strerror(errno));
+    }
+    close(controlSocketFileDescriptor);
+}
+
+/**
+ * Listen on the control socket for the next process, which takes over the listeners.
+ * @param  path      the path of the control socket, a stale socket file is replaced
+ * @param  listeners the TCP and the UDP socket of each worker
+ * @param  nWorkers  the number of workers
+ * @return -1 if hot restart is not available
+ */
+int startHandoffServer(const char* path, const int* listeners, int nWorkers) {
+    if ( nWorkers > MAX_HANDOFF_WORKERS ) {
+        LOG_WARN("Hot restart supports %d workers at most.\n", MAX_HANDOFF_WORKERS);
+        return -1;
+    }
+    drainFileDescriptor = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ( drainFileDescriptor == -1 ) {
+        LOG_WARN("Failed to create the eventfd of hot restart: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(handoffServer.path, sizeof(handoffServer.path), "%s", path);
+    memcpy(handoffServer.listeners, listeners, sizeof(int) * 2 * nWorkers);
+    handoffServer.nWorkers = nWorkers;
+
+    pthread_t thread;
+    int errorCode = pthread_create(&thread, NULL, runHandoffServer, &handoffServer);
+    if ( errorCode != 0 ) {
+        LOG_WARN("Failed to start the thread of hot restart: %s\n", strerror(errorCode));
+        close(drainFileDescriptor);
+        drainFileDescriptor = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Get the eventfd which tells the event loops to drain.
+ * @return the file descriptor, -1 if hot restart is disabled
+ */
+int getDrainFileDescriptor(void) {
+    return drainFileDescriptor;
+}
+
+/**
+ * Hand the listeners to the first process which becomes ready, then make the workers drain.
+ * @param  pArgument the HandoffServer
+ * @return NULL
+ */
+static void* runHandoffServer(void* pArgument) {
+    HandoffServer* pServer = (HandoffServer*) pArgument;
+
+    while ( TRUE ) {
+        int listenerFileDescriptor = createControlListener(pServer->path);
+        if ( listenerFileDescriptor == -1 ) {
+            return NULL;
+        }
+        int controlSocketFileDescriptor = accept4(listenerFileDescriptor, NULL, NULL, SOCK_CLOEXEC);
+        // The path is free for the new process as soon as it takes over
+        close(listenerFileDescriptor);
+        if ( controlSocketFileDescriptor == -1 ) {
+            LOG_WARN("Failed to accept a process on the control socket: %s\n", strerror(errno));
+            continue;
+        }
+
+        int result = handOffListeners(controlSocketFileDescriptor);
+        close(controlSocketFileDescriptor);
+        if ( result == 0 ) {
+            uint64_t value = 1;
+            if ( write(drainFileDescriptor, &value, sizeof(value)) != sizeof(value) ) {
+                LOG_ERROR("Failed to make the workers drain: %s\n", strerror(errno));
+            }
+            return NULL;
+        }
+        LOG_WARN("The new process failed before it served the listeners, keep serving them.\n");
+    }
+}
+
+/**
+ * Send the listeners to a new process and wait until it serves them.
+ * @param  controlSocketFileDescriptor the connection of the new process
+ * @return -1 if the new process did not become ready
+ */
+static int handOffListeners(int controlSocketFileDescriptor) {
+    setControlTimeout(controlSocketFileDescriptor);
+
+    int nWorkers = handoffServer.nWorkers;
+    size_t listenersSize = sizeof(int) * 2 * nWorkers;
+    struct iovec vector;
+    vector.iov_base = &nWorkers;
+    vector.iov_len = sizeof(nWorkers);
+    char control[CMSG_SPACE(sizeof(int) * 2 * MAX_HANDOFF_WORKERS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(listenersSize);
+
+    struct cmsghdr* pControl = CMSG_FIRSTHDR(&message);
+    pControl->cmsg_level = SOL_SOCKET;
+    pControl->cmsg_type = SCM_RIGHTS;
+    pControl->cmsg_len = CMSG_LEN(listenersSize);
+    memcpy(CMSG_DATA(pControl), handoffServer.listeners, listenersSize);
+
+    if ( sendmsg(controlSocketFileDescriptor, &message, MSG_NOSIGNAL) != sizeof(nWorkers) ) {
+        LOG_WARN("Failed to hand off the listeners: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char ready = 0;
+    if ( recv(controlSocketFileDescriptor, &ready, sizeof(ready), 0) != sizeof(ready) || ready != HANDOFF_READY ) {
+        return -1;
+    }
+    LOG_INFO("A new process serves the listeners, the workers drain their connections and exit.\n");
+    return 0;
+}
+
+/**
+ * Bind a Unix domain socket to the control path and listen on it.
+ * @param  path the path of the control socket, a stale socket file is removed first
+ * @return the listening socket, -1 if it is failed to create
+ */
+static int createControlListener(const char* path) {
+    struct sockaddr_un socketAddress;
+    if ( fillSocketAddress(path, &socketAddress) == -1 ) {
+        return -1;
+    }
+    int listenerFileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( listenerFileDescriptor == -1 ) {
+        LOG_WARN("Failed to create the control socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if ( bind(listenerFileDescriptor, (struct sockaddr*) &socketAddress, sizeof(socketAddress)) == -1 ||
+         listen(listenerFileDescriptor, 1) == -1 ) {
+        LOG_WARN("Failed to listen on the control socket %s: %s\n", path, strerror(errno));
+        close(listenerFileDescriptor);
+        return -1;
+    }
+    return listenerFileDescriptor;
+}
+
+/**
+ * Fill the address of a control socket.
+ * @param  path           the path of the control socket
+ * @param  pSocketAddress the address to fill
+ * @return -1 if the path is too long
+ */
+static int fillSocketAddress(const char* path, struct sockaddr_un* pSocketAddress) {
+    memset(pSocketAddress, 0, sizeof(struct sockaddr_un));
+    pSocketAddress->sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(pSocketAddress->sun_path) ) {
+        LOG_ERROR("The path of the control socket is too long: %s\n", path);
+        return -1;
+    }
+    memcpy(pSocketAddress->sun_path, path, strlen(path));
+    return 0;
+}
+
+/**
+ * Bound the time a process waits for the other side of a handoff, so a hung peer
+ * does not stall a restart forever.
+ * @param socketFileDescriptor the control connection
+ */
+static void setControlTimeout(int socketFileDescriptor) {
+    struct timeval timeout;
+    timeout.tv_sec = HANDOFF_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(socketFileDescriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socketFileDescriptor, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
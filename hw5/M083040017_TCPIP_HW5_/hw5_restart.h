@@ -0,0 +1,35 @@
+#ifndef HW5_RESTART_H
+#define HW5_RESTART_H
+
+/**
+ * A hot restart hands the listening sockets of the running server to a new process over
+ * a Unix domain socket, the kernel passes them with SCM_RIGHTS:
+ *
+ *     new process                          running server
+ *     connect(path)               ---->    accept(), stop listening on the path
+ *                                 <----    the number of workers and their TCP and UDP sockets
+ *     serve the sockets, then
+ *     send HANDOFF_READY          ---->    stop accepting, drain the connections and exit
+ *     listen on the path
+ *
+ * Both processes share the same sockets while they overlap, so clients in the accept queue
+ * are served by either of them and none is refused. If the new process fails before it is
+ * ready, the running server listens on the path again and keeps serving.
+ */
+#define HANDOFF_READY           'R'
+
+/**
+ * The most workers whose sockets fit into a single message, the kernel passes 253
+ * file descriptors at most.
+ */
+#define MAX_HANDOFF_WORKERS     126
+
+/**
+ * Prototypes of functions.
+ */
+int takeOverListeners(const char* path, int* listeners, int* pnWorkers);
+void finishTakeOver(int controlSocketFileDescriptor);
+int startHandoffServer(const char* path, const int* listeners, int nWorkers);
+int getDrainFileDescriptor(void);
+
+#endif
@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for CPU affinity
+#endif
+
 #include <errno.h>
 #include <fcntl.h>      // for opening socket
 #include <stdio.h>
@@ -6,31 +10,61 @@
 #include <unistd.h>     // for closing socket
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
-#define TRUE                    1
-#define FALSE                   0
-
-#define MAX_PENDING_CONNECTIONS 4
-#define MAX_CONNECTIONS         32
-#define BUFFER_SIZE             1024
+#include "hw5_log.h"
+#include "hw5_restart.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+
+#define USAGE                   "Usage: %s [-t Threads] [-c] [-e epoll|uring] [-l Level] [-s Seconds] [-f Files] [-m Bytes] [-d Threads] [-H] [-n] [-k] [-z Bytes] " \
+                                "[-b Backlog] [-x Connections] [-i Seconds] [-r Seconds] [-w Seconds] [-u Path] PortNumber\n" \
+                                "  -t Threads  the number of worker threads, defaults to the number of online CPUs\n" \
+                                "  -c          pin each worker thread to a CPU\n" \
+                                "  -e Engine   the I/O engine of the event loops, uring falls back to epoll on old kernels\n" \
+                                "  -l Level    the least level of logs to write: debug, info, warn or error, defaults to info\n" \
+                                "  -s Seconds  write the statistics to the log every few seconds\n" \
+                                "  -f Files    the number of files each worker keeps open, 0 disables the cache, defaults to 256\n" \
+                                "  -m Bytes    cached files up to this size are answered from memory, defaults to 16384\n" \
+                                "  -d Threads  the number of threads which wait for the disk, 0 leaves it to the event loops, defaults to 4\n" \
+                                "  -H          back the buffers of connections with huge pages\n" \
+                                "  -n          keep Nagle's algorithm, small replies wait for the ACK of the previous one\n" \
+                                "  -k          send the header of a file on its own instead of corking it with the file\n" \
+                                "  -z Bytes    responses from memory of at least this size are sent with MSG_ZEROCOPY,\n" \
+                                "              0 copies every response, defaults to 32768\n" \
+                                "  -b Backlog  the length of the queue of connections waiting to be accepted, defaults to 1024\n" \
+                                "  -x Connections  clients beyond this number are turned away with a busy reply, 0 is unlimited\n" \
+                                "  -i Seconds  close connections idle for this long, 0 disables it, defaults to 60\n" \
+                                "  -r Seconds  close connections which do not complete a request in time, 0 disables it, defaults to 10\n" \
+                                "  -w Seconds  close connections which do not take a response in time, 0 disables it, defaults to 30\n" \
+                                "  -u Path     the control socket of hot restart, a server started with the path of a running\n" \
+                                "              server takes over its listeners and the running server drains and exits\n"
 
 /**
- * Fix undefined reference to `max' issue.
+ * The state of a worker thread which serves a shard of the connections.
  */
-static inline int max(int a, int b) {
-    return (a > b) ? a : b;
-}
+typedef struct {
+    int       workerId;
+    int       cpuId;
+    int       ioEngine;
+    int       tcpSocketFileDescriptor;
+    int       udpSocketFileDescriptor;
+    TransmitPolicy transmitPolicy;      // the policy of the TCP listener of this worker
+    pthread_t thread;
+} Worker;
 
 /**
  * Prototypes of functions.
  */
-int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor);
-int registerNewSocket(int clientSocketFD, int* clientSocketFileDescriptors, int n);
-void toUppercaseString(char* input, char* output);
+int createListeners(int portNumber, int isReusePort, int backlog, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor);
+void closeListeners(int tcpSocketFileDescriptor, int udpSocketFileDescriptor);
+void* runWorker(void* pArgument);
 
 /**
  * The entrance of the server application.
@@ -40,33 +74,235 @@ void toUppercaseString(char* input, char* output);
  * @return 0 if the application exited normally
  */
 int main(int argc, char* argv[]) {
-    if ( argc != 2 ) {
-        fprintf(stderr, "Usage: %s PortNumber\n", argv[0]);
+    int nWorkers = 0;
+    int isCpuPinned = FALSE;
+    int ioEngine = IO_ENGINE_EPOLL;
+    int level = LOG_LEVEL_INFO;
+    int statsInterval = 0;
+    int maxCacheEntries = DEFAULT_CACHE_ENTRIES;
+    long smallFileSize = DEFAULT_SMALL_FILE_SIZE;
+    int nOffloadThreads = DEFAULT_OFFLOAD_THREADS;
+    int isHugePageEnabled = FALSE;
+    TransmitPolicy transmitPolicy = { TRUE, TRUE, DEFAULT_ZEROCOPY_THRESHOLD };
+    long zeroCopyThreshold = DEFAULT_ZEROCOPY_THRESHOLD;
+    int backlog = DEFAULT_BACKLOG;
+    int maxConnections = 0;
+    int idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    int readTimeout = DEFAULT_READ_TIMEOUT;
+    int writeTimeout = DEFAULT_WRITE_TIMEOUT;
+    const char* controlPath = NULL;
+    int option = 0;
+    while ( (option = getopt(argc, argv, "t:ce:l:s:f:m:d:Hnkz:b:x:i:r:w:u:")) != -1 ) {
+        switch ( option ) {
+            case 't':
+                nWorkers = atoi(optarg);
+                break;
+            case 'c':
+                isCpuPinned = TRUE;
+                break;
+            case 'e':
+                if ( strcmp(optarg, "epoll") == 0 ) {
+                    ioEngine = IO_ENGINE_EPOLL;
+                } else if ( strcmp(optarg, "uring") == 0 ) {
+                    ioEngine = IO_ENGINE_URING;
+                } else {
+                    fprintf(stderr, USAGE, argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                level = parseLogLevel(optarg);
+                if ( level == -1 ) {
+                    fprintf(stderr, USAGE, argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                statsInterval = atoi(optarg);
+                break;
+            case 'f':
+                maxCacheEntries = atoi(optarg);
+                break;
+            case 'm':
+                smallFileSize = atol(optarg);
+                break;
+            case 'd':
+                nOffloadThreads = atoi(optarg);
+                break;
+            case 'H':
+                isHugePageEnabled = TRUE;
+                break;
+            case 'n':
+                transmitPolicy.isNoDelay = FALSE;
+                break;
+            case 'k':
+                transmitPolicy.isCorked = FALSE;
+                break;
+            case 'z':
+                zeroCopyThreshold = atol(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'x':
+                maxConnections = atoi(optarg);
+                break;
+            case 'i':
+                idleTimeout = atoi(optarg);
+                break;
+            case 'r':
+                readTimeout = atoi(optarg);
+                break;
+            case 'w':
+                writeTimeout = atoi(optarg);
+                break;
+            case 'u':
+                controlPath = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ( optind != argc - 1 || nWorkers < 0 || statsInterval < 0 || maxCacheEntries < 0 || smallFileSize < 0 ||
+         nOffloadThreads < 0 || zeroCopyThreshold < 0 || backlog <= 0 || maxConnections < 0 || idleTimeout < 0 ||
+         readTimeout < 0 || writeTimeout < 0 ) {
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     } 
 
-    int portNumber = atoi(argv[1]);
+    transmitPolicy.zeroCopyThreshold = (size_t) zeroCopyThreshold;
+
+    int portNumber = atoi(argv[optind]);
     if ( portNumber <= 0 ) {
-        fprintf(stderr, "Usage: %s PortNumber\n", argv[0]);
+        fprintf(stderr, USAGE, argv[0]);
         return EXIT_FAILURE;
     }
 
+    /*
+     * Logs are written by a background thread, the records left at exit are flushed by stopLogger().
+     */
+    if ( startLogger(level) == 0 ) {
+        atexit(stopLogger);
+    }
+
+    /*
+     * Shard the service across workers, each worker owns a TCP and a UDP socket bound
+     * to the same port with SO_REUSEPORT and runs its own event loop.
+     */
+    int nCpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if ( nCpus <= 0 ) {
+        nCpus = 1;
+    }
+    if ( nWorkers == 0 ) {
+        nWorkers = nCpus;
+    }
+
+    /*
+     * A hot restart adopts the listeners of the running server, the workers follow the
+     * shards of the running server since a shard closed by either process loses its queue.
+     */
+    int listeners[2 * MAX_HANDOFF_WORKERS];
+    int nInheritedWorkers = 0;
+    int controlSocketFileDescriptor = controlPath == NULL ? -1 : takeOverListeners(controlPath, listeners, &nInheritedWorkers);
+    if ( controlSocketFileDescriptor != -1 ) {
+        if ( nInheritedWorkers != nWorkers ) {
+            LOG_WARN("The running server has %d worker(s), the new process keeps them.\n", nInheritedWorkers);
+        }
+        nWorkers = nInheritedWorkers;
+    }
+
+    Worker* workers = (Worker*) calloc(nWorkers, sizeof(Worker));
+    if ( workers == NULL ) {
+        LOG_ERROR("Failed to allocate workers: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int i = 0;
+    for ( i = 0; i < nWorkers; ++ i ) {
+        workers[i].workerId = i;
+        workers[i].cpuId = isCpuPinned ? i % nCpus : -1;
+        workers[i].ioEngine = ioEngine;
+        if ( controlSocketFileDescriptor != -1 ) {
+            workers[i].tcpSocketFileDescriptor = listeners[2 * i];
+            workers[i].udpSocketFileDescriptor = listeners[2 * i + 1];
+            // Listening again only changes the backlog, the queued clients stay
+            listen(workers[i].tcpSocketFileDescriptor, backlog);
+        } else if ( createListeners(portNumber, nWorkers > 1, backlog, &workers[i].tcpSocketFileDescriptor, 
+                &workers[i].udpSocketFileDescriptor) == -1 ) {
+            return EXIT_FAILURE;
+        }
+        if ( i < MAX_HANDOFF_WORKERS ) {
+            listeners[2 * i] = workers[i].tcpSocketFileDescriptor;
+            listeners[2 * i + 1] = workers[i].udpSocketFileDescriptor;
+        }
+        workers[i].transmitPolicy = transmitPolicy;
+        applyTransmitPolicy(workers[i].tcpSocketFileDescriptor, &workers[i].transmitPolicy);
+    }
+    LOG_INFO("Server is listening on port %d with %d worker(s).\n", portNumber, nWorkers);
+    if ( statsInterval > 0 ) {
+        startStatsReporter(statsInterval);
+    }
+    configureBufferPool(isHugePageEnabled);
+    configureFileCache(maxCacheEntries, (size_t) smallFileSize);
+    configureConnectionLimits(maxConnections, idleTimeout, readTimeout, writeTimeout);
+    startOffloadPool(nOffloadThreads);
+    if ( controlPath != NULL ) {
+        startHandoffServer(controlPath, listeners, nWorkers);
+    }
+
+    /*
+     * The main thread serves the first shard itself. The previous server drains once
+     * the workers of this process are started.
+     */
+    for ( i = 1; i < nWorkers; ++ i ) {
+        int errorCode = pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]);
+        if ( errorCode != 0 ) {
+            LOG_ERROR("Failed to start worker #%d: %s\n", i, strerror(errorCode));
+            return EXIT_FAILURE;
+        }
+    }
+    if ( controlSocketFileDescriptor != -1 ) {
+        finishTakeOver(controlSocketFileDescriptor);
+    }
+    runWorker(&workers[0]);
+
+    for ( i = 1; i < nWorkers; ++ i ) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Create the TCP and UDP sockets of the server and bind them to the port.
+ * @param  portNumber               the port number to listen to
+ * @param  isReusePort              whether other sockets are allowed to bind to the same port
+ * @param  backlog                  the length of the queue of connections waiting to be accepted
+ * @param  pTcpSocketFileDescriptor the pointer which receives the file descriptor of TCP socket
+ * @param  pUdpSocketFileDescriptor the pointer which receives the file descriptor of UDP socket
+ * @return -1 if the sockets are failed to create
+ */
+int createListeners(int portNumber, int isReusePort, int backlog, int* pTcpSocketFileDescriptor, int* pUdpSocketFileDescriptor) {
     /*
      * Create socket file descriptor.
      * Function Prototype: int socket(int domain, int type,int protocol)
      * Defined in sys/socket.h
      *
      * @param domain:   AF_INET stands for Internet, AF_UNIX can only communicate between UNIX systems.
-     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP
+     * @param type      the prototype to use, SOCK_STREAM stands for TCP and SOCK_DGRAM stands for UDP,
+     *                  SOCK_NONBLOCK makes every I/O operation on the socket return EAGAIN instead of blocking
      * @param protocol  if type is specified, this parameter can be assigned to 0.
      * @return -1 if socket is failed to create
      */
-    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    int udpSocketFileDescriptor = socket(AF_INET, SOCK_DGRAM, 0);
+    int tcpSocketFileDescriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int udpSocketFileDescriptor = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
     if ( tcpSocketFileDescriptor == -1 || udpSocketFileDescriptor == -1 ) {
-        fprintf(stderr, "[ERROR] Failed to create socket: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        LOG_ERROR("Failed to create socket: %s\n", strerror(errno));
+        closeListeners(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        return -1;
     }
 
     /*
@@ -107,14 +343,23 @@ int main(int argc, char* argv[]) {
      *                stand for IP and TCP level respectively
      * @param optname SO_REUSERADDR controls whether bind should permit reuse of local addresses for this socket.
      *                See http://www.gnu.org/software/libc/manual/html_node/Socket_002dLevel-Options.html for details.
+     *                SO_REUSEPORT lets every worker bind its own socket to the same port, the kernel then
+     *                spreads incoming connections and datagrams across these sockets.
      * @param optval  the value of the option
      * @param optlen  the size of the option
      * @return -1 if the operation failed
      */
     int optionValue = 1;
     setsockopt(tcpSocketFileDescriptor, SOL_SOCKET, SO_REUSEADDR, &optionValue, sizeof(optionValue));
+    if ( isReusePort ) {
+        if ( setsockopt(tcpSocketFileDescriptor, SOL_SOCKET, SO_REUSEPORT, &optionValue, sizeof(optionValue)) == -1 ||
+             setsockopt(udpSocketFileDescriptor, SOL_SOCKET, SO_REUSEPORT, &optionValue, sizeof(optionValue)) == -1 ) {
+            LOG_ERROR("Failed to enable SO_REUSEPORT: %s\n", strerror(errno));
+            closeListeners(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+            return -1;
+        }
+    }
 
-    
     /*
      * Bind socket file descriptor to the port.
      * Function Prototype: int bind(int sockfd, struct sockaddr *my_addr, int addrlen)
@@ -126,12 +371,14 @@ int main(int argc, char* argv[]) {
      * @return -1 if socket is failed to bind
      */
     if ( bind(tcpSocketFileDescriptor, (struct sockaddr*)(&serverSocketAddress), sockaddrSize) == -1) {
-        fprintf(stderr, "[ERROR] Failed to bind TCP socket file descriptor to specified address: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        LOG_ERROR("Failed to bind TCP socket file descriptor to specified address: %s\n", strerror(errno));
+        closeListeners(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        return -1;
     }
     if ( bind(udpSocketFileDescriptor, (struct sockaddr*)(&serverSocketAddress), sockaddrSize) == -1) {
-        fprintf(stderr, "[ERROR] Failed to bind UDP socket file descriptor to specified address: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+        LOG_ERROR("Failed to bind UDP socket file descriptor to specified address: %s\n", strerror(errno));
+        closeListeners(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        return -1;
     }
 
     /*
@@ -140,243 +387,244 @@ int main(int argc, char* argv[]) {
      * Defined in sys/socket.h and sys/types.h
      *
      * @param sockfd  the socket file descriptor
-     * @param backlog the maximum length to which the queue of pending connections
+     * @param backlog the maximum length to which the queue of pending connections, the kernel caps it
+     *                at net.core.somaxconn, a longer queue absorbs bursts while the workers are busy
      * @return -1 if socket is failed to listen
      */
-    if ( listen(tcpSocketFileDescriptor, MAX_PENDING_CONNECTIONS) == -1 ) {
-        fprintf(stderr, "[ERROR] Failed to listen to the TCP socket: %s\n", strerror(errno));
-        return EXIT_FAILURE;
+    if ( listen(tcpSocketFileDescriptor, backlog) == -1 ) {
+        LOG_ERROR("Failed to listen to the TCP socket: %s\n", strerror(errno));
+        closeListeners(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+        return -1;
+    }
+
+    *pTcpSocketFileDescriptor = tcpSocketFileDescriptor;
+    *pUdpSocketFileDescriptor = udpSocketFileDescriptor;
+    return 0;
+}
+
+/**
+ * Close the TCP and UDP sockets of the server.
+ * @param tcpSocketFileDescriptor the file descriptor of TCP socket, -1 if it was not created
+ * @param udpSocketFileDescriptor the file descriptor of UDP socket, -1 if it was not created
+ */
+void closeListeners(int tcpSocketFileDescriptor, int udpSocketFileDescriptor) {
+    if ( tcpSocketFileDescriptor != -1 ) {
+        close(tcpSocketFileDescriptor);
+    }
+    if ( udpSocketFileDescriptor != -1 ) {
+        close(udpSocketFileDescriptor);
+    }
+}
+
+/**
+ * The entrance of worker threads.
+ * @param  pArgument the pointer to the Worker struct of this thread
+ * @return NULL
+ */
+void* runWorker(void* pArgument) {
+    Worker* pWorker = (Worker*) pArgument;
+    attachWorkerStats();
+    attachFileCache();
+
+    if ( pWorker->cpuId >= 0 ) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(pWorker->cpuId, &cpuSet);
+
+        int errorCode = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if ( errorCode != 0 ) {
+            LOG_WARN("Failed to pin worker #%d to CPU %d: %s\n", 
+                pWorker->workerId, pWorker->cpuId, strerror(errorCode));
+        }
     }
 
     /*
-     * Prepare for handling TCP and UDP connections using select.
+     * Prepare for handling TCP and UDP connections using io_uring or epoll.
      */
-    int exitCode = acceptConnections(tcpSocketFileDescriptor, udpSocketFileDescriptor);
+    int exitCode = IO_ENGINE_UNSUPPORTED;
+    if ( pWorker->ioEngine == IO_ENGINE_URING ) {
+        exitCode = acceptConnectionsWithUring(pWorker->tcpSocketFileDescriptor, pWorker->udpSocketFileDescriptor,
+            &pWorker->transmitPolicy);
+        if ( exitCode == IO_ENGINE_UNSUPPORTED ) {
+            LOG_WARN("Worker #%d falls back to epoll.\n", pWorker->workerId);
+        }
+    }
+    if ( exitCode == IO_ENGINE_UNSUPPORTED ) {
+        exitCode = acceptConnections(pWorker->tcpSocketFileDescriptor, pWorker->udpSocketFileDescriptor, &pWorker->transmitPolicy);
+    }
     if ( exitCode == -1 ) {
-        fprintf(stderr, "[ERROR] Server exit with an error: %s\n", strerror(errno));
+        LOG_ERROR("Worker #%d exit with an error: %s\n", pWorker->workerId, strerror(errno));
     }
 
     /*
      * Close Sockets.
      */
-    close(tcpSocketFileDescriptor);
-    close(udpSocketFileDescriptor);
+    closeListeners(pWorker->tcpSocketFileDescriptor, pWorker->udpSocketFileDescriptor);
 
-    return EXIT_SUCCESS;
+    return NULL;
 }
 
 /**
- * Connections handler for the server.
- * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
- * @param  udpSocketFileDescriptor the file descriptor of UDP socket
- * @return -1 if a severe error occurred in this procedure
+ * Release the file or the cache entry a response body was sent from.
+ * @param fileFileDescriptor the file descriptor of the body, -1 if there is none
+ * @param pCachedFile        the cache entry which owns the body, NULL if the file is owned by the response
  */
-int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor) {
-    /**
-     * The file descriptor used to check readability, if characters become available for reading.
-     */
-    fd_set readFileDescriptorSet;
+void releaseBodySource(int fileFileDescriptor, CachedFile* pCachedFile) {
+    if ( pCachedFile != NULL ) {
+        releaseCachedFile(pCachedFile);
+    } else if ( fileFileDescriptor != -1 ) {
+        close(fileFileDescriptor);
+    }
+}
 
-    /**
-     * Buffers for sending and receiving data.
-     */
-    char inputBuffer[BUFFER_SIZE] = {0};
-    char outputBuffer[BUFFER_SIZE] = {0};
+/**
+ * Get the size of the buffer which receives the response to a request, an engine
+ * reserves it before the request is handled.
+ * @param  pRequest the header of the request
+ * @return the number of bytes handleRequest() may write to its output buffer
+ */
+size_t getResponseCapacity(const FrameHeader* pRequest) {
+    size_t payloadLength = pRequest->payloadLength > MAX_SMALL_RESPONSE ? (size_t) pRequest->payloadLength : MAX_SMALL_RESPONSE;
+    return FRAME_HEADER_SIZE + payloadLength;
+}
 
-    /**
-     * Client sockets.
-     */
-    socklen_t sockaddrSize = sizeof(struct sockaddr);
-    struct sockaddr_in clientSocketAddress;
-    int clientSocketFileDescriptors[MAX_CONNECTIONS] = {0};
+/**
+ * Handle a request frame received from a TCP client and build the response.
+ * Both I/O engines share this procedure, they only differ in how bytes are moved.
+ * @param  pRequest     the header of the request
+ * @param  payload      the payload of the request, pRequest->payloadLength bytes
+ * @param  outputBuffer the buffer which receives the response, at least
+ *                      getResponseCapacity(pRequest) bytes
+ * @param  pBody        the pointer which receives the body to send after outputBuffer,
+ *                      the engine releases its source with releaseBodySource() once it is sent
+ * @param  pJob         the job of the connection which loads a file missing from the cache,
+ *                      NULL makes the event loop load the file itself
+ * @return the number of bytes written to outputBuffer, -1 if the connection has to be closed,
+ *         REQUEST_OFFLOADED if the request waits for pJob
+ */
+int handleRequest(const FrameHeader* pRequest, const unsigned char* payload, unsigned char* outputBuffer, ResponseBody* pBody,
+                  OffloadJob* pJob) {
+    FrameHeader response;
+    response.opcode = pRequest->opcode;
+    response.status = STATUS_OK;
+    response.requestId = pRequest->requestId;
+    response.payloadLength = 0;
+    memset(pBody, 0, sizeof(ResponseBody));
+    pBody->fileFileDescriptor = -1;
+    // A request resumed after its job completed was counted when it was first handled
+    if ( pJob == NULL || !pJob->isCompleted || pJob->type != OFFLOAD_LOAD_FILE ) {
+        countRequest(pRequest->opcode);
+    }
 
-    /**
-     * Handle TCP and UDP connections.
-     */
-    while ( TRUE ) {
-        /**
-         * Clear the read file descriptor set.
-         */
-        FD_ZERO(&readFileDescriptorSet);
-
-        /**
-         * Add file descriptor of TCP and UDP to the set.
-         */
-        FD_SET(tcpSocketFileDescriptor, &readFileDescriptorSet);
-        FD_SET(udpSocketFileDescriptor, &readFileDescriptorSet);
-        int maxFileDescriptor = max(tcpSocketFileDescriptor, udpSocketFileDescriptor);
-
-        /**
-         * Add valid socket file descriptor to the read set.
-         */
-        int i = 0;
-        for ( i = 0; i < MAX_CONNECTIONS; ++ i ) {
-            int clientSocketFD = clientSocketFileDescriptors[i];
-
-            if ( clientSocketFD > 0 ) {
-                FD_SET(clientSocketFD, &readFileDescriptorSet);
-            }
-            if ( clientSocketFD > maxFileDescriptor ) {
-                maxFileDescriptor = clientSocketFD;
+    // Handler for TCP messages
+    if ( pRequest->opcode == OPCODE_BYE ) {
+        return -1;
+    } else if ( pRequest->opcode == OPCODE_GET || pRequest->opcode == OPCODE_GET_RANGE || pRequest->opcode == OPCODE_STAT ) {
+        // Send file stream to the client, or a part of it
+        uint64_t rangeOffset = 0;
+        uint64_t rangeLength = 0;
+        size_t pathOffset = 0;
+        if ( pRequest->opcode == OPCODE_GET_RANGE ) {
+            if ( pRequest->payloadLength < RANGE_HEADER_SIZE ) {
+                response.status = STATUS_BAD_REQUEST;
+                addStat(STAT_FAILED_REQUESTS, 1);
+                encodeFrameHeader(&response, outputBuffer);
+                return FRAME_HEADER_SIZE;
             }
+            rangeOffset = decodeUint64(payload);
+            rangeLength = decodeUint64(payload + 8);
+            pathOffset = RANGE_HEADER_SIZE;
         }
 
-        /*
-         * Wait for an activity on one of the sockets, timeout is NULL, so wait indefinitely.
-         * Function Prototype: int select(int nfds, fd_set *readset, fd_set *writeset,fd_set* exceptset, struct tim *timeout);
-         * Defined in sys/select.h
-         *
-         * @param nfds      the max ID of file descriptor to check
-         * @param readset   the file descriptor used to check readability
-         * @param writeset  the file descriptor used to check writability
-         * @param exceptset the file descriptor used to check exceptions
-         * @param timeout   the interval to be rounded up
-         * @return the number of file descriptors contained in the three returned descriptor sets
-         */
-        int events = select(maxFileDescriptor + 1, &readFileDescriptorSet, NULL, NULL, NULL);
-        if ( events == -1 && errno != EINTR ) {
-            fprintf(stderr, "[ERROR] An error occurred while monitoring sockets: %s\n", strerror(errno));
-        }
-
-        // New incoming TCP connection
-        if ( FD_ISSET(tcpSocketFileDescriptor, &readFileDescriptorSet) ) {
-            // Establish connection with client
-            int clientSocketFD = accept(tcpSocketFileDescriptor, (struct sockaddr *)(&clientSocketAddress), &sockaddrSize);
-
-            if ( clientSocketFD == -1 ) {
-                fprintf(stderr, "[WARN][TCP] Failed to accpet a socket from client: %s\n", strerror(errno));
-                continue;
-            }
-            fprintf(stderr, "[INFO][TCP] Connection established with %s:%d\n", 
-                inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port));
-
-            // Register file descriptors for sockets
-            int clientSocketFDIndex = registerNewSocket(clientSocketFD, clientSocketFileDescriptors, MAX_CONNECTIONS);
-            if ( clientSocketFDIndex == -1 ) {
-                fprintf(stderr, "[WARN][TCP] Failed to register the socket for client: %s:%d\n", 
-                    inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port));
-            } else {
-                fprintf(stderr, "[INFO][TCP] Socket #%d registered for the client: %s:%d\n", 
-                    clientSocketFDIndex, inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port));
+        // Hot files come from the cache of the worker, cold files are loaded by the disk I/O pool
+        const unsigned char* path = payload + pathOffset;
+        size_t pathLength = pRequest->payloadLength - pathOffset;
+        CachedFile* pCachedFile = NULL;
+        int isLoaded = TRUE;
+        if ( pJob != NULL && pJob->isCompleted && pJob->type == OFFLOAD_LOAD_FILE ) {
+            pCachedFile = pJob->pLoadedFile;
+            pJob->isCompleted = FALSE;
+            pJob->pLoadedFile = NULL;
+        } else if ( (pCachedFile = findCachedFile(path, pathLength)) != NULL ) {
+            isLoaded = FALSE;
+        } else {
+            if ( pJob != NULL ) {
+                pJob->type = OFFLOAD_LOAD_FILE;
+                pJob->path = path;
+                pJob->pathLength = pathLength;
+                if ( submitOffloadJob(pJob) == 0 ) {
+                    return REQUEST_OFFLOADED;
+                }
             }
+            pCachedFile = loadCachedFile(path, pathLength);
         }
-        
-        // New incoming UDP connection
-        if ( FD_ISSET(udpSocketFileDescriptor, &readFileDescriptorSet) ) {
-            // Receive a message from client
-            int readBytes = recvfrom(udpSocketFileDescriptor, inputBuffer, BUFFER_SIZE, 0, (struct sockaddr *)(&clientSocketAddress), &sockaddrSize);
-
-            if ( readBytes < 0 ) {
-                fprintf(stderr, "[ERROR][UDP] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
-                    inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
-                continue;
+        if ( pCachedFile != NULL && isLoaded ) {
+            insertCachedFile(pCachedFile);
+        }
+        int fileFileDescriptor = pCachedFile == NULL ? -1 : pCachedFile->fileFileDescriptor;
+        uint64_t fileSize = pCachedFile == NULL ? 0 : (uint64_t) pCachedFile->size;
+
+        if ( pCachedFile == NULL ) {
+            response.status = STATUS_NOT_FOUND;
+        } else if ( pRequest->opcode == OPCODE_STAT ) {
+            encodeUint64(fileSize, outputBuffer + FRAME_HEADER_SIZE);
+            response.payloadLength = sizeof(uint64_t);
+        } else if ( rangeOffset > fileSize ) {
+            response.status = STATUS_BAD_RANGE;
+        } else {
+            // The range stops at the end of the file
+            if ( rangeLength == 0 || rangeLength > fileSize - rangeOffset ) {
+                rangeLength = fileSize - rangeOffset;
             }
-            fprintf(stderr, "[INFO][UDP] Received a message from client %s:%d: %s\n", 
-                inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
-
-            // Send a message to client
-            toUppercaseString(inputBuffer, outputBuffer);
-            if ( sendto(udpSocketFileDescriptor, outputBuffer, strlen(outputBuffer), 0, (struct sockaddr *)(&clientSocketAddress), sockaddrSize) == -1 ) {
-                fprintf(stderr, "[ERROR][UDP] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
-                    inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
+            response.payloadLength = rangeLength;
+            if ( rangeLength > 0 && pCachedFile != NULL && pCachedFile->content != NULL ) {
+                pBody->content = pCachedFile->content + rangeOffset;
+                pBody->contentLength = (size_t) rangeLength;
+                pBody->pCachedFile = pCachedFile;
+            } else if ( rangeLength > 0 ) {
+                pBody->fileFileDescriptor = fileFileDescriptor;
+                pBody->fileOffset = (off_t) rangeOffset;
+                pBody->fileLength = (off_t) rangeLength;
+                pBody->pCachedFile = pCachedFile;
             }
         }
-
-        // IO operation on some other sockets
-        for ( i = 0; i < MAX_CONNECTIONS; ++ i ) {
-            int clientSocketFD = clientSocketFileDescriptors[i];
-
-            if ( FD_ISSET(clientSocketFD, &readFileDescriptorSet) ) {
-                // Receive a message from client
-                int readBytes = recv(clientSocketFD, inputBuffer, BUFFER_SIZE, 0);
-                
-                if ( readBytes < 0 ) {
-                    fprintf(stderr, "[ERROR][TCP] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
-                        inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
-                    continue;
-                }
-                fprintf(stderr, "[INFO][TCP] Received a message from client %s:%d: %s\n", 
-                    inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
-
-                // Handler for TCP messages
-                if ( readBytes == 0 || strcmp("BYE", inputBuffer) == 0 ) {
-                    // Complete receiving message from client
-                    close(clientSocketFD);
-                    clientSocketFileDescriptors[i] = 0;
-                    fprintf(stderr, "[INFO][TCP] Client %s:%d disconnected.\n", 
-                        inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port));
-
-                    continue;
-                } else if ( strncmp("GET", inputBuffer, 3) ==0 ) {
-                    // Send file stream to the client
-                    char filePath[BUFFER_SIZE] = {0};
-                    memcpy(filePath, &inputBuffer[4], strlen(inputBuffer) - 4);
-                    FILE* inputFile = fopen(filePath, "rb");
-
-                    char* pMessage = "ACCEPT";
-                    if ( inputFile == NULL ) {
-                        pMessage = "REJECT";
-                    }
-                    send(clientSocketFD, pMessage, strlen(pMessage), 0);
-
-                    // Send file stream
-                    int readBytes = 0;
-                    while ( (readBytes = fread(outputBuffer, sizeof(char), BUFFER_SIZE, inputFile)) > 0 ) {
-                        send(clientSocketFD, outputBuffer, readBytes, 0);
-                        fprintf(stderr, "[INFO] Sent %lu bytes\n", strlen(outputBuffer));
-                        memset(outputBuffer, 0, BUFFER_SIZE);
-                    }
-                    fclose(inputFile);
-                    fprintf(stderr, "[INFO][TCP] Send file stream to client %s:%d: %s\n", 
-                        inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), inputBuffer);
-                } else {
-                    // Send a message to client
-                    // toUppercaseString(inputBuffer, outputBuffer);
-                    if ( send(clientSocketFD, inputBuffer, strlen(inputBuffer), 0) == -1 ) {
-                        clientSocketFileDescriptors[i] = 0;
-
-                        fprintf(stderr, "[ERROR] An error occurred while sending message to the client %s:%d: %s\nThe connection is going to close.\n", 
-                            inet_ntoa(clientSocketAddress.sin_addr), ntohs(clientSocketAddress.sin_port), strerror(errno));
-                    }
-                }
-            }
+        if ( pBody->fileFileDescriptor == -1 && pBody->content == NULL ) {
+            releaseBodySource(fileFileDescriptor, pCachedFile);
         }
-    }
-}
-
-/**
- * Register a new file descriptor for new connections.
- * @param  clientSocketFD              the file descriptor to register
- * @param  clientSocketFileDescriptors the set of file descriptors
- * @param  n                           the capcity of the set of file descriptors
- * @return the index of the file descriptor in the set
- */
-int registerNewSocket(int clientSocketFD, int* clientSocketFileDescriptors, int n) {
-    int i = 0;
-    for ( i = 0; i < n; ++ i ) {
-        if ( clientSocketFileDescriptors[i] == 0 ) {
-            clientSocketFileDescriptors[i] = clientSocketFD;
-            
-            return i;
+    } else if ( pRequest->opcode == OPCODE_ECHO ) {
+        // Send a message to client
+        memcpy(outputBuffer + FRAME_HEADER_SIZE, payload, pRequest->payloadLength);
+        response.payloadLength = pRequest->payloadLength;
+    } else if ( pRequest->opcode == OPCODE_UPPERCASE ) {
+        // Send the message in upper case to client
+        toUppercaseString((const char*) payload, (char*) outputBuffer + FRAME_HEADER_SIZE, pRequest->payloadLength);
+        response.payloadLength = pRequest->payloadLength;
+    } else if ( pRequest->opcode == OPCODE_STREAM ) {
+        // Send zero bytes from a sparse file, its holes are read without touching the disk or the memory
+        int fileFileDescriptor = pRequest->payloadLength == sizeof(uint64_t) ? memfd_create("hw5_stream", MFD_CLOEXEC) : -1;
+        uint64_t streamLength = pRequest->payloadLength == sizeof(uint64_t) ? decodeUint64(payload) : 0;
+        if ( fileFileDescriptor == -1 || ftruncate(fileFileDescriptor, (off_t) streamLength) == -1 ) {
+            response.status = STATUS_BAD_REQUEST;
+        } else {
+            response.payloadLength = streamLength;
         }
-    }
-    return -1;
-}
-
-/**
- * Convert all lower case characters to upper case.
- * @param input  the string for input
- * @param output the string for output
- */
-void toUppercaseString(char* input, char* output) {
-    for ( ; *input; ++ input, ++ output ) {
-        *output = *input;
-
-        if ( *input >= 'a' && *input <= 'z' ) {
-            *output = *input - 'a' + 'A';
+        if ( response.status == STATUS_OK && streamLength > 0 ) {
+            pBody->fileFileDescriptor = fileFileDescriptor;
+            pBody->fileOffset = 0;
+            pBody->fileLength = (off_t) streamLength;
+        } else if ( fileFileDescriptor != -1 ) {
+            close(fileFileDescriptor);
         }
+    } else if ( pRequest->opcode == OPCODE_STATS ) {
+        // Send the statistics of all workers to client
+        response.payloadLength = formatStats((char*) outputBuffer + FRAME_HEADER_SIZE, MAX_SMALL_RESPONSE);
+    } else {
+        response.status = STATUS_BAD_REQUEST;
     }
 
-    // Add the end character of at the end of string
-    *output = 0;
+    if ( response.status != STATUS_OK ) {
+        addStat(STAT_FAILED_REQUESTS, 1);
+    }
+    encodeFrameHeader(&response, outputBuffer);
+    return FRAME_HEADER_SIZE + (pBody->fileFileDescriptor == -1 && pBody->content == NULL ? (int) response.payloadLength : 0);
 }
@@ -0,0 +1,67 @@
+#ifndef HW5_SERVER_H
+#define HW5_SERVER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "hw5_buffer.h"
+#include "hw5_cache.h"
+#include "hw5_connection.h"
+#include "hw5_offload.h"
+#include "hw5_protocol.h"
+#include "hw5_transmit.h"
+
+#define TRUE                    1
+#define FALSE                   0
+
+#define BUFFER_SIZE             1024
+
+/**
+ * The most bytes a response built in memory holds beyond the payload of its request,
+ * the text report of STATS is the largest of them.
+ */
+#define MAX_SMALL_RESPONSE      1024
+
+/**
+ * The I/O engines which are able to drive the event loop of a worker.
+ */
+#define IO_ENGINE_EPOLL         0
+#define IO_ENGINE_URING         1
+
+/**
+ * Returned by the io_uring engine if the kernel lacks a feature it relies on,
+ * the worker falls back to the epoll engine in this case.
+ */
+#define IO_ENGINE_UNSUPPORTED   -2
+
+/**
+ * Returned by handleRequest() if the file of a request is loaded by the disk I/O pool,
+ * the request is handled again when the job completes.
+ */
+#define REQUEST_OFFLOADED       -2
+
+/**
+ * The body which follows the header of a response. It is sent from a file, or from
+ * memory if the file cache keeps the content of a small file.
+ */
+typedef struct {
+    int                     fileFileDescriptor;     // -1 if the body is not sent from a file
+    off_t                   fileOffset;
+    off_t                   fileLength;
+    const unsigned char*    content;                // NULL if the body is not sent from memory
+    size_t                  contentLength;
+    CachedFile*             pCachedFile;            // the owner of the file or the content, NULL if the file is owned by the response
+} ResponseBody;
+
+/**
+ * Prototypes of functions shared by the I/O engines.
+ */
+int acceptConnections(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, const TransmitPolicy* pPolicy);
+int acceptConnectionsWithUring(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, const TransmitPolicy* pPolicy);
+size_t getResponseCapacity(const FrameHeader* pRequest);
+int handleRequest(const FrameHeader* pRequest, const unsigned char* payload, unsigned char* outputBuffer, ResponseBody* pBody,
+                  OffloadJob* pJob);
+void releaseBodySource(int fileFileDescriptor, CachedFile* pCachedFile);
+void toUppercaseString(const char* input, char* output, size_t length);
+
+#endif
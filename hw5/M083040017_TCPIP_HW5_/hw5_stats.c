@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hw5_log.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+
+#define STATS_REPORT_SIZE       1024
+
+__thread WorkerStats* pThreadStats = NULL;
+
+/**
+ * The statistics of all workers, a worker pushes its own on start. They are never
+ * freed, so readers can walk the list at any time.
+ */
+static WorkerStats* pAllStats = NULL;
+
+static const char* histogramNames[N_HISTOGRAMS] = { "echo", "get_ttfb" };
+
+/**
+ * Prototypes of functions.
+ */
+static void* runStatsReporter(void* pArgument);
+
+/**
+ * Give the calling thread its own statistics.
+ * @return -1 if the memory is exhausted, the thread is not counted then
+ */
+int attachWorkerStats(void) {
+    if ( pThreadStats != NULL ) {
+        return 0;
+    }
+
+    WorkerStats* pStats = (WorkerStats*) calloc(1, sizeof(WorkerStats));
+    if ( pStats == NULL ) {
+        LOG_WARN("Failed to allocate statistics: %s\n", strerror(errno));
+        return -1;
+    }
+    pStats->pNext = __atomic_load_n(&pAllStats, __ATOMIC_RELAXED);
+    while ( !__atomic_compare_exchange_n(&pAllStats, &pStats->pNext, pStats, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {
+        // pNext was updated with the current head, try again
+    }
+    pThreadStats = pStats;
+    return 0;
+}
+
+/**
+ * Record the latency of an operation in a histogram of the calling thread.
+ * @param histogram the index of the histogram
+ * @param startTime the time the operation started, from getMonotonicTime()
+ */
+void recordLatency(int histogram, uint64_t startTime) {
+    WorkerStats* pStats = pThreadStats;
+    if ( pStats == NULL || histogram == HISTOGRAM_NONE ) {
+        return;
+    }
+    uint64_t now = getMonotonicTime();
+    uint64_t* pBucket = &pStats->histograms[histogram][getHistogramBucket(now > startTime ? now - startTime : 0)];
+    __atomic_store_n(pBucket, *pBucket + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum the statistics of all workers and write them as text, one line for each group.
+ * @param  buffer     the buffer which receives the text
+ * @param  bufferSize the capacity of the buffer
+ * @return the length of the text, without the end character
+ */
+size_t formatStats(char* buffer, size_t bufferSize) {
+    uint64_t counters[N_STAT_COUNTERS] = {0};
+    static __thread uint64_t histograms[N_HISTOGRAMS][HISTOGRAM_BUCKETS];
+    memset(histograms, 0, sizeof(histograms));
+
+    WorkerStats* pStats = __atomic_load_n(&pAllStats, __ATOMIC_ACQUIRE);
+    for ( ; pStats != NULL; pStats = pStats->pNext ) {
+        int i = 0;
+        int j = 0;
+        for ( i = 0; i < N_STAT_COUNTERS; ++ i ) {
+            counters[i] += __atomic_load_n(&pStats->counters[i], __ATOMIC_RELAXED);
+        }
+        for ( i = 0; i < N_HISTOGRAMS; ++ i ) {
+            for ( j = 0; j < HISTOGRAM_BUCKETS; ++ j ) {
+                histograms[i][j] += __atomic_load_n(&pStats->histograms[i][j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    int length = snprintf(buffer, bufferSize,
+        "connections opened %llu active %llu rejected %llu timed_out %llu\n"
+        "requests echo %llu upper %llu get %llu range %llu stat %llu stats %llu stream %llu unknown %llu failed %llu\n"
+        "datagrams %llu\n"
+        "bytes in %llu out %llu\n"
+        "cache hits %llu misses %llu\n"
+        "errors %llu\n",
+        (unsigned long long) counters[STAT_CONNECTIONS_OPENED],
+        (unsigned long long) (counters[STAT_CONNECTIONS_OPENED] - counters[STAT_CONNECTIONS_CLOSED]),
+        (unsigned long long) counters[STAT_REJECTIONS],
+        (unsigned long long) counters[STAT_TIMEOUTS],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_ECHO],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_UPPERCASE],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_GET],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_GET_RANGE],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_STAT],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_STATS],
+        (unsigned long long) counters[STAT_REQUESTS + OPCODE_STREAM],
+        (unsigned long long) counters[STAT_REQUESTS],
+        (unsigned long long) counters[STAT_FAILED_REQUESTS],
+        (unsigned long long) counters[STAT_DATAGRAMS],
+        (unsigned long long) counters[STAT_BYTES_IN],
+        (unsigned long long) counters[STAT_BYTES_OUT],
+        (unsigned long long) counters[STAT_CACHE_HITS],
+        (unsigned long long) counters[STAT_CACHE_MISSES],
+        (unsigned long long) counters[STAT_CONNECTION_ERRORS]);
+
+    int i = 0;
+    for ( i = 0; i < N_HISTOGRAMS && length >= 0 && (size_t) length < bufferSize; ++ i ) {
+        uint64_t count = 0;
+        int maxBucket = 0;
+        int j = 0;
+        for ( j = 0; j < HISTOGRAM_BUCKETS; ++ j ) {
+            count += histograms[i][j];
+            if ( histograms[i][j] > 0 ) {
+                maxBucket = j;
+            }
+        }
+        length += snprintf(buffer + length, bufferSize - length,
+            "%s_us count %llu p50 %.1f p99 %.1f p999 %.1f max %.1f\n", histogramNames[i], (unsigned long long) count,
+            getPercentile(histograms[i], count, 0.5) / 1000.0, getPercentile(histograms[i], count, 0.99) / 1000.0,
+            getPercentile(histograms[i], count, 0.999) / 1000.0, count == 0 ? 0 : getBucketValue(maxBucket) / 1000.0);
+    }
+
+    if ( length < 0 ) {
+        length = 0;
+    }
+    return (size_t) length < bufferSize ? (size_t) length : bufferSize - 1;
+}
+
+/**
+ * Start a thread which writes the statistics to the log periodically.
+ * @param  intervalSeconds the number of seconds between reports
+ * @return -1 if the thread is failed to start
+ */
+int startStatsReporter(int intervalSeconds) {
+    pthread_t thread;
+    int errorCode = pthread_create(&thread, NULL, runStatsReporter, (void*) (intptr_t) intervalSeconds);
+    if ( errorCode != 0 ) {
+        LOG_ERROR("Failed to start the statistics reporter: %s\n", strerror(errorCode));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Find the bucket of a value. Values below 2 * HISTOGRAM_SUB_BUCKETS have a bucket each,
+ * larger values share a bucket with the values of the same 4 leading bits.
+ * @param  value the value to record
+ * @return the index of the bucket
+ */
+int getHistogramBucket(uint64_t value) {
+    if ( value < 2 * HISTOGRAM_SUB_BUCKETS ) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - 4;
+    return shift * HISTOGRAM_SUB_BUCKETS + (int) (value >> shift);
+}
+
+/**
+ * Get the highest value which falls into a bucket.
+ * @param  bucket the index of the bucket
+ * @return the highest value of the bucket
+ */
+uint64_t getBucketValue(int bucket) {
+    if ( bucket < 2 * HISTOGRAM_SUB_BUCKETS ) {
+        return (uint64_t) bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t subBucket = (uint64_t) (bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS);
+    return ((subBucket + 1) << shift) - 1;
+}
+
+/**
+ * Get a percentile of a histogram.
+ * @param  histogram  the buckets of the histogram
+ * @param  count      the number of recorded values
+ * @param  percentile the percentile, between 0 and 1
+ * @return the highest value of the bucket which holds the percentile, 0 if the histogram is empty
+ */
+uint64_t getPercentile(const uint64_t* histogram, uint64_t count, double percentile) {
+    if ( count == 0 ) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile * count);
+    if ( rank < count ) {
+        ++ rank;
+    }
+
+    uint64_t seen = 0;
+    int i = 0;
+    for ( i = 0; i < HISTOGRAM_BUCKETS; ++ i ) {
+        seen += histogram[i];
+        if ( seen >= rank ) {
+            return getBucketValue(i);
+        }
+    }
+    return getBucketValue(HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * The entrance of the reporter thread.
+ * @param  pArgument the number of seconds between reports
+ * @return NULL
+ */
+static void* runStatsReporter(void* pArgument) {
+    int intervalSeconds = (int) (intptr_t) pArgument;
+    char report[STATS_REPORT_SIZE];
+
+    while ( TRUE ) {
+        sleep(intervalSeconds);
+        formatStats(report, sizeof(report));
+
+        // A record keeps a short copy of its strings, so every line is a record
+        const char* pLine = report;
+        const char* pLineEnd = NULL;
+        while ( (pLineEnd = strchr(pLine, '\n')) != NULL ) {
+            LOG_INFO("[STATS] %.*s\n", (int) (pLineEnd - pLine), pLine);
+            pLine = pLineEnd + 1;
+        }
+    }
+    return NULL;
+}
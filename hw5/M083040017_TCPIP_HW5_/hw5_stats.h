@@ -0,0 +1,101 @@
+#ifndef HW5_STATS_H
+#define HW5_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * The counters of a worker. Requests are counted by opcode from STAT_REQUESTS,
+ * opcodes the server does not know are counted at STAT_REQUESTS itself.
+ */
+#define STAT_CONNECTIONS_OPENED 0
+#define STAT_CONNECTIONS_CLOSED 1
+#define STAT_DATAGRAMS          2
+#define STAT_BYTES_IN           3
+#define STAT_BYTES_OUT          4
+#define STAT_CONNECTION_ERRORS  5
+#define STAT_FAILED_REQUESTS    6
+#define STAT_CACHE_HITS         7
+#define STAT_CACHE_MISSES       8
+#define STAT_REJECTIONS         9
+#define STAT_TIMEOUTS           10
+#define STAT_REQUESTS           11
+#define STAT_MAX_OPCODE         8
+#define N_STAT_COUNTERS         (STAT_REQUESTS + STAT_MAX_OPCODE + 1)
+
+/**
+ * The latency histograms of a worker, in nanoseconds.
+ * - ECHO:     from handling an echo or upper case request until its response is sent.
+ * - GET_TTFB: from handling a GET request until the first byte of the file is sent.
+ */
+#define HISTOGRAM_NONE          -1
+#define HISTOGRAM_ECHO          0
+#define HISTOGRAM_GET_TTFB      1
+#define N_HISTOGRAMS            2
+
+/**
+ * Histograms are log-linear like HdrHistogram: every power of 2 is split into
+ * 16 buckets, so a value is kept with an error below 1/16.
+ */
+#define HISTOGRAM_SUB_BUCKETS   16
+#define HISTOGRAM_BUCKETS       (64 * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * The statistics of a worker thread. Only the thread writes them, readers sum
+ * the statistics of all threads without locks and may see a slightly stale total.
+ */
+typedef struct WorkerStats {
+    uint64_t            counters[N_STAT_COUNTERS];
+    uint64_t            histograms[N_HISTOGRAMS][HISTOGRAM_BUCKETS];
+    struct WorkerStats* pNext;
+} WorkerStats;
+
+/**
+ * The statistics of the calling thread, NULL if the thread is not a worker.
+ */
+extern __thread WorkerStats* pThreadStats;
+
+/**
+ * Prototypes of functions.
+ */
+int attachWorkerStats(void);
+void recordLatency(int histogram, uint64_t startTime);
+size_t formatStats(char* buffer, size_t bufferSize);
+int startStatsReporter(int intervalSeconds);
+int getHistogramBucket(uint64_t value);
+uint64_t getBucketValue(int bucket);
+uint64_t getPercentile(const uint64_t* histogram, uint64_t count, double percentile);
+
+/**
+ * Add to a counter of the calling thread.
+ * @param counter the index of the counter
+ * @param value   the value to add
+ */
+static inline void addStat(int counter, uint64_t value) {
+    WorkerStats* pStats = pThreadStats;
+    if ( pStats != NULL ) {
+        // The thread is the only writer, a plain store is enough for readers to see whole values
+        __atomic_store_n(&pStats->counters[counter], pStats->counters[counter] + value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Count a request of a TCP client.
+ * @param opcode the opcode of the request
+ */
+static inline void countRequest(int opcode) {
+    addStat(STAT_REQUESTS + (opcode > 0 && opcode <= STAT_MAX_OPCODE ? opcode : 0), 1);
+}
+
+/**
+ * Read the monotonic clock, which is served by the vDSO without a system call.
+ * @return the current time in nanoseconds
+ */
+static inline uint64_t getMonotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+#endif
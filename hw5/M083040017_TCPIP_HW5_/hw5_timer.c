@@ -0,0 +1,192 @@
+#include <string.h>
+
+#include "hw5_timer.h"
+
+/**
+ * Prototypes of functions.
+ */
+static uint64_t getDeadlineTick(const TimerWheel* pWheel, uint64_t deadline);
+static void placeTimer(TimerWheel* pWheel, TimerEntry* pEntry);
+static void linkTimer(TimerEntry* pHead, TimerEntry* pEntry);
+static void unlinkTimer(TimerEntry* pEntry);
+static void takeSlot(TimerEntry* pSlot, TimerEntry* pList);
+
+/**
+ * Initialize an empty wheel.
+ * @param pWheel the wheel to initialize
+ * @param now    the current monotonic time in nanoseconds, the first tick starts from it
+ */
+void createTimerWheel(TimerWheel* pWheel, uint64_t now) {
+    memset(pWheel, 0, sizeof(TimerWheel));
+    pWheel->startTime = now;
+
+    int level = 0;
+    for ( level = 0; level < TIMER_WHEEL_LEVELS; ++ level ) {
+        int slot = 0;
+        for ( slot = 0; slot < TIMER_WHEEL_SLOTS; ++ slot ) {
+            pWheel->slots[level][slot].pNext = &pWheel->slots[level][slot];
+            pWheel->slots[level][slot].pPrevious = &pWheel->slots[level][slot];
+        }
+    }
+}
+
+/**
+ * Schedule a timer, or move it if it is scheduled already.
+ * @param pWheel   the wheel of the worker
+ * @param pEntry   the timer
+ * @param deadline the monotonic time in nanoseconds when the timer expires
+ */
+void scheduleTimer(TimerWheel* pWheel, TimerEntry* pEntry, uint64_t deadline) {
+    cancelTimer(pWheel, pEntry);
+    pEntry->expiryTick = getDeadlineTick(pWheel, deadline);
+    placeTimer(pWheel, pEntry);
+    ++ pWheel->nTimers;
+}
+
+/**
+ * Make sure a timer expires by a deadline. A timer which expires earlier is kept, so an
+ * owner may arm its timer after every event and check the real deadline when it fires.
+ * @param pWheel   the wheel of the worker
+ * @param pEntry   the timer
+ * @param deadline the monotonic time in nanoseconds when the timer expires at the latest
+ */
+void armTimer(TimerWheel* pWheel, TimerEntry* pEntry, uint64_t deadline) {
+    if ( !isTimerScheduled(pEntry) || pEntry->expiryTick > getDeadlineTick(pWheel, deadline) ) {
+        scheduleTimer(pWheel, pEntry, deadline);
+    }
+}
+
+/**
+ * Cancel a timer, nothing happens if it is not scheduled.
+ * @param pWheel the wheel of the worker
+ * @param pEntry the timer
+ */
+void cancelTimer(TimerWheel* pWheel, TimerEntry* pEntry) {
+    if ( isTimerScheduled(pEntry) ) {
+        unlinkTimer(pEntry);
+        -- pWheel->nTimers;
+    }
+}
+
+/**
+ * Move the wheel to the current time and call the callback of every timer which expired.
+ * The callback may schedule and cancel any timer, including the one which expired.
+ * @param pWheel    the wheel of the worker
+ * @param now       the current monotonic time in nanoseconds
+ * @param callback  the function called for each expired timer
+ * @param pArgument the argument passed to the callback
+ */
+void advanceTimerWheel(TimerWheel* pWheel, uint64_t now, TimerCallback callback, void* pArgument) {
+    uint64_t targetTick = now > pWheel->startTime ? (now - pWheel->startTime) / TIMER_TICK_NS : 0;
+
+    while ( pWheel->currentTick < targetTick ) {
+        if ( pWheel->nTimers == 0 ) {
+            pWheel->currentTick = targetTick;
+            return;
+        }
+        ++ pWheel->currentTick;
+
+        // A level is spread over the level below whenever the level below completes a turn
+        int level = 1;
+        for ( level = 1; level < TIMER_WHEEL_LEVELS; ++ level ) {
+            if ( (pWheel->currentTick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0 ) {
+                break;
+            }
+            TimerEntry list;
+            takeSlot(&pWheel->slots[level][(pWheel->currentTick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], &list);
+            while ( list.pNext != &list ) {
+                TimerEntry* pEntry = list.pNext;
+                unlinkTimer(pEntry);
+                placeTimer(pWheel, pEntry);
+            }
+        }
+
+        TimerEntry list;
+        takeSlot(&pWheel->slots[0][pWheel->currentTick & TIMER_WHEEL_MASK], &list);
+        while ( list.pNext != &list ) {
+            TimerEntry* pEntry = list.pNext;
+            unlinkTimer(pEntry);
+            if ( pEntry->expiryTick > pWheel->currentTick ) {
+                // A deadline beyond the last level comes around again
+                placeTimer(pWheel, pEntry);
+                continue;
+            }
+            -- pWheel->nTimers;
+            callback(pEntry, pArgument);
+        }
+    }
+}
+
+/**
+ * Convert a deadline to the tick of the wheel when it passes, which is at least the next tick.
+ * @param  pWheel   the wheel of the worker
+ * @param  deadline the monotonic time in nanoseconds
+ * @return the tick
+ */
+static uint64_t getDeadlineTick(const TimerWheel* pWheel, uint64_t deadline) {
+    uint64_t tick = deadline > pWheel->startTime ? (deadline - pWheel->startTime) / TIMER_TICK_NS + 1 : 0;
+    return tick > pWheel->currentTick ? tick : pWheel->currentTick + 1;
+}
+
+/**
+ * Put a timer into the slot which the wheel reaches before it expires.
+ * @param pWheel the wheel of the worker
+ * @param pEntry the timer which is not linked
+ */
+static void placeTimer(TimerWheel* pWheel, TimerEntry* pEntry) {
+    uint64_t expiryTick = pEntry->expiryTick;
+    uint64_t delta = expiryTick - pWheel->currentTick;
+    uint64_t horizon = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if ( delta >= horizon ) {
+        expiryTick = pWheel->currentTick + horizon - 1;
+        delta = horizon - 1;
+    }
+
+    int level = 0;
+    while ( level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))) ) {
+        ++ level;
+    }
+    linkTimer(&pWheel->slots[level][(expiryTick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], pEntry);
+}
+
+/**
+ * Append a timer to a list.
+ * @param pHead  the head of the list
+ * @param pEntry the timer which is not linked
+ */
+static void linkTimer(TimerEntry* pHead, TimerEntry* pEntry) {
+    pEntry->pNext = pHead;
+    pEntry->pPrevious = pHead->pPrevious;
+    pHead->pPrevious->pNext = pEntry;
+    pHead->pPrevious = pEntry;
+}
+
+/**
+ * Remove a timer from its list.
+ * @param pEntry the linked timer
+ */
+static void unlinkTimer(TimerEntry* pEntry) {
+    pEntry->pPrevious->pNext = pEntry->pNext;
+    pEntry->pNext->pPrevious = pEntry->pPrevious;
+    pEntry->pNext = NULL;
+    pEntry->pPrevious = NULL;
+}
+
+/**
+ * Move all timers of a slot to a list, so the slot may receive timers while they are handled.
+ * @param pSlot the head of the slot
+ * @param pList the head of the list, it is initialized
+ */
+static void takeSlot(TimerEntry* pSlot, TimerEntry* pList) {
+    if ( pSlot->pNext == pSlot ) {
+        pList->pNext = pList;
+        pList->pPrevious = pList;
+        return;
+    }
+    pList->pNext = pSlot->pNext;
+    pList->pPrevious = pSlot->pPrevious;
+    pList->pNext->pPrevious = pList;
+    pList->pPrevious->pNext = pList;
+    pSlot->pNext = pSlot;
+    pSlot->pPrevious = pSlot;
+}
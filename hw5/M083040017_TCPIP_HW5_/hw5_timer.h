@@ -0,0 +1,69 @@
+#ifndef HW5_TIMER_H
+#define HW5_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The resolution of the timers, a timer fires within a tick after its deadline.
+ */
+#define TIMER_TICK_NS           250000000ULL
+#define TIMER_TICK_MS           250
+
+/**
+ * Each level of the wheel has 64 slots and a slot of a level spans a whole turn of the
+ * level below, so 4 levels cover 64^4 ticks, about 48 days. Later deadlines are kept at
+ * the end of the last level and checked again when they come up.
+ */
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK        (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS      4
+
+/**
+ * A timer embedded in the object it belongs to. Slots are circular lists, so a timer
+ * is added, moved and cancelled without searching.
+ */
+typedef struct TimerEntry {
+    struct TimerEntry*  pNext;          // NULL if the timer is not scheduled
+    struct TimerEntry*  pPrevious;
+    uint64_t            expiryTick;
+    void*               pOwner;
+} TimerEntry;
+
+/**
+ * Called for a timer which expired, the timer is not scheduled anymore and may be scheduled again.
+ */
+typedef void (*TimerCallback)(TimerEntry* pEntry, void* pArgument);
+
+/**
+ * The timers of a worker, a hierarchical timing wheel like the timers of the Linux kernel.
+ * Timers of the first level expire when the wheel reaches their slot, and a slot of a
+ * higher level is spread over the level below when the wheel reaches it.
+ */
+typedef struct {
+    uint64_t    startTime;
+    uint64_t    currentTick;
+    int         nTimers;
+    TimerEntry  slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];   // the heads of the lists
+} TimerWheel;
+
+/**
+ * Prototypes of functions.
+ */
+void createTimerWheel(TimerWheel* pWheel, uint64_t now);
+void scheduleTimer(TimerWheel* pWheel, TimerEntry* pEntry, uint64_t deadline);
+void armTimer(TimerWheel* pWheel, TimerEntry* pEntry, uint64_t deadline);
+void cancelTimer(TimerWheel* pWheel, TimerEntry* pEntry);
+void advanceTimerWheel(TimerWheel* pWheel, uint64_t now, TimerCallback callback, void* pArgument);
+
+/**
+ * Tell whether a timer waits in a wheel.
+ * @param  pEntry the timer
+ * @return TRUE if the timer is scheduled
+ */
+static inline int isTimerScheduled(const TimerEntry* pEntry) {
+    return pEntry->pNext != NULL;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "hw5_log.h"
+#include "hw5_server.h"
+#include "hw5_transmit.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY             60
+#endif
+
+/**
+ * Prototypes of functions.
+ */
+static void completeZeroCopySends(ZeroCopyState* pState, uint32_t firstSequence, uint32_t lastSequence);
+static void releaseZeroCopyResponse(ZeroCopyState* pState, ZeroCopyResponse* pResponse);
+
+/**
+ * Set the socket options of a policy on a listener, the sockets it accepts inherit them.
+ * @param tcpSocketFileDescriptor the file descriptor of the TCP listener
+ * @param pPolicy                 the policy, the features the kernel refuses are turned off
+ */
+void applyTransmitPolicy(int tcpSocketFileDescriptor, TransmitPolicy* pPolicy) {
+    int optionValue = 1;
+    if ( pPolicy->isNoDelay &&
+         setsockopt(tcpSocketFileDescriptor, IPPROTO_TCP, TCP_NODELAY, &optionValue, sizeof(optionValue)) == -1 ) {
+        LOG_WARN("Failed to enable TCP_NODELAY: %s\n", strerror(errno));
+        pPolicy->isNoDelay = FALSE;
+    }
+    if ( pPolicy->zeroCopyThreshold > 0 &&
+         setsockopt(tcpSocketFileDescriptor, SOL_SOCKET, SO_ZEROCOPY, &optionValue, sizeof(optionValue)) == -1 ) {
+        LOG_WARN("Failed to enable SO_ZEROCOPY, responses are copied: %s\n", strerror(errno));
+        pPolicy->zeroCopyThreshold = 0;
+    }
+}
+
+/**
+ * Take a slot for a response which is going to be sent with MSG_ZEROCOPY.
+ * @param  pState the zero-copy sends of the connection
+ * @return the slot, NULL if the response has to be copied
+ */
+ZeroCopyResponse* beginZeroCopyResponse(ZeroCopyState* pState) {
+    if ( !pState->isEnabled || pState->nPending == MAX_ZEROCOPY_PENDING ) {
+        return NULL;
+    }
+
+    int i = 0;
+    for ( i = 0; i < MAX_ZEROCOPY_PENDING; ++ i ) {
+        ZeroCopyResponse* pResponse = &pState->pending[i];
+        if ( !pResponse->isUsed ) {
+            memset(pResponse, 0, sizeof(ZeroCopyResponse));
+            pResponse->isUsed = TRUE;
+            pResponse->isOpen = TRUE;
+            pResponse->firstSequence = pState->nextSequence;
+            pResponse->lastSequence = pState->nextSequence;
+            ++ pState->nPending;
+            return pResponse;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Count a successful sendmsg() with MSG_ZEROCOPY, the kernel numbers each of them.
+ * @param pState    the zero-copy sends of the connection
+ * @param pResponse the response which was sent
+ */
+void countZeroCopySend(ZeroCopyState* pState, ZeroCopyResponse* pResponse) {
+    ++ pState->nextSequence;
+    pResponse->lastSequence = pState->nextSequence;
+}
+
+/**
+ * Hand the memory of a sent response to its slot, it is released once the kernel is done with it.
+ * @param pState      the zero-copy sends of the connection
+ * @param pResponse   the response which was sent
+ * @param pBuffer     the buffer of the response, it is emptied
+ * @param pCachedFile the owner of the content of the response, NULL if there is none
+ */
+void finishZeroCopyResponse(ZeroCopyState* pState, ZeroCopyResponse* pResponse, ByteBuffer* pBuffer, CachedFile* pCachedFile) {
+    pResponse->isOpen = FALSE;
+    pResponse->buffer = *pBuffer;
+    pResponse->pCachedFile = pCachedFile;
+    memset(pBuffer, 0, sizeof(ByteBuffer));
+
+    if ( pResponse->nCompletedSends == pResponse->lastSequence - pResponse->firstSequence ) {
+        releaseZeroCopyResponse(pState, pResponse);
+    }
+}
+
+/**
+ * Read the notifications of a socket from its error queue and release the responses
+ * the kernel no longer reads. If the kernel had to copy the data anyway, as it does on
+ * loopback, the connection stops asking for zero-copy sends.
+ * @param  pState               the zero-copy sends of the connection
+ * @param  socketFileDescriptor the file descriptor of the socket
+ * @return -1 if the error queue is failed to read
+ */
+int reapZeroCopyCompletions(ZeroCopyState* pState, int socketFileDescriptor) {
+    while ( TRUE ) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if ( recvmsg(socketFileDescriptor, &message, MSG_ERRQUEUE) == -1 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        struct cmsghdr* pControl = NULL;
+        for ( pControl = CMSG_FIRSTHDR(&message); pControl != NULL; pControl = CMSG_NXTHDR(&message, pControl) ) {
+            if ( pControl->cmsg_level != SOL_IP || pControl->cmsg_type != IP_RECVERR ) {
+                continue;
+            }
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(pControl), sizeof(error));
+            if ( error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY ) {
+                continue;
+            }
+            if ( (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && pState->isEnabled ) {
+                LOG_DEBUG("[TCP] The kernel copied the zero-copy sends of socket #%d, later responses are copied\n",
+                    socketFileDescriptor);
+                pState->isEnabled = FALSE;
+            }
+            completeZeroCopySends(pState, error.ee_info, error.ee_data + 1);
+        }
+    }
+}
+
+/**
+ * Release the memory of every response of a connection which was reset, the kernel
+ * dropped the data which still referred to it.
+ * @param pState the zero-copy sends of the connection
+ */
+void dropZeroCopyResponses(ZeroCopyState* pState) {
+    int i = 0;
+    for ( i = 0; i < MAX_ZEROCOPY_PENDING; ++ i ) {
+        if ( pState->pending[i].isUsed ) {
+            releaseZeroCopyResponse(pState, &pState->pending[i]);
+        }
+    }
+}
+
+/**
+ * Count the completed sends of every response and release the responses which are done.
+ * @param pState        the zero-copy sends of the connection
+ * @param firstSequence the first completed send
+ * @param lastSequence  the end of the completed sends, exclusive
+ */
+static void completeZeroCopySends(ZeroCopyState* pState, uint32_t firstSequence, uint32_t lastSequence) {
+    int i = 0;
+    for ( i = 0; i < MAX_ZEROCOPY_PENDING; ++ i ) {
+        ZeroCopyResponse* pResponse = &pState->pending[i];
+        if ( !pResponse->isUsed ) {
+            continue;
+        }
+        uint32_t start = pResponse->firstSequence > firstSequence ? pResponse->firstSequence : firstSequence;
+        uint32_t end = pResponse->lastSequence < lastSequence ? pResponse->lastSequence : lastSequence;
+        if ( end > start ) {
+            pResponse->nCompletedSends += end - start;
+        }
+        if ( !pResponse->isOpen && pResponse->nCompletedSends == pResponse->lastSequence - pResponse->firstSequence ) {
+            releaseZeroCopyResponse(pState, pResponse);
+        }
+    }
+}
+
+/**
+ * Give the memory of a response back and free its slot.
+ * @param pState    the zero-copy sends of the connection
+ * @param pResponse the response which is done
+ */
+static void releaseZeroCopyResponse(ZeroCopyState* pState, ZeroCopyResponse* pResponse) {
+    releaseBuffer(&pResponse->buffer);
+    releaseBodySource(-1, pResponse->pCachedFile);
+    pResponse->isUsed = FALSE;
+    -- pState->nPending;
+}
@@ -0,0 +1,68 @@
+#ifndef HW5_TRANSMIT_H
+#define HW5_TRANSMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hw5_buffer.h"
+#include "hw5_cache.h"
+
+#define DEFAULT_ZEROCOPY_THRESHOLD  32768
+
+/**
+ * The number of zero-copy responses of a connection whose memory the kernel may still
+ * read. A response which finds every slot taken is copied as usual.
+ */
+#define MAX_ZEROCOPY_PENDING        8
+
+/**
+ * How a listener sends its responses, accepted sockets inherit the socket options.
+ * - isNoDelay:         TCP_NODELAY, a small reply is sent at once instead of waiting for an ACK.
+ * - isCorked:          the header of a file response is held back with MSG_MORE, so it
+ *                      leaves in the same segment as the start of the file.
+ * - zeroCopyThreshold: responses built in memory from this size are sent with MSG_ZEROCOPY,
+ *                      0 if the listener does not support it.
+ */
+typedef struct {
+    int     isNoDelay;
+    int     isCorked;
+    size_t  zeroCopyThreshold;
+} TransmitPolicy;
+
+/**
+ * The memory of a response sent with MSG_ZEROCOPY, it is kept until the kernel reports
+ * that every send from firstSequence to lastSequence has left the memory alone. A slot
+ * never moves while it is used, so a connection keeps a pointer to its open response.
+ */
+typedef struct {
+    int             isUsed;
+    int             isOpen;                 // more sends may follow, the memory is not attached yet
+    uint32_t        firstSequence;
+    uint32_t        lastSequence;           // exclusive
+    uint32_t        nCompletedSends;
+    ByteBuffer      buffer;
+    CachedFile*     pCachedFile;
+} ZeroCopyResponse;
+
+/**
+ * The zero-copy sends of a connection. The kernel numbers the sends of a socket which
+ * used MSG_ZEROCOPY from 0, and reports ranges of them through the error queue.
+ */
+typedef struct {
+    int                 isEnabled;          // cleared if the kernel copies the data anyway
+    uint32_t            nextSequence;
+    int                 nPending;
+    ZeroCopyResponse    pending[MAX_ZEROCOPY_PENDING];
+} ZeroCopyState;
+
+/**
+ * Prototypes of functions.
+ */
+void applyTransmitPolicy(int tcpSocketFileDescriptor, TransmitPolicy* pPolicy);
+ZeroCopyResponse* beginZeroCopyResponse(ZeroCopyState* pState);
+void countZeroCopySend(ZeroCopyState* pState, ZeroCopyResponse* pResponse);
+void finishZeroCopyResponse(ZeroCopyState* pState, ZeroCopyResponse* pResponse, ByteBuffer* pBuffer, CachedFile* pCachedFile);
+int reapZeroCopyCompletions(ZeroCopyState* pState, int socketFileDescriptor);
+void dropZeroCopyResponses(ZeroCopyState* pState);
+
+#endif
@@ -0,0 +1,124 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "hw5_server.h"
+#include "hw5_uppercase.h"
+
+/**
+ * The kernel chosen on the first conversion, shared by all workers.
+ */
+static UppercaseKernel pUppercaseKernel = NULL;
+
+/**
+ * Convert all lower case characters to upper case.
+ * The kernel is chosen at runtime according to the instruction sets of the CPU.
+ * @param input  the buffer for input
+ * @param output the buffer for output, may be the same as input
+ * @param length the number of bytes to convert
+ */
+void toUppercaseString(const char* input, char* output, size_t length) {
+    UppercaseKernel pKernel = __atomic_load_n(&pUppercaseKernel, __ATOMIC_RELAXED);
+    if ( pKernel == NULL ) {
+        // Every thread which races here chooses the same kernel
+        pKernel = selectUppercaseKernel(NULL);
+        __atomic_store_n(&pUppercaseKernel, pKernel, __ATOMIC_RELAXED);
+    }
+    pKernel(input, output, length);
+}
+
+/**
+ * Choose the fastest kernel the CPU supports.
+ * @param  pKernelName the pointer which receives the name of the kernel, may be NULL
+ * @return the kernel
+ */
+UppercaseKernel selectUppercaseKernel(const char** pKernelName) {
+    const char* kernelName = "scalar";
+    UppercaseKernel pKernel = toUppercaseScalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+        kernelName = "avx2";
+        pKernel = toUppercaseAvx2;
+    } else if ( __builtin_cpu_supports("sse2") ) {
+        kernelName = "sse2";
+        pKernel = toUppercaseSse2;
+    }
+#endif
+
+    if ( pKernelName != NULL ) {
+        *pKernelName = kernelName;
+    }
+    return pKernel;
+}
+
+/**
+ * Convert all lower case characters to upper case one byte at a time.
+ * @param input  the buffer for input
+ * @param output the buffer for output, may be the same as input
+ * @param length the number of bytes to convert
+ */
+void toUppercaseScalar(const char* input, char* output, size_t length) {
+    size_t i = 0;
+    for ( i = 0; i < length; ++ i ) {
+        // Only 'a' to 'z' fall below 26 after the subtraction
+        output[i] = (unsigned char) (input[i] - 'a') < 26 ? input[i] - 'a' + 'A' : input[i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * Convert all lower case characters to upper case 16 bytes at a time.
+ *
+ * Bytes are compared as signed integers, so bytes above 0x7f are negative and never
+ * fall in the range of 'a' to 'z'. The letters in the range get the 0x20 bit cleared.
+ *
+ * @param input  the buffer for input
+ * @param output the buffer for output, may be the same as input
+ * @param length the number of bytes to convert
+ */
+__attribute__((target("sse2")))
+void toUppercaseSse2(const char* input, char* output, size_t length) {
+    const __m128i beforeA = _mm_set1_epi8('a' - 1);
+    const __m128i afterZ = _mm_set1_epi8('z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+
+    size_t i = 0;
+    for ( ; i + 16 <= length; i += 16 ) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (input + i));
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(bytes, beforeA), _mm_cmplt_epi8(bytes, afterZ));
+        bytes = _mm_xor_si128(bytes, _mm_and_si128(isLower, caseBit));
+        _mm_storeu_si128((__m128i*) (output + i), bytes);
+    }
+    toUppercaseScalar(input + i, output + i, length - i);
+}
+
+/**
+ * Convert all lower case characters to upper case 32 bytes at a time.
+ * See toUppercaseSse2() for the comparisons.
+ * @param input  the buffer for input
+ * @param output the buffer for output, may be the same as input
+ * @param length the number of bytes to convert
+ */
+__attribute__((target("avx2")))
+void toUppercaseAvx2(const char* input, char* output, size_t length) {
+    const __m256i beforeA = _mm256_set1_epi8('a' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+
+    size_t i = 0;
+    for ( ; i + 32 <= length; i += 32 ) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (input + i));
+        __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, beforeA), _mm256_cmpgt_epi8(afterZ, bytes));
+        bytes = _mm256_xor_si256(bytes, _mm256_and_si256(isLower, caseBit));
+        _mm256_storeu_si256((__m256i*) (output + i), bytes);
+    }
+    toUppercaseSse2(input + i, output + i, length - i);
+}
+
+#endif
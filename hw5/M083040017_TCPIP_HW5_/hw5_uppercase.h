@@ -0,0 +1,29 @@
+#ifndef HW5_UPPERCASE_H
+#define HW5_UPPERCASE_H
+
+#include <stddef.h>
+
+/**
+ * A kernel which converts the lower case ASCII letters of a buffer to upper case.
+ * Other bytes, including the end character of strings, are copied unchanged, and
+ * input may be the same buffer as output.
+ */
+typedef void (*UppercaseKernel)(const char* input, char* output, size_t length);
+
+/**
+ * Prototypes of the kernels, the SIMD kernels are only available on x86.
+ */
+void toUppercaseScalar(const char* input, char* output, size_t length);
+#if defined(__x86_64__) || defined(__i386__)
+void toUppercaseSse2(const char* input, char* output, size_t length);
+void toUppercaseAvx2(const char* input, char* output, size_t length);
+#endif
+
+/**
+ * Choose the fastest kernel the CPU supports.
+ * @param  pKernelName the pointer which receives the name of the kernel, may be NULL
+ * @return the kernel
+ */
+UppercaseKernel selectUppercaseKernel(const char** pKernelName);
+
+#endif
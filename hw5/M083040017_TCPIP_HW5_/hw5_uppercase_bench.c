@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hw5_uppercase.h"
+
+#define MIN_PAYLOAD_SIZE        64
+#define MAX_PAYLOAD_SIZE        65536
+
+/**
+ * The number of bytes each kernel converts for a payload size.
+ */
+#define BYTES_PER_MEASUREMENT   (256L * 1024 * 1024)
+
+/**
+ * A kernel under measurement.
+ */
+typedef struct {
+    const char*     name;
+    UppercaseKernel pKernel;
+} Candidate;
+
+/**
+ * Prototypes of functions.
+ */
+void toUppercaseNulScan(const char* input, char* output, size_t length);
+double measureKernel(UppercaseKernel pKernel, const char* input, char* output, size_t length);
+
+/**
+ * The entrance of the benchmark, which reports the throughput of every kernel
+ * for payloads from MIN_PAYLOAD_SIZE to MAX_PAYLOAD_SIZE bytes.
+ *
+ * @return 0 if the application exited normally
+ */
+int main(void) {
+    Candidate candidates[] = {
+        { "nul-scan", toUppercaseNulScan },
+        { "scalar",   toUppercaseScalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2",     toUppercaseSse2 },
+        { "avx2",     NULL },
+#endif
+    };
+    int nCandidates = sizeof(candidates) / sizeof(candidates[0]);
+
+    const char* kernelName = NULL;
+    UppercaseKernel pSelectedKernel = selectUppercaseKernel(&kernelName);
+#if defined(__x86_64__) || defined(__i386__)
+    // The AVX2 kernel faults on CPUs without AVX2, measure it only if it was selected
+    if ( pSelectedKernel == toUppercaseAvx2 ) {
+        candidates[nCandidates - 1].pKernel = toUppercaseAvx2;
+    } else {
+        -- nCandidates;
+    }
+#endif
+    fprintf(stderr, "[INFO] The server uses the %s kernel on this CPU.\n", kernelName);
+
+    // One extra byte for the end character the NUL scanning kernel relies on
+    char* input = (char*) malloc(MAX_PAYLOAD_SIZE + 1);
+    char* output = (char*) malloc(MAX_PAYLOAD_SIZE + 1);
+    char* expected = (char*) malloc(MAX_PAYLOAD_SIZE + 1);
+    if ( input == NULL || output == NULL || expected == NULL ) {
+        fprintf(stderr, "[ERROR] Failed to allocate the buffers.\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    int i = 0;
+    for ( i = 0; i < MAX_PAYLOAD_SIZE; ++ i ) {
+        // Printable text with a few bytes above 0x7f, but without the end character
+        input[i] = (char) (rand() % 16 == 0 ? 0x80 + rand() % 0x80 : ' ' + rand() % ('~' - ' '));
+    }
+    input[MAX_PAYLOAD_SIZE] = 0;
+
+    /*
+     * Verify every kernel against the scalar kernel before measuring.
+     */
+    size_t length = 0;
+    int j = 0;
+    for ( length = 0; length <= 100; ++ length ) {
+        toUppercaseScalar(input, expected, length);
+        for ( j = 2; j < nCandidates; ++ j ) {
+            candidates[j].pKernel(input, output, length);
+            if ( memcmp(output, expected, length) != 0 ) {
+                fprintf(stderr, "[ERROR] The %s kernel is wrong for %lu bytes.\n", candidates[j].name, (unsigned long) length);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    printf("%10s", "bytes");
+    for ( j = 0; j < nCandidates; ++ j ) {
+        printf("%12s", candidates[j].name);
+    }
+    printf("    (GB/s)\n");
+    for ( length = MIN_PAYLOAD_SIZE; length <= MAX_PAYLOAD_SIZE; length *= 4 ) {
+        char savedByte = input[length];
+        input[length] = 0;
+
+        printf("%10lu", (unsigned long) length);
+        for ( j = 0; j < nCandidates; ++ j ) {
+            printf("%12.2f", measureKernel(candidates[j].pKernel, input, output, length));
+        }
+        printf("\n");
+        input[length] = savedByte;
+    }
+
+    free(input);
+    free(output);
+    free(expected);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * The conversion the server used before the kernels, which scans for the end character
+ * and measures the output with strlen() again like the callers did.
+ * @param input  the string for input
+ * @param output the string for output
+ * @param length unused, the string ends with the end character
+ */
+void toUppercaseNulScan(const char* input, char* output, size_t length) {
+    char* pOutput = output;
+    for ( ; *input; ++ input, ++ pOutput ) {
+        *pOutput = *input;
+
+        if ( *input >= 'a' && *input <= 'z' ) {
+            *pOutput = *input - 'a' + 'A';
+        }
+    }
+    *pOutput = 0;
+
+    // Keep the compiler from dropping the length
+    volatile size_t outputLength = strlen(output);
+    (void) outputLength;
+    (void) length;
+}
+
+/**
+ * Measure the throughput of a kernel for a payload size.
+ * @param  pKernel the kernel to measure
+ * @param  input   the payload
+ * @param  output  the buffer which receives the conversion
+ * @param  length  the size of the payload
+ * @return the throughput in GB/s
+ */
+double measureKernel(UppercaseKernel pKernel, const char* input, char* output, size_t length) {
+    long nRounds = BYTES_PER_MEASUREMENT / (long) length;
+
+    struct timespec startTime;
+    struct timespec endTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    long i = 0;
+    for ( i = 0; i < nRounds; ++ i ) {
+        pKernel(input, output, length);
+        // Keep the compiler from merging the rounds
+        __asm__ __volatile__("" : : "r"(output) : "memory");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+    double elapsedSeconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    return (double) nRounds * length / elapsedSeconds / 1e9;
+}
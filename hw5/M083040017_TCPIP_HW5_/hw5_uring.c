@@ -0,0 +1,1085 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "hw5_log.h"
+#include "hw5_restart.h"
+#include "hw5_server.h"
+#include "hw5_stats.h"
+#include "hw5_timer.h"
+
+#define URING_ENTRIES           4096
+#define URING_BUFFER_GROUP      0
+#define URING_RECV_BUFFERS      4096    // must be a power of 2
+#define URING_UDP_SLOTS         32
+#define URING_FILE_CHUNK_SIZE   MAX_BUFFER_SIZE     // a chunk fills the largest buffer of the pool
+
+/**
+ * Operations are tagged in the lowest bits of user_data, the remaining bits hold
+ * the pointer of the object which owns the operation.
+ */
+#define URING_TAG_MASK          7ULL
+#define URING_TAG_CONTROL       0       // a request of the worker itself, see URING_CONTROL_*
+#define URING_TAG_ACCEPT        1
+#define URING_TAG_UDP           2
+#define URING_TAG_RECV          3
+#define URING_TAG_SEND          4
+#define URING_TAG_FILE_READ     5
+#define URING_TAG_OFFLOAD       6
+#define URING_TAG_TIMER         7
+
+/**
+ * The requests tagged URING_TAG_CONTROL own no object, the bits above the tag tell them apart.
+ */
+#define URING_CONTROL_DRAIN         (1ULL << 3)     // the poll of the drain eventfd
+#define URING_CONTROL_CANCEL        (2ULL << 3)     // the cancellation of a request on the listeners
+#define URING_CONTROL_FILE_EVENTS   (3ULL << 3)     // the poll of the inotify instance of the file cache
+
+/**
+ * The memory shared with the kernel for a ring and the buffers provided to it.
+ */
+typedef struct {
+    int                     ringFileDescriptor;
+
+    void*                   sqRingPointer;
+    size_t                  sqRingSize;
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned*               sqArray;
+    unsigned                sqMask;
+    unsigned                sqEntries;
+    struct io_uring_sqe*    sqes;
+    size_t                  sqesSize;
+    unsigned                nPendingSubmissions;
+
+    void*                   cqRingPointer;
+    size_t                  cqRingSize;
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned                cqMask;
+    struct io_uring_cqe*    cqes;
+
+    struct io_uring_buf*    bufferRing;
+    size_t                  bufferRingSize;
+    char*                   bufferMemory;
+
+    OffloadCompletions      completions;
+    ConnectionTable         connections;
+    const TransmitPolicy*   pPolicy;
+
+    /**
+     * The timeouts of connections, a timeout request wakes the loop for every tick.
+     */
+    TimerWheel              timers;
+    const ConnectionLimits* pLimits;
+    uint64_t                loopTime;
+    struct __kernel_timespec tickInterval;
+
+    /**
+     * A hot restart cancels the requests on the listeners, the worker returns once
+     * its connections are closed and its datagrams are done.
+     */
+    int                     isDraining;
+    int                     nDatagrams;             // the datagrams with a request in flight
+
+    /**
+     * An accept which fails for lack of descriptors or memory leaves the client in the queue,
+     * so it is armed again once a connection closes or on the next tick instead of at once.
+     */
+    int                     tcpSocketFileDescriptor;
+    int                     isAcceptStalled;        // no accept is armed until resumeAccept()
+    int                     isStallReported;        // the stall is logged once, until an accept succeeds
+} UringContext;
+
+/**
+ * A TCP client served by the io_uring engine. At most one request is in flight
+ * for each connection, a linked read and send pair counts as one request, and so
+ * does a job of the disk I/O pool.
+ */
+typedef struct {
+    int         socketFileDescriptor;
+    char        peerName[PEER_NAME_SIZE];   // formatted once when the client is accepted
+    uint64_t    connectedTime;
+    int         fileFileDescriptor;     // -1 if no file is being streamed
+    off_t       fileOffset;
+    off_t       fileRemaining;
+    ByteBuffer  fileBuffer;
+    CachedFile* pCachedFile;            // the owner of the content or the file, NULL if there is none
+    const unsigned char* pSendData;
+    size_t      sendLength;             // includes the content which follows the output buffer
+    size_t      sendOffset;
+    const unsigned char* pContent;      // the body of a small cached file, NULL if there is none
+    size_t      contentLength;
+    struct iovec sendVectors[2];
+    struct msghdr sendMessage;
+    ByteBuffer  input;                  // a receive is only submitted if it holds no complete request
+    ByteBuffer  output;                 // released once the response is sent
+    int         latencyHistogram;       // HISTOGRAM_NONE if the latency of the response is recorded
+    uint64_t    requestStartTime;
+    OffloadJob  offloadJob;
+    int         isOffloaded;
+    TimerEntry  timer;
+    uint64_t    lastActivityTime;
+    uint64_t    requestArrivalTime;     // when the first bytes of an incomplete request arrived
+    int         isTimedOut;             // the socket is shut down, the request in flight fails and closes it
+} UringConnection;
+
+/**
+ * A UDP datagram cycling through receiving and replying.
+ */
+typedef struct {
+    int                 isSending;
+    struct sockaddr_in  clientSocketAddress;
+    struct iovec        iov;
+    struct msghdr       message;
+    char                buffer[BUFFER_SIZE];
+    size_t              length;
+} UringDatagram;
+
+/**
+ * Prototypes of functions.
+ */
+static int setupUring(UringContext* pContext);
+static void destroyUring(UringContext* pContext);
+static struct io_uring_sqe* getSubmissionEntry(UringContext* pContext);
+static void recycleRecvBuffer(UringContext* pContext, unsigned short bufferId);
+static void submitAccept(UringContext* pContext, int tcpSocketFileDescriptor);
+static void resumeAccept(UringContext* pContext);
+static void submitDatagram(UringContext* pContext, int udpSocketFileDescriptor, UringDatagram* pDatagram);
+static void submitRecv(UringContext* pContext, UringConnection* pConnection);
+static void submitSend(UringContext* pContext, UringConnection* pConnection);
+static void submitFileChunk(UringContext* pContext, UringConnection* pConnection);
+static void submitCompletionPoll(UringContext* pContext);
+static void submitTimerTick(UringContext* pContext);
+static void submitDrainPoll(UringContext* pContext);
+static void submitFileEventsPoll(UringContext* pContext);
+static void startDraining(UringContext* pContext, UringDatagram* datagrams);
+static void submitCancel(UringContext* pContext, uint64_t userData);
+static void handleCompletions(UringContext* pContext);
+static void handleRecv(UringContext* pContext, UringConnection* pConnection, int result, unsigned flags);
+static void handleNextFrame(UringContext* pContext, UringConnection* pConnection);
+static void handleSend(UringContext* pContext, UringConnection* pConnection, int result);
+static void armConnectionTimer(UringContext* pContext, UringConnection* pConnection);
+static uint64_t getConnectionDeadline(UringContext* pContext, UringConnection* pConnection);
+static void expireConnection(TimerEntry* pEntry, void* pArgument);
+static void closeConnection(UringContext* pContext, UringConnection* pConnection);
+
+/**
+ * Wrappers of the io_uring system calls, glibc does not provide them.
+ */
+static int ioUringSetup(unsigned entries, struct io_uring_params* pParams) {
+    return (int) syscall(__NR_io_uring_setup, entries, pParams);
+}
+
+static int ioUringEnter(int ringFileDescriptor, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ringFileDescriptor, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int ringFileDescriptor, unsigned opcode, void* pArgument, unsigned nArguments) {
+    return (int) syscall(__NR_io_uring_register, ringFileDescriptor, opcode, pArgument, nArguments);
+}
+
+static inline uint64_t makeUserData(void* pOwner, unsigned tag) {
+    return (uint64_t) (uintptr_t) pOwner | tag;
+}
+
+/**
+ * Connections handler for the server using io_uring.
+ *
+ * TCP connections are accepted with a multishot accept, received into buffers
+ * provided to the kernel in advance, and files are streamed with linked
+ * read and send requests, so the data never waits for the loop between them.
+ * The kernel reads files without blocking the loop, only opening a cold file is
+ * left to the disk I/O pool. A connection which passes its timeout is shut down, so
+ * the request it has in flight fails and closes it. When a new process takes over the
+ * listeners, the worker cancels the requests on them and returns once it is idle.
+ *
+ * @param  tcpSocketFileDescriptor the file descriptor of TCP socket
+ * @param  udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param  pPolicy                 the transmit policy of the TCP listener
+ * @return IO_ENGINE_UNSUPPORTED if the kernel does not support io_uring,
+ *         -1 if a severe error occurred in this procedure, 0 if the worker drained
+ */
+int acceptConnectionsWithUring(int tcpSocketFileDescriptor, int udpSocketFileDescriptor, const TransmitPolicy* pPolicy) {
+    UringContext context;
+    if ( setupUring(&context) == -1 ) {
+        return IO_ENGINE_UNSUPPORTED;
+    }
+    context.pPolicy = pPolicy;
+    context.tcpSocketFileDescriptor = tcpSocketFileDescriptor;
+
+    UringDatagram* datagrams = (UringDatagram*) calloc(URING_UDP_SLOTS, sizeof(UringDatagram));
+    if ( datagrams == NULL ) {
+        destroyUring(&context);
+        return -1;
+    }
+
+    if ( createOffloadCompletions(&context.completions) == -1 ) {
+        free(datagrams);
+        destroyUring(&context);
+        return -1;
+    }
+    submitCompletionPoll(&context);
+    createConnectionTable(&context.connections, sizeof(UringConnection));
+    context.pLimits = getConnectionLimits();
+    context.loopTime = getMonotonicTime();
+    context.tickInterval.tv_nsec = (long long) TIMER_TICK_NS;
+    createTimerWheel(&context.timers, context.loopTime);
+    submitTimerTick(&context);
+    submitDrainPoll(&context);
+    submitFileEventsPoll(&context);
+
+    submitAccept(&context, tcpSocketFileDescriptor);
+    int i = 0;
+    for ( i = 0; i < URING_UDP_SLOTS; ++ i ) {
+        submitDatagram(&context, udpSocketFileDescriptor, &datagrams[i]);
+    }
+    context.nDatagrams = URING_UDP_SLOTS;
+
+    /**
+     * Handle TCP and UDP connections.
+     */
+    while ( TRUE ) {
+        int submitted = ioUringEnter(context.ringFileDescriptor, context.nPendingSubmissions, 1, IORING_ENTER_GETEVENTS);
+        if ( submitted >= 0 ) {
+            context.nPendingSubmissions -= submitted;
+        } else if ( errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+            LOG_ERROR("An error occurred while waiting for completions: %s\n", strerror(errno));
+            break;
+        }
+        context.loopTime = getMonotonicTime();
+
+        unsigned head = *context.cqHead;
+        unsigned tail = __atomic_load_n(context.cqTail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; ++ head ) {
+            struct io_uring_cqe* pCompletion = &context.cqes[head & context.cqMask];
+            unsigned tag = (unsigned) (pCompletion->user_data & URING_TAG_MASK);
+            void* pOwner = (void*) (uintptr_t) (pCompletion->user_data & ~URING_TAG_MASK);
+            int result = pCompletion->res;
+            unsigned flags = pCompletion->flags;
+
+            if ( tag == URING_TAG_ACCEPT ) {
+                if ( result >= 0 ) {
+                    context.isStallReported = FALSE;
+                    // The multishot accept does not report the address of the client, ask for it once
+                    struct sockaddr_in clientSocketAddress;
+                    socklen_t sockaddrSize = sizeof(clientSocketAddress);
+                    memset(&clientSocketAddress, 0, sizeof(clientSocketAddress));
+                    getpeername(result, (struct sockaddr*) &clientSocketAddress, &sockaddrSize);
+                    char peerName[PEER_NAME_SIZE];
+                    formatPeerName(&clientSocketAddress, peerName);
+
+                    UringConnection* pConnection = NULL;
+                    if ( !admitConnection() ) {
+                        rejectConnection(result, peerName);
+                    } else if ( (pConnection = (UringConnection*) addConnection(&context.connections, result)) == NULL ) {
+                        close(result);
+                        dismissConnection();
+                    } else {
+                        pConnection->socketFileDescriptor = result;
+                        memcpy(pConnection->peerName, peerName, sizeof(peerName));
+                        pConnection->connectedTime = getMonotonicTime();
+                        pConnection->fileFileDescriptor = -1;
+                        pConnection->latencyHistogram = HISTOGRAM_NONE;
+                        pConnection->offloadJob.pOwner = pConnection;
+                        pConnection->offloadJob.pCompletions = &context.completions;
+                        pConnection->timer.pOwner = pConnection;
+                        pConnection->lastActivityTime = context.loopTime;
+                        addStat(STAT_CONNECTIONS_OPENED, 1);
+                        LOG_INFO("[TCP] Socket #%d registered for the client: %s\n", result, pConnection->peerName);
+                        submitRecv(&context, pConnection);
+                    }
+                } else if ( !context.isDraining && !context.isStallReported ) {
+                    LOG_WARN("[TCP] Failed to accpet a socket from client: %s\n", strerror(-result));
+                    context.isStallReported = result != -ECONNABORTED && result != -EINTR;
+                }
+                // The multishot accept stops on errors and has to be armed again
+                if ( !(flags & IORING_CQE_F_MORE) && !context.isDraining ) {
+                    if ( result < 0 && result != -ECONNABORTED && result != -EINTR ) {
+                        // Accepting again right away fails on the same client until a descriptor is free
+                        context.isAcceptStalled = TRUE;
+                    } else {
+                        submitAccept(&context, tcpSocketFileDescriptor);
+                    }
+                }
+            } else if ( tag == URING_TAG_UDP ) {
+                UringDatagram* pDatagram = (UringDatagram*) pOwner;
+
+                if ( !pDatagram->isSending && result >= 0 ) {
+                    LOG_DEBUG("[UDP] Received a message from client %s:%d: %.*s\n",
+                        inet_ntoa(pDatagram->clientSocketAddress.sin_addr), ntohs(pDatagram->clientSocketAddress.sin_port), result, pDatagram->buffer);
+
+                    // Send a message to client
+                    addStat(STAT_DATAGRAMS, 1);
+                    addStat(STAT_BYTES_IN, (uint64_t) result);
+                    pDatagram->length = (size_t) result;
+                    toUppercaseString(pDatagram->buffer, pDatagram->buffer, pDatagram->length);
+                    pDatagram->isSending = TRUE;
+                    submitDatagram(&context, udpSocketFileDescriptor, pDatagram);
+                } else if ( result == -EAGAIN && (pDatagram->isSending || !context.isDraining) ) {
+                    // The socket is non-blocking, so a burst can outrun it; retry the same operation
+                    submitDatagram(&context, udpSocketFileDescriptor, pDatagram);
+                } else {
+                    if ( result >= 0 && pDatagram->isSending ) {
+                        addStat(STAT_BYTES_OUT, (uint64_t) result);
+                    } else if ( result < 0 && !context.isDraining ) {
+                        LOG_ERROR("[UDP] An error occurred while %s message of the client %s:%d: %s\n",
+                            pDatagram->isSending ? "sending" : "receiving", inet_ntoa(pDatagram->clientSocketAddress.sin_addr),
+                            ntohs(pDatagram->clientSocketAddress.sin_port), strerror(-result));
+                    }
+                    pDatagram->isSending = FALSE;
+                    if ( context.isDraining ) {
+                        // The new process receives the next datagrams
+                        -- context.nDatagrams;
+                    } else {
+                        submitDatagram(&context, udpSocketFileDescriptor, pDatagram);
+                    }
+                }
+            } else if ( tag == URING_TAG_RECV ) {
+                handleRecv(&context, (UringConnection*) pOwner, result, flags);
+            } else if ( tag == URING_TAG_SEND ) {
+                handleSend(&context, (UringConnection*) pOwner, result);
+            } else if ( tag == URING_TAG_OFFLOAD ) {
+                handleCompletions(&context);
+                submitCompletionPoll(&context);
+            } else if ( tag == URING_TAG_TIMER ) {
+                advanceTimerWheel(&context.timers, context.loopTime, expireConnection, &context);
+                submitTimerTick(&context);
+                resumeAccept(&context);
+            } else if ( tag == URING_TAG_CONTROL ) {
+                uint64_t control = (uint64_t) (uintptr_t) pOwner;
+                if ( control == URING_CONTROL_DRAIN ) {
+                    startDraining(&context, datagrams);
+                } else if ( control == URING_CONTROL_FILE_EVENTS ) {
+                    handleFileCacheEvents();
+                    submitFileEventsPoll(&context);
+                } else if ( result < 0 && result != -ENOENT && result != -EALREADY ) {
+                    // A request which already completed or is completing reports itself
+                    LOG_WARN("Failed to cancel a request on the listeners: %s\n", strerror(-result));
+                }
+            } else if ( tag == URING_TAG_FILE_READ ) {
+                // Only failed or short reads post a completion, the linked send reports it to the connection
+                LOG_WARN("[TCP] Failed to read file stream: %s\n",
+                    result < 0 ? strerror(-result) : "unexpected end of file");
+            }
+        }
+        __atomic_store_n(context.cqHead, head, __ATOMIC_RELEASE);
+
+        if ( context.isDraining && context.connections.nConnections == 0 && context.nDatagrams <= 0 ) {
+            free(datagrams);
+            close(context.completions.eventFileDescriptor);
+            destroyUring(&context);
+            return 0;
+        }
+    }
+
+    free(datagrams);
+    close(context.completions.eventFileDescriptor);
+    destroyUring(&context);
+    return -1;
+}
+
+/**
+ * Create the ring, map the submission and completion queues and register the
+ * buffer ring used for receiving from TCP sockets.
+ * @param  pContext the context to initialize
+ * @return -1 if the kernel does not support a required feature
+ */
+static int setupUring(UringContext* pContext) {
+    memset(pContext, 0, sizeof(UringContext));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    pContext->ringFileDescriptor = ioUringSetup(URING_ENTRIES, &params);
+    if ( pContext->ringFileDescriptor == -1 && errno == EINVAL ) {
+        memset(&params, 0, sizeof(params));
+        pContext->ringFileDescriptor = ioUringSetup(URING_ENTRIES, &params);
+    }
+    if ( pContext->ringFileDescriptor == -1 ) {
+        LOG_WARN("Failed to create io_uring instance: %s\n", strerror(errno));
+        return -1;
+    }
+    if ( !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ) {
+        LOG_WARN("The kernel is too old for the io_uring engine\n");
+        close(pContext->ringFileDescriptor);
+        return -1;
+    }
+
+    /*
+     * The submission and completion rings share one mapping since IORING_FEAT_SINGLE_MMAP.
+     */
+    pContext->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pContext->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ( pContext->cqRingSize > pContext->sqRingSize ) {
+        pContext->sqRingSize = pContext->cqRingSize;
+    }
+    pContext->cqRingSize = pContext->sqRingSize;
+
+    char* pRing = (char*) mmap(NULL, pContext->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        pContext->ringFileDescriptor, IORING_OFF_SQ_RING);
+    pContext->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* pSqes = mmap(NULL, pContext->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        pContext->ringFileDescriptor, IORING_OFF_SQES);
+    pContext->sqRingPointer = pRing == MAP_FAILED ? NULL : pRing;
+    pContext->cqRingPointer = pContext->sqRingPointer;
+    pContext->sqes = pSqes == MAP_FAILED ? NULL : (struct io_uring_sqe*) pSqes;
+    if ( pContext->sqRingPointer == NULL || pContext->sqes == NULL ) {
+        LOG_WARN("Failed to map io_uring queues: %s\n", strerror(errno));
+        destroyUring(pContext);
+        return -1;
+    }
+
+    pContext->sqHead = (unsigned*) (pRing + params.sq_off.head);
+    pContext->sqTail = (unsigned*) (pRing + params.sq_off.tail);
+    pContext->sqArray = (unsigned*) (pRing + params.sq_off.array);
+    pContext->sqMask = *(unsigned*) (pRing + params.sq_off.ring_mask);
+    pContext->sqEntries = params.sq_entries;
+
+    pContext->cqHead = (unsigned*) (pRing + params.cq_off.head);
+    pContext->cqTail = (unsigned*) (pRing + params.cq_off.tail);
+    pContext->cqMask = *(unsigned*) (pRing + params.cq_off.ring_mask);
+    pContext->cqes = (struct io_uring_cqe*) (pRing + params.cq_off.cqes);
+
+    /*
+     * Register a ring of buffers, the kernel picks one of them when data arrives on a socket
+     * so buffers are never pinned by idle connections.
+     */
+    pContext->bufferRingSize = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+    pContext->bufferRing = (struct io_uring_buf*) mmap(NULL, pContext->bufferRingSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pContext->bufferMemory = (char*) malloc((size_t) URING_RECV_BUFFERS * BUFFER_SIZE);
+    if ( pContext->bufferRing == MAP_FAILED || pContext->bufferMemory == NULL ) {
+        pContext->bufferRing = NULL;
+        destroyUring(pContext);
+        return -1;
+    }
+
+    struct io_uring_buf_reg bufferRegistration;
+    memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+    bufferRegistration.ring_addr = (uint64_t) (uintptr_t) pContext->bufferRing;
+    bufferRegistration.ring_entries = URING_RECV_BUFFERS;
+    bufferRegistration.bgid = URING_BUFFER_GROUP;
+    if ( ioUringRegister(pContext->ringFileDescriptor, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) == -1 ) {
+        LOG_WARN("Failed to register provided buffers: %s\n", strerror(errno));
+        destroyUring(pContext);
+        return -1;
+    }
+
+    unsigned short i = 0;
+    for ( i = 0; i < URING_RECV_BUFFERS; ++ i ) {
+        recycleRecvBuffer(pContext, i);
+    }
+    return 0;
+}
+
+/**
+ * Release the ring and all memory shared with the kernel.
+ * @param pContext the context to release
+ */
+static void destroyUring(UringContext* pContext) {
+    if ( pContext->sqRingPointer != NULL ) {
+        munmap(pContext->sqRingPointer, pContext->sqRingSize);
+    }
+    if ( pContext->sqes != NULL ) {
+        munmap(pContext->sqes, pContext->sqesSize);
+    }
+    if ( pContext->bufferRing != NULL ) {
+        munmap(pContext->bufferRing, pContext->bufferRingSize);
+    }
+    free(pContext->bufferMemory);
+    close(pContext->ringFileDescriptor);
+}
+
+/**
+ * Get a free submission queue entry, submit pending entries first if the queue is full.
+ * @param  pContext the context of the ring
+ * @return a zeroed submission queue entry which is published to the kernel on the next io_uring_enter()
+ */
+static struct io_uring_sqe* getSubmissionEntry(UringContext* pContext) {
+    unsigned tail = *pContext->sqTail;
+
+    while ( tail - __atomic_load_n(pContext->sqHead, __ATOMIC_ACQUIRE) >= pContext->sqEntries ) {
+        int submitted = ioUringEnter(pContext->ringFileDescriptor, pContext->nPendingSubmissions, 0, 0);
+        if ( submitted > 0 ) {
+            pContext->nPendingSubmissions -= submitted;
+        }
+    }
+
+    unsigned index = tail & pContext->sqMask;
+    struct io_uring_sqe* pSubmission = &pContext->sqes[index];
+    memset(pSubmission, 0, sizeof(struct io_uring_sqe));
+    pContext->sqArray[index] = index;
+    __atomic_store_n(pContext->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++ pContext->nPendingSubmissions;
+
+    return pSubmission;
+}
+
+/**
+ * Give a receive buffer back to the kernel.
+ * @param pContext the context of the ring
+ * @param bufferId the ID of the buffer in the buffer ring
+ */
+static void recycleRecvBuffer(UringContext* pContext, unsigned short bufferId) {
+    /*
+     * The tail of the ring overlays the reserved field of the first entry. struct io_uring_buf_ring
+     * is not used because its flexible array gets shifted when the header is compiled as C++.
+     */
+    unsigned short* pTail = &pContext->bufferRing[0].resv;
+    unsigned short tail = *pTail;
+    struct io_uring_buf* pBuffer = &pContext->bufferRing[tail & (URING_RECV_BUFFERS - 1)];
+
+    pBuffer->addr = (uint64_t) (uintptr_t) (pContext->bufferMemory + (size_t) bufferId * BUFFER_SIZE);
+    pBuffer->len = BUFFER_SIZE;
+    pBuffer->bid = bufferId;
+    __atomic_store_n(pTail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Accept all incoming TCP connections with a single multishot request.
+ * @param pContext                the context of the ring
+ * @param tcpSocketFileDescriptor the file descriptor of TCP socket
+ */
+static void submitAccept(UringContext* pContext, int tcpSocketFileDescriptor) {
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_ACCEPT;
+    pSubmission->fd = tcpSocketFileDescriptor;
+    pSubmission->ioprio = IORING_ACCEPT_MULTISHOT;
+    pSubmission->accept_flags = SOCK_CLOEXEC;
+    pSubmission->user_data = makeUserData(NULL, URING_TAG_ACCEPT);
+}
+
+/**
+ * Arm the accept again after it stalled, nothing happens if it is armed or the worker drains.
+ * @param pContext the context of the ring
+ */
+static void resumeAccept(UringContext* pContext) {
+    if ( pContext->isAcceptStalled && !pContext->isDraining ) {
+        pContext->isAcceptStalled = FALSE;
+        submitAccept(pContext, pContext->tcpSocketFileDescriptor);
+    }
+}
+
+/**
+ * Receive a datagram into the slot, or send the reply stored in the slot.
+ * @param pContext                the context of the ring
+ * @param udpSocketFileDescriptor the file descriptor of UDP socket
+ * @param pDatagram               the slot of the datagram
+ */
+static void submitDatagram(UringContext* pContext, int udpSocketFileDescriptor, UringDatagram* pDatagram) {
+    memset(&pDatagram->message, 0, sizeof(struct msghdr));
+    pDatagram->message.msg_name = &pDatagram->clientSocketAddress;
+    pDatagram->message.msg_namelen = sizeof(struct sockaddr_in);
+    pDatagram->message.msg_iov = &pDatagram->iov;
+    pDatagram->message.msg_iovlen = 1;
+
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    if ( pDatagram->isSending ) {
+        pDatagram->iov.iov_base = pDatagram->buffer;
+        pDatagram->iov.iov_len = pDatagram->length;
+        pSubmission->opcode = IORING_OP_SENDMSG;
+    } else {
+        pDatagram->iov.iov_base = pDatagram->buffer;
+        pDatagram->iov.iov_len = BUFFER_SIZE;
+        pSubmission->opcode = IORING_OP_RECVMSG;
+    }
+    pSubmission->fd = udpSocketFileDescriptor;
+    pSubmission->addr = (uint64_t) (uintptr_t) &pDatagram->message;
+    pSubmission->len = 1;
+    pSubmission->user_data = makeUserData(pDatagram, URING_TAG_UDP);
+}
+
+/**
+ * Wait for the next message of a TCP client, the kernel selects the buffer.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection to receive from
+ */
+static void submitRecv(UringContext* pContext, UringConnection* pConnection) {
+    armConnectionTimer(pContext, pConnection);
+
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_RECV;
+    pSubmission->fd = pConnection->socketFileDescriptor;
+    pSubmission->flags = IOSQE_BUFFER_SELECT;
+    pSubmission->buf_group = URING_BUFFER_GROUP;
+    pSubmission->len = BUFFER_SIZE;
+    pSubmission->user_data = makeUserData(pConnection, URING_TAG_RECV);
+}
+
+/**
+ * Send the rest of the pending data of a TCP client. The cached content of a small
+ * file is gathered with the response header into a single sendmsg. If the policy corks
+ * files, every send of a file but the last one carries MSG_MORE, so the header leaves
+ * in the same segment as the first chunk.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection to send to
+ */
+static void submitSend(UringContext* pContext, UringConnection* pConnection) {
+    int flags = MSG_NOSIGNAL;
+    if ( pContext->pPolicy->isCorked && pConnection->fileFileDescriptor != -1 &&
+         (pConnection->pSendData != pConnection->fileBuffer.data || pConnection->fileRemaining > (off_t) pConnection->sendLength) ) {
+        flags |= MSG_MORE;
+    }
+    armConnectionTimer(pContext, pConnection);
+
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    if ( pConnection->pContent != NULL ) {
+        size_t headerLength = pConnection->sendLength - pConnection->contentLength;
+        struct msghdr* pMessage = &pConnection->sendMessage;
+        memset(pMessage, 0, sizeof(struct msghdr));
+        pMessage->msg_iov = pConnection->sendVectors;
+        if ( pConnection->sendOffset < headerLength ) {
+            pConnection->sendVectors[pMessage->msg_iovlen].iov_base = (void*) (pConnection->pSendData + pConnection->sendOffset);
+            pConnection->sendVectors[pMessage->msg_iovlen].iov_len = headerLength - pConnection->sendOffset;
+            ++ pMessage->msg_iovlen;
+        }
+        size_t contentOffset = pConnection->sendOffset > headerLength ? pConnection->sendOffset - headerLength : 0;
+        pConnection->sendVectors[pMessage->msg_iovlen].iov_base = (void*) (pConnection->pContent + contentOffset);
+        pConnection->sendVectors[pMessage->msg_iovlen].iov_len = pConnection->contentLength - contentOffset;
+        ++ pMessage->msg_iovlen;
+
+        pSubmission->opcode = IORING_OP_SENDMSG;
+        pSubmission->addr = (uint64_t) (uintptr_t) pMessage;
+        pSubmission->len = 1;
+    } else {
+        pSubmission->opcode = IORING_OP_SEND;
+        pSubmission->addr = (uint64_t) (uintptr_t) (pConnection->pSendData + pConnection->sendOffset);
+        pSubmission->len = (unsigned) (pConnection->sendLength - pConnection->sendOffset);
+    }
+    pSubmission->fd = pConnection->socketFileDescriptor;
+    pSubmission->msg_flags = flags;
+    pSubmission->user_data = makeUserData(pConnection, URING_TAG_SEND);
+}
+
+/**
+ * Read the next chunk of the file and send it to the client with a linked pair of requests.
+ * The length of the chunk is known from the file size, so a short read breaks the link
+ * and cancels the send instead of sending stale data.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection streaming a file
+ */
+static void submitFileChunk(UringContext* pContext, UringConnection* pConnection) {
+    size_t chunkLength = URING_FILE_CHUNK_SIZE;
+    if ( pConnection->fileRemaining < (off_t) chunkLength ) {
+        chunkLength = (size_t) pConnection->fileRemaining;
+    }
+    pConnection->pSendData = pConnection->fileBuffer.data;
+    pConnection->sendLength = chunkLength;
+    pConnection->sendOffset = 0;
+
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_READ;
+    pSubmission->fd = pConnection->fileFileDescriptor;
+    pSubmission->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    pSubmission->addr = (uint64_t) (uintptr_t) pConnection->fileBuffer.data;
+    pSubmission->len = (unsigned) chunkLength;
+    pSubmission->off = (uint64_t) pConnection->fileOffset;
+    pSubmission->user_data = makeUserData(NULL, URING_TAG_FILE_READ);
+
+    submitSend(pContext, pConnection);
+}
+
+/**
+ * Wait for the disk I/O pool to signal its eventfd.
+ * @param pContext the context of the ring
+ */
+static void submitCompletionPoll(UringContext* pContext) {
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_POLL_ADD;
+    pSubmission->fd = pContext->completions.eventFileDescriptor;
+    pSubmission->poll32_events = POLLIN;
+    pSubmission->user_data = makeUserData(NULL, URING_TAG_OFFLOAD);
+}
+
+/**
+ * Wake the loop after a tick to move the timers, the request completes with -ETIME.
+ * @param pContext the context of the ring
+ */
+static void submitTimerTick(UringContext* pContext) {
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_TIMEOUT;
+    pSubmission->addr = (uint64_t) (uintptr_t) &pContext->tickInterval;
+    pSubmission->len = 1;
+    pSubmission->user_data = makeUserData(NULL, URING_TAG_TIMER);
+}
+
+/**
+ * Wait for a hot restart to signal the drain eventfd, nothing is submitted if hot restart is disabled.
+ * @param pContext the context of the ring
+ */
+static void submitDrainPoll(UringContext* pContext) {
+    if ( getDrainFileDescriptor() == -1 ) {
+        return;
+    }
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_POLL_ADD;
+    pSubmission->fd = getDrainFileDescriptor();
+    pSubmission->poll32_events = POLLIN;
+    pSubmission->user_data = URING_CONTROL_DRAIN | URING_TAG_CONTROL;
+}
+
+/**
+ * Wait for changes of the cached files, nothing is submitted if the cache does not watch them.
+ * @param pContext the context of the ring
+ */
+static void submitFileEventsPoll(UringContext* pContext) {
+    int fileEventsFileDescriptor = getFileCacheEventDescriptor();
+    if ( fileEventsFileDescriptor == -1 ) {
+        return;
+    }
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_POLL_ADD;
+    pSubmission->fd = fileEventsFileDescriptor;
+    pSubmission->poll32_events = POLLIN;
+    pSubmission->user_data = URING_CONTROL_FILE_EVENTS | URING_TAG_CONTROL;
+}
+
+/**
+ * Stop taking clients and datagrams after a new process took over the listeners. The
+ * multishot accept and the receives of the datagram slots are cancelled by their
+ * user_data, which every io_uring kernel supports, a slot sending a reply finishes it
+ * first. A connection waiting for its next request is shut down on the next tick.
+ * @param pContext  the context of the ring
+ * @param datagrams the URING_UDP_SLOTS slots of datagrams
+ */
+static void startDraining(UringContext* pContext, UringDatagram* datagrams) {
+    pContext->isDraining = TRUE;
+    LOG_INFO("The worker drains %d connection(s).\n", pContext->connections.nConnections);
+
+    submitCancel(pContext, makeUserData(NULL, URING_TAG_ACCEPT));
+    int i = 0;
+    for ( i = 0; i < URING_UDP_SLOTS; ++ i ) {
+        if ( !datagrams[i].isSending ) {
+            submitCancel(pContext, makeUserData(&datagrams[i], URING_TAG_UDP));
+        }
+    }
+
+    for ( i = 0; i < pContext->connections.capacity; ++ i ) {
+        UringConnection* pConnection = (UringConnection*) pContext->connections.connections[i];
+        if ( pConnection != NULL ) {
+            armConnectionTimer(pContext, pConnection);
+        }
+    }
+}
+
+/**
+ * Cancel the request which was submitted with a user_data.
+ * @param pContext the context of the ring
+ * @param userData the user_data of the request
+ */
+static void submitCancel(UringContext* pContext, uint64_t userData) {
+    struct io_uring_sqe* pSubmission = getSubmissionEntry(pContext);
+    pSubmission->opcode = IORING_OP_ASYNC_CANCEL;
+    pSubmission->addr = userData;
+    pSubmission->user_data = URING_CONTROL_CANCEL | URING_TAG_CONTROL;
+}
+
+/**
+ * Handle the requests whose files were loaded by the disk I/O pool.
+ * @param pContext the context of the ring
+ */
+static void handleCompletions(UringContext* pContext) {
+    OffloadJob* pJob = takeOffloadCompletions(&pContext->completions);
+    while ( pJob != NULL ) {
+        OffloadJob* pNextJob = pJob->pNext;
+        ((UringConnection*) pJob->pOwner)->isOffloaded = FALSE;
+        handleNextFrame(pContext, (UringConnection*) pJob->pOwner);
+        pJob = pNextJob;
+    }
+}
+
+/**
+ * Handle a message received from a TCP client.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection which received the message
+ * @param result      the number of bytes received or a negative error code
+ * @param flags       the flags of the completion which carry the ID of the selected buffer
+ */
+static void handleRecv(UringContext* pContext, UringConnection* pConnection, int result, unsigned flags) {
+    if ( result == -ENOBUFS ) {
+        // All buffers are waiting in this batch of completions, they are recycled before the retry
+        submitRecv(pContext, pConnection);
+        return;
+    }
+    if ( result < 0 && !pConnection->isTimedOut ) {
+        LOG_ERROR("[TCP] An error occurred while receiving message from the client %s: %s\nThe connection is going to close.\n",
+            pConnection->peerName, strerror(-result));
+        addStat(STAT_CONNECTION_ERRORS, 1);
+    }
+    if ( result <= 0 ) {
+        closeConnection(pContext, pConnection);
+        return;
+    }
+
+    // The provided buffer goes back to the kernel at once, the frame grows in the input buffer of the connection
+    unsigned short bufferId = (unsigned short) (flags >> IORING_CQE_BUFFER_SHIFT);
+    ByteBuffer* pInput = &pConnection->input;
+    int isReserved = reserveBuffer(pInput, (size_t) result) == 0;
+    pConnection->lastActivityTime = pContext->loopTime;
+    if ( pConnection->requestArrivalTime == 0 ) {
+        pConnection->requestArrivalTime = pContext->loopTime;
+    }
+    if ( isReserved ) {
+        memcpy(pInput->data + pInput->end, pContext->bufferMemory + (size_t) bufferId * BUFFER_SIZE, result);
+        pInput->end += (size_t) result;
+        addStat(STAT_BYTES_IN, (uint64_t) result);
+    }
+    recycleRecvBuffer(pContext, bufferId);
+    if ( !isReserved ) {
+        LOG_ERROR("[TCP] Failed to reserve %d bytes for the request of client %s\nThe connection is going to close.\n",
+            result, pConnection->peerName);
+        addStat(STAT_CONNECTION_ERRORS, 1);
+        closeConnection(pContext, pConnection);
+        return;
+    }
+
+    handleNextFrame(pContext, pConnection);
+}
+
+/**
+ * Handle the first request in the input buffer of a connection and send the response,
+ * or receive more data if the request is incomplete.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection which has no request in flight
+ */
+static void handleNextFrame(UringContext* pContext, UringConnection* pConnection) {
+    FrameHeader request;
+    ByteBuffer* pInput = &pConnection->input;
+    if ( getBufferLength(pInput) < FRAME_HEADER_SIZE ) {
+        submitRecv(pContext, pConnection);
+        return;
+    }
+    decodeFrameHeader(pInput->data + pInput->start, &request);
+    if ( request.payloadLength > MAX_REQUEST_PAYLOAD ) {
+        LOG_ERROR("[TCP] The client %s sent a request of %llu bytes.\nThe connection is going to close.\n",
+            pConnection->peerName, (unsigned long long) request.payloadLength);
+        addStat(STAT_CONNECTION_ERRORS, 1);
+        closeConnection(pContext, pConnection);
+        return;
+    }
+    size_t frameLength = FRAME_HEADER_SIZE + (size_t) request.payloadLength;
+    if ( getBufferLength(pInput) < frameLength ) {
+        submitRecv(pContext, pConnection);
+        return;
+    }
+    LOG_DEBUG("[TCP] Received request #%u (opcode %d, %llu bytes) from client %s\n",
+        request.requestId, request.opcode, (unsigned long long) request.payloadLength, pConnection->peerName);
+
+    // A request handled again after its file is loaded keeps its start time
+    ResponseBody body;
+    if ( !pConnection->offloadJob.isCompleted ) {
+        pConnection->requestStartTime = getMonotonicTime();
+    }
+    ByteBuffer* pOutput = &pConnection->output;
+    if ( reserveBuffer(pOutput, getResponseCapacity(&request)) == -1 ) {
+        LOG_ERROR("[TCP] Failed to reserve the response for client %s\nThe connection is going to close.\n",
+            pConnection->peerName);
+        addStat(STAT_CONNECTION_ERRORS, 1);
+        closeConnection(pContext, pConnection);
+        return;
+    }
+    int responseLength = handleRequest(&request, pInput->data + pInput->start + FRAME_HEADER_SIZE, pOutput->data, &body,
+        &pConnection->offloadJob);
+    if ( responseLength == REQUEST_OFFLOADED ) {
+        pConnection->isOffloaded = TRUE;
+        return;
+    }
+    if ( responseLength == -1 ) {
+        closeConnection(pContext, pConnection);
+        return;
+    }
+
+    // Keep the pipelined requests which follow this one, they arrived with this request
+    consumeBuffer(pInput, frameLength);
+    pConnection->requestArrivalTime = getBufferLength(pInput) > 0 ? pConnection->lastActivityTime : 0;
+
+    pConnection->pCachedFile = body.pCachedFile;
+    if ( body.fileFileDescriptor != -1 ) {
+        pConnection->fileFileDescriptor = body.fileFileDescriptor;
+        pConnection->fileOffset = body.fileOffset;
+        pConnection->fileRemaining = body.fileLength;
+        if ( reserveBuffer(&pConnection->fileBuffer, URING_FILE_CHUNK_SIZE) == -1 ) {
+            closeConnection(pContext, pConnection);
+            return;
+        }
+    }
+
+    pConnection->latencyHistogram = HISTOGRAM_NONE;
+    if ( request.opcode == OPCODE_ECHO || request.opcode == OPCODE_UPPERCASE ) {
+        pConnection->latencyHistogram = HISTOGRAM_ECHO;
+    } else if ( request.opcode == OPCODE_GET || request.opcode == OPCODE_GET_RANGE ) {
+        pConnection->latencyHistogram = HISTOGRAM_GET_TTFB;
+    }
+    pOutput->end = (size_t) responseLength;
+    pConnection->pSendData = pOutput->data;
+    pConnection->pContent = body.content;
+    pConnection->contentLength = body.contentLength;
+    pConnection->sendLength = (size_t) responseLength + body.contentLength;
+    pConnection->sendOffset = 0;
+    submitSend(pContext, pConnection);
+}
+
+/**
+ * Handle the completion of a send to a TCP client, continue the file stream if there is one.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection which sent the data
+ * @param result      the number of bytes sent or a negative error code
+ */
+static void handleSend(UringContext* pContext, UringConnection* pConnection, int result) {
+    if ( result < 0 ) {
+        if ( result != -ECANCELED && !pConnection->isTimedOut ) {
+            LOG_ERROR("An error occurred while sending message to the client %s: %s\nThe connection is going to close.\n",
+                pConnection->peerName, strerror(-result));
+            addStat(STAT_CONNECTION_ERRORS, 1);
+        }
+        closeConnection(pContext, pConnection);
+        return;
+    }
+
+    pConnection->sendOffset += result;
+    pConnection->lastActivityTime = pContext->loopTime;
+    addStat(STAT_BYTES_OUT, (uint64_t) result);
+    if ( pConnection->latencyHistogram != HISTOGRAM_NONE &&
+         (pConnection->pSendData == pConnection->fileBuffer.data ||
+          (pConnection->sendOffset == pConnection->sendLength && pConnection->fileFileDescriptor == -1)) ) {
+        // An echo is done when it is sent, a file when its first chunk is on the way
+        recordLatency(pConnection->latencyHistogram, pConnection->requestStartTime);
+        pConnection->latencyHistogram = HISTOGRAM_NONE;
+    }
+    if ( pConnection->sendOffset < pConnection->sendLength ) {
+        submitSend(pContext, pConnection);
+        return;
+    }
+    releaseBuffer(&pConnection->output);
+
+    if ( pConnection->fileFileDescriptor != -1 ) {
+        if ( pConnection->pSendData == pConnection->fileBuffer.data ) {
+            pConnection->fileOffset += pConnection->sendLength;
+            pConnection->fileRemaining -= pConnection->sendLength;
+        }
+        if ( pConnection->fileRemaining > 0 ) {
+            submitFileChunk(pContext, pConnection);
+            return;
+        }
+
+        releaseBodySource(pConnection->fileFileDescriptor, pConnection->pCachedFile);
+        releaseBuffer(&pConnection->fileBuffer);
+        pConnection->fileFileDescriptor = -1;
+        pConnection->pCachedFile = NULL;
+    } else if ( pConnection->pContent != NULL ) {
+        releaseBodySource(-1, pConnection->pCachedFile);
+        pConnection->pContent = NULL;
+        pConnection->contentLength = 0;
+        pConnection->pCachedFile = NULL;
+    }
+    handleNextFrame(pContext, pConnection);
+}
+
+/**
+ * Make sure the timer of a connection fires by its deadline, it is called whenever the
+ * connection waits for its socket. A timer which fires early is armed again.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection
+ */
+static void armConnectionTimer(UringContext* pContext, UringConnection* pConnection) {
+    uint64_t deadline = getConnectionDeadline(pContext, pConnection);
+    if ( deadline != UINT64_MAX ) {
+        armTimer(&pContext->timers, &pConnection->timer, deadline);
+    }
+}
+
+/**
+ * Compute when a connection times out with the request it has in flight, the timeouts
+ * are the same as the ones of the epoll engine. A draining worker shuts down a connection
+ * with nothing to do right away.
+ * @param  pContext    the context of the ring
+ * @param  pConnection the connection
+ * @return the monotonic time in nanoseconds, UINT64_MAX if the connection has no deadline
+ */
+static uint64_t getConnectionDeadline(UringContext* pContext, UringConnection* pConnection) {
+    const ConnectionLimits* pLimits = pContext->pLimits;
+    if ( pConnection->isOffloaded || pConnection->isTimedOut ) {
+        return UINT64_MAX;
+    }
+    if ( getBufferLength(&pConnection->output) > 0 || pConnection->fileFileDescriptor != -1 ) {
+        return getTimeoutDeadline(pConnection->lastActivityTime, pLimits->writeTimeout);
+    }
+    if ( getBufferLength(&pConnection->input) > 0 ) {
+        return getTimeoutDeadline(pConnection->requestArrivalTime, pLimits->readTimeout);
+    }
+    if ( pContext->isDraining ) {
+        return pConnection->lastActivityTime;
+    }
+    return getTimeoutDeadline(pConnection->lastActivityTime, pLimits->idleTimeout);
+}
+
+/**
+ * Shut down a connection whose timer fired if it passed its deadline, or arm the timer
+ * again. The connection is closed when its request in flight completes.
+ * @param pEntry    the timer of the connection
+ * @param pArgument the context of the ring
+ */
+static void expireConnection(TimerEntry* pEntry, void* pArgument) {
+    UringContext* pContext = (UringContext*) pArgument;
+    UringConnection* pConnection = (UringConnection*) pEntry->pOwner;
+
+    uint64_t deadline = getConnectionDeadline(pContext, pConnection);
+    if ( deadline > pContext->loopTime ) {
+        if ( deadline != UINT64_MAX ) {
+            scheduleTimer(&pContext->timers, pEntry, deadline);
+        }
+        return;
+    }
+
+    int isSending = getBufferLength(&pConnection->output) > 0 || pConnection->fileFileDescriptor != -1;
+    int isReceiving = getBufferLength(&pConnection->input) > 0;
+    if ( !pContext->isDraining || isSending || isReceiving ) {
+        LOG_INFO("[TCP] The client %s timed out while %s.\n", pConnection->peerName,
+            isSending ? "receiving a response" : (isReceiving ? "sending a request" : "idle"));
+        addStat(STAT_TIMEOUTS, 1);
+    }
+    pConnection->isTimedOut = TRUE;
+    shutdown(pConnection->socketFileDescriptor, SHUT_RDWR);
+}
+
+/**
+ * Close a TCP connection which has no request in flight.
+ * @param pContext    the context of the ring
+ * @param pConnection the connection to close
+ */
+static void closeConnection(UringContext* pContext, UringConnection* pConnection) {
+    LOG_INFO("[TCP] Client %s disconnected after %.3f s.\n", pConnection->peerName,
+        (getMonotonicTime() - pConnection->connectedTime) / 1e9);
+    addStat(STAT_CONNECTIONS_CLOSED, 1);
+
+    releaseBodySource(pConnection->fileFileDescriptor, pConnection->pCachedFile);
+    releaseBuffer(&pConnection->fileBuffer);
+    releaseBuffer(&pConnection->input);
+    releaseBuffer(&pConnection->output);
+    close(pConnection->socketFileDescriptor);
+    removeConnection(&pContext->connections, pConnection->socketFileDescriptor);
+    cancelTimer(&pContext->timers, &pConnection->timer);
+    dismissConnection();
+    freeConnection(&pContext->connections, pConnection);
+
+    // The descriptor is free for a client which waits in the accept queue
+    resumeAccept(pContext);
+}